@@ -36,6 +36,7 @@ namespace ModulateChat
         private string modulate_log_folder;
         private Timer log_size_timer;
         private string channel_name_prefix;
+        private Task authentication = Task.CompletedTask;
 
         private static readonly HttpClient client = new HttpClient();
         const int VIVOX_TIMEOUT = 10000;
@@ -84,17 +85,17 @@ namespace ModulateChat
             error_code = modulate.load_api_key_from_file(api_key_file);
             if (error_code != 0)
                 fatal_error("Couldn't load api key from " + api_key_file);
-            foreach(string filename in voice_skin_files)
-            {
-                error_code = modulate.create_voice_skin(filename);
-                if (error_code != 0)
-                    fatal_error("Failed to create voice skin from file " + filename + " error code " + error_code.ToString());
-            }
+            // The names come from the cache, and authenticating the skins below loads them off the UI thread
+            error_code = modulate.create_voice_skins(voice_skin_files, true);
+            if (error_code != 0)
+                fatal_error("Failed to create voice skin from file " + modulate.get_voice_skin_load_error_filename() + " error code " + error_code.ToString());
             List<string> voice_skin_list = new List<string>();
             for(int i = 0; i < modulate.get_number_of_skins(); i++)
             {
                 voice_skin_list.Add(modulate.get_voice_skin_name(i));
             }
+            // Skins finish loading in no particular order, so list them by name
+            voice_skin_list.Sort();
             voice_skin_names = voice_skin_list.ToArray();
             voice_skin_display_names = voice_skin_list.ToArray();
             string[] separators = { "_2020_" };
@@ -111,10 +112,7 @@ namespace ModulateChat
 
             modulate.vivox_start_connect();
 
-            foreach(string voice_skin_name in voice_skin_names)
-            {
-                authenticate_skin(voice_skin_name);
-            }
+            authentication = authenticate_skins();
 
             bool vivox_connected = false;
             int sleep_duration = 100;
@@ -140,27 +138,44 @@ namespace ModulateChat
             throw new SystemException("Modulate Fatal Error: "+message);
         }
 
-        private async void authenticate_skin(string voice_skin_name)
+        // Every skin goes to the server in one request, and they're authenticated together, or not at all
+        private async Task authenticate_skins()
         {
-            string auth_message = modulate.create_auth_message_for_voice_skin(voice_skin_name);
-            Console.WriteLine("Authenticating " + voice_skin_name + " with auth message " + auth_message);
+            // Creating the messages is heavy, so it's kept off the UI thread
+            string request = await Task.Run(() => modulate.create_auth_batch_request());
+            if (request.Length == 0)
+                fatal_error("Failed to create an authentication message for voice skin " + modulate.get_auth_batch_failed_voice_skin_name() + " Please ensure that you have the latest ModulateChat app, and contact <> if the problem persists.");
+            Console.WriteLine("Authenticating voice skins with auth request " + request);
             HttpRequestMessage msg = new HttpRequestMessage(HttpMethod.Post, "<>");
-            msg.Content = new StringContent("{\"request_string\": \"" + auth_message + "\"}", Encoding.UTF8, "application/json");
+            msg.Content = new StringContent(request, Encoding.UTF8, "application/json");
             msg.Headers.Add("Accept", "application/json");
             HttpResponseMessage response = await client.SendAsync(msg);
             string response_string = await response.Content.ReadAsStringAsync();
             Console.WriteLine("Auth response message " + response_string);
 
-            if (!response_string.Contains("\"success\": true"))
-                fatal_error("Failed to authenticate voice skin " + voice_skin_name + " with the Modulate server.  Please ensure that you're connected to the internet, and if the problem persists, contact <>");
-            string response_key = "\"signed_response\": \"";
-            string signed_response = response_string.Substring(response_string.IndexOf(response_key) + response_key.Length);
-            signed_response = signed_response.Substring(0, signed_response.IndexOf("\""));
-            Console.WriteLine("Checking "+voice_skin_name+" auth with response "+signed_response);
-
-            int error_code = modulate.check_auth_message_for_voice_skin(voice_skin_name, signed_response);
+            int error_code = modulate.apply_auth_batch_response(response_string);
+            if (error_code < 0)
+                fatal_error("Failed to authenticate voice skins with the Modulate server.  Please ensure that you're connected to the internet, and if the problem persists, contact <>");
             if (error_code != 0)
-                fatal_error("Failed to authenticate voice skin " + voice_skin_name + " Please ensure that you have the latest ModulateChat app, and contact <> if the problem persists.");
+                fatal_error("Failed to authenticate voice skin " + modulate.get_auth_batch_failed_voice_skin_name() + " Please ensure that you have the latest ModulateChat app, and contact <> if the problem persists.");
+        }
+
+        // A session converts with its own copy of the skin, loaded when it's added, and stays silent
+        // until that copy's authenticated too
+        private async void authenticate_session_copy()
+        {
+            await authentication;
+            int sleep_duration = 100;
+            for (int current_ms = 0; current_ms < VIVOX_TIMEOUT; current_ms += sleep_duration)
+            {
+                if (modulate.get_number_of_voice_skin_copies_awaiting_authentication() > 0)
+                {
+                    authentication = authenticate_skins();
+                    await authentication;
+                    return;
+                }
+                await Task.Delay(sleep_duration);
+            }
         }
 
         private void VoiceSkinSelector_SelectionChanged(object sender, SelectionChangedEventArgs e)
@@ -217,6 +232,7 @@ namespace ModulateChat
 
             channel_name = channel_name_prefix + fix_channel_name(ChannelTextBox.Text);
             modulate.vivox_add_session(channel_name);
+            authenticate_session_copy();
             ConnectButton.Content = "Disconnect";
             Console.WriteLine("Connected to channel " + channel_name);
             connected = true;
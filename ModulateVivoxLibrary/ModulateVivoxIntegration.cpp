@@ -7,6 +7,13 @@
 //
 
 #include "ModulateVivoxIntegration.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "rt_audit.hpp"
 #include "secret.h" // issuer and secret key
 #include "vivox/include/VxcTypes.h" // vx_sdk_config_t
 
@@ -21,47 +28,135 @@
 #include "VivoxBase.hpp"
 
 #define MAX_SAMPLES 2048
-#define LOGSIZE 100
+// Weight of each new frame in the rolling realtime factor, ~1s of 10ms frames
+#define REALTIME_FACTOR_SMOOTHING 0.01
 #define EXPECTED_SAMPLE_RATE 48000
-#define MODULATE_CONVERSION_BUFFER_SIZE 4800
+#define MODULATE_CONVERSION_BUFFER_SIZE 8192
+#define MODULATE_ECHO_TARGET_LATENCY_MS 10.0f
+// Until set_model_block_ms, the voice skin converts Vivox's frames as they come
+#define MODULATE_MODEL_BLOCK_MS 0.0f
+// Room for the longest delay, plus a frame in flight each way
+#define MODULATE_PIPELINE_BUFFER_SIZE ((MODULATE_MAX_PIPELINE_DELAY_FRAMES + 2) * MAX_SAMPLES)
+// Upper bound on how long a lost wakeup can stall the worker
+#define MODULATE_PIPELINE_WORKER_TIMEOUT_MS 2
+// ~340ms of input at 48kHz to prime an incoming voice skin with
+#define MODULATE_SKIN_SWITCH_HISTORY_SIZE 16384
+#define MODULATE_SKIN_SWITCH_WORKER_TIMEOUT_MS 20
+// ~340ms of input and output at 48kHz - the logging service is woken well before this fills up
+#define MODULATE_WAV_LOG_BUFFER_SIZE 32768
+// Session logs are losslessly compressed 16-bit audio.  Define as WavSampleFormat::int16 for
+// plain WAV files, or WavSampleFormat::float32 to log exactly the samples the voice skin saw
+#ifndef MODULATE_WAV_LOG_FORMAT
+#define MODULATE_WAV_LOG_FORMAT WavSampleFormat::flac
+#endif
 
 ModulateVivoxIntegration::ModulateVivoxIntegration(unsigned int max_segment_size,
                                                    void* starting_voice_skin,
                                                    const char* log_dir) :
-  params(modulate_build_default_parameters_struct()),
-  float_buffer(new float[MAX_SAMPLES]),
-  input_times(new double[LOGSIZE]),
-  output_times(new double[LOGSIZE]),
-  voice_skin(starting_voice_skin),
-  input_wav_logger(48000, 48000, log_dir, "input_log"),
-  output_wav_logger(48000, 48000, log_dir, "output_log"),
+  pending_settings{starting_voice_skin, modulate_build_default_parameters_struct(), SilenceGate::default_settings(), 0},
+  skin_switch_settings(SkinSwitch::default_settings()),
+  voice_skin_copy_waits(0),
+  sessions(max_segment_size, MAX_SAMPLES, MODULATE_CONVERSION_BUFFER_SIZE, MODULATE_ECHO_TARGET_LATENCY_MS,
+           MODULATE_PIPELINE_BUFFER_SIZE, MODULATE_SKIN_SWITCH_HISTORY_SIZE, pending_settings),
+  skin_switch_worker_running(true),
+  kernels(get_audio_kernels()),
+  native_rate_enabled(true),
+  deadline_misses(0),
+  realtime_factor(0.0),
+  event_log(MODULATE_RT_EVENT_LOG_CAPACITY, (int)sessions.get_number_of_contexts(), log_dir),
+  metrics_exporter(metrics, log_dir),
+  session_logger(wav_logging_service, MODULATE_WAV_LOG_BUFFER_SIZE, MAX_SAMPLES, log_dir, "session_log", MODULATE_WAV_LOG_FORMAT),
+  wav_logging_enabled(true),
   realtime_echo_running(false),
-  conversion_buffer(new short[MODULATE_CONVERSION_BUFFER_SIZE])
+  pipelined(false),
+  pipeline_worker_running(false)
 {
-  input_wav_logger.start_logging_thread();
-  output_wav_logger.start_logging_thread();
-
-  modulate_voice_skin_helper_create(&voice_skin_helper, max_segment_size);
-  modulate_voice_skin_helper_reset(voice_skin_helper, EXPECTED_SAMPLE_RATE);
-
-  std::fill_n(input_times, LOGSIZE, 1.0);
-  std::fill_n(output_times, LOGSIZE, 1.0);
-
-  t1 = std::chrono::high_resolution_clock::now();
-  t2 = std::chrono::high_resolution_clock::now();
+  for(size_t i = 0; i < sessions.get_number_of_contexts(); i++) {
+    wanted_voice_skins[i] = starting_voice_skin;
+    awaiting_copy[i] = false;
+    sessions.get_context(i).skin_switch.request(starting_voice_skin);
+    sessions.get_context(i).framing.set_block_ms(MODULATE_MODEL_BLOCK_MS);
+  }
+  register_metrics();
+  skin_switch_worker = std::thread(&ModulateVivoxIntegration::run_skin_switch_worker, this);
+  session_logger.start_logging_thread();
+  event_log.start();
 
   vivox_base_ptr = new VivoxBase(this);
   vivox_config_setup();
 }
 
 ModulateVivoxIntegration::~ModulateVivoxIntegration() {
+  // The exporter reads from everything else
+  metrics_exporter.stop();
   VivoxBase* vivox_base = (VivoxBase*)vivox_base_ptr;
   delete vivox_base;
-  modulate_voice_skin_helper_destroy(&voice_skin_helper);
-  delete[] conversion_buffer;
-  delete[] float_buffer;
-  delete[] input_times;
-  delete[] output_times;
+  stop_pipeline_worker();
+  skin_switch_worker_running.store(false);
+  skin_switch_event.signal();
+  skin_switch_worker.join();
+}
+
+void ModulateVivoxIntegration::register_metrics() {
+  capture_callback_metric = metrics.add_counter("modulate_capture_callbacks_total", "Capture callbacks from Vivox");
+  render_callback_metric = metrics.add_counter("modulate_render_callbacks_total", "Render callbacks from Vivox");
+  voice_skin_failure_metric = metrics.add_counter("modulate_voice_skin_failures_total",
+                                                  "Voice skin calls that returned an error");
+  generate_time_metric = metrics.add_histogram("modulate_generate_seconds", "Time the voice skin took per call",
+                                               {0.0005, 0.001, 0.002, 0.003, 0.005, 0.0075, 0.01, 0.015, 0.02, 0.05});
+  metrics.add_counter_function("modulate_deadline_misses_total", "Voice skin calls that took longer than their audio",
+                               {}, [this] {return (double)deadline_misses.load(std::memory_order_relaxed);});
+  metrics.add_gauge_function("modulate_realtime_factor", "Time generating over the duration generated, over about a second",
+                             {}, [this] {return realtime_factor.load(std::memory_order_relaxed);});
+  metrics.add_counter_function("modulate_log_dropped_samples_total", "Audio left out of the session log with its ring full",
+                               {}, [this] {return (double)session_logger.get_dropped_samples();});
+  metrics.add_counter_function("modulate_audio_events_dropped_total", "Audio thread events dropped with the queue full",
+                               {}, [this] {return (double)event_log.get_dropped_events();});
+  metrics.add_gauge_function("modulate_sessions", "Sessions added, and those Vivox has delivered audio for",
+                             {{"state", "added"}}, [this] {return (double)sessions.count_sessions(false);});
+  metrics.add_gauge_function("modulate_sessions", "Sessions added, and those Vivox has delivered audio for",
+                             {{"state", "bound"}}, [this] {return (double)sessions.count_sessions(true);});
+  metrics.add_counter_function("modulate_unmatched_callbacks_total", "Audio callbacks whose channel matched no session, converted through the default context",
+                               {}, [this] {return (double)sessions.get_unmatched_callbacks();});
+  metrics.add_gauge_function("modulate_authenticated_voice_skins", "Voice skins known to be authenticated",
+                             {}, [this] {return (double)authenticator.get_authenticated_count();});
+  metrics.add_gauge_function("modulate_voice_skin_authenticated", "Whether the selected voice skin is authenticated",
+                             {}, [this] {
+    void* voice_skin;
+    {
+      std::lock_guard<std::mutex> lock(settings_writer_mutex);
+      voice_skin = pending_settings.voice_skin;
+    }
+    return authenticator.is_authenticated(voice_skin) ? 1.0 : 0.0;
+  });
+  metrics.add_counter_function("modulate_voice_skin_copy_waits_total", "Times a session went silent waiting for its own copy of a voice skin",
+                               {}, [this] {return (double)voice_skin_copy_waits.load(std::memory_order_relaxed);});
+  metrics.add_gauge_function("modulate_realtime_echo", "Whether realtime echo is on",
+                             {}, [this] {return realtime_echo_running.load() ? 1.0 : 0.0;});
+  metrics.add_counter_function("modulate_skin_switches_total", "Switches to a new voice skin",
+                               {}, [this] {return (double)get_skin_switch_stats().switches;});
+  metrics.add_counter_function("modulate_pipeline_deadline_misses_total", "Pipelined frames not converted by when they were due",
+                               {}, [this] {return (double)get_pipeline_stats().deadline_misses;});
+  metrics.add_counter_function("modulate_pipeline_input_overruns_total", "Pipelined frames dropped with the worker too far behind",
+                               {}, [this] {return (double)get_pipeline_stats().input_overruns;});
+  metrics.add_counter_function("modulate_oversized_frames_total", "Frames longer than the buffers, converted a piece at a time",
+                               {}, [this] {return (double)get_framing_stats().oversized_frames;});
+
+  // Per session, as each has its own devices' clocks and its own gate
+  for(size_t i = 0; i < sessions.get_number_of_contexts(); i++) {
+    SessionContext* context = &sessions.get_context(i);
+    const MetricLabels labels = {{"session", i < MODULATE_MAX_SESSIONS ? std::to_string(i) : "default"}};
+    metrics.add_counter_function("modulate_echo_underruns_total", "Render callbacks the echo ring ran dry in",
+                                 labels, [context] {return (double)context->echo_buffer.get_stats().underruns;});
+    metrics.add_counter_function("modulate_echo_overruns_total", "Capture callbacks that didn't fit in the echo ring",
+                                 labels, [context] {return (double)context->echo_buffer.get_stats().overruns;});
+    metrics.add_counter_function("modulate_echo_resyncs_total", "Times the echo ring skipped ahead to bound its latency",
+                                 labels, [context] {return (double)context->echo_buffer.get_stats().resyncs;});
+    metrics.add_gauge_function("modulate_echo_drift_ppm", "Capture clock drift against render the echo path corrects for",
+                               labels, [context] {return (double)context->echo_buffer.get_stats().drift_ppm;});
+    metrics.add_counter_function("modulate_silence_gate_skipped_frames_total", "Frames the silence gate kept from the voice skin",
+                                 labels, [context] {return (double)context->silence_gate.get_stats().skipped_frames;});
+  }
 }
 
 void ModulateVivoxIntegration::vivox_config_setup() {
@@ -74,6 +169,311 @@ void ModulateVivoxIntegration::vivox_config_setup() {
   vivox_base->config_finish_setup(config);
 }
 
+template <typename Update>
+uint64_t ModulateVivoxIntegration::update_settings(Update update) {
+  std::lock_guard<std::mutex> lock(settings_writer_mutex);
+  update(pending_settings);
+  pending_settings.generation++;
+  // Apply the same change to every session, leaving anything set per-session alone
+  for(size_t i = 0; i < sessions.get_number_of_contexts(); i++) {
+    SessionContext& context = sessions.get_context(i);
+    ConversionSettings session_settings = context.pending_settings;
+    session_settings.voice_skin = wanted_voice_skins[i];
+    update(session_settings);
+    if(session_settings.voice_skin != wanted_voice_skins[i]) {
+      wanted_voice_skins[i] = session_settings.voice_skin;
+      session_settings.voice_skin = get_session_voice_skin(i);
+    } else {
+      session_settings.voice_skin = context.pending_settings.voice_skin;
+    }
+    session_settings.generation = pending_settings.generation;
+    context.publish_settings(session_settings);
+    context.skin_switch.request(session_settings.voice_skin);
+  }
+  skin_switch_event.signal();
+  return pending_settings.generation;
+}
+
+void* ModulateVivoxIntegration::get_session_voice_skin(size_t index) {
+  void* voice_skin = wanted_voice_skins[index];
+  const bool was_awaiting_copy = awaiting_copy[index];
+  awaiting_copy[index] = false;
+  // The default context, and contexts no session's using, share the app's voice skin
+  if(!voice_skin_copier || !voice_skin || index >= MODULATE_MAX_SESSIONS || !sessions.get_context(index).is_reserved())
+    return voice_skin;
+  // Otherwise the session is silent until its own copy is ready, rather than sharing
+  void* copy = voice_skin_copier(voice_skin, index + 1);
+  awaiting_copy[index] = !copy;
+  if(!was_awaiting_copy && (!copy || !authenticator.is_authenticated(copy)))
+    voice_skin_copy_waits.fetch_add(1, std::memory_order_relaxed);
+  return copy;
+}
+
+void ModulateVivoxIntegration::publish_session_voice_skin(SessionContext& context, uint64_t generation) {
+  ConversionSettings session_settings = context.pending_settings;
+  session_settings.voice_skin = get_session_voice_skin(context.index);
+  session_settings.generation = generation;
+  context.publish_settings(session_settings);
+  context.skin_switch.request(session_settings.voice_skin);
+}
+
+void ModulateVivoxIntegration::publish_awaited_copies() {
+  std::lock_guard<std::mutex> lock(settings_writer_mutex);
+  for(size_t i = 0; i < MODULATE_MAX_SESSIONS; i++) {
+    if(awaiting_copy[i] && voice_skin_copier(wanted_voice_skins[i], i + 1))
+      publish_session_voice_skin(sessions.get_context(i), ++pending_settings.generation);
+  }
+}
+
+uint64_t ModulateVivoxIntegration::set_voice_skin(void* new_voice_skin) {
+  return update_settings([=](ConversionSettings& settings) {settings.voice_skin = new_voice_skin;});
+}
+
+void ModulateVivoxIntegration::set_voice_skin_copier(VoiceSkinCopier copier) {
+  std::lock_guard<std::mutex> lock(settings_writer_mutex);
+  voice_skin_copier = copier;
+  // Sessions already added get their copies now
+  pending_settings.generation++;
+  for(size_t i = 0; i < MODULATE_MAX_SESSIONS; i++)
+    if(sessions.get_context(i).is_reserved())
+      publish_session_voice_skin(sessions.get_context(i), pending_settings.generation);
+  skin_switch_event.signal();
+}
+
+uint64_t ModulateVivoxIntegration::set_radio_strength(float new_radio_strength) {
+  return update_settings([=](ConversionSettings& settings) {settings.params.radio_strength = new_radio_strength;});
+}
+
+uint64_t ModulateVivoxIntegration::set_presence_strength(float new_presence_strength) {
+  return update_settings([=](ConversionSettings& settings) {settings.params.presence_strength = new_presence_strength;});
+}
+
+uint64_t ModulateVivoxIntegration::set_bass_booster_strength(float new_bass_booster_strength) {
+  return update_settings([=](ConversionSettings& settings) {settings.params.bass_booster_strength = new_bass_booster_strength;});
+}
+
+uint64_t ModulateVivoxIntegration::set_intimidator_strength(float new_intimidator_strength) {
+  return update_settings([=](ConversionSettings& settings) {settings.params.intimidator_strength = new_intimidator_strength;});
+}
+
+uint64_t ModulateVivoxIntegration::set_helm_strength(float new_helm_strength) {
+  return update_settings([=](ConversionSettings& settings) {settings.params.helm_strength = new_helm_strength;});
+}
+
+uint64_t ModulateVivoxIntegration::set_vivid_strength(float new_vivid_strength) {
+  return update_settings([=](ConversionSettings& settings) {settings.params.vivid_strength = new_vivid_strength;});
+}
+
+uint64_t ModulateVivoxIntegration::set_silence_gate(bool enabled, float threshold_dbfs, float hangover_ms) {
+  return update_settings([=](ConversionSettings& settings) {settings.gate = {enabled, threshold_dbfs, hangover_ms};});
+}
+
+uint64_t ModulateVivoxIntegration::set_session_voice_skin(const char* channel_name, void* new_voice_skin) {
+  std::lock_guard<std::mutex> lock(settings_writer_mutex);
+  pending_settings.generation++;
+  for(size_t i = 0; i < sessions.get_number_of_contexts(); i++) {
+    SessionContext& context = sessions.get_context(i);
+    if(!context.is_reserved_for(channel_name))
+      continue;
+    wanted_voice_skins[i] = new_voice_skin;
+    publish_session_voice_skin(context, pending_settings.generation);
+  }
+  skin_switch_event.signal();
+  return pending_settings.generation;
+}
+
+void ModulateVivoxIntegration::set_voice_skin_switching(float prime_ms, float crossfade_ms) {
+  std::lock_guard<std::mutex> lock(settings_writer_mutex);
+  skin_switch_settings = {prime_ms, crossfade_ms};
+}
+
+SkinSwitchStats ModulateVivoxIntegration::get_skin_switch_stats() {
+  SkinSwitchStats total = {0, 0, 0.0};
+  for(size_t i = 0; i < sessions.get_number_of_contexts(); i++) {
+    const SkinSwitchStats stats = sessions.get_context(i).skin_switch.get_stats();
+    total.switches += stats.switches;
+    total.primed_switches += stats.primed_switches;
+    total.longest_prepare_ms = std::max(total.longest_prepare_ms, stats.longest_prepare_ms);
+  }
+  return total;
+}
+
+void ModulateVivoxIntegration::run_skin_switch_worker() {
+  std::vector<size_t> order(sessions.get_number_of_contexts());
+  while(skin_switch_worker_running.load()) {
+    skin_switch_event.wait_for(std::chrono::milliseconds(MODULATE_SKIN_SWITCH_WORKER_TIMEOUT_MS));
+    publish_awaited_copies();
+    // Sessions with the most recent input first, so that a skin shared between sessions is
+    // primed with the input of one that's actually live
+    for(size_t i = 0; i < order.size(); i++)
+      order[i] = i;
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+      return sessions.get_context(a).skin_switch.get_last_input_ns() > sessions.get_context(b).skin_switch.get_last_input_ns();
+    });
+    for(size_t i : order) {
+      SessionContext& context = sessions.get_context(i);
+      if(!skin_switch_worker_running.load() || !context.skin_switch.needs_preparing())
+        continue;
+      void* voice_skin = context.skin_switch.get_requested_voice_skin();
+      SkinSwitchSettings switch_settings;
+      modulate_parameters params;
+      {
+        std::lock_guard<std::mutex> lock(settings_writer_mutex);
+        switch_settings = skin_switch_settings;
+        params = context.pending_settings.params;
+      }
+      // Resetting a skin another session is using would glitch that session instead
+      bool in_use = false;
+      for(size_t j = 0; j < sessions.get_number_of_contexts(); j++)
+        in_use = in_use || sessions.get_context(j).skin_switch.is_using(voice_skin);
+      context.skin_switch.prepare(voice_skin, !in_use, switch_settings, params, native_rate_enabled.load(),
+                                  skin_switch_worker_running);
+    }
+  }
+}
+
+uint64_t ModulateVivoxIntegration::get_observed_settings_generation() {
+  std::lock_guard<std::mutex> lock(settings_writer_mutex);
+  uint64_t observed = pending_settings.generation;
+  for(size_t i = 0; i < sessions.get_number_of_contexts(); i++)
+    observed = std::min(observed, sessions.get_context(i).get_observed_settings_generation());
+  return observed;
+}
+
+void ModulateVivoxIntegration::set_echo_target_latency_ms(float latency_ms) {
+  for(size_t i = 0; i < sessions.get_number_of_contexts(); i++)
+    sessions.get_context(i).echo_buffer.set_target_latency_ms(latency_ms);
+}
+
+void ModulateVivoxIntegration::set_echo_monitor_gain(float gain) {
+  for(size_t i = 0; i < sessions.get_number_of_contexts(); i++)
+    sessions.get_context(i).echo_buffer.set_monitor_gain(gain);
+}
+
+void ModulateVivoxIntegration::set_echo_drift_compensation(bool enabled) {
+  for(size_t i = 0; i < sessions.get_number_of_contexts(); i++)
+    sessions.get_context(i).echo_buffer.set_drift_compensation(enabled);
+}
+
+EchoBufferStats ModulateVivoxIntegration::get_echo_stats() {
+  EchoBufferStats total = {0, 0, 0, 0, 0.0f};
+  for(size_t i = 0; i < sessions.get_number_of_contexts(); i++) {
+    const EchoBufferStats stats = sessions.get_context(i).echo_buffer.get_stats();
+    total.underruns += stats.underruns;
+    total.overruns += stats.overruns;
+    total.resyncs += stats.resyncs;
+    total.fill += stats.fill;
+    // Drift doesn't add up across sessions, so report the largest
+    if(fabsf(stats.drift_ppm) > fabsf(total.drift_ppm))
+      total.drift_ppm = stats.drift_ppm;
+  }
+  return total;
+}
+
+bool ModulateVivoxIntegration::start_latency_probe() {
+  std::lock_guard<std::mutex> lock(settings_writer_mutex);
+  return latency_probe.start();
+}
+
+LatencyProbeResult ModulateVivoxIntegration::get_latency_probe_result() {
+  LatencyProbeResult result = {};
+  result.state = latency_probe.get_state();
+  if(!latency_probe.get_measurements(result.conversion, result.rendered, result.sample_rate, result.render_sample_rate))
+    return result;
+  // Take out the delays that are known
+  SessionContext& context = sessions.get_context(latency_probe.get_session_index());
+  const FramingStats framing = context.framing.get_stats();
+  result.rebuffer_ms = framing.latency_ms;
+  const size_t block = framing.block_size ? framing.block_size : (size_t)latency_probe.get_frame_count();
+  if(native_rate_enabled.load() && context.skin_switch.get_converter().supports(result.sample_rate, block))
+    result.native_rate_ms = 1000.0 * NativeRateConverter::get_latency_samples(result.sample_rate) / result.sample_rate;
+  result.voice_skin_ms = result.conversion.latency_ms - result.rebuffer_ms - result.native_rate_ms;
+  if(result.conversion.found && result.rendered.found)
+    result.echo_ms = result.rendered.latency_ms - result.conversion.latency_ms;
+  return result;
+}
+
+void ModulateVivoxIntegration::set_model_block_ms(float block_ms) {
+  for(size_t i = 0; i < sessions.get_number_of_contexts(); i++)
+    sessions.get_context(i).framing.set_block_ms(block_ms);
+}
+
+FramingStats ModulateVivoxIntegration::get_framing_stats() {
+  FramingStats total = {0, 0, 0.0, 0, 0, 0};
+  for(size_t i = 0; i < sessions.get_number_of_contexts(); i++) {
+    const FramingStats stats = sessions.get_context(i).framing.get_stats();
+    total.block_size = std::max(total.block_size, stats.block_size);
+    total.latency_samples = std::max(total.latency_samples, stats.latency_samples);
+    total.latency_ms = std::max(total.latency_ms, stats.latency_ms);
+    total.blocks += stats.blocks;
+    total.oversized_frames += stats.oversized_frames;
+    total.underruns += stats.underruns;
+  }
+  return total;
+}
+
+void ModulateVivoxIntegration::set_pipelined_conversion(bool enabled, int delay_frames, DeadlineMissPolicy miss_policy) {
+  std::lock_guard<std::mutex> lock(settings_writer_mutex);
+  // The worker goes first, so the capture callback never converts alongside it, and then any
+  // callback still in convert_pipelined, so nothing else is using the pipelines to reset
+  stop_pipeline_worker();
+  pipelined.store(false);
+  sessions.wait_for_callbacks();
+  for(size_t i = 0; i < sessions.get_number_of_contexts(); i++)
+    sessions.get_context(i).pipeline.configure(delay_frames, miss_policy);
+  if(!enabled)
+    return;
+  pipeline_worker_running.store(true);
+  pipeline_worker = std::thread(&ModulateVivoxIntegration::run_pipeline_worker, this);
+  pipelined.store(true);
+}
+
+void ModulateVivoxIntegration::stop_pipeline_worker() {
+  if(!pipeline_worker.joinable())
+    return;
+  pipeline_worker_running.store(false);
+  pipeline_event.signal();
+  pipeline_worker.join();
+}
+
+ConversionPipelineStats ModulateVivoxIntegration::get_pipeline_stats() {
+  ConversionPipelineStats total = {0, 0, 0};
+  for(size_t i = 0; i < sessions.get_number_of_contexts(); i++) {
+    const ConversionPipelineStats stats = sessions.get_context(i).pipeline.get_stats();
+    total.frames += stats.frames;
+    total.deadline_misses += stats.deadline_misses;
+    total.input_overruns += stats.input_overruns;
+  }
+  return total;
+}
+
+void ModulateVivoxIntegration::run_pipeline_worker() {
+  PipelineFrame frame;
+  while(pipeline_worker_running.load()) {
+    pipeline_event.wait_for(std::chrono::milliseconds(MODULATE_PIPELINE_WORKER_TIMEOUT_MS));
+    // Take a frame from each session in turn, so that one busy session can't starve the others.
+    // Steady audio can keep this busy indefinitely, so it checks for a stop as it goes.
+    bool converted = true;
+    while(converted && pipeline_worker_running.load(std::memory_order_relaxed)) {
+      converted = false;
+      for(size_t i = 0; i < sessions.get_number_of_contexts(); i++) {
+        SessionContext* context = sessions.acquire_index(i);
+        if(!context)
+          continue;
+        if(context->pipeline.take(frame, context->float_buffer)) {
+          // A failed frame is only partly converted, so it's handed back as a miss instead
+          if(convert_samples(*context, context->float_buffer, frame.pcm_frame_count, frame.audio_frame_rate, frame.speaking))
+            context->pipeline.give(context->float_buffer, frame.pcm_frame_count);
+          else
+            context->pipeline.give_missed(frame.pcm_frame_count);
+          converted = true;
+        }
+        sessions.finish_callback(*context);
+      }
+    }
+  }
+}
+
 void ModulateVivoxIntegration::start_realtime_echo() {
   realtime_echo_running.store(true);
 }
@@ -83,91 +483,242 @@ void ModulateVivoxIntegration::end_realtime_echo() {
 }
 
 void ModulateVivoxIntegration::modulate_convert_before_audio_sent(void *callback_handle, const char *session_group_handle, const char *initial_target_uri, short *pcm_frames, int pcm_frame_count, int audio_frame_rate, int channels_per_frame, int speaking) {
+  MODULATE_RT_AUDIT_SCOPE("modulate_convert_before_audio_sent");
+  // Before converting, so that how long that takes doesn't show up as clock drift
+  const auto callback_time = std::chrono::steady_clock::now();
   VivoxBase* base = reinterpret_cast<VivoxBase*>(callback_handle);
   ModulateVivoxIntegration* app = reinterpret_cast<ModulateVivoxIntegration*>(base->modulate_integration_ptr);
-  app->convert(pcm_frames, pcm_frame_count, audio_frame_rate, channels_per_frame, speaking);
-  for(size_t i = 0; i < pcm_frame_count; i++) {
-    size_t buffer_ptr = (app->conversion_write_ptr + i) % MODULATE_CONVERSION_BUFFER_SIZE;
-    // Record only the first channel in the conversion buffer
-    app->conversion_buffer[buffer_ptr] = pcm_frames[i * channels_per_frame];
-  }
-  app->conversion_write_ptr += pcm_frame_count;
+  SessionContextLease lease(app->sessions, session_group_handle, initial_target_uri);
+  app->metrics.increment(app->capture_callback_metric);
+  const bool probing = app->latency_probe.begin_capture(lease.context.index, pcm_frames, pcm_frame_count, channels_per_frame,
+                                                        audio_frame_rate, callback_time);
+  // Ordered after the lease, for set_pipelined_conversion's wait_for_callbacks
+  if(app->pipelined.load())
+    app->convert_pipelined(lease.context, pcm_frames, pcm_frame_count, audio_frame_rate, channels_per_frame, speaking);
+  else
+    app->convert(lease.context, pcm_frames, pcm_frame_count, audio_frame_rate, channels_per_frame, speaking);
+  if(probing)
+    app->latency_probe.end_capture(pcm_frames, pcm_frame_count, channels_per_frame);
+  // Record only the first channel in the echo buffer
+  lease.context.echo_buffer.push(pcm_frames, pcm_frame_count, channels_per_frame, audio_frame_rate, callback_time);
 }
 
 void ModulateVivoxIntegration::modulate_before_audio_rendered(void *callback_handle, const char *session_group_handle, const char *initial_target_uri, short *pcm_frames, int pcm_frame_count, int audio_frame_rate, int channels_per_frame, int is_silence) {
+  MODULATE_RT_AUDIT_SCOPE("modulate_before_audio_rendered");
+  const auto callback_time = std::chrono::steady_clock::now();
   VivoxBase* base = reinterpret_cast<VivoxBase*>(callback_handle);
   ModulateVivoxIntegration* app = reinterpret_cast<ModulateVivoxIntegration*>(base->modulate_integration_ptr);
+  SessionContextLease lease(app->sessions, session_group_handle, initial_target_uri);
+  app->metrics.increment(app->render_callback_metric);
   if(app->realtime_echo_running.load()) {
-    size_t i = 0;
-    for(; i < pcm_frame_count; i++) {
-      size_t buffer_ptr = app->conversion_read_ptr + i;
-      if(buffer_ptr > app->conversion_write_ptr) {
-        return;
-      }
-      buffer_ptr = buffer_ptr % MODULATE_CONVERSION_BUFFER_SIZE;
-      for(size_t j = 0; j < channels_per_frame; j++)
-        pcm_frames[i*channels_per_frame + j] += app->conversion_buffer[buffer_ptr];
-    }
-    app->conversion_read_ptr += i;
+    lease.context.echo_buffer.mix_into(pcm_frames, pcm_frame_count, channels_per_frame, audio_frame_rate, callback_time);
   } else {
-    // Don't let the read pointer fall behind the write pointer
-    app->conversion_read_ptr = app->conversion_write_ptr;
+    // Don't let stale audio pile up while echo is off
+    lease.context.echo_buffer.discard();
   }
+  app->latency_probe.record_render(lease.context.index, pcm_frames, pcm_frame_count, channels_per_frame, audio_frame_rate,
+                                   callback_time);
 }
 
-void ModulateVivoxIntegration::convert(short *pcm_frames,
+void ModulateVivoxIntegration::convert(SessionContext& context,
+                                       short *pcm_frames,
                                        int pcm_frame_count,
                                        int audio_frame_rate,
                                        int channels_per_frame,
                                        int speaking) {
-  // If we're not yet authenticated, return silence
-  int is_authenticated;
-  modulate_voice_skin_check_authenticated(voice_skin, &is_authenticated);
-  if(!is_authenticated) {
+  float* float_buffer = context.float_buffer;
+  const bool logging_enabled = wav_logging_enabled.load(std::memory_order_relaxed);
+  const uint64_t callback_index = context.callback_count++;
+
+  // A frame longer than the buffers is converted a piece at a time, and is too long to log
+  if(pcm_frame_count > MAX_SAMPLES) {
+    context.framing.record_oversized_frame();
+    if(logging_enabled)
+      session_logger.drop_frame(pcm_frame_count);
+  }
+  for(int offset = 0; offset < pcm_frame_count; offset += MAX_SAMPLES) {
+    const int count = std::min(pcm_frame_count - offset, MAX_SAMPLES);
+    short* chunk = pcm_frames + (size_t)offset * channels_per_frame;
+
+    // Get only the first channel of audio
+    kernels.int16_to_float_strided(chunk, channels_per_frame, float_buffer, count);
+
+    // One record per callback: the input before it's rebuffered, and the output once it's back
+    const bool logging = logging_enabled && count == pcm_frame_count &&
+                         session_logger.begin_frame(float_buffer, count, audio_frame_rate, speaking,
+                                                    context.index, callback_index);
+    if(!convert_samples(context, float_buffer, count, audio_frame_rate, speaking)) {
+      if(logging)
+        session_logger.end_frame(nullptr);
+      continue;
+    }
+    if(logging)
+      session_logger.end_frame(float_buffer);
+
+    // Populate all channels with result
+    kernels.float_to_int16_fan_out(float_buffer, chunk, count, channels_per_frame);
+  }
+}
+
+void ModulateVivoxIntegration::convert_pipelined(SessionContext& context,
+                                                 short *pcm_frames,
+                                                 int pcm_frame_count,
+                                                 int audio_frame_rate,
+                                                 int channels_per_frame,
+                                                 int speaking) {
+  const bool logging_enabled = wav_logging_enabled.load(std::memory_order_relaxed);
+  const uint64_t callback_index = context.callback_count++;
+  if(pcm_frame_count > MAX_SAMPLES) {
+    event_log.post(RtEventCode::frame_too_long, RtEventSource::capture_callback, context.index, 0, pcm_frame_count,
+                   audio_frame_rate);
+    if(logging_enabled)
+      session_logger.drop_frame(pcm_frame_count);
     memset(pcm_frames, 0, sizeof(short)*pcm_frame_count*channels_per_frame);
     return;
   }
+  float* capture_buffer = context.pipeline.get_capture_buffer();
+  kernels.int16_to_float_strided(pcm_frames, channels_per_frame, capture_buffer, pcm_frame_count);
+  // Logged here rather than by the worker, so each record is the input and output of one callback
+  const bool logging = logging_enabled &&
+                       session_logger.begin_frame(capture_buffer, pcm_frame_count, audio_frame_rate, speaking,
+                                                  context.index, callback_index);
+  if(context.pipeline.submit(capture_buffer, pcm_frame_count, audio_frame_rate, speaking))
+    pipeline_event.signal();
 
-  // Get only the first channel of audio
-  for(size_t i = 0; i < pcm_frame_count; i++)
-    float_buffer[i] = float(pcm_frames[i*channels_per_frame]) / (1<<15);
+  // Send the frame the worker converted delay_frames callbacks ago
+  context.pipeline.collect(capture_buffer, pcm_frame_count);
+  if(logging)
+    session_logger.end_frame(capture_buffer);
+  kernels.float_to_int16_fan_out(capture_buffer, pcm_frames, pcm_frame_count, channels_per_frame);
+}
+
+bool ModulateVivoxIntegration::convert_samples(SessionContext& context, float* samples, int pcm_frame_count, int audio_frame_rate, int speaking) {
+  return context.framing.process(samples, pcm_frame_count, audio_frame_rate, [&](float* block, size_t block_count) {
+    return convert_block(context, block, (int)block_count, audio_frame_rate, speaking);
+  });
+}
+
+bool ModulateVivoxIntegration::convert_block(SessionContext& context, float* samples, int pcm_frame_count, int audio_frame_rate, int speaking) {
+  // Pick up the latest settings once per frame - these stay fixed until the next frame
+  const ConversionSettings& settings = context.settings.acquire();
+  // The input is kept to prime the next voice skin with, and once settings.voice_skin has
+  // been primed the switch to it starts here - see SkinSwitch
+  context.skin_switch.record_input(samples, pcm_frame_count, audio_frame_rate);
+  void* voice_skin = context.skin_switch.update(settings.voice_skin, audio_frame_rate, context.voice_skin_helper);
+  const bool crossfading = context.skin_switch.is_crossfading();
+  // The voice skin these settings replaced is in use until the switch is over
+  if(settings.generation != context.observed_settings_generation.load(std::memory_order_relaxed) &&
+     context.skin_switch.is_settled(settings.voice_skin))
+    context.observed_settings_generation.store(settings.generation, std::memory_order_release);
 
-  input_wav_logger.set_sample_rate_nonblocking(audio_frame_rate);
-  input_wav_logger.add_audio_nonblocking(float_buffer, pcm_frame_count);
+  // If we're not yet authenticated, or no voice skin is ready yet, return silence
+  void* audible_voice_skin = voice_skin ? voice_skin : crossfading ? context.skin_switch.get_incoming_voice_skin() : nullptr;
+  if(!authenticator.is_authenticated(audible_voice_skin)) {
+    memset(samples, 0, sizeof(float)*pcm_frame_count);
+    return true;
+  }
+
+  const GateAction action = context.silence_gate.update(samples, pcm_frame_count, audio_frame_rate, speaking != 0, settings.gate);
+  if(action == GateAction::skip) {
+    // No one hears this frame, so a switch under way can just finish
+    if(crossfading)
+      context.skin_switch.skip_crossfade(context.voice_skin_helper);
+    memset(samples, 0, sizeof(float)*pcm_frame_count);
+    return true;
+  }
 
   int error_code = 0;
+  const bool native_rate = native_rate_enabled.load(std::memory_order_relaxed);
+  const auto generate_start = std::chrono::steady_clock::now();
+  if(action == GateAction::open && voice_skin) {
+    // Run the audio from just before the onset through first, so the model isn't starting cold.
+    // The output is thrown away; the time counts towards this frame.
+    size_t warm_up_count;
+    float* warm_up_audio = context.silence_gate.get_warm_up_audio(warm_up_count, audio_frame_rate);
+    if(warm_up_count)
+      generate(context, voice_skin, warm_up_audio, warm_up_count, audio_frame_rate, &settings.params, native_rate);
+  }
+  // The incoming voice skin converts the input before it's overwritten
+  if(crossfading && !authenticator.is_authenticated(context.skin_switch.get_incoming_voice_skin()))
+    context.skin_switch.silence_incoming(pcm_frame_count);
+  else if(crossfading)
+    error_code = context.skin_switch.convert_incoming(samples, pcm_frame_count, audio_frame_rate, &settings.params,
+                                                      native_rate);
   // Convert from the input voice to a new voice
-  error_code = modulate_voice_skin_helper_generate(voice_skin,
-                                                   voice_skin_helper,
-                                                   float_buffer,
-                                                   float_buffer,
-                                                   pcm_frame_count,
-                                                   audio_frame_rate,
-                                                   &params);
+  if(!error_code && voice_skin)
+    error_code = generate(context, voice_skin, samples, pcm_frame_count, audio_frame_rate, &settings.params, native_rate);
+  else if(!error_code)
+    // Crossfading in the first voice skin, from silence
+    memset(samples, 0, sizeof(float)*pcm_frame_count);
+  record_generate_time(std::chrono::steady_clock::now() - generate_start, pcm_frame_count, audio_frame_rate);
   if(error_code) {
-    std::cerr<<"Modulate voice skin helper generate non-zero error code "<<error_code<<std::endl;
-    return;
+    metrics.increment(voice_skin_failure_metric);
+    // The worker only converts in pipelined mode
+    event_log.post(RtEventCode::voice_skin_failed,
+                   pipelined.load(std::memory_order_relaxed) ? RtEventSource::pipeline_worker : RtEventSource::capture_callback,
+                   context.index, error_code, pcm_frame_count, audio_frame_rate);
+    return false;
   }
+  if(crossfading)
+    context.skin_switch.mix(samples, pcm_frame_count, context.voice_skin_helper);
+  context.silence_gate.apply_fade(samples, pcm_frame_count, audio_frame_rate);
+  return true;
+}
+
+int ModulateVivoxIntegration::generate(SessionContext& context, void* voice_skin, float* samples, size_t pcm_frame_count,
+                                       int audio_frame_rate, const modulate_parameters* params, bool native_rate) {
+  NativeRateConverter& converter = context.skin_switch.get_converter();
+  if(native_rate && converter.supports(audio_frame_rate, pcm_frame_count))
+    return converter.generate(voice_skin, samples, samples, pcm_frame_count, audio_frame_rate, params);
+  return modulate_voice_skin_helper_generate(voice_skin, context.voice_skin_helper, samples, samples,
+                                             (unsigned int)pcm_frame_count, audio_frame_rate, params);
+}
+
+void ModulateVivoxIntegration::record_generate_time(std::chrono::steady_clock::duration generate_time, int pcm_frame_count, int audio_frame_rate) {
+  const uint64_t generate_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(generate_time).count();
+  generate_latency.record(generate_ns);
+  metrics.observe(generate_time_metric, generate_ns / 1e9);
+  if(pcm_frame_count <= 0 || audio_frame_rate <= 0)
+    return;
 
-  output_wav_logger.set_sample_rate_nonblocking(audio_frame_rate);
-  output_wav_logger.add_audio_nonblocking(float_buffer, pcm_frame_count);
+  const double frame_ns = 1e9 * pcm_frame_count / audio_frame_rate;
+  if(generate_ns > frame_ns)
+    deadline_misses.fetch_add(1, std::memory_order_relaxed);
 
-  // Populate all channels with result
-  for(size_t i = 0; i < pcm_frame_count; i++) {
-    pcm_frames[i*channels_per_frame] = (short)(float_buffer[i] * ((1<<15) - 1));
-    for(size_t channel = 1; channel < channels_per_frame; channel++)
-      pcm_frames[i*channels_per_frame + channel] = pcm_frames[i*channels_per_frame];
-  }
+  // Only the audio thread writes this, so a plain load and store is enough
+  const double ratio = generate_ns / frame_ns;
+  const double previous = realtime_factor.load(std::memory_order_relaxed);
+  const double smoothing = previous == 0.0 ? 1.0 : REALTIME_FACTOR_SMOOTHING;
+  realtime_factor.store(previous + smoothing * (ratio - previous), std::memory_order_relaxed);
 }
 
 double ModulateVivoxIntegration::get_average_performance_ratio() {
-  double num = 0;
-  for(size_t i = 0; i < LOGSIZE; i++)
-    num += input_times[i];
-  double den = 0;
-  for(size_t i = 0; i < LOGSIZE; i++)
-    den += output_times[i];
-  return num/den;
+  return realtime_factor.load(std::memory_order_relaxed);
+}
+
+ConversionPerformanceStats ModulateVivoxIntegration::get_performance_stats() {
+  ConversionPerformanceStats stats;
+  stats.frames = generate_latency.get_count();
+  stats.deadline_misses = deadline_misses.load(std::memory_order_relaxed);
+  stats.p50_ms = generate_latency.get_percentile(0.5) / 1e6;
+  stats.p99_ms = generate_latency.get_percentile(0.99) / 1e6;
+  stats.p999_ms = generate_latency.get_percentile(0.999) / 1e6;
+  stats.max_ms = generate_latency.get_max() / 1e6;
+  stats.realtime_factor = realtime_factor.load(std::memory_order_relaxed);
+
+  uint64_t gate_frames = 0;
+  uint64_t skipped_frames = 0;
+  double skipped_seconds = 0.0;
+  for(size_t i = 0; i < sessions.get_number_of_contexts(); i++) {
+    const SilenceGateStats gate_stats = sessions.get_context(i).silence_gate.get_stats();
+    gate_frames += gate_stats.frames;
+    skipped_frames += gate_stats.skipped_frames;
+    skipped_seconds += gate_stats.skipped_seconds;
+  }
+  stats.skipped_fraction = gate_frames ? (double)skipped_frames / gate_frames : 0.0;
+  stats.cpu_seconds_saved = skipped_seconds * stats.realtime_factor;
+  stats.log_dropped_samples = session_logger.get_dropped_samples();
+  return stats;
 }
 
 void ModulateVivoxIntegration::connect() {
@@ -183,6 +734,20 @@ void ModulateVivoxIntegration::login() {
   vivox_base->Unlock();
 }
 void ModulateVivoxIntegration::add_session(const char* channel_name, bool is_echo) {
+  // Set up the session's conversion context before Vivox can start delivering its audio
+  {
+    std::lock_guard<std::mutex> lock(settings_writer_mutex);
+    SessionContext* context = sessions.reserve(channel_name);
+    if(context) {
+      wanted_voice_skins[context->index] = pending_settings.voice_skin;
+      ConversionSettings session_settings = pending_settings;
+      session_settings.voice_skin = get_session_voice_skin(context->index);
+      context->publish_settings(session_settings);
+      context->skin_switch.request(session_settings.voice_skin);
+      skin_switch_event.signal();
+    } else
+      std::cerr<<"No free conversion context for channel "<<channel_name<<", sharing the default one"<<std::endl;
+  }
   VivoxBase* vivox_base = (VivoxBase*)vivox_base_ptr;
   vivox_base->Lock();
   vivox_base->add_session(channel_name, is_echo);
@@ -193,7 +758,13 @@ void ModulateVivoxIntegration::remove_session(const char* channel_name, bool is_
   vivox_base->Lock();
   vivox_base->remove_session(channel_name, is_echo);
   vivox_base->Unlock();
-
+  // Waiting for the session's callbacks to finish can take a while, so only resetting its
+  // context is done under the lock
+  while(SessionContext* context = sessions.drain(channel_name)) {
+    std::lock_guard<std::mutex> lock(settings_writer_mutex);
+    sessions.release(*context);
+    awaiting_copy[context->index] = false;
+  }
 }
 bool ModulateVivoxIntegration::check_connected() {
   VivoxBase* vivox_base = (VivoxBase*)vivox_base_ptr;
@@ -13,27 +13,110 @@
 #include <chrono>
 #include <iostream>
 #include <cmath>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <cstdint>
+#include <functional>
 #include "modulate/modulate.h"
 
 #include "wav_logger.hpp"
+#include "multitrack_logger.hpp"
+#include "session_registry.hpp"
+#include "audio_kernels.hpp"
+#include "latency_histogram.hpp"
+#include "voice_skin_authenticator.hpp"
+#include "rt_event_log.hpp"
+#include "latency_probe.hpp"
+#include "metrics_registry.hpp"
+#include "metrics_exporter.hpp"
+
+// Timing of the voice skin on the audio thread.  The realtime factor is the time
+// spent generating divided by the duration of the audio generated, so anything
+// approaching 1 means the conversion can't keep up.
+struct ConversionPerformanceStats {
+  uint64_t frames;
+  uint64_t deadline_misses; // frames that took longer to generate than their duration
+  double p50_ms;
+  double p99_ms;
+  double p999_ms;
+  double max_ms;
+  double realtime_factor;   // rolling average over roughly the last second of frames
+  double skipped_fraction;  // frames the silence gate kept away from the voice skin
+  double cpu_seconds_saved; // estimated from the skipped audio and the realtime factor
+  uint64_t log_dropped_samples; // audio left out of the session log because its ring was full
+};
+
+// Gives a session its own copy of one of the app's voice skins - see
+// ModulateVivoxIntegration::set_voice_skin_copier
+typedef std::function<void*(void* voice_skin, size_t copy)> VoiceSkinCopier;
 
 class ModulateVivoxIntegration {
 private:
-  modulate_parameters params;
-  void* voice_skin;
-  void* voice_skin_helper;
-  float* float_buffer;
+  // Settings are written by the UI thread(s) into pending_settings, then published
+  // to each session's context.  The mutex only serializes writers (and session
+  // setup/teardown); the audio thread never takes it.
+  std::mutex settings_writer_mutex;
+  ConversionSettings pending_settings;
+  SkinSwitchSettings skin_switch_settings;
+  template <typename Update>
+  uint64_t update_settings(Update update);
+
+  // The voice skin each context was set to.  With a copier, a session converts with its own
+  // copy of it instead, and is silent while the copy's awaited.  All under the lock.
+  VoiceSkinCopier voice_skin_copier;
+  void* wanted_voice_skins[MODULATE_MAX_SESSIONS + 1];
+  bool awaiting_copy[MODULATE_MAX_SESSIONS + 1];
+  std::atomic<uint64_t> voice_skin_copy_waits;
+  // What the context at index converts with, as far as it's known yet
+  void* get_session_voice_skin(size_t index);
+  void publish_session_voice_skin(SessionContext& context, uint64_t generation);
+  // Publishes the copies sessions were waiting for that are ready now, from the skin switch worker
+  void publish_awaited_copies();
+
+  // Per-session helpers, buffers and settings
+  SessionRegistry sessions;
+
+  // Resets and primes the voice skins sessions are switching to, off the audio thread
+  std::atomic<bool> skin_switch_worker_running;
+  std::thread skin_switch_worker;
+  AudioSafeEvent skin_switch_event;
+  void run_skin_switch_worker();
+
+  // Which voice skins may be converted with, so the audio thread needn't ask the SDK
+  VoiceSkinAuthenticator authenticator;
 
-  // Logging storage
-  double* input_times;
-  double* output_times;
-  size_t log_ptr = 0;
+  // Sample conversion routines for this CPU, picked once at construction
+  const AudioKernels& kernels;
 
-  std::chrono::time_point<std::chrono::high_resolution_clock> t1;
-  std::chrono::time_point<std::chrono::high_resolution_clock> t2;
+  // Converts 24kHz multiples with the low-level API - see NativeRateConverter
+  std::atomic<bool> native_rate_enabled;
+  int generate(SessionContext& context, void* voice_skin, float* samples, size_t pcm_frame_count, int audio_frame_rate,
+               const modulate_parameters* params, bool native_rate);
 
-  ThreadedWavLogger input_wav_logger;
-  ThreadedWavLogger output_wav_logger;
+  // Performance monitoring, written by the audio thread
+  LatencyHistogram generate_latency;
+  std::atomic<uint64_t> deadline_misses;
+  std::atomic<double> realtime_factor;
+  void record_generate_time(std::chrono::steady_clock::duration generate_time, int pcm_frame_count, int audio_frame_rate);
+
+  // Errors from the audio threads, written out by a background thread
+  RtEventLog event_log;
+
+  // Operational metrics - recorded by the audio threads, or read from the stats kept above
+  // and in each session when a snapshot is taken
+  MetricsRegistry metrics;
+  MetricsExporter metrics_exporter;
+  MetricsCounter capture_callback_metric;
+  MetricsCounter render_callback_metric;
+  MetricsCounter voice_skin_failure_metric;
+  MetricsHistogram generate_time_metric;
+  void register_metrics();
+
+  // Input and output of every callback, in one stream
+  WavLoggingService wav_logging_service;
+  MultitrackLogger session_logger;
+  std::atomic<bool> wav_logging_enabled;
 
   // VivoxBase is a class to manage interaction with the vivox servers
   // This likely isn't very interesting to investigate, as most apps
@@ -44,9 +127,30 @@ private:
   void vivox_config_setup();
 
   std::atomic<bool> realtime_echo_running;
-  short* conversion_buffer;
-  size_t conversion_write_ptr = 0;
-  size_t conversion_read_ptr = 0;
+
+  // Times the audio path when asked to
+  LatencyProbe latency_probe;
+
+  // Pipelined mode: the capture callback only queues audio, and a worker thread runs
+  // the voice skin, at the cost of a fixed delay
+  std::atomic<bool> pipelined;
+  std::atomic<bool> pipeline_worker_running;
+  std::thread pipeline_worker;
+  AudioSafeEvent pipeline_event;
+  void run_pipeline_worker();
+  void stop_pipeline_worker();
+  void convert_pipelined(SessionContext& context,
+                         short *pcm_frames,
+                         int pcm_frame_count,
+                         int audio_frame_rate,
+                         int channels_per_frame,
+                         int speaking);
+  // Converts mono float audio in place, in the session's blocks - see FrameRebuffer.  Returns
+  // false if the voice skin failed, in which case samples may hold either the input or partial
+  // output.
+  bool convert_samples(SessionContext& context, float* samples, int pcm_frame_count, int audio_frame_rate, int speaking);
+  // Converts one block, as convert_samples
+  bool convert_block(SessionContext& context, float* samples, int pcm_frame_count, int audio_frame_rate, int speaking);
 
   // Vivox-SDK comptible functions to do Modulate voice conversion
   // and enable realtime echo
@@ -59,24 +163,91 @@ public:
                            const char* log_dir);
   ~ModulateVivoxIntegration();
 
-  void convert(short *pcm_frames,
+  void convert(SessionContext& context,
+               short *pcm_frames,
                int pcm_frame_count,
                int audio_frame_rate,
                int channels_per_frame,
                int speaking);
 
-  // TODO, make these threadsafe and wait-free for the convert function
-  void set_voice_skin(void* new_voice_skin) {voice_skin = new_voice_skin;};
-  void set_radio_strength(float new_radio_strength) {params.radio_strength = new_radio_strength;};
-  void set_presence_strength(float new_presence_strength) {params.presence_strength = new_presence_strength;};
-  void set_bass_booster_strength(float new_bass_booster_strength) {params.bass_booster_strength = new_bass_booster_strength;};
-  void set_intimidator_strength(float new_intimidator_strength) {params.intimidator_strength = new_intimidator_strength;};
-  void set_helm_strength(float new_helm_strength) {params.helm_strength = new_helm_strength;};
-  void set_vivid_strength(float new_vivid_strength) {params.vivid_strength = new_vivid_strength;};
+  // These are safe to call from any thread, and are wait-free for the convert function.
+  // They apply to every session.  Each returns the generation of the settings it published.
+  uint64_t set_voice_skin(void* new_voice_skin);
+  uint64_t set_radio_strength(float new_radio_strength);
+  uint64_t set_presence_strength(float new_presence_strength);
+  uint64_t set_bass_booster_strength(float new_bass_booster_strength);
+  uint64_t set_intimidator_strength(float new_intimidator_strength);
+  uint64_t set_helm_strength(float new_helm_strength);
+  uint64_t set_vivid_strength(float new_vivid_strength);
+  // Skips the voice skin while the user isn't speaking - see SilenceGate
+  uint64_t set_silence_gate(bool enabled, float threshold_dbfs, float hangover_ms);
+  // Once this returns a generation >= the one returned by a setter, no audio frame is
+  // still using the settings that setter replaced - e.g. a voice skin swapped out by
+  // set_voice_skin may then be destroyed.
+  uint64_t get_observed_settings_generation();
+  // Use a different voice skin for one session (which must already have been added)
+  uint64_t set_session_voice_skin(const char* channel_name, void* new_voice_skin);
+  // A voice skin carries internal state, so sessions converting with the same one at once
+  // corrupt each other's audio.  With a copier, each session converts with its own copy of the
+  // voice skin it's set to (audio that isn't any session's shares the app's).  The copier is
+  // called off the audio thread, with the settings lock held, so mustn't wait: given the app's
+  // voice skin and a copy number from 1 to MODULATE_MAX_SESSIONS, it returns the copy - valid
+  // until the integration is destroyed - or nullptr if it isn't ready, in which case it's asked
+  // again every little while.  Until it's ready and authenticated the session is silent, and
+  // each such wait is counted by get_voice_skin_copy_waits.
+  void set_voice_skin_copier(VoiceSkinCopier copier);
+  uint64_t get_voice_skin_copy_waits() const {return voice_skin_copy_waits.load();}
+  // How a new voice skin takes over - see SkinSwitch.  Applies from the next switch.
+  void set_voice_skin_switching(float prime_ms, float crossfade_ms);
+  // Totals across all sessions
+  SkinSwitchStats get_skin_switch_stats();
+  // Authenticates voice skins for every session - see VoiceSkinAuthenticator
+  VoiceSkinAuthenticator& get_authenticator() {return authenticator;}
   double get_average_performance_ratio();
+  ConversionPerformanceStats get_performance_stats();
 
   void start_realtime_echo();
   void end_realtime_echo();
+  void set_wav_logging_enabled(bool enabled) {wav_logging_enabled.store(enabled);};
+  // Whether frames at a multiple of 24kHz skip the voice skin helper's resampler for our own.
+  // On by default.
+  void set_native_rate_fast_path(bool enabled) {native_rate_enabled.store(enabled);}
+  // How much audio each voice skin call converts, instead of whatever Vivox's frame size is.
+  // This adds the delay reported by get_framing_stats.  0 (the default) follows Vivox's frames.
+  void set_model_block_ms(float block_ms);
+  // The largest block and delay of any session, and totals across all sessions
+  FramingStats get_framing_stats();
+  // How much converted audio the echo path keeps buffered to absorb callback jitter.  Negative
+  // values are ignored, and the most it buffers is MODULATE_CONVERSION_BUFFER_SIZE samples at
+  // the capture rate less three frames, e.g. about 140ms at 48kHz with 10ms frames.
+  void set_echo_target_latency_ms(float latency_ms);
+  // Linear gain on the echoed audio, 1 by default
+  void set_echo_monitor_gain(float gain);
+  // Whether the echo path follows the capture device's clock - see EchoBuffer.  On by default.
+  void set_echo_drift_compensation(bool enabled);
+  // Totals across all sessions
+  EchoBufferStats get_echo_stats();
+  // Measures the latency of the audio path by injecting a probe into the next capture
+  // callback's session - see LatencyProbe.  Returns false while a measurement is under way.
+  bool start_latency_probe();
+  // The last measurement, by stage, once its state is complete.  Finding the probe takes a
+  // moment, so call this off the UI thread.
+  LatencyProbeResult get_latency_probe_result();
+
+  // Moves the voice skin off Vivox's capture thread onto a worker thread, delaying the
+  // converted audio by delay_frames callbacks.  Frames the worker doesn't finish in time
+  // are filled in according to miss_policy.  Audio may be flowing: callbacks already under
+  // way finish in the old mode first, and each session's delay starts over.
+  void set_pipelined_conversion(bool enabled, int delay_frames, DeadlineMissPolicy miss_policy);
+  // Totals across all sessions
+  ConversionPipelineStats get_pipeline_stats();
+
+  // Counters, gauges and histograms covering the whole integration - see MetricsRegistry.
+  // Safe to call from any thread.
+  std::vector<MetricSample> get_metrics() {return metrics.snapshot();}
+  // Writes the metrics to the log directory every interval_s, until called with
+  // MetricsFormat::none - see MetricsExporter
+  void set_metrics_export(MetricsFormat format, double interval_s) {metrics_exporter.configure(format, interval_s);}
 
   // Vivox Connection Management
   // Some base functions to enable the ModulateChat demo app to connect to vivox servers
@@ -5,46 +5,67 @@
 #include "ModulateVivoxLibrary.h"
 
 #include "ModulateVivoxIntegration.hpp"
+#include "voice_skin_catalog.hpp"
+
+// Kept with the logs, the one directory we know we can write to
+#define MODULATE_VOICE_SKIN_NAME_CACHE "voice_skin_names.txt"
 
 using namespace ModulateVivoxLibrary;
 
 UnmanagedWrapper::UnmanagedWrapper(const std::string& log_dir) {
 	modulate_start_text_logging_in_directory(log_dir.c_str());
+	voice_skin_catalog = new VoiceSkinCatalog(MODULATE_MAX_SEGMENT_SIZE, log_dir + "/" + MODULATE_VOICE_SKIN_NAME_CACHE);
 	vivox_app = new ModulateVivoxIntegration(MODULATE_MAX_SEGMENT_SIZE, voice_skin, log_dir.c_str());
+	// Each session converts with its own copy of the selected skin, loaded by the catalog when the
+	// session is added
+	VoiceSkinCatalog* catalog = voice_skin_catalog;
+	vivox_app->set_voice_skin_copier([catalog](void* voice_skin, size_t copy) -> void* {
+		return catalog->get_voice_skin_copy(voice_skin, copy);
+	});
 }
 
 UnmanagedWrapper::~UnmanagedWrapper() {
 	delete vivox_app;
-	for (auto it = voice_skin_map.begin(); it != voice_skin_map.end(); it++)
-		modulate_voice_skin_destroy(&it->second);
+	delete voice_skin_catalog;
 }
 
 unsigned int UnmanagedWrapper::get_number_of_skins() {
-	return (unsigned int)voice_skin_map.size();
+	return (unsigned int)voice_skin_catalog->size();
 }
 
 const std::string& UnmanagedWrapper::get_voice_skin_name(int index) {
-	return voice_skin_name_vector[index];
+	return voice_skin_catalog->get_name(index);
 }
 
 void UnmanagedWrapper::select_voice_skin(const std::string& name) {
-	void* new_voice_skin = voice_skin_map[name];
-	if (new_voice_skin != voice_skin) {
-		modulate_voice_skin_reset(new_voice_skin);
-		voice_skin = new_voice_skin;
-	}
+	// Loads the skin now if it was registered lazily
+	void* new_voice_skin = voice_skin_catalog->get_voice_skin(name);
+	if (!new_voice_skin)
+		return;
+	// Reset, primed and crossfaded in by the integration, off the audio thread
+	voice_skin = new_voice_skin;
 	vivox_app->set_voice_skin(voice_skin);
 }
 
 int UnmanagedWrapper::create_voice_skin(const std::string& filename) {
-	void* new_voice_skin;
-	int error_code = modulate_voice_skin_create(MODULATE_MAX_SEGMENT_SIZE, filename.c_str(), &new_voice_skin);
-	if (error_code)
-		return error_code;
-	std::string voice_skin_name = get_name_from_voice_skin(new_voice_skin);
-	voice_skin_map[voice_skin_name] = new_voice_skin;
-	voice_skin_name_vector.push_back(voice_skin_name);
-	return 0;
+	return voice_skin_catalog->add({ filename }, false, 1, voice_skin_load_error_filename);
+}
+
+int UnmanagedWrapper::create_voice_skins(const std::vector<std::string>& filenames, int lazy) {
+	return voice_skin_catalog->add(filenames, lazy != 0, 0, voice_skin_load_error_filename);
+}
+
+const std::string& UnmanagedWrapper::get_voice_skin_load_error_filename() {
+	return voice_skin_load_error_filename;
+}
+
+SkinLoadProgress UnmanagedWrapper::get_voice_skin_load_progress() {
+	VoiceSkinLoadProgress catalog_progress = voice_skin_catalog->get_progress();
+	SkinLoadProgress progress;
+	progress.total = (unsigned int)catalog_progress.total;
+	progress.done = (unsigned int)catalog_progress.done;
+	progress.failed = (unsigned int)catalog_progress.failed;
+	return progress;
 }
 
 int UnmanagedWrapper::load_api_key_from_file(const std::string& filename) {
@@ -54,8 +75,22 @@ int UnmanagedWrapper::load_api_key_from_file(const std::string& filename) {
 	return 0;
 }
 
+void* UnmanagedWrapper::get_voice_skin_to_authenticate(const std::string& voice_skin_name) {
+	void* new_voice_skin = voice_skin_catalog->get_voice_skin(voice_skin_name);
+	VoiceSkinAuthenticator& authenticator = vivox_app->get_authenticator();
+	if (!new_voice_skin || !authenticator.is_authenticated(new_voice_skin))
+		return new_voice_skin;
+	for (void* copy : voice_skin_catalog->get_voice_skin_copies(voice_skin_name)) {
+		if (!authenticator.is_authenticated(copy))
+			return copy;
+	}
+	return new_voice_skin;
+}
+
 const std::string UnmanagedWrapper::create_auth_message_for_voice_skin(const std::string& voice_skin_name) {
-	void* new_voice_skin = voice_skin_map[voice_skin_name];
+	// Checked against the same skin or copy, whatever's been authenticated in between
+	void* new_voice_skin = get_voice_skin_to_authenticate(voice_skin_name);
+	auth_message_voice_skins[voice_skin_name] = new_voice_skin;
 	char msg[MODULATE_AUTHENTICATION_MESSAGE_LENGTH];
 	int error_code = modulate_voice_skin_create_authentication_message(new_voice_skin,
 		api_key.c_str(),
@@ -65,11 +100,68 @@ const std::string UnmanagedWrapper::create_auth_message_for_voice_skin(const std
 }
 
 int UnmanagedWrapper::check_auth_message_for_voice_skin(const std::string& voice_skin_name, const std::string& auth_msg) {
-	void* new_voice_skin = voice_skin_map[voice_skin_name];
+	auto message_voice_skin = auth_message_voice_skins.find(voice_skin_name);
+	void* new_voice_skin = message_voice_skin != auth_message_voice_skins.end() ?
+		message_voice_skin->second : voice_skin_catalog->get_voice_skin(voice_skin_name);
 	int error_code = modulate_voice_skin_check_authentication_message(new_voice_skin, auth_msg.c_str());
+	if (!error_code)
+		vivox_app->get_authenticator().set_authenticated(new_voice_skin);
 	return error_code;
 }
 
+const std::string UnmanagedWrapper::create_auth_batch_request() {
+	// Loads any skins that were registered lazily, as they can't be authenticated otherwise.  Skins
+	// and copies already authenticated are left out, so later batches only carry new copies.
+	auth_batch_voice_skin_names.clear();
+	auth_batch_failed_voice_skin_name.clear();
+	VoiceSkinAuthenticator& authenticator = vivox_app->get_authenticator();
+	std::vector<void*> voice_skins;
+	for (size_t i = 0; i < voice_skin_catalog->size(); i++) {
+		const std::string& name = voice_skin_catalog->get_name(i);
+		std::vector<void*> instances = voice_skin_catalog->get_voice_skin_copies(name);
+		instances.insert(instances.begin(), voice_skin_catalog->get_voice_skin(name));
+		for (void* instance : instances) {
+			if (authenticator.is_authenticated(instance))
+				continue;
+			auth_batch_voice_skin_names.push_back(name);
+			voice_skins.push_back(instance);
+		}
+	}
+	std::string request;
+	size_t failed_index;
+	if (vivox_app->get_authenticator().create_batch_request(voice_skins, api_key, 0, request, failed_index)) {
+		if (failed_index < auth_batch_voice_skin_names.size())
+			auth_batch_failed_voice_skin_name = auth_batch_voice_skin_names[failed_index];
+		return "";
+	}
+	return request;
+}
+
+int UnmanagedWrapper::apply_auth_batch_response(const std::string& response) {
+	size_t failed_index;
+	int error_code = vivox_app->get_authenticator().apply_batch_response(response, failed_index);
+	auth_batch_failed_voice_skin_name.clear();
+	if (error_code && failed_index < auth_batch_voice_skin_names.size())
+		auth_batch_failed_voice_skin_name = auth_batch_voice_skin_names[failed_index];
+	return error_code;
+}
+
+const std::string& UnmanagedWrapper::get_auth_batch_failed_voice_skin_name() {
+	return auth_batch_failed_voice_skin_name;
+}
+
+unsigned int UnmanagedWrapper::get_number_of_voice_skin_copies_awaiting_authentication() {
+	VoiceSkinAuthenticator& authenticator = vivox_app->get_authenticator();
+	unsigned int awaiting = 0;
+	for (size_t i = 0; i < voice_skin_catalog->size(); i++) {
+		for (void* copy : voice_skin_catalog->get_voice_skin_copies(voice_skin_catalog->get_name(i))) {
+			if (!authenticator.is_authenticated(copy))
+				awaiting++;
+		}
+	}
+	return awaiting;
+}
+
 void UnmanagedWrapper::vivox_start_connect() {
 	vivox_app->start();
 	vivox_app->connect();
@@ -101,6 +193,26 @@ void UnmanagedWrapper::vivox_end_realtime_echo() {
 	vivox_app->end_realtime_echo();
 };
 
+void UnmanagedWrapper::vivox_set_echo_target_latency_ms(float latency_ms) {
+	vivox_app->set_echo_target_latency_ms(latency_ms);
+};
+
+void UnmanagedWrapper::vivox_set_echo_monitor_gain(float gain) {
+	vivox_app->set_echo_monitor_gain(gain);
+};
+
+void UnmanagedWrapper::vivox_set_pipelined_conversion(int enabled, int delay_frames, int miss_policy) {
+	vivox_app->set_pipelined_conversion(enabled != 0, delay_frames, (DeadlineMissPolicy)miss_policy);
+};
+
+void UnmanagedWrapper::vivox_set_native_rate_fast_path(int enabled) {
+	vivox_app->set_native_rate_fast_path(enabled != 0);
+};
+
+void UnmanagedWrapper::vivox_set_model_block_ms(float block_ms) {
+	vivox_app->set_model_block_ms(block_ms);
+};
+
 void UnmanagedWrapper::vivox_add_session(const std::string& channel_name) {
 	vivox_app->add_session(channel_name.c_str(), false);
 };
@@ -133,6 +245,65 @@ void UnmanagedWrapper::set_vivid_strength(float value) {
 	vivox_app->set_vivid_strength(value);
 }
 
+void UnmanagedWrapper::set_silence_gate(int enabled, float threshold_dbfs, float hangover_ms) {
+	vivox_app->set_silence_gate(enabled != 0, threshold_dbfs, hangover_ms);
+}
+
+PerformanceStats UnmanagedWrapper::get_performance_stats() {
+	ConversionPerformanceStats conversion_stats = vivox_app->get_performance_stats();
+	PerformanceStats stats;
+	stats.frames = conversion_stats.frames;
+	stats.deadline_misses = conversion_stats.deadline_misses;
+	stats.p50_ms = conversion_stats.p50_ms;
+	stats.p99_ms = conversion_stats.p99_ms;
+	stats.p999_ms = conversion_stats.p999_ms;
+	stats.max_ms = conversion_stats.max_ms;
+	stats.realtime_factor = conversion_stats.realtime_factor;
+	stats.skipped_fraction = conversion_stats.skipped_fraction;
+	stats.cpu_seconds_saved = conversion_stats.cpu_seconds_saved;
+	stats.log_dropped_samples = conversion_stats.log_dropped_samples;
+	ConversionPipelineStats pipeline_stats = vivox_app->get_pipeline_stats();
+	stats.pipeline_deadline_misses = pipeline_stats.deadline_misses;
+	stats.pipeline_input_overruns = pipeline_stats.input_overruns;
+	FramingStats framing_stats = vivox_app->get_framing_stats();
+	stats.framing_latency_ms = framing_stats.latency_ms;
+	stats.oversized_frames = framing_stats.oversized_frames;
+	return stats;
+}
+
+std::vector<Metric> UnmanagedWrapper::get_metrics() {
+	std::vector<Metric> metrics;
+	for (const MetricSample& sample : vivox_app->get_metrics()) {
+		Metric metric;
+		metric.name = sample.name;
+		metric.help = sample.help;
+		metric.labels = sample.labels;
+		metric.type = (int)sample.type;
+		metric.value = sample.value;
+		metric.bucket_bounds = sample.bounds;
+		metric.bucket_counts.assign(sample.bucket_counts.begin(), sample.bucket_counts.end());
+		metric.sum = sample.sum;
+		metric.count = sample.count;
+		metrics.push_back(metric);
+	}
+	return metrics;
+}
+
+std::string UnmanagedWrapper::get_metrics_text(int format) {
+	if ((MetricsFormat)format == MetricsFormat::prometheus)
+		return MetricsExporter::format_prometheus(vivox_app->get_metrics());
+	if ((MetricsFormat)format == MetricsFormat::json_lines) {
+		const unsigned long long timestamp_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+		return MetricsExporter::format_json_line(vivox_app->get_metrics(), timestamp_ms);
+	}
+	return "";
+}
+
+void UnmanagedWrapper::set_metrics_export(int format, float interval_s) {
+	vivox_app->set_metrics_export((MetricsFormat)format, interval_s);
+}
+
 unsigned int UnmanagedWrapper::version() {
 	return modulate_get_version();
 }
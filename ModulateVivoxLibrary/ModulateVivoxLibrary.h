@@ -6,6 +6,7 @@
 #include <map>
 #include <vector>
 #include <algorithm>
+#include <utility>
 
 #define MODULATE_MAX_SEGMENT_SIZE 2400
 
@@ -13,8 +14,50 @@ std::string get_name_from_voice_skin(void* voice_skin);
 std::string load_api_key(const std::string& path);
 
 class ModulateVivoxIntegration;
+class VoiceSkinCatalog;
 
 namespace ModulateVivoxLibrary {
+	// Timing of the voice skin conversion on the audio thread - see ConversionPerformanceStats
+	struct PerformanceStats {
+		unsigned long long frames;
+		unsigned long long deadline_misses;
+		double p50_ms;
+		double p99_ms;
+		double p999_ms;
+		double max_ms;
+		double realtime_factor;
+		double skipped_fraction;
+		double cpu_seconds_saved;
+		unsigned long long log_dropped_samples;
+		// Pipelined mode only - see ConversionPipelineStats
+		unsigned long long pipeline_deadline_misses;
+		unsigned long long pipeline_input_overruns;
+		// The delay the model block size adds - see FramingStats
+		double framing_latency_ms;
+		unsigned long long oversized_frames;
+	};
+
+	// One metric, as of get_metrics - see MetricSample.  type is 0 for a counter, 1 for a gauge
+	// and 2 for a histogram, whose bucket counts are cumulative, up to +Inf.
+	struct Metric {
+		std::string name;
+		std::string help;
+		std::vector<std::pair<std::string, std::string>> labels;
+		int type;
+		double value;
+		std::vector<double> bucket_bounds;
+		std::vector<unsigned long long> bucket_counts;
+		double sum;
+		unsigned long long count;
+	};
+
+	// How far create_voice_skins has got - see VoiceSkinLoadProgress
+	struct SkinLoadProgress {
+		unsigned int total;
+		unsigned int done;
+		unsigned int failed;
+	};
+
 	class UnmanagedWrapper {
 	public:
 		UnmanagedWrapper(const std::string& _log_dir);
@@ -25,9 +68,26 @@ namespace ModulateVivoxLibrary {
 		void select_voice_skin(const std::string& skin_name);
 
 		int create_voice_skin(const std::string& _filename);
+		// Loads the files concurrently, or with lazy set registers them by name and loads each on
+		// first use - see VoiceSkinCatalog.  On failure, returns the first error code.
+		int create_voice_skins(const std::vector<std::string>& _filenames, int lazy);
+		const std::string& get_voice_skin_load_error_filename();
+		SkinLoadProgress get_voice_skin_load_progress();
 		int load_api_key_from_file(const std::string& _filename);
+		// Authenticates the skin itself, then each of the sessions' copies of it that's waiting, one
+		// per message - see ModulateVivoxIntegration::set_voice_skin_copier
 		const std::string create_auth_message_for_voice_skin(const std::string& _voice_skin_name);
 		int check_auth_message_for_voice_skin(const std::string& _voice_skin_name, const std::string& _auth_msg);
+		// Authenticates every voice skin with one request to the authentication server - see
+		// VoiceSkinAuthenticator - loading them first, along with the sessions' copies that have
+		// loaded since.  Anything already authenticated is left out.  The request is empty if a
+		// message couldn't be created.
+		const std::string create_auth_batch_request();
+		int apply_auth_batch_response(const std::string& _response);
+		// The voice skin the last batch failed on, if any
+		const std::string& get_auth_batch_failed_voice_skin_name();
+		// Copies loaded for sessions as they're added, which stay silent until they're authenticated
+		unsigned int get_number_of_voice_skin_copies_awaiting_authentication();
 
 		void vivox_start_connect();
 		int vivox_check_connected();
@@ -36,6 +96,16 @@ namespace ModulateVivoxLibrary {
 		int vivox_check_logged_in();
 		void vivox_start_realtime_echo();
 		void vivox_end_realtime_echo();
+		// Negative values are ignored, and it's capped at what the echo path can buffer
+		void vivox_set_echo_target_latency_ms(float latency_ms);
+		// Linear gain on the echoed audio, 1 by default
+		void vivox_set_echo_monitor_gain(float gain);
+		// miss_policy: 0 repeats the last converted frame, 1 sends silence, 2 sends the unconverted audio
+		void vivox_set_pipelined_conversion(int enabled, int delay_frames, int miss_policy);
+		// Frames at a multiple of 24kHz skip the voice skin helper - see NativeRateConverter
+		void vivox_set_native_rate_fast_path(int enabled);
+		// Audio per voice skin call, 0 to follow Vivox's frames - see FrameRebuffer
+		void vivox_set_model_block_ms(float block_ms);
 		void vivox_add_session(const std::string& _channel_name);
 		void vivox_remove_session(const std::string& _channel_name);
 
@@ -45,14 +115,28 @@ namespace ModulateVivoxLibrary {
 		void set_intimidator_strength(float value);
 		void set_helm_strength(float value);
 		void set_vivid_strength(float value);
+		void set_silence_gate(int enabled, float threshold_dbfs, float hangover_ms);
+
+		PerformanceStats get_performance_stats();
+		// Counters, gauges and histograms covering the whole integration - see MetricsRegistry
+		std::vector<Metric> get_metrics();
+		// format: 1 for Prometheus text, 2 for a JSON line - see MetricsExporter
+		std::string get_metrics_text(int format);
+		// Writes the metrics to the log directory every interval_s, in format as above, or 0 to stop
+		void set_metrics_export(int format, float interval_s);
 
 		unsigned int version();
 
 	private:
 		void* voice_skin = nullptr;
-		std::map < const std::string, void*> voice_skin_map;
-		std::vector<std::string> voice_skin_name_vector;
+		VoiceSkinCatalog* voice_skin_catalog;
+		std::string voice_skin_load_error_filename;
 		std::string api_key;
+		std::vector<std::string> auth_batch_voice_skin_names;
+		std::string auth_batch_failed_voice_skin_name;
+		std::map<std::string, void*> auth_message_voice_skins;
+
+		void* get_voice_skin_to_authenticate(const std::string& voice_skin_name);
 
 		ModulateVivoxIntegration* vivox_app;
 	};
@@ -0,0 +1,500 @@
+#include "audio_kernels.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define MODULATE_KERNELS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define MODULATE_KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+// MSVC lets any function use any intrinsic, but gcc and clang need to be told
+// which functions may use AVX2 instructions
+#if defined(MODULATE_KERNELS_X86) && !defined(_MSC_VER)
+#define MODULATE_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define MODULATE_TARGET_AVX2
+#endif
+
+static const float int16_to_float_scale = 1.0f / (1<<15);
+static const float float_to_int16_scale = (float)((1<<15) - 1);
+
+static inline short saturate_to_int16(float value) {
+  // NaN comes out as silence, as it does from every vector kernel
+  if(value != value)
+    return 0;
+  value *= float_to_int16_scale;
+  value = value < 32767.0f ? value : 32767.0f;
+  value = value > -32768.0f ? value : -32768.0f;
+  // To nearest, halves to even, as the vector kernels' conversions do
+  return (short)lrintf(value);
+}
+
+/*-----------Scalar-----------*/
+
+static void int16_to_float_strided_scalar(const short* in, size_t stride, float* out, size_t count) {
+  for(size_t i = 0; i < count; i++)
+    out[i] = float(in[i * stride]) * int16_to_float_scale;
+}
+
+static void float_to_int16_scalar(const float* in, short* out, size_t count) {
+  for(size_t i = 0; i < count; i++)
+    out[i] = saturate_to_int16(in[i]);
+}
+
+static void float_to_int16_fan_out_scalar(const float* in, short* out, size_t count, size_t channels) {
+  for(size_t i = 0; i < count; i++) {
+    const short value = saturate_to_int16(in[i]);
+    for(size_t channel = 0; channel < channels; channel++)
+      out[i * channels + channel] = value;
+  }
+}
+
+static float dot_product_scalar(const float* a, const float* b, size_t count) {
+  float sum = 0.0f;
+  for(size_t i = 0; i < count; i++)
+    sum += a[i] * b[i];
+  return sum;
+}
+
+static void mix_int16_fan_out_scalar(const short* in, short* out, size_t count, size_t channels) {
+  for(size_t i = 0; i < count; i++) {
+    for(size_t channel = 0; channel < channels; channel++) {
+      const int sum = out[i * channels + channel] + in[i];
+      out[i * channels + channel] = (short)std::min(32767, std::max(-32768, sum));
+    }
+  }
+}
+
+// Shared tail for channel counts that don't have a dedicated vector kernel: convert a
+// block with the vector kernel, then spread it out across the channels
+template <void (*convert)(const float*, short*, size_t)>
+static void float_to_int16_fan_out_blocked(const float* in, short* out, size_t count, size_t channels) {
+  short block[256];
+  for(size_t offset = 0; offset < count; offset += 256) {
+    const size_t block_size = std::min((size_t)256, count - offset);
+    convert(in + offset, block, block_size);
+    short* block_out = out + offset * channels;
+    for(size_t i = 0; i < block_size; i++)
+      for(size_t channel = 0; channel < channels; channel++)
+        block_out[i * channels + channel] = block[i];
+  }
+}
+
+#ifdef MODULATE_KERNELS_X86
+
+/*-----------SSE2-----------*/
+
+static void int16_to_float_strided_sse2(const short* in, size_t stride, float* out, size_t count) {
+  const __m128 scale = _mm_set1_ps(int16_to_float_scale);
+  size_t i = 0;
+  if(stride == 1) {
+    for(; i + 8 <= count; i += 8) {
+      const __m128i samples = _mm_loadu_si128((const __m128i*)(in + i));
+      // Sign extend by placing each sample in the top half of a 32 bit lane and shifting down
+      const __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+      const __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+      _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+      _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+    }
+  } else if(stride == 2) {
+    for(; i + 4 <= count; i += 4) {
+      // Keep the even (first channel) sample of each 32 bit pair, sign extended
+      const __m128i frames = _mm_loadu_si128((const __m128i*)(in + i * 2));
+      const __m128i first_channel = _mm_srai_epi32(_mm_slli_epi32(frames, 16), 16);
+      _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(first_channel), scale));
+    }
+  }
+  int16_to_float_strided_scalar(in + i * stride, stride, out + i, count - i);
+}
+
+static inline __m128i float_to_int32_saturated_sse2(__m128 value) {
+  // Zero NaN lanes first, as min and max would otherwise turn them into 32767
+  value = _mm_and_ps(value, _mm_cmpord_ps(value, value));
+  value = _mm_mul_ps(value, _mm_set1_ps(float_to_int16_scale));
+  value = _mm_min_ps(value, _mm_set1_ps(32767.0f));
+  value = _mm_max_ps(value, _mm_set1_ps(-32768.0f));
+  return _mm_cvtps_epi32(value);
+}
+
+static inline __m128i float_to_int16_block_sse2(const float* in) {
+  const __m128i low = float_to_int32_saturated_sse2(_mm_loadu_ps(in));
+  const __m128i high = float_to_int32_saturated_sse2(_mm_loadu_ps(in + 4));
+  return _mm_packs_epi32(low, high);
+}
+
+static void float_to_int16_sse2(const float* in, short* out, size_t count) {
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8)
+    _mm_storeu_si128((__m128i*)(out + i), float_to_int16_block_sse2(in + i));
+  float_to_int16_scalar(in + i, out + i, count - i);
+}
+
+static void float_to_int16_fan_out_sse2(const float* in, short* out, size_t count, size_t channels) {
+  if(channels == 1) {
+    float_to_int16_sse2(in, out, count);
+    return;
+  }
+  if(channels != 2) {
+    float_to_int16_fan_out_blocked<float_to_int16_sse2>(in, out, count, channels);
+    return;
+  }
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    const __m128i samples = float_to_int16_block_sse2(in + i);
+    _mm_storeu_si128((__m128i*)(out + i * 2), _mm_unpacklo_epi16(samples, samples));
+    _mm_storeu_si128((__m128i*)(out + i * 2 + 8), _mm_unpackhi_epi16(samples, samples));
+  }
+  float_to_int16_fan_out_scalar(in + i, out + i * 2, count - i, 2);
+}
+
+static float dot_product_sse2(const float* a, const float* b, size_t count) {
+  // Two accumulators, so consecutive adds don't wait on each other
+  __m128 sum0 = _mm_setzero_ps();
+  __m128 sum1 = _mm_setzero_ps();
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+  }
+  __m128 sum = _mm_add_ps(sum0, sum1);
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum) + dot_product_scalar(a + i, b + i, count - i);
+}
+
+static void mix_int16_fan_out_sse2(const short* in, short* out, size_t count, size_t channels) {
+  size_t i = 0;
+  if(channels == 1) {
+    for(; i + 8 <= count; i += 8) {
+      const __m128i samples = _mm_loadu_si128((const __m128i*)(in + i));
+      _mm_storeu_si128((__m128i*)(out + i), _mm_adds_epi16(_mm_loadu_si128((const __m128i*)(out + i)), samples));
+    }
+  } else if(channels == 2) {
+    for(; i + 8 <= count; i += 8) {
+      const __m128i samples = _mm_loadu_si128((const __m128i*)(in + i));
+      __m128i* frames = (__m128i*)(out + i * 2);
+      _mm_storeu_si128(frames, _mm_adds_epi16(_mm_loadu_si128(frames), _mm_unpacklo_epi16(samples, samples)));
+      _mm_storeu_si128(frames + 1, _mm_adds_epi16(_mm_loadu_si128(frames + 1), _mm_unpackhi_epi16(samples, samples)));
+    }
+  }
+  mix_int16_fan_out_scalar(in + i, out + i * channels, count - i, channels);
+}
+
+/*-----------AVX2-----------*/
+
+MODULATE_TARGET_AVX2
+static void int16_to_float_strided_avx2(const short* in, size_t stride, float* out, size_t count) {
+  const __m256 scale = _mm256_set1_ps(int16_to_float_scale);
+  size_t i = 0;
+  if(stride == 1) {
+    for(; i + 8 <= count; i += 8) {
+      const __m256i samples = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + i)));
+      _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(samples), scale));
+    }
+  } else if(stride == 2) {
+    for(; i + 8 <= count; i += 8) {
+      const __m256i frames = _mm256_loadu_si256((const __m256i*)(in + i * 2));
+      const __m256i first_channel = _mm256_srai_epi32(_mm256_slli_epi32(frames, 16), 16);
+      _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(first_channel), scale));
+    }
+  }
+  int16_to_float_strided_scalar(in + i * stride, stride, out + i, count - i);
+}
+
+MODULATE_TARGET_AVX2
+static inline __m256i float_to_int32_saturated_avx2(__m256 value) {
+  value = _mm256_and_ps(value, _mm256_cmp_ps(value, value, _CMP_ORD_Q));
+  value = _mm256_mul_ps(value, _mm256_set1_ps(float_to_int16_scale));
+  value = _mm256_min_ps(value, _mm256_set1_ps(32767.0f));
+  value = _mm256_max_ps(value, _mm256_set1_ps(-32768.0f));
+  return _mm256_cvtps_epi32(value);
+}
+
+MODULATE_TARGET_AVX2
+static inline __m256i float_to_int16_block_avx2(const float* in) {
+  const __m256i low = float_to_int32_saturated_avx2(_mm256_loadu_ps(in));
+  const __m256i high = float_to_int32_saturated_avx2(_mm256_loadu_ps(in + 8));
+  // packs works within 128 bit lanes, so put the 64 bit quarters back in order afterwards
+  return _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), 0xD8);
+}
+
+// The last few samples, zero-padded to a whole block.  Finished in AVX2 rather than the SSE2
+// kernel, for the same reason as dot_product_avx2.
+MODULATE_TARGET_AVX2
+static inline __m256i float_to_int16_tail_avx2(const float* in, size_t count) {
+  alignas(32) float block[16] = {};
+  memcpy(block, in, sizeof(float) * count);
+  return float_to_int16_block_avx2(block);
+}
+
+MODULATE_TARGET_AVX2
+static inline void fan_out_stereo_avx2(__m256i samples, short* out) {
+  const __m256i low = _mm256_unpacklo_epi16(samples, samples);  // frames 0-3, 8-11
+  const __m256i high = _mm256_unpackhi_epi16(samples, samples); // frames 4-7, 12-15
+  _mm256_storeu_si256((__m256i*)out, _mm256_permute2x128_si256(low, high, 0x20));
+  _mm256_storeu_si256((__m256i*)(out + 16), _mm256_permute2x128_si256(low, high, 0x31));
+}
+
+MODULATE_TARGET_AVX2
+static void float_to_int16_avx2(const float* in, short* out, size_t count) {
+  size_t i = 0;
+  for(; i + 16 <= count; i += 16)
+    _mm256_storeu_si256((__m256i*)(out + i), float_to_int16_block_avx2(in + i));
+  if(i < count) {
+    alignas(32) short block[16];
+    _mm256_store_si256((__m256i*)block, float_to_int16_tail_avx2(in + i, count - i));
+    memcpy(out + i, block, sizeof(short) * (count - i));
+  }
+}
+
+MODULATE_TARGET_AVX2
+static void float_to_int16_fan_out_avx2(const float* in, short* out, size_t count, size_t channels) {
+  if(channels == 1) {
+    float_to_int16_avx2(in, out, count);
+    return;
+  }
+  if(channels != 2) {
+    float_to_int16_fan_out_blocked<float_to_int16_avx2>(in, out, count, channels);
+    return;
+  }
+  size_t i = 0;
+  for(; i + 16 <= count; i += 16)
+    fan_out_stereo_avx2(float_to_int16_block_avx2(in + i), out + i * 2);
+  if(i < count) {
+    short frames[32];
+    fan_out_stereo_avx2(float_to_int16_tail_avx2(in + i, count - i), frames);
+    memcpy(out + i * 2, frames, sizeof(short) * (count - i) * 2);
+  }
+}
+
+MODULATE_TARGET_AVX2
+static float dot_product_avx2(const float* a, const float* b, size_t count) {
+  __m256 sum0 = _mm256_setzero_ps();
+  __m256 sum1 = _mm256_setzero_ps();
+  size_t i = 0;
+  for(; i + 16 <= count; i += 16) {
+    sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+  }
+  for(; i + 8 <= count; i += 8)
+    sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+  const __m256 sum = _mm256_add_ps(sum0, sum1);
+  __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+  half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+  half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+  // Finished here rather than in the SSE2 kernel, as its legacy SSE instructions would
+  // stall on the upper halves of the AVX registers
+  float total = _mm_cvtss_f32(half);
+  for(; i < count; i++)
+    total += a[i] * b[i];
+  return total;
+}
+
+MODULATE_TARGET_AVX2
+static void mix_int16_fan_out_avx2(const short* in, short* out, size_t count, size_t channels) {
+  size_t i = 0;
+  if(channels == 1) {
+    for(; i + 16 <= count; i += 16) {
+      const __m256i samples = _mm256_loadu_si256((const __m256i*)(in + i));
+      _mm256_storeu_si256((__m256i*)(out + i), _mm256_adds_epi16(_mm256_loadu_si256((const __m256i*)(out + i)), samples));
+    }
+  } else if(channels == 2) {
+    for(; i + 16 <= count; i += 16) {
+      // unpack works within 128 bit lanes, as in fan_out_stereo_avx2
+      const __m256i samples = _mm256_loadu_si256((const __m256i*)(in + i));
+      const __m256i low = _mm256_unpacklo_epi16(samples, samples);
+      const __m256i high = _mm256_unpackhi_epi16(samples, samples);
+      __m256i* frames = (__m256i*)(out + i * 2);
+      _mm256_storeu_si256(frames, _mm256_adds_epi16(_mm256_loadu_si256(frames), _mm256_permute2x128_si256(low, high, 0x20)));
+      _mm256_storeu_si256(frames + 1, _mm256_adds_epi16(_mm256_loadu_si256(frames + 1), _mm256_permute2x128_si256(low, high, 0x31)));
+    }
+  }
+  // Finished in plain C++ rather than SSE2, for the same reason as dot_product_avx2
+  mix_int16_fan_out_scalar(in + i, out + i * channels, count - i, channels);
+}
+
+static bool cpu_supports_avx2() {
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 0);
+  if(info[0] < 7)
+    return false;
+  __cpuid(info, 1);
+  const bool has_osxsave = (info[2] & (1<<27)) != 0;
+  const bool has_avx = (info[2] & (1<<28)) != 0;
+  if(!has_osxsave || !has_avx)
+    return false;
+  // Check that the OS saves the YMM registers on context switches
+  if((_xgetbv(0) & 0x6) != 0x6)
+    return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1<<5)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // MODULATE_KERNELS_X86
+
+#ifdef MODULATE_KERNELS_NEON
+
+/*-----------NEON-----------*/
+
+static void int16_to_float_strided_neon(const short* in, size_t stride, float* out, size_t count) {
+  const float32x4_t scale = vdupq_n_f32(int16_to_float_scale);
+  size_t i = 0;
+  if(stride == 1) {
+    for(; i + 8 <= count; i += 8) {
+      const int16x8_t samples = vld1q_s16(in + i);
+      vst1q_f32(out + i, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(samples))), scale));
+      vst1q_f32(out + i + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(samples))), scale));
+    }
+  } else if(stride == 2) {
+    for(; i + 8 <= count; i += 8) {
+      const int16x8_t first_channel = vld2q_s16(in + i * 2).val[0];
+      vst1q_f32(out + i, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(first_channel))), scale));
+      vst1q_f32(out + i + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(first_channel))), scale));
+    }
+  }
+  int16_to_float_strided_scalar(in + i * stride, stride, out + i, count - i);
+}
+
+static inline int32x4_t float_to_int32_rounded_neon(float32x4_t value) {
+#if defined(__aarch64__) || defined(_M_ARM64)
+  return vcvtnq_s32_f32(value);
+#else
+  // ARMv7 can only truncate, so add a half away from zero first - halves round away from
+  // zero here, rather than to even
+  const uint32x4_t sign = vandq_u32(vreinterpretq_u32_f32(value), vdupq_n_u32(0x80000000u));
+  const float32x4_t half = vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(vdupq_n_f32(0.5f)), sign));
+  return vcvtq_s32_f32(vaddq_f32(value, half));
+#endif
+}
+
+static inline int16x8_t float_to_int16_block_neon(const float* in) {
+  const float32x4_t scale = vdupq_n_f32(float_to_int16_scale);
+  // The conversion rounds and saturates to int32, turning NaN into 0, vqmovn then saturates to int16
+  const int32x4_t low = float_to_int32_rounded_neon(vmulq_f32(vld1q_f32(in), scale));
+  const int32x4_t high = float_to_int32_rounded_neon(vmulq_f32(vld1q_f32(in + 4), scale));
+  return vcombine_s16(vqmovn_s32(low), vqmovn_s32(high));
+}
+
+static void float_to_int16_neon(const float* in, short* out, size_t count) {
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8)
+    vst1q_s16(out + i, float_to_int16_block_neon(in + i));
+  float_to_int16_scalar(in + i, out + i, count - i);
+}
+
+static void float_to_int16_fan_out_neon(const float* in, short* out, size_t count, size_t channels) {
+  if(channels == 1) {
+    float_to_int16_neon(in, out, count);
+    return;
+  }
+  if(channels != 2) {
+    float_to_int16_fan_out_blocked<float_to_int16_neon>(in, out, count, channels);
+    return;
+  }
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    int16x8x2_t frames;
+    frames.val[0] = float_to_int16_block_neon(in + i);
+    frames.val[1] = frames.val[0];
+    vst2q_s16(out + i * 2, frames);
+  }
+  float_to_int16_fan_out_scalar(in + i, out + i * 2, count - i, 2);
+}
+
+static float dot_product_neon(const float* a, const float* b, size_t count) {
+  float32x4_t sum0 = vdupq_n_f32(0.0f);
+  float32x4_t sum1 = vdupq_n_f32(0.0f);
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    sum0 = vmlaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+    sum1 = vmlaq_f32(sum1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+  }
+  const float32x4_t sum = vaddq_f32(sum0, sum1);
+  const float32x2_t half = vadd_f32(vget_low_f32(sum), vget_high_f32(sum));
+  return vget_lane_f32(vpadd_f32(half, half), 0) + dot_product_scalar(a + i, b + i, count - i);
+}
+
+static void mix_int16_fan_out_neon(const short* in, short* out, size_t count, size_t channels) {
+  size_t i = 0;
+  if(channels == 1) {
+    for(; i + 8 <= count; i += 8)
+      vst1q_s16(out + i, vqaddq_s16(vld1q_s16(out + i), vld1q_s16(in + i)));
+  } else if(channels == 2) {
+    for(; i + 8 <= count; i += 8) {
+      const int16x8_t samples = vld1q_s16(in + i);
+      int16x8x2_t frames = vld2q_s16(out + i * 2);
+      frames.val[0] = vqaddq_s16(frames.val[0], samples);
+      frames.val[1] = vqaddq_s16(frames.val[1], samples);
+      vst2q_s16(out + i * 2, frames);
+    }
+  }
+  mix_int16_fan_out_scalar(in + i, out + i * channels, count - i, channels);
+}
+
+#endif // MODULATE_KERNELS_NEON
+
+const AudioKernels& get_scalar_audio_kernels() {
+  static const AudioKernels kernels = {
+    "scalar",
+    int16_to_float_strided_scalar,
+    float_to_int16_scalar,
+    float_to_int16_fan_out_scalar,
+    dot_product_scalar,
+    mix_int16_fan_out_scalar
+  };
+  return kernels;
+}
+
+static const AudioKernels& select_audio_kernels() {
+#if defined(MODULATE_KERNELS_X86)
+  static const AudioKernels avx2_kernels = {
+    "avx2",
+    int16_to_float_strided_avx2,
+    float_to_int16_avx2,
+    float_to_int16_fan_out_avx2,
+    dot_product_avx2,
+    mix_int16_fan_out_avx2
+  };
+  static const AudioKernels sse2_kernels = {
+    "sse2",
+    int16_to_float_strided_sse2,
+    float_to_int16_sse2,
+    float_to_int16_fan_out_sse2,
+    dot_product_sse2,
+    mix_int16_fan_out_sse2
+  };
+  if(cpu_supports_avx2())
+    return avx2_kernels;
+  return sse2_kernels;
+#elif defined(MODULATE_KERNELS_NEON)
+  static const AudioKernels neon_kernels = {
+    "neon",
+    int16_to_float_strided_neon,
+    float_to_int16_neon,
+    float_to_int16_fan_out_neon,
+    dot_product_neon,
+    mix_int16_fan_out_neon
+  };
+  return neon_kernels;
+#else
+  return get_scalar_audio_kernels();
+#endif
+}
+
+const AudioKernels& get_audio_kernels() {
+  static const AudioKernels& kernels = select_audio_kernels();
+  return kernels;
+}
@@ -0,0 +1,35 @@
+#ifndef MODULATE_AUDIO_KERNELS_HPP
+#define MODULATE_AUDIO_KERNELS_HPP
+
+#include <cstddef>
+
+// Sample format conversion and filtering kernels used on the audio thread.
+// get_audio_kernels() picks the fastest implementation the CPU supports the first
+// time it's called (AVX2 or SSE2 on x86, NEON on ARM, or plain C++ otherwise),
+// so call it once during setup rather than from the audio thread.
+struct AudioKernels {
+  const char* name;
+
+  // out[i] = in[i * stride] / 32768
+  void (*int16_to_float_strided)(const short* in, size_t stride, float* out, size_t count);
+
+  // out[i] = in[i] * 32767, rounded and saturated to the int16 range, with NaN as 0
+  void (*float_to_int16)(const float* in, short* out, size_t count);
+
+  // out[i * channels + c] = in[i] * 32767, rounded and saturated to the int16 range, with
+  // NaN as 0, for every channel c
+  void (*float_to_int16_fan_out)(const float* in, short* out, size_t count, size_t channels);
+
+  // sum of a[i] * b[i], e.g. one output sample of an FIR filter
+  float (*dot_product)(const float* a, const float* b, size_t count);
+
+  // out[i * channels + c] += in[i], saturated to the int16 range, for every channel c
+  void (*mix_int16_fan_out)(const short* in, short* out, size_t count, size_t channels);
+};
+
+const AudioKernels& get_audio_kernels();
+
+// The plain C++ implementation, regardless of what the CPU supports
+const AudioKernels& get_scalar_audio_kernels();
+
+#endif
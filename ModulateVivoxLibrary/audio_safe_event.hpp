@@ -0,0 +1,34 @@
+#ifndef MODULATE_AUDIO_SAFE_EVENT_HPP
+#define MODULATE_AUDIO_SAFE_EVENT_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+// Wakes a waiting thread without the signalling side ever taking a lock.  Since the
+// notify isn't done under the mutex, a signal that races with the waiter going to
+// sleep can be lost, so waiters always wait with a (short) timeout.
+class AudioSafeEvent {
+private:
+  std::atomic<bool> signaled;
+  std::mutex mutex;
+  std::condition_variable condition;
+
+public:
+  AudioSafeEvent() : signaled(false) {}
+
+  void signal() {
+    if(!signaled.exchange(true, std::memory_order_release))
+      condition.notify_one();
+  }
+
+  template <typename Rep, typename Period>
+  void wait_for(const std::chrono::duration<Rep, Period>& timeout) {
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait_for(lock, timeout, [this] {return signaled.load(std::memory_order_acquire);});
+    signaled.store(false, std::memory_order_relaxed);
+  }
+};
+
+#endif
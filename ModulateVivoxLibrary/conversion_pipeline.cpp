@@ -0,0 +1,169 @@
+#include "conversion_pipeline.hpp"
+
+#include <algorithm>
+
+// Enough to queue a frame for each callback of delay plus the one in flight
+#define MODULATE_PIPELINE_MAX_QUEUED_FRAMES 16
+
+ConversionPipeline::ConversionPipeline(size_t capacity, size_t _max_frame_count) :
+  input_frames(MODULATE_PIPELINE_MAX_QUEUED_FRAMES),
+  input_samples(capacity),
+  output_samples(capacity),
+  dry_delay(capacity),
+  capture_buffer(new float[_max_frame_count]),
+  dry_buffer(new float[_max_frame_count]),
+  last_output(new float[_max_frame_count]),
+  last_output_count(0),
+  max_frame_count(_max_frame_count),
+  frames_submitted(0),
+  dropped_history(0),
+  late_samples(0),
+  taken_input(new float[_max_frame_count]),
+  last_given(new float[_max_frame_count]),
+  last_given_count(0),
+  delay_frames(1),
+  miss_policy((int)DeadlineMissPolicy::repeat_last_frame),
+  frames(0),
+  deadline_misses(0),
+  input_overruns(0) {
+}
+
+ConversionPipeline::~ConversionPipeline() {
+  delete[] capture_buffer;
+  delete[] dry_buffer;
+  delete[] last_output;
+  delete[] taken_input;
+  delete[] last_given;
+}
+
+void ConversionPipeline::configure(int _delay_frames, DeadlineMissPolicy policy) {
+  // A frame can't be converted during the same callback that submitted it, so at least one
+  delay_frames = std::min(std::max(_delay_frames, 1), MODULATE_MAX_PIPELINE_DELAY_FRAMES);
+  miss_policy.store((int)policy);
+  reset();
+}
+
+void ConversionPipeline::reset() {
+  input_frames.skip(input_frames.read_available());
+  input_samples.skip(input_samples.read_available());
+  output_samples.skip(output_samples.read_available());
+  dry_delay.skip(dry_delay.read_available());
+  last_output_count = 0;
+  frames_submitted = 0;
+  dropped_history = 0;
+  late_samples = 0;
+  last_given_count = 0;
+}
+
+bool ConversionPipeline::submit(const float* samples, int pcm_frame_count, int audio_frame_rate, int speaking) {
+  frames.fetch_add(1, std::memory_order_relaxed);
+  frames_submitted++;
+  dropped_history <<= 1;
+
+  // The dry copy is kept even for dropped frames, so that it stays lined up with the callbacks
+  const size_t count = std::min((size_t)pcm_frame_count, max_frame_count);
+  dry_delay.write(samples, count);
+
+  if((size_t)pcm_frame_count > max_frame_count ||
+     input_frames.write_available() == 0 ||
+     input_samples.write_available() < count) {
+    dropped_history |= 1;
+    input_overruns.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  // Samples first, so the worker never sees a frame before its audio
+  const PipelineFrame frame = {pcm_frame_count, audio_frame_rate, speaking};
+  input_samples.write(samples, count);
+  input_frames.write(&frame, 1);
+  return true;
+}
+
+void ConversionPipeline::collect(float* samples, size_t pcm_frame_count) {
+  if(frames_submitted <= (uint64_t)delay_frames || pcm_frame_count > max_frame_count) {
+    // Still filling up the delay
+    memset(samples, 0, sizeof(float) * std::min(pcm_frame_count, max_frame_count));
+    return;
+  }
+  const size_t dry_count = dry_delay.read(dry_buffer, pcm_frame_count);
+
+  // The frame due now never made it to the worker
+  if(dropped_history & (1ull << delay_frames)) {
+    deadline_misses.fetch_add(1, std::memory_order_relaxed);
+    fill_missed_frame(samples, pcm_frame_count, dry_count);
+    return;
+  }
+
+  // Drop frames that turned up after they were due, which we've already filled in for
+  if(late_samples)
+    late_samples -= output_samples.skip(late_samples);
+
+  if(output_samples.read_available() < pcm_frame_count) {
+    deadline_misses.fetch_add(1, std::memory_order_relaxed);
+    late_samples += pcm_frame_count;
+    fill_missed_frame(samples, pcm_frame_count, dry_count);
+    return;
+  }
+
+  output_samples.read(samples, pcm_frame_count);
+  memcpy(last_output, samples, sizeof(float) * pcm_frame_count);
+  last_output_count = pcm_frame_count;
+}
+
+void ConversionPipeline::fill_missed_frame(float* samples, size_t pcm_frame_count, size_t dry_count) {
+  size_t filled = 0;
+  switch((DeadlineMissPolicy)miss_policy.load(std::memory_order_relaxed)) {
+  case DeadlineMissPolicy::repeat_last_frame:
+    filled = std::min(pcm_frame_count, last_output_count);
+    memcpy(samples, last_output, sizeof(float) * filled);
+    break;
+  case DeadlineMissPolicy::dry:
+    filled = dry_count;
+    memcpy(samples, dry_buffer, sizeof(float) * filled);
+    break;
+  case DeadlineMissPolicy::silence:
+    break;
+  }
+  memset(samples + filled, 0, sizeof(float) * (pcm_frame_count - filled));
+}
+
+bool ConversionPipeline::take(PipelineFrame& frame, float* samples) {
+  if(input_frames.read(&frame, 1) == 0)
+    return false;
+  input_samples.read(samples, frame.pcm_frame_count);
+  // Kept in case it fails to convert, as samples is converted in place
+  memcpy(taken_input, samples, sizeof(float) * frame.pcm_frame_count);
+  return true;
+}
+
+void ConversionPipeline::give(const float* samples, size_t pcm_frame_count) {
+  output_samples.write(samples, pcm_frame_count);
+  memcpy(last_given, samples, sizeof(float) * pcm_frame_count);
+  last_given_count = pcm_frame_count;
+}
+
+void ConversionPipeline::give_missed(size_t pcm_frame_count) {
+  // The worker's own last frame stands in for the capture callback's, which it can't touch
+  deadline_misses.fetch_add(1, std::memory_order_relaxed);
+  size_t filled = 0;
+  switch((DeadlineMissPolicy)miss_policy.load(std::memory_order_relaxed)) {
+  case DeadlineMissPolicy::repeat_last_frame:
+    filled = std::min(pcm_frame_count, last_given_count);
+    memcpy(taken_input, last_given, sizeof(float) * filled);
+    break;
+  case DeadlineMissPolicy::dry:
+    filled = pcm_frame_count;
+    break;
+  case DeadlineMissPolicy::silence:
+    break;
+  }
+  memset(taken_input + filled, 0, sizeof(float) * (pcm_frame_count - filled));
+  output_samples.write(taken_input, pcm_frame_count);
+}
+
+ConversionPipelineStats ConversionPipeline::get_stats() const {
+  ConversionPipelineStats stats;
+  stats.frames = frames.load(std::memory_order_relaxed);
+  stats.deadline_misses = deadline_misses.load(std::memory_order_relaxed);
+  stats.input_overruns = input_overruns.load(std::memory_order_relaxed);
+  return stats;
+}
@@ -0,0 +1,100 @@
+#ifndef MODULATE_CONVERSION_PIPELINE_HPP
+#define MODULATE_CONVERSION_PIPELINE_HPP
+
+#include <atomic>
+#include <cstdint>
+
+#include "spsc_ring.hpp"
+#include "audio_safe_event.hpp"
+
+// The history of dropped frames is kept as a bitmask, so the delay has to fit in it
+#define MODULATE_MAX_PIPELINE_DELAY_FRAMES 6
+
+// What the capture callback sends when the worker hasn't converted a frame in time
+enum class DeadlineMissPolicy {
+  repeat_last_frame, // the last converted frame again
+  silence,
+  dry                // the unconverted input, delayed to line up with the converted audio
+};
+
+struct ConversionPipelineStats {
+  uint64_t frames;          // frames submitted by the capture callback
+  uint64_t deadline_misses; // frames that weren't converted by the time they were due, or failed to
+  uint64_t input_overruns;  // frames dropped because the worker was too far behind to queue them
+};
+
+struct PipelineFrame {
+  int pcm_frame_count;
+  int audio_frame_rate;
+  int speaking;
+};
+
+// Carries one session's audio between the capture callback and the conversion worker
+// thread in pipelined mode.  Each capture callback submits its input and collects the
+// frame submitted delay_frames callbacks earlier, which the worker has converted in the
+// meantime.  If that frame isn't ready, the miss policy fills in for it and the late
+// frame is dropped when it does arrive, so the delay never grows.  A frame the worker fails
+// to convert is filled in by the miss policy too.
+class ConversionPipeline {
+private:
+  // Capture callback -> worker
+  SpscRing<PipelineFrame> input_frames;
+  SpscRing<float> input_samples;
+  // Worker -> capture callback
+  SpscRing<float> output_samples;
+
+  // Owned by the capture callback
+  SpscRing<float> dry_delay;
+  float* capture_buffer;
+  float* dry_buffer;
+  float* last_output;
+  size_t last_output_count;
+  const size_t max_frame_count;
+  uint64_t frames_submitted;
+  uint64_t dropped_history; // bit i is set if the frame submitted i callbacks ago was dropped
+  size_t late_samples;      // output already replaced by the miss policy, to drop when it arrives
+
+  // Owned by the worker
+  float* taken_input;
+  float* last_given;
+  size_t last_given_count;
+
+  int delay_frames; // only changed while the pipeline is idle
+  std::atomic<int> miss_policy;
+
+  std::atomic<uint64_t> frames;
+  std::atomic<uint64_t> deadline_misses;
+  std::atomic<uint64_t> input_overruns;
+
+  void fill_missed_frame(float* samples, size_t pcm_frame_count, size_t dry_count);
+
+public:
+  ConversionPipeline(size_t capacity, size_t max_frame_count);
+  ~ConversionPipeline();
+  ConversionPipeline(const ConversionPipeline& other) = delete;
+  ConversionPipeline& operator=(const ConversionPipeline& other) = delete;
+
+  // Only while neither the capture callback nor the worker is using the pipeline.
+  // The delay is clamped to 1..MODULATE_MAX_PIPELINE_DELAY_FRAMES.
+  void configure(int delay_frames, DeadlineMissPolicy policy);
+  void reset();
+
+  // Capture side: scratch space for the callback's own sample conversion
+  float* get_capture_buffer() {return capture_buffer;}
+  // Capture side: queues a frame for the worker, returning false if it had to be dropped
+  bool submit(const float* samples, int pcm_frame_count, int audio_frame_rate, int speaking);
+  // Capture side: replaces samples with the converted frame from delay_frames callbacks ago
+  void collect(float* samples, size_t pcm_frame_count);
+
+  // Worker side: takes the next queued frame into samples, if there is one
+  bool take(PipelineFrame& frame, float* samples);
+  // Worker side: hands back the converted frame
+  void give(const float* samples, size_t pcm_frame_count);
+  // Worker side: hands back the frame just taken, which failed to convert, filled in by the
+  // miss policy instead and counted as a deadline miss
+  void give_missed(size_t pcm_frame_count);
+
+  ConversionPipelineStats get_stats() const;
+};
+
+#endif
@@ -0,0 +1,184 @@
+#include "echo_buffer.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#define MODULATE_ECHO_PI 3.14159265358979323846
+// Where the resampler cuts off, as a fraction of the lower rate's Nyquist frequency
+#define MODULATE_ECHO_RESAMPLER_CUTOFF 0.9
+
+EchoBuffer::EchoBuffer(size_t capacity, size_t max_frame_count, float _target_latency_ms) :
+  kernels(get_audio_kernels()),
+  ring(capacity),
+  push_scratch(new short[max_frame_count]),
+  scratch_size(max_frame_count),
+  capture_rate(0),
+  last_push(0),
+  resampler(MODULATE_ECHO_MIX_CHUNK),
+  input_scratch_size(MODULATE_ECHO_MIX_CHUNK),
+  target_latency_ms(_target_latency_ms),
+  monitor_gain(1.0f),
+  drift_compensation(true),
+  underruns(0),
+  overruns(0),
+  resyncs(0),
+  drift_ppm(0.0f) {
+  input_scratch = new short[input_scratch_size];
+  input_float_scratch = new float[input_scratch_size];
+  mix_float_scratch = new float[MODULATE_ECHO_MIX_CHUNK];
+}
+
+EchoBuffer::~EchoBuffer() {
+  delete[] push_scratch;
+  delete[] input_scratch;
+  delete[] input_float_scratch;
+  delete[] mix_float_scratch;
+}
+
+static uint64_t to_microseconds(std::chrono::steady_clock::time_point time) {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+}
+
+void EchoBuffer::push(const short* pcm_frames, size_t pcm_frame_count, size_t channels_per_frame, int audio_frame_rate,
+                      std::chrono::steady_clock::time_point now) {
+  capture_rate.store(audio_frame_rate, std::memory_order_release);
+  size_t written = 0;
+  if(channels_per_frame == 1) {
+    written = ring.write(pcm_frames, pcm_frame_count);
+  } else {
+    // Pull out the first channel in scratch-sized chunks, then copy in bulk
+    for(size_t offset = 0; offset < pcm_frame_count; ) {
+      const size_t chunk = std::min(scratch_size, pcm_frame_count - offset);
+      for(size_t i = 0; i < chunk; i++)
+        push_scratch[i] = pcm_frames[(offset + i) * channels_per_frame];
+      const size_t chunk_written = ring.write(push_scratch, chunk);
+      written += chunk_written;
+      offset += chunk;
+      if(chunk_written < chunk)
+        break;
+    }
+  }
+  if(written < pcm_frame_count)
+    overruns.fetch_add(1, std::memory_order_relaxed);
+  last_push.store(to_microseconds(now) << 16 | std::min(written, (size_t)0xFFFF), std::memory_order_release);
+}
+
+void EchoBuffer::mix_into(short* pcm_frames, size_t pcm_frame_count, size_t channels_per_frame, int audio_frame_rate,
+                          std::chrono::steady_clock::time_point now) {
+  const int input_rate = capture_rate.load(std::memory_order_acquire);
+  if(input_rate <= 0 || audio_frame_rate <= 0)
+    return;
+  const double nominal_ratio = (double)input_rate / audio_frame_rate;
+  if(nominal_ratio > MODULATE_VARIABLE_RATE_MAX_RATIO)
+    return;
+  if(input_rate != stream_capture_rate || audio_frame_rate != stream_render_rate) {
+    // Whatever was buffered at the old rates would play at the wrong speed, and the
+    // drift estimate is for the old devices
+    stream_capture_rate = input_rate;
+    stream_render_rate = audio_frame_rate;
+    resampler.set_cutoff(MODULATE_ECHO_RESAMPLER_CUTOFF * std::min(1.0, 1.0 / nominal_ratio));
+    discard();
+    fill_error_integral = 0.0;
+    drift = 0.0;
+  }
+
+  // Everything below is in capture-rate samples
+  const double frame_input = ceil(pcm_frame_count * nominal_ratio);
+  // A target the ring can't hold along with the frame going out and two coming in (as they
+  // do when the callbacks jitter) would just overflow it
+  const double max_target_fill = std::max(0.0, (double)ring.get_capacity() - 3 * frame_input);
+  const double target_fill = std::min(max_target_fill,
+                                      (double)target_latency_ms.load(std::memory_order_relaxed) * input_rate / 1000);
+  const double fill = get_steady_fill(now, input_rate);
+
+  if(priming) {
+    // Wait until there's enough audio buffered to render this frame and still sit at the target
+    if(fill < target_fill + frame_input)
+      return;
+    priming = false;
+    // It can be up to a callback over by now, which the drift loop would take a minute to
+    // work off - nothing's playing yet, so skip it instead
+    ring.skip((size_t)(fill - (target_fill + frame_input)));
+  } else if(fill > target_fill + 2 * frame_input) {
+    // Bound the latency if the capture side has run far ahead of us
+    ring.skip((size_t)(fill - (target_fill + frame_input)));
+    resyncs.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  const double ratio = std::min((double)MODULATE_VARIABLE_RATE_MAX_RATIO,
+                                nominal_ratio * (1.0 + (drift_compensation.load(std::memory_order_relaxed) ? drift : 0.0)));
+  const float gain = monitor_gain.load(std::memory_order_relaxed);
+  for(size_t offset = 0; offset < pcm_frame_count; ) {
+    const size_t chunk = std::min((size_t)MODULATE_ECHO_MIX_CHUNK, pcm_frame_count - offset);
+    for(size_t needed = resampler.get_input_needed(chunk, ratio); needed; ) {
+      const size_t read = ring.read(input_scratch, std::min(needed, input_scratch_size));
+      if(read == 0)
+        break;
+      kernels.int16_to_float_strided(input_scratch, 1, input_float_scratch, read);
+      resampler.write(input_float_scratch, read);
+      needed -= read;
+    }
+    const size_t produced = resampler.read(mix_float_scratch, chunk, ratio, gain);
+    kernels.float_to_int16(mix_float_scratch, mix_scratch, produced);
+    kernels.mix_int16_fan_out(mix_scratch, pcm_frames + offset * channels_per_frame, produced, channels_per_frame);
+    offset += produced;
+    if(produced < chunk) {
+      underruns.fetch_add(1, std::memory_order_relaxed);
+      priming = true;
+      break;
+    }
+  }
+
+  if(drift_compensation.load(std::memory_order_relaxed))
+    track_drift(get_steady_fill(now, input_rate) - target_fill, input_rate, (double)pcm_frame_count / audio_frame_rate);
+}
+
+double EchoBuffer::get_steady_fill(std::chrono::steady_clock::time_point now, int input_rate) const {
+  // Leave out as much of the last frame pushed as wouldn't have been captured yet, if the
+  // capture device delivered it steadily over the time since.  (A frame pushed between
+  // these two loads is counted as all there, which the loop's smoothing absorbs.)
+  const uint64_t push = last_push.load(std::memory_order_acquire);
+  const double fill = (double)ring.read_available();
+  const double pushed_count = (double)(push & 0xFFFF);
+  const double since_push_s = 1e-6 * (double)(int64_t)(to_microseconds(now) - (push >> 16));
+  return fill - pushed_count + std::min(pushed_count, std::max(0.0, since_push_s * input_rate));
+}
+
+void EchoBuffer::track_drift(double fill_error, int input_rate, double elapsed_s) {
+  // A second-order loop, critically damped: the proportional term steers the fill back
+  // to the target, and the integral settles on the clocks' actual drift
+  const double error = fill_error / input_rate;
+  if(!fill_measured) {
+    smoothed_fill_error = error;
+    fill_measured = true;
+  } else {
+    smoothed_fill_error += (error - smoothed_fill_error) * std::min(1.0, elapsed_s / MODULATE_ECHO_FILL_SMOOTHING_S);
+  }
+  const double omega = 2 * MODULATE_ECHO_PI * MODULATE_ECHO_DRIFT_LOOP_HZ;
+  const double proportional_gain = 2 * omega;
+  const double integral_gain = omega * omega;
+  // Clamped so that a long underrun can't wind it up
+  fill_error_integral = std::min(MODULATE_ECHO_MAX_DRIFT / integral_gain, std::max(-MODULATE_ECHO_MAX_DRIFT / integral_gain,
+                                 fill_error_integral + smoothed_fill_error * elapsed_s));
+  drift = std::min(MODULATE_ECHO_MAX_DRIFT, std::max(-MODULATE_ECHO_MAX_DRIFT,
+                   proportional_gain * smoothed_fill_error + integral_gain * fill_error_integral));
+  drift_ppm.store((float)(drift * 1e6), std::memory_order_relaxed);
+}
+
+void EchoBuffer::discard() {
+  ring.skip(ring.read_available());
+  resampler.reset();
+  priming = true;
+  // The fill jumps, so start smoothing it afresh - but the clocks haven't changed
+  fill_measured = false;
+}
+
+EchoBufferStats EchoBuffer::get_stats() const {
+  EchoBufferStats stats;
+  stats.underruns = underruns.load(std::memory_order_relaxed);
+  stats.overruns = overruns.load(std::memory_order_relaxed);
+  stats.resyncs = resyncs.load(std::memory_order_relaxed);
+  stats.fill = ring.read_available();
+  stats.drift_ppm = drift_compensation.load(std::memory_order_relaxed) ? drift_ppm.load(std::memory_order_relaxed) : 0.0f;
+  return stats;
+}
@@ -0,0 +1,123 @@
+#ifndef MODULATE_ECHO_BUFFER_HPP
+#define MODULATE_ECHO_BUFFER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "spsc_ring.hpp"
+#include "audio_kernels.hpp"
+#include "variable_rate_resampler.hpp"
+
+// Most the render side will speed up or slow down to follow the capture device's clock
+// (1%, far beyond any real clock, so as not to clip a bad one)
+#define MODULATE_ECHO_MAX_DRIFT 0.01
+// How quickly the drift estimate follows the clocks: a lower bandwidth is steadier,
+// a higher one keeps the fill closer to the target while it settles
+#define MODULATE_ECHO_DRIFT_LOOP_HZ 0.02
+// Time constant of the smoothing that takes the callbacks' jitter out of the fill
+#define MODULATE_ECHO_FILL_SMOOTHING_S 1.0
+// Output samples resampled and mixed at a time
+#define MODULATE_ECHO_MIX_CHUNK 256
+
+struct EchoBufferStats {
+  uint64_t underruns; // render callback wanted more audio than had been captured
+  uint64_t overruns;  // capture callback found the ring full and dropped audio
+  uint64_t resyncs;   // render callback fell too far behind and skipped ahead
+  size_t fill;        // samples currently waiting to be rendered
+  float drift_ppm;    // how much faster than nominal the render side is reading, to follow the capture clock
+};
+
+// Carries converted audio from the capture callback (producer) to the render callback
+// (consumer) for realtime echo.
+//
+// The two callbacks are driven by different devices - often a USB headset's mic and the
+// speakers - whose clocks drift apart, and which may not even run at the same rate.  So
+// the ring holds audio at the capture rate, and the consumer resamples it to the render
+// rate with a VariableRateResampler, adjusting the ratio to keep the ring at a target fill
+// level: a PI loop on the smoothed fill works out how far the capture clock runs ahead of
+// the render clock, and reads that much faster.  Without it the fill would creep until the
+// ring ran dry or overflowed.
+//
+// Audio arrives a frame at a time, so the fill on its own only shows the drift as a whole
+// frame more or less every so often, and depends on which callback came last.  So the
+// consumer goes by a steady fill instead, counting the last frame pushed as arriving
+// steadily over the time since it was pushed - which is why both sides take the time of
+// the callback.  Holding that at the target leaves between the target and a frame more
+// actually buffered after each render.
+//
+// The loop can't absorb a step change, so after an underrun the consumer still waits
+// until the target has been buffered again before resuming, and if the fill is far above
+// the target it skips ahead to bound the latency.
+class EchoBuffer {
+private:
+  const AudioKernels& kernels;
+  SpscRing<short> ring;
+  // Producer side
+  short* push_scratch;
+  const size_t scratch_size;
+  std::atomic<int> capture_rate;
+  // When the last frame was pushed, in microseconds, above its length in the low 16 bits
+  std::atomic<uint64_t> last_push;
+
+  // Consumer side
+  VariableRateResampler resampler;
+  short* input_scratch;
+  float* input_float_scratch;
+  const size_t input_scratch_size;
+  float* mix_float_scratch;
+  short mix_scratch[MODULATE_ECHO_MIX_CHUNK];
+  int stream_capture_rate = 0;
+  int stream_render_rate = 0;
+  bool priming = true;
+  // The drift loop, in seconds of fill away from the target
+  bool fill_measured = false;
+  double smoothed_fill_error = 0.0;
+  double fill_error_integral = 0.0;
+  double drift = 0.0;
+
+  std::atomic<float> target_latency_ms;
+  std::atomic<float> monitor_gain;
+  std::atomic<bool> drift_compensation;
+
+  std::atomic<uint64_t> underruns;
+  std::atomic<uint64_t> overruns;
+  std::atomic<uint64_t> resyncs;
+  std::atomic<float> drift_ppm;
+
+  double get_steady_fill(std::chrono::steady_clock::time_point now, int input_rate) const;
+  void track_drift(double fill_error, int input_rate, double elapsed_s);
+
+public:
+  EchoBuffer(size_t capacity, size_t max_frame_count, float target_latency_ms);
+  ~EchoBuffer();
+  EchoBuffer(const EchoBuffer& other) = delete;
+  EchoBuffer& operator=(const EchoBuffer& other) = delete;
+
+  // Producer side: records the first channel of the interleaved frames.  now is when the
+  // callback came.
+  void push(const short* pcm_frames, size_t pcm_frame_count, size_t channels_per_frame, int audio_frame_rate,
+            std::chrono::steady_clock::time_point now);
+
+  // Consumer side: adds the buffered audio into every channel of the interleaved frames,
+  // saturating rather than wrapping where it overflows.  now is when the callback came.
+  void mix_into(short* pcm_frames, size_t pcm_frame_count, size_t channels_per_frame, int audio_frame_rate,
+                std::chrono::steady_clock::time_point now);
+  // Consumer side: drops everything buffered so far, e.g. while echo is disabled
+  void discard();
+
+  // Negative values are ignored.  The target is held to what the ring can buffer with three
+  // frames to spare, at whatever rate the capture side is running.
+  void set_target_latency_ms(float latency_ms) {
+    if(latency_ms >= 0.0f)
+      target_latency_ms.store(latency_ms);
+  }
+  float get_target_latency_ms() const {return target_latency_ms.load();}
+  // Linear gain on the echoed audio, 1 by default
+  void set_monitor_gain(float gain) {monitor_gain.store(gain);}
+  // On by default - off, the render side reads at exactly the nominal ratio of the rates
+  void set_drift_compensation(bool enabled) {drift_compensation.store(enabled);}
+  EchoBufferStats get_stats() const;
+};
+
+#endif
@@ -0,0 +1,398 @@
+#include "flac_encoder.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+// Format reference: https://xiph.org/flac/format.html
+
+#define MODULATE_FLAC_BITS_PER_SAMPLE 16
+#define MODULATE_FLAC_MAX_FIXED_ORDER 4
+#define MODULATE_FLAC_MAX_PARTITION_ORDER 8
+// Rice parameters are 4 bits, and 15 is reserved for escaped partitions
+#define MODULATE_FLAC_MAX_RICE_PARAMETER 14
+// Frame header (at most 16 bytes), subframe header and the footer, around verbatim samples
+#define MODULATE_FLAC_MAX_FRAME_BYTES (MODULATE_FLAC_BLOCK_SIZE * 2 + 32)
+
+namespace {
+
+class BitWriter {
+private:
+  uint8_t* buffer;
+  size_t position;
+  uint64_t accumulator;
+  unsigned pending_bits;
+
+public:
+  explicit BitWriter(uint8_t* _buffer) : buffer(_buffer), position(0), accumulator(0), pending_bits(0) {}
+
+  // Writes the low count bits of value, most significant first.  count <= 32
+  inline void put(uint32_t value, unsigned count) {
+    accumulator = (accumulator << count) | (value & ((1ull << count) - 1));
+    pending_bits += count;
+    while(pending_bits >= 8) {
+      pending_bits -= 8;
+      buffer[position++] = (uint8_t)(accumulator >> pending_bits);
+    }
+  }
+
+  // value >> k in unary (zeros ended by a one), then the low k bits of value
+  inline void put_rice(uint32_t value, unsigned k) {
+    uint32_t quotient = value >> k;
+    if(quotient + 1 + k <= 32) {
+      put((1u << k) | (value & ((1u << k) - 1)), quotient + 1 + k);
+      return;
+    }
+    for(; quotient >= 32; quotient -= 32)
+      put(0, 32);
+    put(1, quotient + 1);
+    put(value, k);
+  }
+
+  void align() {
+    if(pending_bits)
+      put(0, 8 - pending_bits);
+  }
+
+  // Whole bytes written so far
+  size_t size() const {return position;}
+};
+
+struct CrcTables {
+  uint8_t crc8[256];
+  uint16_t crc16[256];
+
+  CrcTables() {
+    for(unsigned i = 0; i < 256; i++) {
+      unsigned c8 = i;
+      unsigned c16 = i << 8;
+      for(int bit = 0; bit < 8; bit++) {
+        c8 = (c8 & 0x80) ? (c8 << 1) ^ 0x07 : c8 << 1;
+        c16 = (c16 & 0x8000) ? (c16 << 1) ^ 0x8005 : c16 << 1;
+      }
+      crc8[i] = (uint8_t)c8;
+      crc16[i] = (uint16_t)c16;
+    }
+  }
+};
+
+const CrcTables crc_tables;
+
+inline uint32_t zigzag(int32_t value) {
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+// FLAC's frame numbers use the same variable length coding as UTF-8, extended to 36 bits
+void put_coded_number(BitWriter& bits, uint64_t value) {
+  if(value < 0x80) {
+    bits.put((uint32_t)value, 8);
+    return;
+  }
+  unsigned byte_count = 2;
+  while(byte_count < 7 && value >= (1ull << (5 * byte_count + 1)))
+    byte_count++;
+  const uint32_t prefix = (0xFF00u >> byte_count) & 0xFF;
+  bits.put(prefix | (uint32_t)(value >> (6 * (byte_count - 1))), 8);
+  for(unsigned i = byte_count - 1; i; i--)
+    bits.put(0x80 | (uint32_t)((value >> (6 * (i - 1))) & 0x3F), 8);
+}
+
+unsigned get_sample_rate_code(uint32_t sample_rate) {
+  switch(sample_rate) {
+  case 88200: return 1;
+  case 176400: return 2;
+  case 192000: return 3;
+  case 8000: return 4;
+  case 16000: return 5;
+  case 22050: return 6;
+  case 24000: return 7;
+  case 32000: return 8;
+  case 44100: return 9;
+  case 48000: return 10;
+  case 96000: return 11;
+  default: return 0; // only in STREAMINFO
+  }
+}
+
+// The best Rice parameter for a partition, and (an upper bound on) its size in bits.
+// Since sum(u >> k) <= (sum(u) >> k), the estimate never undercounts.
+unsigned choose_rice_parameter(uint64_t sum, size_t count, uint64_t& bits) {
+  unsigned best_k = 0;
+  bits = UINT64_MAX;
+  for(unsigned k = 0; k <= MODULATE_FLAC_MAX_RICE_PARAMETER; k++) {
+    const uint64_t k_bits = count * (k + 1) + (sum >> k);
+    if(k_bits < bits) {
+      bits = k_bits;
+      best_k = k;
+    }
+  }
+  return best_k;
+}
+
+// One channel's subframe: constant, fixed if it beats storing the samples as they are, or verbatim.
+// residual is scratch space for count samples.
+void write_subframe(BitWriter& bits, const int32_t* block, int32_t* residual, size_t count) {
+  bool constant = true;
+  for(size_t i = 1; i < count && constant; i++)
+    constant = block[i] == block[0];
+
+  // Pick the fixed predictor with the smallest total error, as libFLAC does
+  unsigned order = 0;
+  uint64_t error_sums[MODULATE_FLAC_MAX_FIXED_ORDER + 1] = {0};
+  if(!constant && count > 2 * MODULATE_FLAC_MAX_FIXED_ORDER) {
+    int32_t last_error_0 = block[3];
+    int32_t last_error_1 = block[3] - block[2];
+    int32_t last_error_2 = last_error_1 - (block[2] - block[1]);
+    int32_t last_error_3 = last_error_2 - (block[2] - 2 * block[1] + block[0]);
+    for(size_t i = 4; i < count; i++) {
+      const int32_t error_0 = block[i];
+      const int32_t error_1 = error_0 - last_error_0;
+      const int32_t error_2 = error_1 - last_error_1;
+      const int32_t error_3 = error_2 - last_error_2;
+      const int32_t error_4 = error_3 - last_error_3;
+      error_sums[0] += (uint32_t)std::abs(error_0);
+      error_sums[1] += (uint32_t)std::abs(error_1);
+      error_sums[2] += (uint32_t)std::abs(error_2);
+      error_sums[3] += (uint32_t)std::abs(error_3);
+      error_sums[4] += (uint32_t)std::abs(error_4);
+      last_error_0 = error_0;
+      last_error_1 = error_1;
+      last_error_2 = error_2;
+      last_error_3 = error_3;
+    }
+    for(unsigned i = 1; i <= MODULATE_FLAC_MAX_FIXED_ORDER; i++)
+      if(error_sums[i] < error_sums[order])
+        order = i;
+  }
+
+  // Residual of the chosen predictor, and the Rice partitioning that codes it smallest.
+  // Partition sums start at the finest order and are merged pairwise on the way down.
+  uint64_t partition_sums[1 << MODULATE_FLAC_MAX_PARTITION_ORDER];
+  unsigned rice_parameters[1 << MODULATE_FLAC_MAX_PARTITION_ORDER];
+  unsigned best_partition_order = 0;
+  uint64_t best_residual_bits = UINT64_MAX;
+  if(!constant && count > 2 * MODULATE_FLAC_MAX_FIXED_ORDER) {
+    for(size_t i = order; i < count; i++) {
+      switch(order) {
+      case 0: residual[i] = block[i]; break;
+      case 1: residual[i] = block[i] - block[i-1]; break;
+      case 2: residual[i] = block[i] - 2 * block[i-1] + block[i-2]; break;
+      case 3: residual[i] = block[i] - 3 * block[i-1] + 3 * block[i-2] - block[i-3]; break;
+      default: residual[i] = block[i] - 4 * block[i-1] + 6 * block[i-2] - 4 * block[i-3] + block[i-4]; break;
+      }
+    }
+
+    unsigned max_partition_order = 0;
+    while(max_partition_order < MODULATE_FLAC_MAX_PARTITION_ORDER &&
+          count % (2u << max_partition_order) == 0 &&
+          (count >> (max_partition_order + 1)) > order)
+      max_partition_order++;
+
+    const size_t finest_length = count >> max_partition_order;
+    for(size_t partition = 0; partition < (1u << max_partition_order); partition++) {
+      uint64_t sum = 0;
+      const size_t end = (partition + 1) * finest_length;
+      for(size_t i = std::max(partition * finest_length, (size_t)order); i < end; i++)
+        sum += zigzag(residual[i]);
+      partition_sums[partition] = sum;
+    }
+
+    for(int partition_order = (int)max_partition_order; partition_order >= 0; partition_order--) {
+      const size_t partition_count = (size_t)1 << partition_order;
+      const size_t partition_length = count >> partition_order;
+      uint64_t residual_bits = 0;
+      unsigned parameters[1 << MODULATE_FLAC_MAX_PARTITION_ORDER];
+      for(size_t partition = 0; partition < partition_count; partition++) {
+        uint64_t partition_bits;
+        parameters[partition] = choose_rice_parameter(partition_sums[partition],
+                                                      partition_length - (partition ? 0 : order), partition_bits);
+        residual_bits += 4 + partition_bits;
+      }
+      if(residual_bits < best_residual_bits) {
+        best_residual_bits = residual_bits;
+        best_partition_order = (unsigned)partition_order;
+        memcpy(rice_parameters, parameters, partition_count * sizeof(unsigned));
+      }
+      for(size_t partition = 0; partition < partition_count / 2; partition++)
+        partition_sums[partition] = partition_sums[2 * partition] + partition_sums[2 * partition + 1];
+    }
+  }
+
+  const uint64_t verbatim_bits = (uint64_t)count * MODULATE_FLAC_BITS_PER_SAMPLE;
+  if(constant) {
+    bits.put(0x00, 8);
+    bits.put((uint32_t)block[0], MODULATE_FLAC_BITS_PER_SAMPLE);
+  } else if(best_residual_bits != UINT64_MAX &&
+            order * MODULATE_FLAC_BITS_PER_SAMPLE + 6 + best_residual_bits < verbatim_bits) {
+    bits.put((0x08 | order) << 1, 8);
+    for(unsigned i = 0; i < order; i++)
+      bits.put((uint32_t)block[i], MODULATE_FLAC_BITS_PER_SAMPLE);
+    bits.put(0, 2); // 4-bit Rice parameters
+    bits.put(best_partition_order, 4);
+    const size_t partition_length = count >> best_partition_order;
+    for(size_t partition = 0; partition < ((size_t)1 << best_partition_order); partition++) {
+      const unsigned k = rice_parameters[partition];
+      bits.put(k, 4);
+      const size_t end = (partition + 1) * partition_length;
+      for(size_t i = std::max(partition * partition_length, (size_t)order); i < end; i++)
+        bits.put_rice(zigzag(residual[i]), k);
+    }
+  } else {
+    bits.put(0x01 << 1, 8);
+    for(size_t i = 0; i < count; i++)
+      bits.put((uint32_t)block[i], MODULATE_FLAC_BITS_PER_SAMPLE);
+  }
+}
+
+} // namespace
+
+uint8_t flac_crc8(const uint8_t* data, size_t size) {
+  uint8_t crc = 0;
+  for(size_t i = 0; i < size; i++)
+    crc = crc_tables.crc8[crc ^ data[i]];
+  return crc;
+}
+
+uint16_t flac_crc16(const uint8_t* data, size_t size) {
+  uint16_t crc = 0;
+  for(size_t i = 0; i < size; i++)
+    crc = (uint16_t)((crc << 8) ^ crc_tables.crc16[(crc >> 8) ^ data[i]]);
+  return crc;
+}
+
+FlacEncoder::FlacEncoder() :
+  out(nullptr),
+  sample_rate(0),
+  block(new int32_t[MODULATE_FLAC_BLOCK_SIZE]),
+  block_fill(0),
+  residual(new int32_t[MODULATE_FLAC_BLOCK_SIZE]),
+  frame_buffer(new uint8_t[MODULATE_FLAC_MAX_FRAME_BYTES]),
+  frame_number(0),
+  total_samples(0),
+  min_frame_bytes(0),
+  max_frame_bytes(0),
+  bytes_written(0) {
+}
+
+FlacEncoder::~FlacEncoder() {
+  delete[] block;
+  delete[] residual;
+  delete[] frame_buffer;
+}
+
+void FlacEncoder::begin(std::ostream& stream, uint32_t _sample_rate) {
+  out = &stream;
+  sample_rate = _sample_rate;
+  block_fill = 0;
+  frame_number = 0;
+  total_samples = 0;
+  min_frame_bytes = 0;
+  max_frame_bytes = 0;
+
+  out->write("fLaC", 4);
+  stream_info_pos = out->tellp();
+  uint8_t header[MODULATE_FLAC_STREAM_INFO_BYTES];
+  get_stream_info(header);
+  out->write(reinterpret_cast<const char*>(header), sizeof(header));
+  bytes_written = 4 + MODULATE_FLAC_STREAM_INFO_BYTES;
+}
+
+void FlacEncoder::get_stream_info(uint8_t* header) const {
+  BitWriter bits(header);
+  bits.put(0x80, 8); // the last (and only) metadata block, STREAMINFO
+  bits.put(34, 24);
+  bits.put(MODULATE_FLAC_BLOCK_SIZE, 16); // min block size
+  bits.put(MODULATE_FLAC_BLOCK_SIZE, 16); // max block size
+  bits.put(min_frame_bytes, 24);          // 0 while unknown
+  bits.put(max_frame_bytes, 24);
+  bits.put(sample_rate, 20);
+  bits.put(0, 3);                                 // one channel
+  bits.put(MODULATE_FLAC_BITS_PER_SAMPLE - 1, 5);
+  bits.put((uint32_t)(total_samples >> 32), 4);   // 36 bits of sample count
+  bits.put((uint32_t)total_samples, 32);
+  for(int i = 0; i < 4; i++)
+    bits.put(0, 32);                              // no MD5 signature
+}
+
+void FlacEncoder::add_samples(const short* samples, size_t count) {
+  while(count) {
+    const size_t copy_count = std::min(count, (size_t)MODULATE_FLAC_BLOCK_SIZE - block_fill);
+    for(size_t i = 0; i < copy_count; i++)
+      block[block_fill + i] = samples[i];
+    block_fill += copy_count;
+    samples += copy_count;
+    count -= copy_count;
+    if(block_fill == MODULATE_FLAC_BLOCK_SIZE)
+      encode_block();
+  }
+}
+
+void FlacEncoder::finish() {
+  if(!out)
+    return;
+  std::ostream* const stream = out;
+  uint8_t header[MODULATE_FLAC_STREAM_INFO_BYTES];
+  finish_without_header(header);
+  const std::streampos end_pos = stream->tellp();
+  stream->seekp(stream_info_pos);
+  stream->write(reinterpret_cast<const char*>(header), sizeof(header));
+  stream->seekp(end_pos);
+}
+
+void FlacEncoder::finish_without_header(uint8_t* stream_info) {
+  if(!out)
+    return;
+  if(block_fill)
+    encode_block();
+  get_stream_info(stream_info);
+  out = nullptr;
+}
+
+size_t FlacEncoder::encode_subframe(const short* samples, size_t count, uint8_t* coded) {
+  count = std::min(count, (size_t)MODULATE_FLAC_BLOCK_SIZE);
+  for(size_t i = 0; i < count; i++)
+    block[i] = samples[i];
+  BitWriter bits(coded);
+  write_subframe(bits, block, residual, count);
+  bits.align();
+  return bits.size();
+}
+
+void FlacEncoder::encode_block() {
+  const size_t count = block_fill;
+  BitWriter bits(frame_buffer);
+
+  // Frame header: sync code, fixed block size stream, then the block size, rate, mono and 16 bits
+  unsigned block_size_code = count <= 256 ? 6 : 7; // block size in the next 8 or 16 bits
+  for(unsigned i = 0; i < 8; i++)
+    if(count == (256u << i))
+      block_size_code = 8 + i;
+  bits.put(0x3FFE, 14);
+  bits.put(0, 2);
+  bits.put(block_size_code, 4);
+  bits.put(get_sample_rate_code(sample_rate), 4);
+  bits.put(0, 4);
+  bits.put(4, 3);
+  bits.put(0, 1);
+  put_coded_number(bits, frame_number);
+  if(block_size_code == 6)
+    bits.put((uint32_t)count - 1, 8);
+  else if(block_size_code == 7)
+    bits.put((uint32_t)count - 1, 16);
+  bits.put(flac_crc8(frame_buffer, bits.size()), 8);
+
+  write_subframe(bits, block, residual, count);
+
+  bits.align();
+  const uint16_t crc = flac_crc16(frame_buffer, bits.size());
+  bits.put(crc, 16);
+
+  const uint32_t frame_bytes = (uint32_t)bits.size();
+  out->write(reinterpret_cast<const char*>(frame_buffer), frame_bytes);
+  bytes_written += frame_bytes;
+  min_frame_bytes = min_frame_bytes ? std::min(min_frame_bytes, frame_bytes) : frame_bytes;
+  max_frame_bytes = std::max(max_frame_bytes, frame_bytes);
+  frame_number++;
+  total_samples += count;
+  block_fill = 0;
+}
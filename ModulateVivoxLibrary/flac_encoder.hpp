@@ -0,0 +1,73 @@
+#ifndef MODULATE_FLAC_ENCODER_HPP
+#define MODULATE_FLAC_ENCODER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+#define MODULATE_FLAC_BLOCK_SIZE 4096
+// The STREAMINFO block, with its metadata block header
+#define MODULATE_FLAC_STREAM_INFO_BYTES (4 + 34)
+
+// The checksums FLAC puts on frame headers and whole frames, for readers to check
+uint8_t flac_crc8(const uint8_t* data, size_t size);
+uint16_t flac_crc16(const uint8_t* data, size_t size);
+
+// A small streaming FLAC encoder for mono 16-bit logs, with no external dependencies.
+// Each block is coded with whichever of FLAC's fixed polynomial predictors (order 0 to 4)
+// fits it best and Rice-coded residuals, or as a constant (silence) or verbatim block
+// when that's smaller.  There's no LPC and no MD5, which keeps the encoder cheap enough
+// for the logging thread (a couple of ms per second of 48kHz audio) while still making
+// speech logs 1.5 to 3 times smaller; the files are ordinary .flac files that any FLAC
+// decoder can read.
+//
+// Not thread safe.  Everything is allocated up front, so encoding doesn't allocate.
+class FlacEncoder {
+private:
+  std::ostream* out;
+  std::streampos stream_info_pos;
+  uint32_t sample_rate;
+
+  int32_t* block;
+  size_t block_fill;
+  int32_t* residual;
+  uint8_t* frame_buffer;
+
+  uint64_t frame_number;
+  uint64_t total_samples;
+  uint32_t min_frame_bytes;
+  uint32_t max_frame_bytes;
+  uint64_t bytes_written;
+
+  void get_stream_info(uint8_t* header) const;
+  void encode_block();
+
+public:
+  FlacEncoder();
+  ~FlacEncoder();
+  FlacEncoder(const FlacEncoder& other) = delete;
+  FlacEncoder& operator=(const FlacEncoder& other) = delete;
+
+  // Writes the stream header.  The stream must be seekable, since finish goes back to fill
+  // in the sample count.
+  void begin(std::ostream& stream, uint32_t sample_rate);
+  void add_samples(const short* samples, size_t count);
+  // Encodes the last partial block and completes the header.  The stream is left open.
+  void finish();
+  // As finish, but leaves the completed header in stream_info (MODULATE_FLAC_STREAM_INFO_BYTES)
+  // for the caller to write at get_stream_info_position, e.g. once it's handed the stream on
+  void finish_without_header(uint8_t* stream_info);
+  std::streampos get_stream_info_position() const {return stream_info_pos;}
+
+  // Codes up to MODULATE_FLAC_BLOCK_SIZE samples as a single FLAC subframe, padded to a whole
+  // byte, for containers with framing of their own.  coded needs room for
+  // get_max_subframe_bytes(count).  An encoder is used either for this or as a stream, not both.
+  size_t encode_subframe(const short* samples, size_t count, uint8_t* coded);
+  static size_t get_max_subframe_bytes(size_t count) {return count * sizeof(short) + 8;}
+
+  // For the current stream
+  uint64_t get_samples() const {return total_samples + block_fill;}
+  uint64_t get_bytes_written() const {return bytes_written;}
+};
+
+#endif
@@ -0,0 +1,99 @@
+#include "frame_rebuffer.hpp"
+
+#include <cmath>
+
+#include "native_rate_converter.hpp"
+
+static size_t greatest_common_divisor(size_t a, size_t b) {
+  while(b) {
+    const size_t remainder = a % b;
+    a = b;
+    b = remainder;
+  }
+  return a;
+}
+
+FrameRebuffer::FrameRebuffer(size_t _max_block_size) :
+  max_block_size(_max_block_size),
+  pending(new float[_max_block_size]),
+  pending_count(0),
+  // The most waiting is a block's delay, plus the block just converted
+  ready(new float[2 * _max_block_size]),
+  ready_count(0),
+  block_ms(0.0f),
+  frame_gcd(0),
+  requested_block_ms(0.0f),
+  rate(0),
+  block_size(0),
+  latency_samples(0),
+  blocks(0),
+  oversized_frames(0),
+  underruns(0) {
+}
+
+FrameRebuffer::~FrameRebuffer() {
+  delete[] pending;
+  delete[] ready;
+}
+
+void FrameRebuffer::configure(int audio_frame_rate) {
+  block_ms = requested_block_ms.load(std::memory_order_relaxed);
+  rate.store(audio_frame_rate, std::memory_order_relaxed);
+  block_size.store(get_block_size(block_ms, audio_frame_rate, max_block_size), std::memory_order_relaxed);
+  latency_samples.store(0, std::memory_order_relaxed);
+  frame_gcd = 0;
+  pending_count = 0;
+  ready_count = 0;
+}
+
+void FrameRebuffer::reset() {
+  configure(rate.load(std::memory_order_relaxed));
+}
+
+void FrameRebuffer::add_frame_size(size_t pcm_frame_count) {
+  // The input left over after each frame is a multiple of the gcd of the frame sizes and the
+  // block, so at most block - that gcd has to be buffered to always have a frame's output
+  frame_gcd = greatest_common_divisor(frame_gcd, pcm_frame_count);
+  const size_t block = block_size.load(std::memory_order_relaxed);
+  const size_t needed = block - greatest_common_divisor(frame_gcd, block);
+  const size_t latency = latency_samples.load(std::memory_order_relaxed);
+  if(needed <= latency)
+    return;
+  const size_t extra = needed - latency;
+  memmove(ready + extra, ready, sizeof(float)*ready_count);
+  memset(ready, 0, sizeof(float)*extra);
+  ready_count += extra;
+  latency_samples.store(needed, std::memory_order_relaxed);
+}
+
+size_t FrameRebuffer::take_ready(float* samples, size_t count) {
+  const size_t taken = std::min(count, ready_count);
+  memcpy(samples, ready, sizeof(float)*taken);
+  ready_count -= taken;
+  memmove(ready, ready + taken, sizeof(float)*ready_count);
+  return taken;
+}
+
+FramingStats FrameRebuffer::get_stats() const {
+  FramingStats stats;
+  const int audio_frame_rate = rate.load(std::memory_order_relaxed);
+  stats.block_size = block_size.load(std::memory_order_relaxed);
+  stats.latency_samples = latency_samples.load(std::memory_order_relaxed);
+  stats.latency_ms = audio_frame_rate > 0 ? 1000.0 * stats.latency_samples / audio_frame_rate : 0.0;
+  stats.blocks = blocks.load(std::memory_order_relaxed);
+  stats.oversized_frames = oversized_frames.load(std::memory_order_relaxed);
+  stats.underruns = underruns.load(std::memory_order_relaxed);
+  return stats;
+}
+
+size_t FrameRebuffer::get_block_size(float block_ms, int audio_frame_rate, size_t max_block_size) {
+  if(block_ms <= 0.0f || audio_frame_rate <= 0)
+    return 0;
+  const size_t step = audio_frame_rate % MODULATE_MODEL_SAMPLE_RATE == 0 ? audio_frame_rate / MODULATE_MODEL_SAMPLE_RATE : 1;
+  const size_t steps = (size_t)std::lround(block_ms * audio_frame_rate / (1000.0 * step));
+  return std::min(std::max<size_t>(steps, 1), max_block_size / step) * step;
+}
+
+size_t FrameRebuffer::get_latency_samples(size_t block_size, size_t pcm_frame_count) {
+  return block_size ? block_size - greatest_common_divisor(pcm_frame_count, block_size) : 0;
+}
@@ -0,0 +1,120 @@
+#ifndef MODULATE_FRAME_REBUFFER_HPP
+#define MODULATE_FRAME_REBUFFER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+struct FramingStats {
+  size_t block_size;        // samples per voice skin call at the current rate, 0 if following Vivox's frames
+  size_t latency_samples;   // delay the rebuffering adds at the current rate
+  double latency_ms;
+  uint64_t blocks;          // blocks converted
+  uint64_t oversized_frames; // callback frames longer than the most that can be converted at once
+  uint64_t underruns;       // output that wasn't ready and went out as silence - should stay 0
+};
+
+// Cuts one session's audio into blocks of a fixed duration for the voice skin, instead of
+// converting whatever frame size Vivox delivers.  Input is collected until there's a whole
+// block, which is converted, and the callback is sent the oldest converted audio.
+//
+// That needs a delay of block - gcd(block, frame) samples, where frame is Vivox's frame size
+// (so none at all when the block divides the frame), which is worked out from the frames
+// seen since the rate last changed.  If the frame size changes to one that needs more, the
+// difference is inserted as silence; the delay is never reduced, so the output never jumps
+// back.  A block size of 0 converts each frame as it comes, split only where it's longer
+// than max_block_size.
+//
+// Only the thread converting the session's audio may call process.
+class FrameRebuffer {
+private:
+  const size_t max_block_size;
+  float* pending;       // input waiting for a whole block
+  size_t pending_count;
+  float* ready;         // converted audio waiting to be sent, oldest first
+  size_t ready_count;
+
+  // Owned by the converting thread, and reported through the atomics
+  float block_ms;
+  size_t frame_gcd;     // of every frame size since the last configure
+  std::atomic<float> requested_block_ms;
+  std::atomic<int> rate;
+  std::atomic<size_t> block_size;
+  std::atomic<size_t> latency_samples;
+
+  std::atomic<uint64_t> blocks;
+  std::atomic<uint64_t> oversized_frames;
+  std::atomic<uint64_t> underruns;
+
+  void configure(int audio_frame_rate);
+  void add_frame_size(size_t pcm_frame_count);
+  size_t take_ready(float* samples, size_t count);
+
+public:
+  explicit FrameRebuffer(size_t max_block_size);
+  ~FrameRebuffer();
+  FrameRebuffer(const FrameRebuffer& other) = delete;
+  FrameRebuffer& operator=(const FrameRebuffer& other) = delete;
+
+  // Safe from any thread.  Applies from the next frame, which starts the stream over.
+  void set_block_ms(float new_block_ms) {requested_block_ms.store(new_block_ms);}
+
+  // Replaces the frame in place with the converted audio, calling convert(block, count) on
+  // each block as it fills.  A block the voice skin fails on is sent as it is.  Returns false
+  // only when following Vivox's frames and convert did, as the frame may then hold either
+  // the input or partial output.
+  template <typename Convert>
+  bool process(float* samples, size_t pcm_frame_count, int audio_frame_rate, Convert convert);
+
+  // Drops anything buffered, e.g. for a new session.  Not while process may be running.
+  void reset();
+  void record_oversized_frame() {oversized_frames.fetch_add(1, std::memory_order_relaxed);}
+  FramingStats get_stats() const;
+
+  // The block process uses for block_ms at audio_frame_rate - a whole number of the
+  // model's samples wherever the rate allows, so that the native rate fast path can take it
+  static size_t get_block_size(float block_ms, int audio_frame_rate, size_t max_block_size);
+  // The delay process adds for frames of a steady size
+  static size_t get_latency_samples(size_t block_size, size_t pcm_frame_count);
+};
+
+template <typename Convert>
+bool FrameRebuffer::process(float* samples, size_t pcm_frame_count, int audio_frame_rate, Convert convert) {
+  if(audio_frame_rate != rate.load(std::memory_order_relaxed) ||
+     requested_block_ms.load(std::memory_order_relaxed) != block_ms)
+    configure(audio_frame_rate);
+  const size_t block = block_size.load(std::memory_order_relaxed);
+  if(!block) {
+    bool converted = true;
+    for(size_t i = 0; i < pcm_frame_count; i += max_block_size)
+      converted = convert(samples + i, std::min(max_block_size, pcm_frame_count - i)) && converted;
+    return converted;
+  }
+
+  add_frame_size(pcm_frame_count);
+  size_t written = 0;
+  for(size_t read = 0; read < pcm_frame_count;) {
+    const size_t count = std::min(pcm_frame_count - read, block - pending_count);
+    memcpy(pending + pending_count, samples + read, sizeof(float)*count);
+    pending_count += count;
+    read += count;
+    if(pending_count == block) {
+      convert(pending, block);
+      memcpy(ready + ready_count, pending, sizeof(float)*block);
+      ready_count += block;
+      pending_count = 0;
+      blocks.fetch_add(1, std::memory_order_relaxed);
+    }
+    // The output overwrites input that's already been read
+    written += take_ready(samples + written, read - written);
+  }
+  if(written < pcm_frame_count) {
+    memset(samples + written, 0, sizeof(float)*(pcm_frame_count - written));
+    underruns.fetch_add(1, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+#endif
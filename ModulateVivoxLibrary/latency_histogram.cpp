@@ -0,0 +1,69 @@
+#include "latency_histogram.hpp"
+
+LatencyHistogram::LatencyHistogram() {
+  reset();
+}
+
+int LatencyHistogram::bucket_index(uint64_t value) {
+  if(value < (uint64_t)sub_buckets)
+    return (int)value;
+  int exponent = 0;
+  for(uint64_t v = value; v > 1; v >>= 1)
+    exponent++;
+  if(exponent > max_exponent)
+    return num_buckets - 1;
+  // The top sub_bucket_bits below the leading one pick the sub-bucket
+  const int sub_bucket = (int)(value >> (exponent - sub_bucket_bits)) & (sub_buckets - 1);
+  return (exponent - sub_bucket_bits + 1) * sub_buckets + sub_bucket;
+}
+
+uint64_t LatencyHistogram::bucket_midpoint(int index) {
+  if(index < sub_buckets)
+    return (uint64_t)index;
+  const int exponent = index / sub_buckets + sub_bucket_bits - 1;
+  const int sub_bucket = index % sub_buckets;
+  const uint64_t width = (uint64_t)1 << (exponent - sub_bucket_bits);
+  const uint64_t lower = ((uint64_t)(sub_buckets + sub_bucket)) << (exponent - sub_bucket_bits);
+  return lower + width / 2;
+}
+
+void LatencyHistogram::record(uint64_t nanoseconds) {
+  buckets[bucket_index(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+  uint64_t current_max = max_value.load(std::memory_order_relaxed);
+  while(nanoseconds > current_max &&
+        !max_value.compare_exchange_weak(current_max, nanoseconds, std::memory_order_relaxed));
+}
+
+void LatencyHistogram::reset() {
+  for(int i = 0; i < num_buckets; i++)
+    buckets[i].store(0, std::memory_order_relaxed);
+  count.store(0, std::memory_order_relaxed);
+  max_value.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::get_percentile(double fraction) const {
+  // Take a snapshot first, since recording may carry on while we look
+  uint64_t snapshot[num_buckets];
+  uint64_t total = 0;
+  for(int i = 0; i < num_buckets; i++) {
+    snapshot[i] = buckets[i].load(std::memory_order_relaxed);
+    total += snapshot[i];
+  }
+  if(total == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t)(fraction * (double)total);
+  if(rank >= total)
+    rank = total - 1;
+  uint64_t seen = 0;
+  for(int i = 0; i < num_buckets; i++) {
+    seen += snapshot[i];
+    if(seen > rank) {
+      const uint64_t value = bucket_midpoint(i);
+      const uint64_t max_recorded = get_max();
+      return value < max_recorded ? value : max_recorded;
+    }
+  }
+  return get_max();
+}
@@ -0,0 +1,41 @@
+#ifndef MODULATE_LATENCY_HISTOGRAM_HPP
+#define MODULATE_LATENCY_HISTOGRAM_HPP
+
+#include <atomic>
+#include <cstdint>
+
+// Fixed-memory histogram of durations in nanoseconds, safe to record into from the
+// audio thread.  Buckets are logarithmic with 8 linear sub-buckets per power of two,
+// so any reported percentile is within ~6% of the true value, from 1ns up to ~70s.
+// record() never allocates or locks, and may be called from several threads at once;
+// the read functions can be called from any thread while recording continues.
+class LatencyHistogram {
+public:
+  static const int sub_bucket_bits = 3;
+  static const int sub_buckets = 1 << sub_bucket_bits;
+  static const int max_exponent = 36;
+  static const int num_buckets = (max_exponent - sub_bucket_bits + 2) * sub_buckets;
+
+private:
+  std::atomic<uint64_t> buckets[num_buckets];
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> max_value;
+
+  static int bucket_index(uint64_t value);
+  static uint64_t bucket_midpoint(int index);
+
+public:
+  LatencyHistogram();
+  LatencyHistogram(const LatencyHistogram& other) = delete;
+  LatencyHistogram& operator=(const LatencyHistogram& other) = delete;
+
+  void record(uint64_t nanoseconds);
+  void reset();
+
+  uint64_t get_count() const {return count.load(std::memory_order_relaxed);}
+  uint64_t get_max() const {return max_value.load(std::memory_order_relaxed);}
+  // Value below which the given fraction (e.g. 0.99) of the recorded durations fall
+  uint64_t get_percentile(double fraction) const;
+};
+
+#endif
@@ -0,0 +1,237 @@
+#include "latency_probe.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#define MODULATE_LATENCY_PROBE_PI 3.14159265358979323846
+
+static int64_t to_microseconds(std::chrono::steady_clock::time_point time) {
+  return (int64_t)std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+}
+
+// When the first of count samples at audio_frame_rate was due, if the one after them is due now
+static int64_t get_due_us(std::chrono::steady_clock::time_point now, size_t count, int audio_frame_rate) {
+  return to_microseconds(now) - (int64_t)(count * 1000000 / (uint64_t)audio_frame_rate);
+}
+
+static size_t get_window_length(int audio_frame_rate) {
+  return (size_t)audio_frame_rate * MODULATE_LATENCY_PROBE_WINDOW_MS / 1000;
+}
+
+// Where the probe lines up best with the recording, to a fraction of a sample
+static LatencyProbeMeasurement find_probe(const AudioKernels& kernels, const float* recording, size_t count,
+                                          int audio_frame_rate) {
+  LatencyProbeMeasurement measurement = {false, 0.0, 0.0};
+  const size_t length = LatencyProbe::get_probe_length(audio_frame_rate);
+  if(count < length + 2)
+    return measurement;
+  std::vector<float> probe(length);
+  double probe_energy = 0.0;
+  for(size_t n = 0; n < length; n++) {
+    probe[n] = LatencyProbe::get_probe_sample(n, audio_frame_rate);
+    probe_energy += (double)probe[n] * probe[n];
+  }
+
+  // Normalized by the energy of the stretch of recording it's compared with, kept as a
+  // running sum, so that loud audio elsewhere in the recording can't outweigh the probe
+  std::vector<double> correlation(count - length + 1);
+  double window_energy = 0.0;
+  for(size_t n = 0; n < length; n++)
+    window_energy += (double)recording[n] * recording[n];
+  size_t best = 0;
+  for(size_t lag = 0; lag < correlation.size(); lag++) {
+    const double product = kernels.dot_product(probe.data(), recording + lag, length);
+    correlation[lag] = window_energy > 0.0 ? product / sqrt(probe_energy * window_energy) : 0.0;
+    if(correlation[lag] > correlation[best])
+      best = lag;
+    if(lag + length < count)
+      window_energy = std::max(0.0, window_energy + (double)recording[lag + length] * recording[lag + length] -
+                                    (double)recording[lag] * recording[lag]);
+  }
+
+  // The peak of a parabola through it and its neighbours
+  double offset = 0.0;
+  if(best > 0 && best + 1 < correlation.size()) {
+    const double before = correlation[best - 1], peak = correlation[best], after = correlation[best + 1];
+    const double curvature = before - 2 * peak + after;
+    if(curvature < 0.0)
+      offset = std::max(-0.5, std::min(0.5, 0.5 * (before - after) / curvature));
+  }
+  measurement.correlation = correlation[best];
+  measurement.found = correlation[best] >= MODULATE_LATENCY_PROBE_MIN_CORRELATION;
+  measurement.latency_ms = 1000.0 * (best + offset) / audio_frame_rate;
+  return measurement;
+}
+
+LatencyProbe::LatencyProbe() :
+  kernels(get_audio_kernels()),
+  state((int)LatencyProbeState::idle),
+  active_callbacks(0),
+  sent(nullptr),
+  rendered(nullptr),
+  capacity(0),
+  session_index(-1),
+  capture_rate(0),
+  capture_frame_count(0),
+  capture_start_us(0),
+  injected(0),
+  sent_count(0),
+  render_rate(0),
+  render_start_us(0),
+  rendered_count(0),
+  render_done(false) {}
+
+LatencyProbe::~LatencyProbe() {
+  delete[] sent;
+  delete[] rendered;
+}
+
+bool LatencyProbe::start() {
+  const LatencyProbeState current = get_state();
+  if(current == LatencyProbeState::armed || current == LatencyProbeState::claiming || current == LatencyProbeState::measuring)
+    return false;
+  // A callback that came in just as the last measurement finished may still be looking at it
+  state.store((int)LatencyProbeState::idle);
+  while(active_callbacks.load() != 0)
+    std::this_thread::yield();
+  if(!sent) {
+    capacity = get_window_length(MODULATE_LATENCY_PROBE_MAX_RATE);
+    sent = new float[capacity];
+    rendered = new float[capacity];
+  }
+  injected = 0;
+  sent_count = 0;
+  render_rate = 0;
+  rendered_count.store(0);
+  render_done.store(false);
+  state.store((int)LatencyProbeState::armed, std::memory_order_release);
+  return true;
+}
+
+void LatencyProbe::fail() {
+  int expected = (int)LatencyProbeState::measuring;
+  state.compare_exchange_strong(expected, (int)LatencyProbeState::failed);
+}
+
+bool LatencyProbe::begin_capture(int index, short* pcm_frames, size_t pcm_frame_count, size_t channels_per_frame,
+                                 int audio_frame_rate, std::chrono::steady_clock::time_point now) {
+  // Nothing to do almost all of the time
+  const int current = state.load(std::memory_order_relaxed);
+  if(current != (int)LatencyProbeState::armed && current != (int)LatencyProbeState::measuring)
+    return false;
+  active_callbacks.fetch_add(1);
+  int expected = (int)LatencyProbeState::armed;
+  if(state.compare_exchange_strong(expected, (int)LatencyProbeState::claiming)) {
+    if(audio_frame_rate <= 0 || audio_frame_rate > MODULATE_LATENCY_PROBE_MAX_RATE) {
+      state.store((int)LatencyProbeState::failed);
+      active_callbacks.fetch_sub(1);
+      return false;
+    }
+    session_index = index;
+    capture_rate = audio_frame_rate;
+    capture_frame_count = (int)pcm_frame_count;
+    capture_start_us = to_microseconds(now);
+    state.store((int)LatencyProbeState::measuring, std::memory_order_release);
+  } else if(expected != (int)LatencyProbeState::measuring || index != session_index) {
+    active_callbacks.fetch_sub(1);
+    return false;
+  }
+  if(audio_frame_rate != capture_rate) {
+    fail();
+    active_callbacks.fetch_sub(1);
+    return false;
+  }
+  capture_start_us = std::min(capture_start_us, get_due_us(now, injected, capture_rate));
+
+  // The probe, then silence, so that nothing else gets into the recordings
+  const size_t probe_length = get_probe_length(capture_rate);
+  for(size_t i = 0; i < pcm_frame_count; i++, injected++) {
+    const float sample = injected < probe_length ? get_probe_sample(injected, capture_rate) : 0.0f;
+    const short value = (short)lrintf(sample * 32767.0f);
+    for(size_t c = 0; c < channels_per_frame; c++)
+      pcm_frames[i * channels_per_frame + c] = value;
+  }
+  return true;
+}
+
+void LatencyProbe::end_capture(const short* pcm_frames, size_t pcm_frame_count, size_t channels_per_frame) {
+  const size_t window = get_window_length(capture_rate);
+  const size_t count = std::min(pcm_frame_count, window - sent_count);
+  kernels.int16_to_float_strided(pcm_frames, channels_per_frame, sent + sent_count, count);
+  sent_count += count;
+  // The render tap gets another window to finish, in case echo isn't running
+  if(sent_count == window && (render_done.load(std::memory_order_acquire) || injected >= 2 * window)) {
+    int expected = (int)LatencyProbeState::measuring;
+    state.compare_exchange_strong(expected, (int)LatencyProbeState::complete, std::memory_order_acq_rel);
+  }
+  active_callbacks.fetch_sub(1);
+}
+
+void LatencyProbe::record_render(int index, const short* pcm_frames, size_t pcm_frame_count, size_t channels_per_frame,
+                                 int audio_frame_rate, std::chrono::steady_clock::time_point now) {
+  if(state.load(std::memory_order_relaxed) != (int)LatencyProbeState::measuring)
+    return;
+  active_callbacks.fetch_add(1);
+  if(state.load() != (int)LatencyProbeState::measuring || index != session_index ||
+     render_done.load(std::memory_order_relaxed)) {
+    active_callbacks.fetch_sub(1);
+    return;
+  }
+  size_t count = rendered_count.load(std::memory_order_relaxed);
+  if(count == 0) {
+    if(audio_frame_rate <= 0 || audio_frame_rate > MODULATE_LATENCY_PROBE_MAX_RATE) {
+      fail();
+      active_callbacks.fetch_sub(1);
+      return;
+    }
+    render_rate = audio_frame_rate;
+    render_start_us.store(to_microseconds(now), std::memory_order_relaxed);
+  } else if(audio_frame_rate != render_rate) {
+    fail();
+    active_callbacks.fetch_sub(1);
+    return;
+  } else {
+    render_start_us.store(std::min(render_start_us.load(std::memory_order_relaxed), get_due_us(now, count, render_rate)),
+                          std::memory_order_relaxed);
+  }
+  const size_t window = get_window_length(render_rate);
+  const size_t recorded = std::min(pcm_frame_count, window - count);
+  kernels.int16_to_float_strided(pcm_frames, channels_per_frame, rendered + count, recorded);
+  count += recorded;
+  rendered_count.store(count, std::memory_order_release);
+  if(count == window)
+    render_done.store(true, std::memory_order_release);
+  active_callbacks.fetch_sub(1);
+}
+
+bool LatencyProbe::get_measurements(LatencyProbeMeasurement& conversion, LatencyProbeMeasurement& render,
+                                    int& sample_rate, int& render_sample_rate) const {
+  if(get_state() != LatencyProbeState::complete)
+    return false;
+  sample_rate = capture_rate;
+  conversion = find_probe(kernels, sent, sent_count, capture_rate);
+  // Render callbacks may have stopped partway, if echo wasn't running
+  const size_t count = rendered_count.load(std::memory_order_acquire);
+  render = {false, 0.0, 0.0};
+  render_sample_rate = 0;
+  if(count) {
+    render_sample_rate = render_rate;
+    render = find_probe(kernels, rendered, count, render_rate);
+    render.latency_ms += (double)(render_start_us.load(std::memory_order_relaxed) - capture_start_us) / 1000;
+  }
+  return true;
+}
+
+float LatencyProbe::get_probe_sample(size_t n, int audio_frame_rate) {
+  const double t = (double)n / audio_frame_rate;
+  const double duration = MODULATE_LATENCY_PROBE_MS / 1000.0;
+  const double sweep = (MODULATE_LATENCY_PROBE_HIGH_HZ - MODULATE_LATENCY_PROBE_LOW_HZ) / duration;
+  const double phase = 2 * MODULATE_LATENCY_PROBE_PI * (MODULATE_LATENCY_PROBE_LOW_HZ * t + 0.5 * sweep * t * t);
+  // Raised-cosine fades at each end
+  const double fade = MODULATE_LATENCY_PROBE_FADE_MS / 1000.0;
+  const double edge = std::min(t, duration - t);
+  const double envelope = edge >= fade ? 1.0 : edge <= 0.0 ? 0.0 : 0.5 - 0.5 * cos(MODULATE_LATENCY_PROBE_PI * edge / fade);
+  return (float)(MODULATE_LATENCY_PROBE_AMPLITUDE * envelope * sin(phase));
+}
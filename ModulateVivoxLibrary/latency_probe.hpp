@@ -0,0 +1,132 @@
+#ifndef MODULATE_LATENCY_PROBE_HPP
+#define MODULATE_LATENCY_PROBE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "audio_kernels.hpp"
+
+// The probe is a linear chirp across the voice band, which any rate Vivox uses can carry
+// and a voice skin stub passes whole, faded in and out so that it doesn't click
+#define MODULATE_LATENCY_PROBE_MS 200
+#define MODULATE_LATENCY_PROBE_LOW_HZ 300.0
+#define MODULATE_LATENCY_PROBE_HIGH_HZ 3000.0
+#define MODULATE_LATENCY_PROBE_FADE_MS 10
+#define MODULATE_LATENCY_PROBE_AMPLITUDE 0.25
+// Audio recorded at each tap from the start of the probe - the longest latency that can be
+// measured is this less the probe
+#define MODULATE_LATENCY_PROBE_WINDOW_MS 1000
+// Highest rate a measurement can run at - the native rate fast path's
+#define MODULATE_LATENCY_PROBE_MAX_RATE 96000
+// Below this normalized correlation, the probe didn't come through
+#define MODULATE_LATENCY_PROBE_MIN_CORRELATION 0.5
+
+enum class LatencyProbeState {
+  idle,
+  armed,     // waiting for the next capture callback
+  claiming,  // a capture callback is starting the measurement on its session
+  measuring,
+  complete,
+  failed     // the rate changed, or the rate or frame was too big to record
+};
+
+// Where the probe turned up at one point along the audio path
+struct LatencyProbeMeasurement {
+  bool found;
+  double latency_ms;  // after it was injected into the capture callback's input
+  double correlation; // normalized, 1 for exactly the probe
+};
+
+// A measurement of one session's audio path, by stage.  The conversion and echo stages
+// are measured; rebuffer_ms and native_rate_ms are the delays those report, so the
+// voice skin stage is what's left of the conversion once they're taken out.
+struct LatencyProbeResult {
+  LatencyProbeState state;
+  int sample_rate;         // of the capture callbacks
+  int render_sample_rate;
+  LatencyProbeMeasurement conversion; // the audio sent, after convert
+  LatencyProbeMeasurement rendered;   // the render callback's output, after the echo
+  double rebuffer_ms;      // model block rebuffering - see FrameRebuffer
+  double native_rate_ms;   // the native rate fast path's filters - see NativeRateConverter
+  double voice_skin_ms;    // the model's lookahead, the helper's resampler, and in pipelined mode the pipeline's delay
+  double echo_ms;          // the echo ring's fill and resampler, if echo was running
+};
+
+// Measures how long audio takes to get through the integration, by injecting a known
+// probe into one session's capture callback input and finding it again by
+// cross-correlation in what the capture callback sends, and in what the render callback
+// plays after mixing in the echo.
+//
+// start arms a measurement, which the next capture callback starts on its session: the
+// probe replaces its input, followed by silence until both taps have recorded a window's
+// worth.  The capture tap's latency counts samples from the probe.  The render callbacks
+// run on another clock, so the render tap's latency is timed against the capture
+// callbacks': each tap's samples are taken as due on a steady clock set by its least
+// delayed callback, since a callback can come late but never early.  If echo isn't
+// running the render tap gives up after another window, without the probe.
+//
+// The audio threads only record; the correlation is done by get_measurements, on the
+// caller's thread, and takes a few hundred milliseconds at 96kHz.
+class LatencyProbe {
+private:
+  const AudioKernels& kernels;
+  std::atomic<int> state;
+  // Callbacks inside the measurement, which start waits for before resetting it
+  std::atomic<int> active_callbacks;
+  float* sent;
+  float* rendered;
+  size_t capacity;
+
+  // Set by the claiming capture callback, before the state becomes measuring
+  int session_index;
+  int capture_rate;
+  int capture_frame_count;
+  // Owned by the capture callback while measuring
+  int64_t capture_start_us; // when the probe started, going by the least delayed callback
+  size_t injected;
+  size_t sent_count;
+  // Owned by the render callback while measuring.  The render tap can give up while a
+  // render callback is still recording, so only what rendered_count covers is read.
+  int render_rate;
+  std::atomic<int64_t> render_start_us;
+  std::atomic<size_t> rendered_count;
+  std::atomic<bool> render_done;
+
+  void fail();
+
+public:
+  LatencyProbe();
+  ~LatencyProbe();
+  LatencyProbe(const LatencyProbe& other) = delete;
+  LatencyProbe& operator=(const LatencyProbe& other) = delete;
+
+  // Starts a new measurement, unless one is under way.  Allocates the recording buffers
+  // the first time.
+  bool start();
+  LatencyProbeState get_state() const {return (LatencyProbeState)state.load(std::memory_order_acquire);}
+  // The session being measured, and its frame size, once measuring has started
+  int get_session_index() const {return session_index;}
+  int get_frame_count() const {return capture_frame_count;}
+
+  // Capture callback, before converting: replaces the input with the probe if this session
+  // is being measured, in which case it returns true and end_capture must follow
+  bool begin_capture(int index, short* pcm_frames, size_t pcm_frame_count, size_t channels_per_frame,
+                     int audio_frame_rate, std::chrono::steady_clock::time_point now);
+  // Capture callback, after converting: records the first channel of what's being sent
+  void end_capture(const short* pcm_frames, size_t pcm_frame_count, size_t channels_per_frame);
+  // Render callback, once the echo is mixed in: records the first channel
+  void record_render(int index, const short* pcm_frames, size_t pcm_frame_count, size_t channels_per_frame,
+                     int audio_frame_rate, std::chrono::steady_clock::time_point now);
+
+  // Once complete, finds the probe in each tap.  Returns false if it isn't complete.
+  bool get_measurements(LatencyProbeMeasurement& conversion, LatencyProbeMeasurement& render,
+                        int& sample_rate, int& render_sample_rate) const;
+
+  // Sample n of the probe at audio_frame_rate, between -1 and 1
+  static float get_probe_sample(size_t n, int audio_frame_rate);
+  static size_t get_probe_length(int audio_frame_rate) {return (size_t)audio_frame_rate * MODULATE_LATENCY_PROBE_MS / 1000;}
+};
+
+#endif
@@ -0,0 +1,216 @@
+#include "log_file_rotation.hpp"
+
+#include <atomic>
+#include <ctime>
+#include <filesystem>
+#include <map>
+#include <utility>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+std::atomic<int64_t> simulated_latency_us(0);
+
+std::mutex log_name_mutex;
+// For each log name: the minute its counter is for, and the next n to use
+std::map<std::string, std::pair<std::string, size_t>> log_name_counters;
+}
+
+std::string get_next_log_filename(const std::string& log_directory, const std::string& basename,
+                                  const std::string& extension) {
+  std::lock_guard<std::mutex> lock(log_name_mutex);
+
+  char time_and_date[20];
+  time_t rawtime;
+  time(&rawtime);
+  struct tm * timeinfo = localtime(&rawtime);
+  strftime(time_and_date, 20, "%Y_%m_%d_%H_%M", timeinfo);
+
+  std::pair<std::string, size_t>& counter = log_name_counters[log_directory + "/" + basename + extension];
+  const bool new_minute = counter.first != time_and_date;
+  if(new_minute) {
+    counter.first = time_and_date;
+    counter.second = 0;
+  }
+
+  std::string filename;
+  do {
+    filename = log_directory + "/" + std::string(time_and_date) + "_" + std::to_string(counter.second++) + "_" +
+               basename + extension;
+    // Only an earlier run can have taken a name, and only in the minute we started in
+  } while(new_minute && std::filesystem::exists(filename));
+  return filename;
+}
+
+void set_simulated_log_file_latency(std::chrono::microseconds latency) {
+  simulated_latency_us.store(latency.count());
+}
+
+static void simulate_latency() {
+  if(const int64_t latency_us = simulated_latency_us.load())
+    std::this_thread::sleep_for(std::chrono::microseconds(latency_us));
+}
+
+// Creates (or empties) filename with size bytes reserved, and opens it for writing from the start
+static void open_preallocated_file(std::ofstream& f, const std::string& filename, size_t size) {
+  simulate_latency();
+#ifdef __linux__
+  // Not posix_fallocate, which falls back to writing out zeros where the file system can't reserve
+  const int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd >= 0) {
+    (void)fallocate(fd, 0, 0, (off_t)size);
+    ::close(fd);
+  }
+#else
+  // On NTFS, extending a file allocates its clusters without writing to them
+  {
+    std::ofstream create(filename, std::ios::binary);
+  }
+  std::error_code error;
+  std::filesystem::resize_file(filename, size, error);
+#endif
+  // Opened for input too, so that opening doesn't truncate the reservation away
+  f.open(filename, std::ios::binary | std::ios::in | std::ios::out);
+}
+
+// Applies patches, closes f and trims off what's left of its preallocation
+static void finish_log_file(std::ofstream& f, const std::string& filename, const std::vector<LogFilePatch>& patches) {
+  if(!f.is_open())
+    return;
+  simulate_latency();
+  const std::streamoff length = f.tellp();
+  for(const LogFilePatch& patch : patches) {
+    f.seekp(patch.position);
+    f.write(reinterpret_cast<const char*>(patch.bytes.data()), patch.bytes.size());
+  }
+  f.close();
+  if(length >= 0) {
+    std::error_code error;
+    std::filesystem::resize_file(filename, (uintmax_t)length, error);
+  }
+}
+
+
+LogFileWorker::LogFileWorker() :
+  running(true) {
+  thread = std::thread([this]{run();});
+}
+
+LogFileWorker::~LogFileWorker() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    running = false;
+  }
+  condition.notify_one();
+  thread.join();
+}
+
+void LogFileWorker::post(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back(std::move(job));
+  }
+  condition.notify_one();
+}
+
+void LogFileWorker::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while(true) {
+    condition.wait(lock, [this] {return !jobs.empty() || !running;});
+    if(jobs.empty())
+      return;
+    std::function<void()> job = std::move(jobs.front());
+    jobs.pop_front();
+    lock.unlock();
+    job();
+    lock.lock();
+  }
+}
+
+
+RotatingLogFile::RotatingLogFile(LogFileWorker* _worker, size_t max_length, const std::string& _log_directory,
+                                 const std::string& _basename, const std::string& _extension) :
+  worker(_worker),
+  preallocation_size(max_length + MODULATE_LOG_FILE_PREALLOCATION_HEADROOM),
+  log_directory(_log_directory),
+  basename(_basename),
+  extension(_extension) {
+  std::filesystem::create_directories(log_directory);
+  // The first file is needed straight away
+  filename = get_next_log_filename(log_directory, basename, extension);
+  open_preallocated_file(f, filename, preallocation_size);
+  prepare_next_file();
+}
+
+RotatingLogFile::~RotatingLogFile() {
+  finish_log_file(f, filename, {});
+  if(next) {
+    std::unique_lock<std::mutex> lock(next->mutex);
+    next->ready_condition.wait(lock, [this] {return next->ready;});
+    next->stream.close();
+    std::error_code error;
+    std::filesystem::remove(next->filename, error);
+  }
+}
+
+void RotatingLogFile::prepare_next_file() {
+  if(!worker)
+    return;
+  next = std::make_shared<NextFile>();
+  // Copies, since the worker may get to this after we're gone
+  worker->post([next = next, size = preallocation_size, log_directory = log_directory, basename = basename,
+                extension = extension] {
+    const std::string next_filename = get_next_log_filename(log_directory, basename, extension);
+    std::ofstream stream;
+    open_preallocated_file(stream, next_filename, size);
+
+    std::lock_guard<std::mutex> lock(next->mutex);
+    next->stream = std::move(stream);
+    next->filename = next_filename;
+    next->ready = true;
+    next->ready_condition.notify_all();
+  });
+}
+
+bool RotatingLogFile::is_next_file_ready() {
+  if(!next)
+    return true;
+  std::lock_guard<std::mutex> lock(next->mutex);
+  return next->ready;
+}
+
+void RotatingLogFile::take_next_file() {
+  if(!next) {
+    filename = get_next_log_filename(log_directory, basename, extension);
+    open_preallocated_file(f, filename, preallocation_size);
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(next->mutex);
+    next->ready_condition.wait(lock, [this] {return next->ready;});
+    f = std::move(next->stream);
+    filename = std::move(next->filename);
+  }
+  prepare_next_file();
+}
+
+void RotatingLogFile::rotate(std::vector<LogFilePatch> patches) {
+  if(!worker) {
+    finish_log_file(f, filename, patches);
+    take_next_file();
+    return;
+  }
+  // Shared, since std::function needs a copyable job
+  auto finished = std::make_shared<std::pair<std::ofstream, std::string>>(std::move(f), filename);
+  worker->post([finished, patches = std::move(patches)] {
+    finish_log_file(finished->first, finished->second, patches);
+  });
+  take_next_file();
+}
+
+void RotatingLogFile::close(std::vector<LogFilePatch> patches) {
+  finish_log_file(f, filename, patches);
+}
@@ -0,0 +1,112 @@
+#ifndef MODULATE_LOG_FILE_ROTATION_HPP
+#define MODULATE_LOG_FILE_ROTATION_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Logs are started afresh once they pass this size
+#ifndef MODULATE_MAX_LOG_FILE_LENGTH
+#define MODULATE_MAX_LOG_FILE_LENGTH (1<<24)
+#endif
+// New log files are reserved at their maximum length plus this much up front, for whatever
+// the drain that takes them over the limit writes, and trimmed to what was written when closed
+#define MODULATE_LOG_FILE_PREALLOCATION_HEADROOM (1<<20)
+
+// log_directory/<date and time>_<n>_<basename><extension>, for the first n not already taken.
+// Only the first name in each minute is checked against the disk; after that n comes from
+// a counter kept per log name, so naming a file doesn't cost any file system calls.
+std::string get_next_log_filename(const std::string& log_directory, const std::string& basename,
+                                  const std::string& extension);
+
+// Makes every log file open and close take this much longer, to see how loggers cope with a
+// slow disk (e.g. one with a virus scanner looking at every new file).  Only for benchmarks.
+void set_simulated_log_file_latency(std::chrono::microseconds latency);
+
+// Bytes to write over part of a log once it's finished, e.g. sizes in its header
+struct LogFilePatch {
+  size_t position;
+  std::vector<uint8_t> bytes;
+};
+
+// Runs file system jobs - creating, preallocating, patching and closing log files - in order
+// on a thread of its own, so that a slow disk (or a virus scanner looking at every new file)
+// doesn't hold up the thread draining the loggers.
+class LogFileWorker {
+private:
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::deque<std::function<void()>> jobs;
+  bool running;
+  std::thread thread;
+
+  void run();
+
+public:
+  LogFileWorker();
+  // Runs whatever's still queued first
+  ~LogFileWorker();
+  LogFileWorker(const LogFileWorker& other) = delete;
+  LogFileWorker& operator=(const LogFileWorker& other) = delete;
+
+  void post(std::function<void()> job);
+};
+
+// The file a logger is writing to.  While it fills, the next file is named, created,
+// preallocated and opened on a LogFileWorker, so that rotating only swaps streams, and the
+// finished file is then patched, closed and trimmed on the worker.  Without a worker all of
+// this happens in place, as it always used to.
+//
+// A log that's never closed (e.g. after a crash) keeps its preallocated length, with zeros
+// after the last thing written.  Not thread safe.
+class RotatingLogFile {
+private:
+  struct NextFile {
+    std::mutex mutex;
+    std::condition_variable ready_condition;
+    bool ready = false;
+    std::ofstream stream;
+    std::string filename;
+  };
+
+  LogFileWorker* worker;
+  std::shared_ptr<NextFile> next;
+  const size_t preallocation_size;
+  const std::string log_directory;
+  const std::string basename;
+  const std::string extension;
+
+  void prepare_next_file();
+  void take_next_file();
+
+public:
+  std::ofstream f;
+  std::string filename;
+
+  // Creates log_directory if it's not there, and opens the first file in place
+  RotatingLogFile(LogFileWorker* worker, size_t max_length, const std::string& log_directory,
+                  const std::string& basename, const std::string& extension);
+  // Closes the current file in place, and deletes the next one if it was never used
+  ~RotatingLogFile();
+  RotatingLogFile(const RotatingLogFile& other) = delete;
+  RotatingLogFile& operator=(const RotatingLogFile& other) = delete;
+
+  // True once the next file can be switched to without waiting for the worker
+  bool is_next_file_ready();
+  // Hands the current file (with patches to apply to it) to the worker to finish, and
+  // switches to the next one, waiting for it if the worker hasn't got to it yet
+  void rotate(std::vector<LogFilePatch> patches);
+  // Finishes the current file in place.  Call before the destructor, to patch it.
+  void close(std::vector<LogFilePatch> patches);
+};
+
+#endif
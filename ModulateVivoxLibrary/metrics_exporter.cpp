@@ -0,0 +1,195 @@
+#include "metrics_exporter.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+
+// Whole numbers (most counters) as such, anything else in as few digits as read back the same
+static std::string format_value(double value) {
+  if(std::isnan(value))
+    return "NaN";
+  if(std::isinf(value))
+    return value > 0 ? "+Inf" : "-Inf";
+  char buffer[32];
+  if(value == floor(value) && fabs(value) < 1e15) {
+    snprintf(buffer, sizeof(buffer), "%.0f", value);
+    return buffer;
+  }
+  for(int precision = 6; precision <= 17; precision++) {
+    snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+    if(strtod(buffer, nullptr) == value)
+      break;
+  }
+  return buffer;
+}
+
+static std::string escape(const std::string& text, bool quotes) {
+  std::string escaped;
+  for(char c : text) {
+    if(c == '\\')
+      escaped += "\\\\";
+    else if(c == '\n')
+      escaped += "\\n";
+    else if(c == '"' && quotes)
+      escaped += "\\\"";
+    else
+      escaped += c;
+  }
+  return escaped;
+}
+
+static const char* describe(MetricType type) {
+  switch(type) {
+    case MetricType::counter: return "counter";
+    case MetricType::gauge: return "gauge";
+    case MetricType::histogram: return "histogram";
+    default: return "untyped";
+  }
+}
+
+// {a="1",b="2"}, with le last for histogram buckets
+static std::string format_labels(const MetricLabels& labels, const char* le = nullptr) {
+  if(labels.empty() && !le)
+    return "";
+  std::string text = "{";
+  for(size_t i = 0; i < labels.size(); i++)
+    text += (i ? "," : "") + labels[i].first + "=\"" + escape(labels[i].second, true) + "\"";
+  if(le)
+    text += std::string(labels.empty() ? "" : ",") + "le=\"" + le + "\"";
+  return text + "}";
+}
+
+MetricsExporter::MetricsExporter(MetricsRegistry& _registry, const char* log_dir) :
+  registry(_registry),
+  log_directory(log_dir ? log_dir : ""),
+  running(false),
+  format(MetricsFormat::none),
+  interval_s(0.0) {}
+
+MetricsExporter::~MetricsExporter() {
+  stop();
+}
+
+void MetricsExporter::configure(MetricsFormat new_format, double new_interval_s) {
+  std::lock_guard<std::mutex> configure_lock(configure_mutex);
+  if(thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      running = false;
+    }
+    condition.notify_one();
+    thread.join();
+  }
+  if(new_format == MetricsFormat::none || log_directory.empty() || !(new_interval_s > 0.0))
+    return;
+  std::error_code error;
+  std::filesystem::create_directories(log_directory, error);
+  format = new_format;
+  interval_s = new_interval_s;
+  running = true;
+  thread = std::thread(&MetricsExporter::run, this);
+}
+
+void MetricsExporter::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while(running) {
+    condition.wait_for(lock, std::chrono::duration<double>(interval_s), [this] {return !running;});
+    // Once more on the way out, so the file has the last of it
+    lock.unlock();
+    write(format);
+    lock.lock();
+  }
+}
+
+void MetricsExporter::write(MetricsFormat write_format) {
+  const std::vector<MetricSample> samples = registry.snapshot();
+  std::error_code error;
+  if(write_format == MetricsFormat::prometheus) {
+    const std::string path = log_directory + "/metrics.prom";
+    {
+      std::ofstream file(path + ".tmp", std::ios::binary | std::ios::trunc);
+      if(!file.is_open())
+        return;
+      file << format_prometheus(samples);
+    }
+    std::filesystem::rename(path + ".tmp", path, error);
+    if(error) {
+      // Some file systems won't rename over a file
+      std::filesystem::remove(path, error);
+      std::filesystem::rename(path + ".tmp", path, error);
+    }
+    return;
+  }
+
+  const std::string path = log_directory + "/metrics.jsonl";
+  const uintmax_t length = std::filesystem::file_size(path, error);
+  if(!error && length > MODULATE_METRICS_MAX_FILE_LENGTH)
+    std::filesystem::rename(path, log_directory + "/metrics.1.jsonl", error);
+  const uint64_t timestamp_ms = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+  std::ofstream file(path, std::ios::binary | std::ios::app);
+  if(file.is_open())
+    file << format_json_line(samples, timestamp_ms) << "\n";
+}
+
+std::string MetricsExporter::format_prometheus(const std::vector<MetricSample>& samples) {
+  // Every sample of a metric has to come together, under its HELP and TYPE
+  std::string text;
+  std::vector<bool> written(samples.size(), false);
+  for(size_t i = 0; i < samples.size(); i++) {
+    if(written[i])
+      continue;
+    const std::string& name = samples[i].name;
+    text += "# HELP " + name + " " + escape(samples[i].help, false) + "\n";
+    text += "# TYPE " + name + " " + describe(samples[i].type) + "\n";
+    for(size_t j = i; j < samples.size(); j++) {
+      const MetricSample& sample = samples[j];
+      if(written[j] || sample.name != name)
+        continue;
+      written[j] = true;
+      if(sample.type != MetricType::histogram) {
+        text += name + format_labels(sample.labels) + " " + format_value(sample.value) + "\n";
+        continue;
+      }
+      for(size_t bucket = 0; bucket < sample.bounds.size(); bucket++)
+        text += name + "_bucket" + format_labels(sample.labels, format_value(sample.bounds[bucket]).c_str()) + " " +
+                format_value((double)sample.bucket_counts[bucket]) + "\n";
+      text += name + "_sum" + format_labels(sample.labels) + " " + format_value(sample.sum) + "\n";
+      text += name + "_count" + format_labels(sample.labels) + " " + format_value((double)sample.count) + "\n";
+    }
+  }
+  return text;
+}
+
+std::string MetricsExporter::format_json_line(const std::vector<MetricSample>& samples, uint64_t timestamp_ms) {
+  // JSON has no infinities or NaN, so those go as strings
+  const auto json_value = [](double value) {
+    return std::isfinite(value) ? format_value(value) : "\"" + format_value(value) + "\"";
+  };
+  std::string line = "{\"timestamp_ms\": " + std::to_string(timestamp_ms) + ", \"metrics\": [";
+  for(size_t i = 0; i < samples.size(); i++) {
+    const MetricSample& sample = samples[i];
+    line += i ? ", " : "";
+    line += "{\"name\": \"" + escape(sample.name, true) + "\", \"type\": \"" + describe(sample.type) + "\"";
+    if(!sample.labels.empty()) {
+      line += ", \"labels\": {";
+      for(size_t j = 0; j < sample.labels.size(); j++)
+        line += (j ? ", \"" : "\"") + escape(sample.labels[j].first, true) + "\": \"" +
+                escape(sample.labels[j].second, true) + "\"";
+      line += "}";
+    }
+    if(sample.type != MetricType::histogram) {
+      line += ", \"value\": " + json_value(sample.value) + "}";
+      continue;
+    }
+    line += ", \"buckets\": [";
+    for(size_t bucket = 0; bucket < sample.bounds.size(); bucket++)
+      line += (bucket ? ", [" : "[") + json_value(sample.bounds[bucket]) + ", " +
+              std::to_string(sample.bucket_counts[bucket]) + "]";
+    line += "], \"sum\": " + json_value(sample.sum) + ", \"count\": " + std::to_string(sample.count) + "}";
+  }
+  return line + "]}";
+}
@@ -0,0 +1,60 @@
+#ifndef MODULATE_METRICS_EXPORTER_HPP
+#define MODULATE_METRICS_EXPORTER_HPP
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics_registry.hpp"
+
+// The JSON lines file is started afresh past this size, keeping the one before it
+#define MODULATE_METRICS_MAX_FILE_LENGTH (1<<24)
+
+enum class MetricsFormat : int {
+  none,
+  prometheus, // text exposition format, metrics.prom rewritten in place each time
+  json_lines  // a snapshot per line, appended to metrics.jsonl
+};
+
+// Writes snapshots of a MetricsRegistry to the log directory every interval, on a thread
+// of its own.  The Prometheus file is replaced whole each time (written alongside, then
+// renamed over it), so that a collector reading it never sees half a snapshot - it's in
+// the form node_exporter's textfile collector picks up.  The JSON lines file keeps the
+// history, rotating to metrics.1.jsonl once it's too long.
+class MetricsExporter {
+private:
+  MetricsRegistry& registry;
+  const std::string log_directory;
+
+  // Serializes configure, which mustn't hold mutex while it waits for the thread
+  std::mutex configure_mutex;
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool running;
+  MetricsFormat format;
+  double interval_s;
+  std::thread thread;
+
+  void run();
+  void write(MetricsFormat format);
+
+public:
+  MetricsExporter(MetricsRegistry& registry, const char* log_dir);
+  // Writes a last snapshot
+  ~MetricsExporter();
+  MetricsExporter(const MetricsExporter& other) = delete;
+  MetricsExporter& operator=(const MetricsExporter& other) = delete;
+
+  // Starts exporting, or with MetricsFormat::none stops.  With no log directory, there's
+  // nowhere to write, so this does nothing.
+  void configure(MetricsFormat format, double interval_s);
+  void stop() {configure(MetricsFormat::none, 0.0);}
+
+  static std::string format_prometheus(const std::vector<MetricSample>& samples);
+  // One line, without the newline, stamped with the time in milliseconds since the Unix epoch
+  static std::string format_json_line(const std::vector<MetricSample>& samples, uint64_t timestamp_ms);
+};
+
+#endif
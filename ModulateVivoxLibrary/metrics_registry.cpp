@@ -0,0 +1,212 @@
+#include "metrics_registry.hpp"
+
+#include <cmath>
+#include <cstring>
+
+static std::atomic<uint64_t> next_registry_serial(1);
+
+// The shard this thread last recorded into - MODULATE_METRICS_SHARDS if it had to share the
+// overflow shard - and whose registry it was in.  An address
+// unique to each running thread stands in for it as a shard's owner - a later thread that
+// happens to get the same one takes over a dead thread's shard, which is harmless.
+struct ShardCache {
+  uint64_t serial;
+  size_t shard;
+};
+static thread_local ShardCache shard_cache = {0, 0};
+static thread_local char thread_token;
+
+static uint64_t to_bits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+static double from_bits(uint64_t bits) {
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+MetricsRegistry::MetricsRegistry() :
+  serial(next_registry_serial.fetch_add(1)),
+  next_cell(0) {
+  shards = new Shard[MODULATE_METRICS_SHARDS + 1];
+  for(size_t i = 0; i <= MODULATE_METRICS_SHARDS; i++) {
+    shards[i].owner.store(0, std::memory_order_relaxed);
+    for(size_t j = 0; j < MODULATE_METRICS_MAX_CELLS; j++)
+      shards[i].cells[j].store(0, std::memory_order_relaxed);
+  }
+}
+
+MetricsRegistry::~MetricsRegistry() {
+  delete[] shards;
+}
+
+MetricInfo* MetricsRegistry::add(const std::string& name, const std::string& help, const MetricLabels& labels,
+                                 MetricType type, size_t cells) {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::unique_ptr<MetricInfo> info(new MetricInfo());
+  info->name = name;
+  info->help = help;
+  info->labels = labels;
+  info->type = type;
+  info->cell = SIZE_MAX;
+  info->gauge_bits.store(to_bits(0.0), std::memory_order_relaxed);
+  if(cells) {
+    if(next_cell + cells > MODULATE_METRICS_MAX_CELLS)
+      return nullptr;
+    info->cell = next_cell;
+    next_cell += cells;
+  }
+  metrics.push_back(std::move(info));
+  return metrics.back().get();
+}
+
+MetricsCounter MetricsRegistry::add_counter(const std::string& name, const std::string& help, const MetricLabels& labels) {
+  MetricsCounter counter;
+  const MetricInfo* info = add(name, help, labels, MetricType::counter, 1);
+  if(info)
+    counter.cell = info->cell;
+  return counter;
+}
+
+MetricsGauge MetricsRegistry::add_gauge(const std::string& name, const std::string& help, const MetricLabels& labels) {
+  MetricsGauge gauge;
+  gauge.info = add(name, help, labels, MetricType::gauge, 0);
+  return gauge;
+}
+
+MetricsHistogram MetricsRegistry::add_histogram(const std::string& name, const std::string& help,
+                                                const std::vector<double>& bounds, const MetricLabels& labels) {
+  MetricsHistogram histogram;
+  // A bucket per bound and one above them all, then the sum
+  MetricInfo* info = add(name, help, labels, MetricType::histogram, bounds.size() + 2);
+  if(info)
+    info->bounds = bounds;
+  histogram.info = info;
+  return histogram;
+}
+
+void MetricsRegistry::add_counter_function(const std::string& name, const std::string& help, const MetricLabels& labels,
+                                           std::function<double()> read) {
+  MetricInfo* info = add(name, help, labels, MetricType::counter, 0);
+  info->read = std::move(read);
+}
+
+void MetricsRegistry::add_gauge_function(const std::string& name, const std::string& help, const MetricLabels& labels,
+                                         std::function<double()> read) {
+  MetricInfo* info = add(name, help, labels, MetricType::gauge, 0);
+  info->read = std::move(read);
+}
+
+MetricsRegistry::Shard& MetricsRegistry::get_shard(bool& shared) {
+  if(shard_cache.serial == serial) {
+    shared = shard_cache.shard == MODULATE_METRICS_SHARDS;
+    return shards[shard_cache.shard];
+  }
+
+  // This thread may have recorded into this registry before, between recording into others
+  const uintptr_t token = (uintptr_t)&thread_token;
+  size_t shard = MODULATE_METRICS_SHARDS;
+  for(size_t i = 0; i < MODULATE_METRICS_SHARDS && shard == MODULATE_METRICS_SHARDS; i++) {
+    if(shards[i].owner.load(std::memory_order_relaxed) == token)
+      shard = i;
+  }
+  for(size_t i = 0; i < MODULATE_METRICS_SHARDS && shard == MODULATE_METRICS_SHARDS; i++) {
+    uintptr_t expected = 0;
+    if(shards[i].owner.compare_exchange_strong(expected, token, std::memory_order_relaxed))
+      shard = i;
+  }
+  // Shards are never given back, so one that's shared stays that way
+  shared = shard == MODULATE_METRICS_SHARDS;
+  shard_cache.serial = serial;
+  shard_cache.shard = shard;
+  return shards[shard];
+}
+
+void MetricsRegistry::add_to_cell(size_t cell, uint64_t value) {
+  bool shared;
+  std::atomic<uint64_t>& target = get_shard(shared).cells[cell];
+  if(shared)
+    target.fetch_add(value, std::memory_order_relaxed);
+  else
+    // Only this thread writes here, so there's no need for a locked add
+    target.store(target.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void MetricsRegistry::add_to_cell(size_t cell, double value) {
+  bool shared;
+  std::atomic<uint64_t>& target = get_shard(shared).cells[cell];
+  uint64_t bits = target.load(std::memory_order_relaxed);
+  if(!shared) {
+    target.store(to_bits(from_bits(bits) + value), std::memory_order_relaxed);
+    return;
+  }
+  while(!target.compare_exchange_weak(bits, to_bits(from_bits(bits) + value), std::memory_order_relaxed)) {}
+}
+
+void MetricsRegistry::set(MetricsGauge gauge, double value) {
+  if(gauge.info)
+    gauge.info->gauge_bits.store(to_bits(value), std::memory_order_relaxed);
+}
+
+void MetricsRegistry::observe(MetricsHistogram histogram, double value) {
+  if(!histogram.info)
+    return;
+  const std::vector<double>& bounds = histogram.info->bounds;
+  size_t bucket = 0;
+  while(bucket < bounds.size() && value > bounds[bucket])
+    bucket++;
+  add_to_cell(histogram.info->cell + bucket, (uint64_t)1);
+  add_to_cell(histogram.info->cell + bounds.size() + 1, value);
+}
+
+uint64_t MetricsRegistry::sum_cells(size_t cell) const {
+  uint64_t total = 0;
+  for(size_t i = 0; i <= MODULATE_METRICS_SHARDS; i++)
+    total += shards[i].cells[cell].load(std::memory_order_relaxed);
+  return total;
+}
+
+double MetricsRegistry::sum_double_cells(size_t cell) const {
+  double total = 0.0;
+  for(size_t i = 0; i <= MODULATE_METRICS_SHARDS; i++)
+    total += from_bits(shards[i].cells[cell].load(std::memory_order_relaxed));
+  return total;
+}
+
+std::vector<MetricSample> MetricsRegistry::snapshot() {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<MetricSample> samples;
+  samples.reserve(metrics.size());
+  for(const std::unique_ptr<MetricInfo>& info : metrics) {
+    MetricSample sample;
+    sample.name = info->name;
+    sample.help = info->help;
+    sample.labels = info->labels;
+    sample.type = info->type;
+    sample.value = 0.0;
+    sample.sum = 0.0;
+    sample.count = 0;
+    if(info->read) {
+      sample.value = info->read();
+    } else if(info->type == MetricType::counter) {
+      sample.value = (double)sum_cells(info->cell);
+    } else if(info->type == MetricType::gauge) {
+      sample.value = from_bits(info->gauge_bits.load(std::memory_order_relaxed));
+    } else {
+      // A recording thread may be between a bucket and the sum, which the next snapshot evens out
+      for(size_t bucket = 0; bucket <= info->bounds.size(); bucket++) {
+        sample.count += sum_cells(info->cell + bucket);
+        sample.bucket_counts.push_back(sample.count);
+      }
+      sample.bounds = info->bounds;
+      sample.bounds.push_back(INFINITY);
+      sample.sum = sum_double_cells(info->cell + info->bounds.size() + 1);
+      sample.value = (double)sample.count;
+    }
+    samples.push_back(std::move(sample));
+  }
+  return samples;
+}
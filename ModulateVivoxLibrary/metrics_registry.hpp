@@ -0,0 +1,127 @@
+#ifndef MODULATE_METRICS_REGISTRY_HPP
+#define MODULATE_METRICS_REGISTRY_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Threads that get a shard of their own - any more share one, with atomic adds
+#define MODULATE_METRICS_SHARDS 16
+// Counter and histogram cells in each shard: a counter takes one, a histogram one per
+// bucket plus one for its sum
+#define MODULATE_METRICS_MAX_CELLS 512
+
+enum class MetricType {
+  counter,
+  gauge,
+  histogram
+};
+
+typedef std::vector<std::pair<std::string, std::string>> MetricLabels;
+
+// What a metric's handle refers to.  Never moved or freed while the registry is around.
+struct MetricInfo {
+  std::string name;
+  std::string help;
+  MetricLabels labels;
+  MetricType type;
+  size_t cell;                // first cell, for counters and histograms
+  std::vector<double> bounds; // histogram bucket upper bounds, ascending; +Inf is implied
+  std::atomic<uint64_t> gauge_bits; // a set gauge's value, as a double
+  std::function<double()> read;     // for metrics read when a snapshot is taken
+};
+
+// Handles to record into, from any thread.  A default-constructed one records nothing.
+struct MetricsCounter {
+  size_t cell = SIZE_MAX;
+};
+struct MetricsGauge {
+  MetricInfo* info = nullptr;
+};
+struct MetricsHistogram {
+  const MetricInfo* info = nullptr;
+};
+
+struct MetricSample {
+  std::string name;
+  std::string help;
+  MetricLabels labels;
+  MetricType type;
+  double value;                         // counters and gauges
+  std::vector<double> bounds;           // histograms: bucket upper bounds, then +Inf
+  std::vector<uint64_t> bucket_counts;  // cumulative, as Prometheus has them
+  double sum;
+  uint64_t count;
+};
+
+// Counters, gauges and histograms for the audio path, written without locks and without
+// the threads contending: each thread that records gets its own shard of cells, claimed
+// the first time it records and found again through a thread-local cache, which it
+// updates with plain loads and stores.  A snapshot adds the shards up.  Once every shard
+// is taken, further threads share an overflow shard with atomic adds, so nothing's lost.
+// Shards aren't given back - a thread that goes away leaves its counts behind in its shard
+// - so there are enough for threads that come and go, like the pipeline worker.
+//
+// Metrics are registered off the audio thread, and then keep their place.  They can also
+// be read from a function when the snapshot is taken, for totals that are already kept
+// elsewhere (e.g. EchoBuffer's).  Registration and snapshots are serialized by a mutex
+// the recording side never takes.
+class MetricsRegistry {
+private:
+  struct alignas(64) Shard {
+    std::atomic<uintptr_t> owner; // the owning thread's token, 0 if free
+    std::atomic<uint64_t> cells[MODULATE_METRICS_MAX_CELLS];
+  };
+  Shard* shards;         // MODULATE_METRICS_SHARDS, then the overflow shard
+  const uint64_t serial; // tells registries apart in the thread-local cache
+
+  std::mutex mutex;
+  std::vector<std::unique_ptr<MetricInfo>> metrics;
+  size_t next_cell;
+
+  MetricInfo* add(const std::string& name, const std::string& help, const MetricLabels& labels, MetricType type,
+                  size_t cells);
+  Shard& get_shard(bool& shared);
+  void add_to_cell(size_t cell, uint64_t value);
+  void add_to_cell(size_t cell, double value);
+  uint64_t sum_cells(size_t cell) const;
+  double sum_double_cells(size_t cell) const;
+
+public:
+  MetricsRegistry();
+  ~MetricsRegistry();
+  MetricsRegistry(const MetricsRegistry& other) = delete;
+  MetricsRegistry& operator=(const MetricsRegistry& other) = delete;
+
+  // Registration, which allocates.  Metrics with the same name should differ only by
+  // labels, and share a type and help.  A registry that's out of cells hands back a
+  // handle that records nothing.
+  MetricsCounter add_counter(const std::string& name, const std::string& help, const MetricLabels& labels = {});
+  MetricsGauge add_gauge(const std::string& name, const std::string& help, const MetricLabels& labels = {});
+  MetricsHistogram add_histogram(const std::string& name, const std::string& help, const std::vector<double>& bounds,
+                                 const MetricLabels& labels = {});
+  // Read when a snapshot is taken, on the thread taking it
+  void add_counter_function(const std::string& name, const std::string& help, const MetricLabels& labels,
+                            std::function<double()> read);
+  void add_gauge_function(const std::string& name, const std::string& help, const MetricLabels& labels,
+                          std::function<double()> read);
+
+  // Recording side, from any thread: never blocks or allocates
+  void increment(MetricsCounter counter, uint64_t amount = 1) {
+    if(counter.cell < MODULATE_METRICS_MAX_CELLS)
+      add_to_cell(counter.cell, amount);
+  }
+  void set(MetricsGauge gauge, double value);
+  void observe(MetricsHistogram histogram, double value);
+
+  // Every metric, in the order registered
+  std::vector<MetricSample> snapshot();
+};
+
+#endif
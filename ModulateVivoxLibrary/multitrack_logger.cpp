@@ -0,0 +1,208 @@
+#include "multitrack_logger.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+// Callbacks the frame ring can hold, however short they are
+#define MODULATE_MULTITRACK_MAX_QUEUED_FRAMES 256
+#define MODULATE_MULTITRACK_RECORD_HEADER_SIZE 8
+#define MODULATE_MULTITRACK_FRAME_HEADER_SIZE 28
+
+// Log data is little-endian, as is every platform we build for, so values are copied as they are
+template <typename Value>
+static uint8_t* put_value(uint8_t* position, Value value) {
+  memcpy(position, &value, sizeof(Value));
+  return position + sizeof(Value);
+}
+
+static uint8_t* put_record_header(uint8_t* position, uint8_t type, uint32_t payload_size) {
+  position = put_value<uint8_t>(position, type);
+  position = put_value<uint8_t>(position, 0);
+  position = put_value<uint16_t>(position, 0);
+  return put_value<uint32_t>(position, payload_size);
+}
+
+static uint64_t get_unix_time_us() {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+MultitrackLogger::MultitrackLogger(WavLoggingService& _service, size_t buffer_size, size_t _max_frame_count,
+                                   const std::string& _log_directory, const std::string& _basename,
+                                   WavSampleFormat _format, size_t _max_file_length) :
+  service(&_service),
+  registered(false),
+  kernels(get_audio_kernels()),
+  frames(MODULATE_MULTITRACK_MAX_QUEUED_FRAMES),
+  samples(buffer_size),
+  frame_open(false),
+  dropped_samples(0),
+  wake_event(nullptr),
+  wake_threshold(samples.get_capacity() / 4),
+  start_time(std::chrono::steady_clock::now()),
+  start_time_unix_us(get_unix_time_us()),
+  file(&_service.get_file_worker(), _max_file_length, _log_directory, _basename, ".mtlog"),
+  file_sample_rate(0),
+  track_samples(new float[_max_frame_count]),
+  staging(new short[_max_frame_count]),
+  // Room for the largest frame: two tracks of 32-bit float, which is bigger than FLAC's worst case
+  record(new uint8_t[MODULATE_MULTITRACK_RECORD_HEADER_SIZE + MODULATE_MULTITRACK_FRAME_HEADER_SIZE +
+                     MODULATE_MULTITRACK_LOG_TRACKS * (sizeof(uint32_t) +
+                       std::max(_max_frame_count * sizeof(float), FlacEncoder::get_max_subframe_bytes(_max_frame_count)))]),
+  flac_encoder(_format == WavSampleFormat::flac ? new FlacEncoder() : nullptr),
+  // A FLAC subframe can't be longer than a block
+  max_frame_count(_format == WavSampleFormat::flac ? std::min(_max_frame_count, (size_t)MODULATE_FLAC_BLOCK_SIZE) : _max_frame_count),
+  log_directory(_log_directory),
+  basename(_basename),
+  format(_format),
+  max_file_length(_max_file_length) {
+  if(!frames.is_lock_free() || !samples.is_lock_free())
+    throw std::runtime_error("Atomic integers are not lock-free, cannot create multitrack logger");
+
+  write_file_header();
+}
+
+MultitrackLogger::~MultitrackLogger() {
+  stop_logging_thread();
+  write_outstanding_frames_to_file();
+  file.close({});
+  delete[] track_samples;
+  delete[] staging;
+  delete[] record;
+  delete flac_encoder;
+}
+
+bool MultitrackLogger::begin_frame(const float* input, size_t pcm_frame_count, int audio_frame_rate, int speaking,
+                                   int session, uint64_t callback_index) {
+  frame_open = false;
+  // Room for the output as well, so that end_frame can't fail
+  const size_t needed = MODULATE_MULTITRACK_LOG_TRACKS * pcm_frame_count;
+  if(pcm_frame_count == 0 || pcm_frame_count > max_frame_count ||
+     frames.write_available() == 0 || samples.write_available() < needed) {
+    dropped_samples.fetch_add(needed, std::memory_order_relaxed);
+    return false;
+  }
+  samples.write(input, pcm_frame_count);
+
+  pending_frame.callback_index = callback_index;
+  pending_frame.timestamp_us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - start_time).count();
+  pending_frame.audio_frame_rate = audio_frame_rate;
+  pending_frame.sample_count = (uint32_t)pcm_frame_count;
+  pending_frame.session = (uint16_t)session;
+  pending_frame.speaking = speaking ? 1 : 0;
+  pending_frame.tracks = 1;
+  frame_open = true;
+  return true;
+}
+
+void MultitrackLogger::end_frame(const float* output) {
+  if(!frame_open)
+    return;
+  frame_open = false;
+  if(output) {
+    samples.write(output, pending_frame.sample_count);
+    pending_frame.tracks = 2;
+  }
+  frames.write(&pending_frame, 1);
+
+  // Wake the service once a quarter of either ring is waiting, as WavLogger does
+  if(samples.get_capacity() - samples.write_available() >= wake_threshold ||
+     frames.read_available() >= frames.get_capacity() / 4) {
+    if(AudioSafeEvent* event = wake_event.load(std::memory_order_acquire))
+      event->signal();
+  }
+}
+
+void MultitrackLogger::write_file_header() {
+  uint8_t header[24];
+  uint8_t* position = header;
+  memcpy(position, "MTLG", 4);
+  position = put_value<uint32_t>(position + 4, MODULATE_MULTITRACK_LOG_VERSION);
+  position = put_value<uint32_t>(position, (uint32_t)format);
+  position = put_value<uint32_t>(position, MODULATE_MULTITRACK_LOG_TRACKS);
+  put_value<uint64_t>(position, start_time_unix_us);
+  file.f.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+  // So that the file's first frame is preceded by its rate
+  file_sample_rate = 0;
+}
+
+void MultitrackLogger::write_rate_record(int sample_rate) {
+  uint8_t* position = put_record_header(record, MODULATE_MULTITRACK_RATE_RECORD, sizeof(uint32_t));
+  position = put_value<uint32_t>(position, (uint32_t)sample_rate);
+  file.f.write(reinterpret_cast<const char*>(record), position - record);
+  file_sample_rate = sample_rate;
+}
+
+void MultitrackLogger::write_frame_record(const MultitrackFrame& frame) {
+  if(frame.audio_frame_rate != file_sample_rate)
+    write_rate_record(frame.audio_frame_rate);
+
+  uint8_t* const payload = record + MODULATE_MULTITRACK_RECORD_HEADER_SIZE;
+  uint8_t* position = payload;
+  position = put_value<uint64_t>(position, frame.callback_index);
+  position = put_value<uint64_t>(position, frame.timestamp_us);
+  position = put_value<uint32_t>(position, (uint32_t)frame.audio_frame_rate);
+  position = put_value<uint32_t>(position, frame.sample_count);
+  position = put_value<uint16_t>(position, frame.session);
+  position = put_value<uint8_t>(position, frame.speaking);
+  position = put_value<uint8_t>(position, frame.tracks);
+
+  const size_t count = frame.sample_count;
+  for(unsigned track = 0; track < frame.tracks; track++) {
+    samples.read(track_samples, count);
+    uint8_t* const track_data = position + sizeof(uint32_t);
+    size_t track_size;
+    if(format == WavSampleFormat::float32) {
+      track_size = count * sizeof(float);
+      memcpy(track_data, track_samples, track_size);
+    } else {
+      kernels.float_to_int16(track_samples, staging, count);
+      if(flac_encoder) {
+        track_size = flac_encoder->encode_subframe(staging, count, track_data);
+      } else {
+        track_size = count * sizeof(short);
+        memcpy(track_data, staging, track_size);
+      }
+    }
+    put_value<uint32_t>(position, (uint32_t)track_size);
+    position = track_data + track_size;
+  }
+
+  put_record_header(record, MODULATE_MULTITRACK_FRAME_RECORD, (uint32_t)(position - payload));
+  file.f.write(reinterpret_cast<const char*>(record), position - record);
+}
+
+void MultitrackLogger::write_outstanding_frames_to_file() {
+  std::lock_guard<std::mutex> lock(writer_mutex);
+  // Only the frames that are here now, so that a busy audio thread can't keep us here
+  for(size_t remaining = frames.read_available(); remaining; remaining--) {
+    MultitrackFrame frame;
+    frames.read(&frame, 1);
+    write_frame_record(frame);
+  }
+
+  // If the next file isn't open yet, this one carries on until it is
+  size_t file_length = file.f.tellp();
+  if(file_length > max_file_length && file.is_next_file_ready()) {
+    file.rotate({});
+    write_file_header();
+  }
+}
+
+void MultitrackLogger::start_logging_thread() {
+  if(registered)
+    return;
+  service->add_logger(this);
+  registered = true;
+}
+
+void MultitrackLogger::stop_logging_thread() {
+  if(!registered)
+    return;
+  service->remove_logger(this);
+  registered = false;
+  write_outstanding_frames_to_file();
+}
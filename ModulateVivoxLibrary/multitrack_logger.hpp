@@ -0,0 +1,118 @@
+#ifndef MODULATE_MULTITRACK_LOGGER_HPP
+#define MODULATE_MULTITRACK_LOGGER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+#include "audio_kernels.hpp"
+#include "spsc_ring.hpp"
+#include "audio_safe_event.hpp"
+#include "flac_encoder.hpp"
+#include "wav_logger.hpp"
+
+// Multitrack log files (.mtlog), all little-endian:
+//
+//   header:  "MTLG", u32 version (1), u32 sample format (a WavSampleFormat),
+//            u32 tracks per frame (2: input then output), u64 logger start time (us since the Unix epoch)
+//   records: u8 type, 3 bytes reserved, u32 payload size, then the payload
+//     rate:  u32 sample rate of the frames that follow.  Starts every file, and marks every change.
+//     frame: u64 callback index (per session), u64 timestamp (us since the logger started),
+//            u32 sample rate, u32 samples per track, u16 session, u8 speaking, u8 tracks present,
+//            then for each track present: u32 size, then the samples as 16-bit PCM, 32-bit float,
+//            or a FLAC subframe (see FlacEncoder::encode_subframe)
+//
+// A frame holds exactly one callback, so its tracks are aligned sample for sample.  If the
+// voice skin failed on a frame, only the input track is present.
+#define MODULATE_MULTITRACK_LOG_VERSION 1
+#define MODULATE_MULTITRACK_LOG_TRACKS 2
+#define MODULATE_MULTITRACK_RATE_RECORD 1
+#define MODULATE_MULTITRACK_FRAME_RECORD 2
+
+struct MultitrackFrame {
+  uint64_t callback_index;
+  uint64_t timestamp_us;
+  int audio_frame_rate;
+  uint32_t sample_count;
+  uint16_t session;
+  uint8_t speaking;
+  uint8_t tracks;
+};
+
+// Logs the input and output of every callback into a single stream, drained by a
+// WavLoggingService, whose file worker opens and closes the log files.  Sample rate changes
+// are recorded in the stream rather than starting a new file, so a file only ends when it
+// reaches max_file_length.
+class MultitrackLogger : public ServicedLogger {
+private:
+  WavLoggingService* service;
+  bool registered;
+  const AudioKernels& kernels;
+
+  // Audio side: samples for both tracks go in first, then the frame, so the logging
+  // thread never sees a frame before all of its audio
+  SpscRing<MultitrackFrame> frames;
+  SpscRing<float> samples;
+  MultitrackFrame pending_frame;
+  bool frame_open;
+  std::atomic<uint64_t> dropped_samples;
+  std::atomic<AudioSafeEvent*> wake_event;
+  const size_t wake_threshold;
+  const std::chrono::steady_clock::time_point start_time;
+  const uint64_t start_time_unix_us;
+
+  // Logging thread side
+  std::mutex writer_mutex;
+  RotatingLogFile file;
+  int file_sample_rate;
+  float* track_samples;
+  short* staging;
+  uint8_t* record;
+  FlacEncoder* flac_encoder; // only for WavSampleFormat::flac
+
+  void write_file_header();
+  void write_rate_record(int sample_rate);
+  void write_frame_record(const MultitrackFrame& frame);
+  void write_outstanding_frames_to_file();
+
+  bool has_outstanding_samples() const override {return frames.read_available() > 0;}
+  void set_wake_event(AudioSafeEvent* event) override {wake_event.store(event);}
+  void drain() override {write_outstanding_frames_to_file();}
+
+public:
+  const size_t max_frame_count; // longer callbacks aren't logged
+  const std::string log_directory;
+  const std::string basename;
+  const WavSampleFormat format;
+  const size_t max_file_length;
+
+  // buffer_size is in samples, shared by both tracks
+  MultitrackLogger(WavLoggingService& service, size_t buffer_size, size_t max_frame_count,
+                   const std::string& log_directory, const std::string& basename,
+                   WavSampleFormat format = WavSampleFormat::int16,
+                   size_t max_file_length = MODULATE_MAX_LOG_FILE_LENGTH);
+  ~MultitrackLogger();
+  MultitrackLogger(const MultitrackLogger& other) = delete;
+  MultitrackLogger& operator=(const MultitrackLogger& other) = delete;
+
+  // Audio side, used by one thread at a time.  Every begin_frame that returns true must be
+  // followed by an end_frame, with output nullptr if there's no output for this frame.
+  // If there's no room for both tracks, nothing is logged and the samples are counted as dropped.
+  bool begin_frame(const float* input, size_t pcm_frame_count, int audio_frame_rate, int speaking,
+                   int session, uint64_t callback_index);
+  void end_frame(const float* output);
+  // Counts a frame that couldn't be logged at all, e.g. one too long for the buffers, as dropped
+  void drop_frame(size_t pcm_frame_count) {
+    dropped_samples.fetch_add(MODULATE_MULTITRACK_LOG_TRACKS * pcm_frame_count, std::memory_order_relaxed);
+  }
+  uint64_t get_dropped_samples() const {return dropped_samples.load(std::memory_order_relaxed);}
+
+  // Starts and stops the service draining this logger
+  void start_logging_thread();
+  void stop_logging_thread();
+};
+
+#endif
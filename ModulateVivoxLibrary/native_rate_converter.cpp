@@ -0,0 +1,123 @@
+#include "native_rate_converter.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#define MODULATE_NATIVE_RATE_PI 3.14159265358979323846
+// Where the lowpass cuts off, as a fraction of the model's Nyquist frequency (11kHz)
+#define MODULATE_NATIVE_RATE_CUTOFF 0.9167
+// Kaiser window shape, trading the cutoff's sharpness for stopband rejection (~70dB)
+#define MODULATE_NATIVE_RATE_KAISER_BETA 7.0
+
+// Modified Bessel function of the first kind, order 0, for the Kaiser window
+static double bessel_i0(double x) {
+  double sum = 1.0;
+  double term = 1.0;
+  for(int k = 1; k < 32; k++) {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+  }
+  return sum;
+}
+
+NativeRateConverter::NativeRateConverter(unsigned int max_segment_size, size_t max_frame_count)
+  : kernels(get_audio_kernels()), max_segment_size(max_segment_size), max_frame_count(max_frame_count), factor(0) {
+  memset(decimator_taps, 0, sizeof(decimator_taps));
+  memset(interpolator_taps, 0, sizeof(interpolator_taps));
+  for(int m = 2; m <= MODULATE_NATIVE_RATE_MAX_FACTOR; m++) {
+    const int length = MODULATE_NATIVE_RATE_TAPS_PER_PHASE * m;
+    const double cutoff = MODULATE_NATIVE_RATE_CUTOFF * 0.5 / m; // cycles per input sample
+    const double center = (length - 1) / 2.0;
+    double sum = 0.0;
+    for(int k = 0; k < length; k++) {
+      const double t = k - center;
+      const double sinc = t == 0.0 ? 1.0 : sin(2 * MODULATE_NATIVE_RATE_PI * cutoff * t) / (2 * MODULATE_NATIVE_RATE_PI * cutoff * t);
+      const double r = t / center;
+      const double window = bessel_i0(MODULATE_NATIVE_RATE_KAISER_BETA * sqrt(std::max(0.0, 1.0 - r * r))) /
+                            bessel_i0(MODULATE_NATIVE_RATE_KAISER_BETA);
+      decimator_taps[m][k] = (float)(2 * cutoff * sinc * window);
+      sum += decimator_taps[m][k];
+    }
+    // Unity gain at DC
+    for(int k = 0; k < length; k++)
+      decimator_taps[m][k] = (float)(decimator_taps[m][k] / sum);
+    // Output phase p of the interpolator is m * sum over j of h[p + j*m] * x[n - j]; the
+    // branch is stored reversed so it lines up with the history, oldest first
+    for(int p = 0; p < m; p++)
+      for(int j = 0; j < MODULATE_NATIVE_RATE_TAPS_PER_PHASE; j++)
+        interpolator_taps[m][p][MODULATE_NATIVE_RATE_TAPS_PER_PHASE - 1 - j] = m * decimator_taps[m][p + j * m];
+  }
+
+  const size_t decimator_history = MODULATE_NATIVE_RATE_TAPS_PER_PHASE * MODULATE_NATIVE_RATE_MAX_FACTOR - 1;
+  decimator_buffer = new float[decimator_history + max_frame_count];
+  model_buffer = new float[max_frame_count];
+  interpolator_buffer = new float[MODULATE_NATIVE_RATE_TAPS_PER_PHASE - 1 + max_frame_count];
+  configure(0);
+}
+
+NativeRateConverter::~NativeRateConverter() {
+  delete[] decimator_buffer;
+  delete[] model_buffer;
+  delete[] interpolator_buffer;
+}
+
+void NativeRateConverter::configure(int new_factor) {
+  factor = new_factor;
+  memset(decimator_buffer, 0, sizeof(float)*(MODULATE_NATIVE_RATE_TAPS_PER_PHASE * MODULATE_NATIVE_RATE_MAX_FACTOR - 1));
+  memset(interpolator_buffer, 0, sizeof(float)*(MODULATE_NATIVE_RATE_TAPS_PER_PHASE - 1));
+}
+
+void NativeRateConverter::reset() {
+  configure(factor);
+}
+
+bool NativeRateConverter::supports(int audio_frame_rate, size_t pcm_frame_count) const {
+  if(audio_frame_rate <= 0 || audio_frame_rate % MODULATE_MODEL_SAMPLE_RATE || pcm_frame_count > max_frame_count)
+    return false;
+  const int m = audio_frame_rate / MODULATE_MODEL_SAMPLE_RATE;
+  return m <= MODULATE_NATIVE_RATE_MAX_FACTOR && pcm_frame_count % m == 0 && pcm_frame_count / m <= max_segment_size;
+}
+
+int NativeRateConverter::generate(void* voice_skin, const float* input, float* output, size_t pcm_frame_count,
+                                  int audio_frame_rate, const modulate_parameters* params) {
+  if(!supports(audio_frame_rate, pcm_frame_count))
+    return 1;
+  const int m = audio_frame_rate / MODULATE_MODEL_SAMPLE_RATE;
+  if(m == 1)
+    return modulate_voice_skin_generate(voice_skin, input, (unsigned int)pcm_frame_count, output, params);
+  // A new rate starts the filters from silence, as the helper's resampler would glitch too
+  if(m != factor)
+    configure(m);
+
+  // Decimate: model sample n is the filter centred just before input sample (n + 1) * m
+  const size_t length = MODULATE_NATIVE_RATE_TAPS_PER_PHASE * m;
+  const size_t decimator_history = length - 1;
+  const size_t model_count = pcm_frame_count / m;
+  memcpy(decimator_buffer + decimator_history, input, sizeof(float)*pcm_frame_count);
+  for(size_t n = 0; n < model_count; n++)
+    model_buffer[n] = kernels.dot_product(decimator_taps[m], decimator_buffer + (n + 1) * m - 1, length);
+  memmove(decimator_buffer, decimator_buffer + pcm_frame_count, sizeof(float)*decimator_history);
+
+  const int error_code = modulate_voice_skin_generate(voice_skin, model_buffer, (unsigned int)model_count, model_buffer, params);
+  if(error_code)
+    return error_code;
+
+  // Interpolate: each model sample gives m output samples, one per polyphase branch
+  const size_t interpolator_history = MODULATE_NATIVE_RATE_TAPS_PER_PHASE - 1;
+  memcpy(interpolator_buffer + interpolator_history, model_buffer, sizeof(float)*model_count);
+  for(size_t n = 0; n < model_count; n++)
+    for(int p = 0; p < m; p++)
+      output[n * m + p] = kernels.dot_product(interpolator_taps[m][p], interpolator_buffer + n,
+                                              MODULATE_NATIVE_RATE_TAPS_PER_PHASE);
+  memmove(interpolator_buffer, interpolator_buffer + model_count, sizeof(float)*interpolator_history);
+  return 0;
+}
+
+size_t NativeRateConverter::get_latency_samples(int audio_frame_rate) {
+  const int m = audio_frame_rate / MODULATE_MODEL_SAMPLE_RATE;
+  if(m <= 1)
+    return 0;
+  // Each filter delays by half its length; the decimator's output sits m - 1 samples later
+  return (size_t)(MODULATE_NATIVE_RATE_TAPS_PER_PHASE * m - m);
+}
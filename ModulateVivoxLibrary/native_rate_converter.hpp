@@ -0,0 +1,66 @@
+#ifndef MODULATE_NATIVE_RATE_CONVERTER_HPP
+#define MODULATE_NATIVE_RATE_CONVERTER_HPP
+
+#include <cstddef>
+
+#include "modulate/modulate.h"
+#include "audio_kernels.hpp"
+
+// The rate voice skins run at through the low-level API
+#define MODULATE_MODEL_SAMPLE_RATE 24000
+// Highest rate the fast path takes, as a multiple of the model's (96kHz)
+#define MODULATE_NATIVE_RATE_MAX_FACTOR 4
+// Filter taps per polyphase branch - more gives a sharper cutoff, and more latency
+#define MODULATE_NATIVE_RATE_TAPS_PER_PHASE 32
+
+// Converts audio at a whole multiple of the model's rate (48kHz, almost always) with the
+// low-level modulate_voice_skin_generate, instead of going through a voice skin helper.
+//
+// The input is decimated to 24kHz, converted, and interpolated back up, each with a
+// windowed-sinc FIR run as a polyphase filter, so only the samples that are kept are
+// computed.  Unlike the helper's resampler, which has to cope with any rate at any time,
+// these have a fixed latency (get_latency_samples) and don't buffer across frames, so a
+// frame's output is always a whole frame.  Frames the fast path can't take - another rate,
+// or a frame that isn't a whole number of 24kHz samples - go through the helper instead.
+//
+// Only the thread converting the session's audio may call generate.
+class NativeRateConverter {
+private:
+  const AudioKernels& kernels;
+  const unsigned int max_segment_size;
+  const size_t max_frame_count;
+
+  // Lowpass prototypes, by factor, each MODULATE_NATIVE_RATE_TAPS_PER_PHASE * factor long.
+  // The decimator uses the prototype as it is (it's symmetric), the interpolator one
+  // reversed branch per output phase, scaled by the factor.
+  float decimator_taps[MODULATE_NATIVE_RATE_MAX_FACTOR + 1][MODULATE_NATIVE_RATE_TAPS_PER_PHASE * MODULATE_NATIVE_RATE_MAX_FACTOR];
+  float interpolator_taps[MODULATE_NATIVE_RATE_MAX_FACTOR + 1][MODULATE_NATIVE_RATE_MAX_FACTOR][MODULATE_NATIVE_RATE_TAPS_PER_PHASE];
+
+  // Each filter's history, followed by the frame being filtered
+  int factor;
+  float* decimator_buffer;
+  float* model_buffer;
+  float* interpolator_buffer;
+
+  void configure(int new_factor);
+
+public:
+  NativeRateConverter(unsigned int max_segment_size, size_t max_frame_count);
+  ~NativeRateConverter();
+  NativeRateConverter(const NativeRateConverter& other) = delete;
+  NativeRateConverter& operator=(const NativeRateConverter& other) = delete;
+
+  // Whether a frame can be converted here rather than by a voice skin helper
+  bool supports(int audio_frame_rate, size_t pcm_frame_count) const;
+  // Converts like modulate_voice_skin_helper_generate, for a frame supports accepts.
+  // input and output may be the same.
+  int generate(void* voice_skin, const float* input, float* output, size_t pcm_frame_count,
+               int audio_frame_rate, const modulate_parameters* params);
+  // Clears the filters' history, as at the start of a new stream
+  void reset();
+
+  // The delay the resampling adds, at audio_frame_rate, for a rate supports accepts
+  static size_t get_latency_samples(int audio_frame_rate);
+};
+
+#endif
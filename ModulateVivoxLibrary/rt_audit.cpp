@@ -0,0 +1,372 @@
+#include "rt_audit.hpp"
+
+#ifdef MODULATE_RT_AUDIT
+
+#include <atomic>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <execinfo.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#endif
+
+struct RtAuditSlot {
+  std::atomic<int> state; // 0 free, 1 being filled in, 2 filled in
+  std::atomic<uint64_t> count;
+  RtAuditViolation violation;
+};
+
+static RtAuditSlot slots[MODULATE_RT_AUDIT_MAX_VIOLATIONS];
+// Violations that didn't fit in the table
+static std::atomic<uint64_t> overflow_count(0);
+
+// Plain pointers, so that the interposed malloc can read them without TLS setup allocating
+static thread_local const char* current_callback = nullptr;
+// Set while recording, so that whatever recording itself calls isn't recorded
+static thread_local bool recording = false;
+
+static int capture_stack(void** stack, int depth) {
+#ifdef _WIN32
+  return (int)CaptureStackBackTrace(0, (DWORD)depth, stack, nullptr);
+#else
+  return backtrace(stack, depth);
+#endif
+}
+
+// The first backtrace loads the unwinder, which allocates - better at startup than mid-report
+static const int stack_capture_warm_up = [] {
+  void* stack[1];
+  return capture_stack(stack, 1);
+}();
+
+RtAuditScope::RtAuditScope(const char* callback) : outer_callback(current_callback) {
+  current_callback = callback;
+}
+
+RtAuditScope::~RtAuditScope() {
+  current_callback = outer_callback;
+}
+
+void rt_audit_record(const char* operation) {
+  const char* callback = current_callback;
+  if(!callback || recording)
+    return;
+  recording = true;
+  for(size_t i = 0; i < MODULATE_RT_AUDIT_MAX_VIOLATIONS; i++) {
+    RtAuditSlot& slot = slots[i];
+    int state = slot.state.load(std::memory_order_acquire);
+    if(state == 0 && slot.state.compare_exchange_strong(state, 1, std::memory_order_acquire)) {
+      slot.violation.operation = operation;
+      slot.violation.callback = callback;
+      slot.violation.stack_depth = capture_stack(slot.violation.stack, MODULATE_RT_AUDIT_STACK_DEPTH);
+      slot.count.store(1, std::memory_order_relaxed);
+      slot.state.store(2, std::memory_order_release);
+      recording = false;
+      return;
+    }
+    // Another thread is filling this one in, maybe with the same violation
+    while(state == 1)
+      state = slot.state.load(std::memory_order_acquire);
+    if(strcmp(slot.violation.operation, operation) == 0 && strcmp(slot.violation.callback, callback) == 0) {
+      slot.count.fetch_add(1, std::memory_order_relaxed);
+      recording = false;
+      return;
+    }
+  }
+  overflow_count.fetch_add(1, std::memory_order_relaxed);
+  recording = false;
+}
+
+size_t rt_audit_get_violations(RtAuditViolation* violations, size_t max_count) {
+  size_t found = 0;
+  for(size_t i = 0; i < MODULATE_RT_AUDIT_MAX_VIOLATIONS; i++) {
+    if(slots[i].state.load(std::memory_order_acquire) != 2)
+      continue;
+    if(found < max_count) {
+      violations[found] = slots[i].violation;
+      violations[found].count = slots[i].count.load(std::memory_order_relaxed);
+    }
+    found++;
+  }
+  return found;
+}
+
+uint64_t rt_audit_get_violation_count() {
+  uint64_t total = overflow_count.load(std::memory_order_relaxed);
+  for(size_t i = 0; i < MODULATE_RT_AUDIT_MAX_VIOLATIONS; i++)
+    if(slots[i].state.load(std::memory_order_acquire) == 2)
+      total += slots[i].count.load(std::memory_order_relaxed);
+  return total;
+}
+
+void rt_audit_reset() {
+  for(size_t i = 0; i < MODULATE_RT_AUDIT_MAX_VIOLATIONS; i++)
+    slots[i].state.store(0, std::memory_order_release);
+  overflow_count.store(0, std::memory_order_relaxed);
+}
+
+void rt_audit_print_report(FILE* f) {
+  for(size_t i = 0; i < MODULATE_RT_AUDIT_MAX_VIOLATIONS; i++) {
+    const RtAuditSlot& slot = slots[i];
+    if(slot.state.load(std::memory_order_acquire) != 2)
+      continue;
+    fprintf(f, "%s in %s, %llu times, first from:\n", slot.violation.operation, slot.violation.callback,
+            (unsigned long long)slot.count.load(std::memory_order_relaxed));
+#ifdef _WIN32
+    for(int j = 0; j < slot.violation.stack_depth; j++)
+      fprintf(f, "  %p\n", slot.violation.stack[j]);
+#else
+    // Symbolized straight to the file, without allocating
+    fflush(f);
+    backtrace_symbols_fd(slot.violation.stack, slot.violation.stack_depth, fileno(f));
+#endif
+  }
+  if(overflow_count.load(std::memory_order_relaxed))
+    fprintf(f, "%llu more violations that didn't fit in the table\n",
+            (unsigned long long)overflow_count.load(std::memory_order_relaxed));
+}
+
+// Allocation
+
+#ifdef __linux__
+extern "C" {
+  void* __libc_malloc(size_t size);
+  void* __libc_calloc(size_t count, size_t size);
+  void* __libc_realloc(void* pointer, size_t size);
+  void* __libc_memalign(size_t alignment, size_t size);
+  void __libc_free(void* pointer);
+}
+#define RT_AUDIT_RAW_MALLOC __libc_malloc
+#define RT_AUDIT_RAW_FREE __libc_free
+#else
+#define RT_AUDIT_RAW_MALLOC malloc
+#define RT_AUDIT_RAW_FREE free
+#endif
+
+static void* audited_allocate(size_t size, const char* operation) {
+  rt_audit_record(operation);
+  return RT_AUDIT_RAW_MALLOC(size ? size : 1);
+}
+
+static void audited_free(void* pointer, const char* operation) {
+  if(!pointer)
+    return;
+  rt_audit_record(operation);
+  RT_AUDIT_RAW_FREE(pointer);
+}
+
+void* operator new(size_t size) {
+  void* pointer = audited_allocate(size, "operator new");
+  if(!pointer)
+    throw std::bad_alloc();
+  return pointer;
+}
+
+void* operator new[](size_t size) {
+  void* pointer = audited_allocate(size, "operator new[]");
+  if(!pointer)
+    throw std::bad_alloc();
+  return pointer;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return audited_allocate(size, "operator new");
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return audited_allocate(size, "operator new[]");
+}
+
+void operator delete(void* pointer) noexcept {
+  audited_free(pointer, "operator delete");
+}
+
+void operator delete[](void* pointer) noexcept {
+  audited_free(pointer, "operator delete[]");
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+  audited_free(pointer, "operator delete");
+}
+
+void operator delete[](void* pointer, size_t) noexcept {
+  audited_free(pointer, "operator delete[]");
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) noexcept {
+  audited_free(pointer, "operator delete");
+}
+
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept {
+  audited_free(pointer, "operator delete[]");
+}
+
+#ifdef __linux__
+
+// The C library's own versions, looked up on first use since they can be called before
+// static initialization has got this far
+#define RT_AUDIT_REAL(name) \
+  static decltype(&::name) real_##name = nullptr; \
+  if(!real_##name) \
+    real_##name = (decltype(&::name))dlsym(RTLD_NEXT, #name)
+
+extern "C" {
+
+void* malloc(size_t size) {
+  rt_audit_record("malloc");
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+  rt_audit_record("calloc");
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) {
+  rt_audit_record("realloc");
+  return __libc_realloc(pointer, size);
+}
+
+void free(void* pointer) {
+  if(pointer)
+    rt_audit_record("free");
+  __libc_free(pointer);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+  rt_audit_record("aligned_alloc");
+  return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** pointer, size_t alignment, size_t size) {
+  rt_audit_record("posix_memalign");
+  if(alignment % sizeof(void*) || (alignment & (alignment - 1)))
+    return EINVAL;
+  *pointer = __libc_memalign(alignment, size);
+  return *pointer ? 0 : ENOMEM;
+}
+
+// Locks
+
+int pthread_mutex_lock(pthread_mutex_t* mutex) {
+  rt_audit_record("pthread_mutex_lock");
+  RT_AUDIT_REAL(pthread_mutex_lock);
+  return real_pthread_mutex_lock(mutex);
+}
+
+// File and stream I/O
+
+int open(const char* path, int flags, ...) {
+  rt_audit_record("open");
+  RT_AUDIT_REAL(open);
+  va_list args;
+  va_start(args, flags);
+  const mode_t mode = (flags & (O_CREAT | O_TMPFILE)) ? va_arg(args, mode_t) : 0;
+  va_end(args);
+  return real_open(path, flags, mode);
+}
+
+int close(int fd) {
+  rt_audit_record("close");
+  RT_AUDIT_REAL(close);
+  return real_close(fd);
+}
+
+ssize_t read(int fd, void* buffer, size_t count) {
+  rt_audit_record("read");
+  RT_AUDIT_REAL(read);
+  return real_read(fd, buffer, count);
+}
+
+ssize_t write(int fd, const void* buffer, size_t count) {
+  rt_audit_record("write");
+  RT_AUDIT_REAL(write);
+  return real_write(fd, buffer, count);
+}
+
+FILE* fopen(const char* path, const char* mode) {
+  rt_audit_record("fopen");
+  RT_AUDIT_REAL(fopen);
+  return real_fopen(path, mode);
+}
+
+FILE* fopen64(const char* path, const char* mode) {
+  rt_audit_record("fopen");
+  RT_AUDIT_REAL(fopen64);
+  return real_fopen64(path, mode);
+}
+
+int fclose(FILE* f) {
+  rt_audit_record("fclose");
+  RT_AUDIT_REAL(fclose);
+  return real_fclose(f);
+}
+
+size_t fread(void* buffer, size_t size, size_t count, FILE* f) {
+  rt_audit_record("fread");
+  RT_AUDIT_REAL(fread);
+  return real_fread(buffer, size, count, f);
+}
+
+size_t fwrite(const void* buffer, size_t size, size_t count, FILE* f) {
+  rt_audit_record("fwrite");
+  RT_AUDIT_REAL(fwrite);
+  return real_fwrite(buffer, size, count, f);
+}
+
+int fputs(const char* s, FILE* f) {
+  rt_audit_record("fputs");
+  RT_AUDIT_REAL(fputs);
+  return real_fputs(s, f);
+}
+
+int fputc(int c, FILE* f) {
+  rt_audit_record("fputc");
+  RT_AUDIT_REAL(fputc);
+  return real_fputc(c, f);
+}
+
+int putc(int c, FILE* f) {
+  rt_audit_record("putc");
+  RT_AUDIT_REAL(putc);
+  return real_putc(c, f);
+}
+
+int fflush(FILE* f) {
+  rt_audit_record("fflush");
+  RT_AUDIT_REAL(fflush);
+  return real_fflush(f);
+}
+
+int vfprintf(FILE* f, const char* format, va_list args) {
+  rt_audit_record("vfprintf");
+  RT_AUDIT_REAL(vfprintf);
+  return real_vfprintf(f, format, args);
+}
+
+int fprintf(FILE* f, const char* format, ...) {
+  rt_audit_record("fprintf");
+  RT_AUDIT_REAL(vfprintf);
+  va_list args;
+  va_start(args, format);
+  const int result = real_vfprintf(f, format, args);
+  va_end(args);
+  return result;
+}
+
+}
+
+#endif
+
+#endif
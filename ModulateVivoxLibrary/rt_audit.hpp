@@ -0,0 +1,61 @@
+#ifndef MODULATE_RT_AUDIT_HPP
+#define MODULATE_RT_AUDIT_HPP
+
+// Real-time safety audit of the audio callbacks.  In a build with MODULATE_RT_AUDIT defined,
+// allocation (operator new and delete, and on Linux malloc and friends), mutex locks and file
+// and stream I/O are interposed, and any made from inside an audited function - one marked
+// with MODULATE_RT_AUDIT_SCOPE - is recorded as a violation, with the stack it came from.
+// Each distinct operation and function is recorded once, with a count.
+//
+// On Windows only operator new and delete are interposed; the C library and locks are only
+// audited on Linux.  Without MODULATE_RT_AUDIT none of this is compiled in.
+
+#ifdef MODULATE_RT_AUDIT
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#define MODULATE_RT_AUDIT_MAX_VIOLATIONS 64
+#define MODULATE_RT_AUDIT_STACK_DEPTH 32
+
+struct RtAuditViolation {
+  const char* operation; // e.g. "operator new", "pthread_mutex_lock", "fwrite"
+  const char* callback;  // the audited function it was made from
+  uint64_t count;
+  // Where it first happened
+  void* stack[MODULATE_RT_AUDIT_STACK_DEPTH];
+  int stack_depth;
+};
+
+// Marks the calling thread as being inside an audited function until destroyed
+class RtAuditScope {
+private:
+  const char* outer_callback;
+public:
+  explicit RtAuditScope(const char* callback);
+  ~RtAuditScope();
+  RtAuditScope(const RtAuditScope& other) = delete;
+  RtAuditScope& operator=(const RtAuditScope& other) = delete;
+};
+
+// Called by the interposed functions.  Does nothing outside an audited function.
+void rt_audit_record(const char* operation);
+
+// Copies out up to max_count of the violations so far, returning how many there are
+size_t rt_audit_get_violations(RtAuditViolation* violations, size_t max_count);
+// Total of every violation's count
+uint64_t rt_audit_get_violation_count();
+void rt_audit_reset();
+// Writes each violation and its stack to f
+void rt_audit_print_report(FILE* f);
+
+#define MODULATE_RT_AUDIT_SCOPE(callback) RtAuditScope modulate_rt_audit_scope(callback)
+
+#else
+
+#define MODULATE_RT_AUDIT_SCOPE(callback)
+
+#endif
+
+#endif
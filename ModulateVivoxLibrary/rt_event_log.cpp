@@ -0,0 +1,229 @@
+#include "rt_event_log.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <iostream>
+
+static uint64_t steady_now_ns() {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t system_now_us() {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Local time to the millisecond, as at the start of every line
+static void format_timestamp(uint64_t timestamp_us, char* buffer, size_t size) {
+  const time_t seconds = (time_t)(timestamp_us / 1000000);
+  struct tm local_time;
+#ifdef _WIN32
+  localtime_s(&local_time, &seconds);
+#else
+  localtime_r(&seconds, &local_time);
+#endif
+  char time_and_date[32];
+  strftime(time_and_date, sizeof(time_and_date), "%Y-%m-%d %H:%M:%S", &local_time);
+  snprintf(buffer, size, "%s.%03d", time_and_date, (int)(timestamp_us / 1000 % 1000));
+}
+
+static size_t round_up_to_power_of_two(size_t value) {
+  size_t result = 1;
+  while(result < value)
+    result <<= 1;
+  return result;
+}
+
+RtEventLog::RtEventLog(size_t min_capacity, int _sessions, const char* log_dir) :
+  capacity(round_up_to_power_of_two(min_capacity)),
+  mask(round_up_to_power_of_two(min_capacity) - 1),
+  enqueue_position(0),
+  dequeue_position(0),
+  sessions(_sessions),
+  interval_ns((uint64_t)MODULATE_RT_EVENT_LOG_INTERVAL_MS * 1000000),
+  dropped_events(0),
+  reported_dropped_events(0),
+  path(log_dir && log_dir[0] ? std::string(log_dir) + "/audio_events.log" : std::string()),
+  running(false) {
+  slots = new Slot[capacity];
+  for(size_t i = 0; i < capacity; i++)
+    slots[i].sequence.store(i, std::memory_order_relaxed);
+  const size_t rate_limit_count = (size_t)RtEventCode::count * (size_t)RtEventSource::count * sessions;
+  rate_limits = new RateLimit[rate_limit_count];
+  for(size_t i = 0; i < rate_limit_count; i++) {
+    rate_limits[i].last_logged_ns.store(0, std::memory_order_relaxed);
+    rate_limits[i].suppressed.store(0, std::memory_order_relaxed);
+  }
+}
+
+RtEventLog::~RtEventLog() {
+  stop();
+  delete[] slots;
+  delete[] rate_limits;
+}
+
+void RtEventLog::start() {
+  if(running.exchange(true))
+    return;
+  if(!path.empty()) {
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+    file.open(path, std::ios::app);
+  }
+  drain_thread = std::thread(&RtEventLog::run_drain_thread, this);
+}
+
+void RtEventLog::stop() {
+  if(!running.exchange(false))
+    return;
+  wake_event.signal();
+  drain_thread.join();
+  file.close();
+}
+
+bool RtEventLog::push(const RtEvent& event) {
+  uint64_t position = enqueue_position.load(std::memory_order_relaxed);
+  Slot* slot;
+  for(;;) {
+    slot = &slots[position & mask];
+    const uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+    const int64_t difference = (int64_t)(sequence - position);
+    if(difference == 0) {
+      if(enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+        break;
+    } else if(difference < 0) {
+      // The drain thread hasn't got to this slot since it was last used
+      return false;
+    } else {
+      position = enqueue_position.load(std::memory_order_relaxed);
+    }
+  }
+  slot->event = event;
+  slot->sequence.store(position + 1, std::memory_order_release);
+  return true;
+}
+
+bool RtEventLog::pop(RtEvent& event) {
+  Slot& slot = slots[dequeue_position & mask];
+  if(slot.sequence.load(std::memory_order_acquire) != dequeue_position + 1)
+    return false;
+  event = slot.event;
+  slot.sequence.store(dequeue_position + capacity, std::memory_order_release);
+  dequeue_position++;
+  return true;
+}
+
+void RtEventLog::post(RtEventCode code, RtEventSource source, int session, int detail, int pcm_frame_count,
+                      int audio_frame_rate) {
+  if(session < 0 || session >= sessions)
+    return;
+  RateLimit& limit = rate_limits[((int)code * (int)RtEventSource::count + (int)source) * sessions + session];
+  const uint64_t now = steady_now_ns();
+  uint64_t last = limit.last_logged_ns.load(std::memory_order_relaxed);
+  if((last && now - last < interval_ns.load(std::memory_order_relaxed)) ||
+     !limit.last_logged_ns.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+    limit.suppressed.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  RtEvent event;
+  event.code = code;
+  event.source = source;
+  event.session = session;
+  event.detail = detail;
+  event.pcm_frame_count = pcm_frame_count;
+  event.audio_frame_rate = audio_frame_rate;
+  event.timestamp_us = system_now_us();
+  event.repeats = limit.suppressed.exchange(0, std::memory_order_relaxed);
+  if(!push(event)) {
+    dropped_events.fetch_add(1 + event.repeats, std::memory_order_relaxed);
+    return;
+  }
+  wake_event.signal();
+}
+
+void RtEventLog::run_drain_thread() {
+  std::ostream& out = file.is_open() ? (std::ostream&)file : std::cerr;
+  while(running.load()) {
+    wake_event.wait_for(std::chrono::milliseconds(MODULATE_RT_EVENT_LOG_DRAIN_TIMEOUT_MS));
+    drain(out);
+  }
+  drain(out);
+}
+
+void RtEventLog::drain(std::ostream& out) {
+  bool wrote = false;
+  RtEvent event;
+  while(pop(event)) {
+    write_event(out, event);
+    wrote = true;
+  }
+
+  // Repeats of events that have since stopped would otherwise never be reported
+  const uint64_t now = steady_now_ns();
+  const uint64_t interval = interval_ns.load(std::memory_order_relaxed);
+  for(int code = 0; code < (int)RtEventCode::count; code++) {
+    for(int source = 0; source < (int)RtEventSource::count; source++) {
+      for(int session = 0; session < sessions; session++) {
+        RateLimit& limit = rate_limits[(code * (int)RtEventSource::count + source) * sessions + session];
+        if(!limit.suppressed.load(std::memory_order_relaxed) ||
+           now - limit.last_logged_ns.load(std::memory_order_relaxed) < interval)
+          continue;
+        const uint64_t repeats = limit.suppressed.exchange(0, std::memory_order_relaxed);
+        if(!repeats)
+          continue;
+        char timestamp[48], line[256];
+        format_timestamp(system_now_us(), timestamp, sizeof(timestamp));
+        snprintf(line, sizeof(line), "%s %s, session %d: %llu more of \"%s\" since the last logged\n", timestamp,
+                 describe((RtEventSource)source), session, (unsigned long long)repeats, describe((RtEventCode)code));
+        out << line;
+        wrote = true;
+      }
+    }
+  }
+
+  const uint64_t dropped = dropped_events.load(std::memory_order_relaxed);
+  if(dropped != reported_dropped_events) {
+    char timestamp[48];
+    format_timestamp(system_now_us(), timestamp, sizeof(timestamp));
+    out << timestamp << " " << dropped - reported_dropped_events << " audio events dropped with the queue full\n";
+    reported_dropped_events = dropped;
+    wrote = true;
+  }
+  if(wrote)
+    out.flush();
+}
+
+void RtEventLog::write_event(std::ostream& out, const RtEvent& event) {
+  char timestamp[48];
+  format_timestamp(event.timestamp_us, timestamp, sizeof(timestamp));
+  char line[256];
+  int length = snprintf(line, sizeof(line), "%s %s, session %d: %s", timestamp, describe(event.source), event.session,
+                        describe(event.code));
+  if(event.code == RtEventCode::voice_skin_failed)
+    length += snprintf(line + length, sizeof(line) - length, " with error code %d", event.detail);
+  length += snprintf(line + length, sizeof(line) - length, " (%d samples at %dHz)", event.pcm_frame_count,
+                     event.audio_frame_rate);
+  if(event.repeats)
+    length += snprintf(line + length, sizeof(line) - length, ", and %llu more since the last logged",
+                       (unsigned long long)event.repeats);
+  out << line << "\n";
+}
+
+const char* RtEventLog::describe(RtEventCode code) {
+  switch(code) {
+    case RtEventCode::voice_skin_failed: return "voice skin failed";
+    case RtEventCode::frame_too_long: return "frame too long to convert, sent silence";
+    default: return "unknown event";
+  }
+}
+
+const char* RtEventLog::describe(RtEventSource source) {
+  switch(source) {
+    case RtEventSource::capture_callback: return "capture callback";
+    case RtEventSource::render_callback: return "render callback";
+    case RtEventSource::pipeline_worker: return "pipeline worker";
+    default: return "unknown source";
+  }
+}
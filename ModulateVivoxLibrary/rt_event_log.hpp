@@ -0,0 +1,108 @@
+#ifndef MODULATE_RT_EVENT_LOG_HPP
+#define MODULATE_RT_EVENT_LOG_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include "audio_safe_event.hpp"
+
+// Slots in the queue - far more than rate limiting lets through between two drains
+#define MODULATE_RT_EVENT_LOG_CAPACITY 256
+// Each kind of event from each source and session is logged at most this often
+#define MODULATE_RT_EVENT_LOG_INTERVAL_MS 1000
+#define MODULATE_RT_EVENT_LOG_DRAIN_TIMEOUT_MS 100
+
+enum class RtEventCode : int {
+  voice_skin_failed, // detail is the voice skin's error code
+  frame_too_long,    // a frame was longer than the buffers and went out as silence
+  count
+};
+
+enum class RtEventSource : int {
+  capture_callback,
+  render_callback,
+  pipeline_worker,
+  count
+};
+
+struct RtEvent {
+  RtEventCode code;
+  RtEventSource source;
+  int session;
+  int detail;
+  int pcm_frame_count;
+  int audio_frame_rate;
+  uint64_t timestamp_us; // since the Unix epoch
+  uint64_t repeats;      // events like this one left out since the last one logged
+};
+
+// Reports errors from the audio threads without blocking them.  post records the event in
+// a fixed-size, lock-free queue (any number of producers, one consumer), and a background
+// thread writes the queue out as text to audio_events.log in the log directory.
+//
+// Each kind of event from each source and session is logged at most once per interval; the
+// rest are counted, and the count goes out with the next one logged, or on its own once
+// they stop, so a failure that lasts for every frame is a line a second rather than a
+// write per frame.  If the queue is full the event is dropped, and the count of dropped
+// events is logged instead.
+class RtEventLog {
+private:
+  struct Slot {
+    std::atomic<uint64_t> sequence;
+    RtEvent event;
+  };
+  Slot* slots;
+  const size_t capacity;
+  const size_t mask;
+  alignas(64) std::atomic<uint64_t> enqueue_position;
+  alignas(64) uint64_t dequeue_position; // drain thread only
+
+  // One per code, source and session
+  struct RateLimit {
+    std::atomic<uint64_t> last_logged_ns; // steady clock, 0 if never
+    std::atomic<uint64_t> suppressed;
+  };
+  RateLimit* rate_limits;
+  const int sessions;
+  std::atomic<uint64_t> interval_ns;
+  std::atomic<uint64_t> dropped_events;
+  uint64_t reported_dropped_events; // drain thread only
+
+  const std::string path;
+  std::ofstream file;
+  std::atomic<bool> running;
+  std::thread drain_thread;
+  AudioSafeEvent wake_event;
+
+  bool push(const RtEvent& event);
+  bool pop(RtEvent& event);
+  void run_drain_thread();
+  void drain(std::ostream& out);
+  static void write_event(std::ostream& out, const RtEvent& event);
+
+public:
+  // sessions is the number of session indices events may come from.  With no log
+  // directory, events go to stderr.
+  RtEventLog(size_t capacity, int sessions, const char* log_dir);
+  ~RtEventLog();
+  RtEventLog(const RtEventLog& other) = delete;
+  RtEventLog& operator=(const RtEventLog& other) = delete;
+
+  void start();
+  // Writes out anything still queued
+  void stop();
+
+  // Audio side, from any thread: never blocks or allocates
+  void post(RtEventCode code, RtEventSource source, int session, int detail, int pcm_frame_count, int audio_frame_rate);
+
+  void set_interval_ms(float interval_ms) {interval_ns.store((uint64_t)(interval_ms * 1e6));}
+  uint64_t get_dropped_events() const {return dropped_events.load(std::memory_order_relaxed);}
+  static const char* describe(RtEventCode code);
+  static const char* describe(RtEventSource source);
+};
+
+#endif
@@ -0,0 +1,237 @@
+#include "session_registry.hpp"
+
+#include <cstring>
+#include <thread>
+#include <chrono>
+
+#define EXPECTED_SAMPLE_RATE 48000
+
+SessionContext::SessionContext(int _index, unsigned int max_segment_size, size_t max_frame_count,
+                               size_t echo_capacity, float echo_target_latency_ms, size_t pipeline_capacity,
+                               size_t skin_history_capacity, const ConversionSettings& initial_settings) :
+  index(_index),
+  voice_skin_helper(nullptr),
+  float_buffer(new float[max_frame_count]),
+  echo_buffer(echo_capacity, max_frame_count, echo_target_latency_ms),
+  silence_gate(max_frame_count),
+  skin_switch(max_segment_size, max_frame_count, skin_history_capacity),
+  framing(max_frame_count),
+  pipeline(pipeline_capacity, max_frame_count),
+  callback_count(0),
+  pending_settings(initial_settings),
+  settings(initial_settings),
+  observed_settings_generation(initial_settings.generation),
+  state(free_state),
+  session_key(0),
+  active_callbacks(0) {
+  channel_name[0] = '\0';
+  modulate_voice_skin_helper_create(&voice_skin_helper, max_segment_size);
+  modulate_voice_skin_helper_reset(voice_skin_helper, EXPECTED_SAMPLE_RATE);
+}
+
+SessionContext::~SessionContext() {
+  modulate_voice_skin_helper_destroy(&voice_skin_helper);
+  delete[] float_buffer;
+}
+
+void SessionContext::publish_settings(const ConversionSettings& new_settings) {
+  pending_settings = new_settings;
+  settings.back_buffer() = new_settings;
+  settings.publish();
+}
+
+uint64_t SessionContext::get_observed_settings_generation() {
+  // A context with no callback in flight will pick up the newest settings on its next frame
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(active_callbacks.load() == 0) {
+    if(skin_switch.is_settled(pending_settings.voice_skin))
+      return pending_settings.generation;
+    // Mid-switch.  A streaming session finishes the switch by itself, but one that isn't may
+    // never get round to it, so it's told to drop the outgoing skin on its next frame - unless
+    // a frame started meanwhile, which could already be using that skin.
+    if(skin_switch.is_idle()) {
+      skin_switch.request_cut_over();
+      if(active_callbacks.load() == 0)
+        return pending_settings.generation;
+    }
+  }
+  return observed_settings_generation.load(std::memory_order_acquire);
+}
+
+bool SessionContext::is_reserved_for(const char* name) const {
+  return state.load() != free_state && strncmp(channel_name, name, MODULATE_MAX_CHANNEL_NAME_LENGTH) == 0;
+}
+
+SessionRegistry::SessionRegistry(unsigned int max_segment_size, size_t max_frame_count,
+                                 size_t echo_capacity, float echo_target_latency_ms, size_t pipeline_capacity,
+                                 size_t skin_history_capacity, const ConversionSettings& initial_settings) :
+  unmatched_callbacks(0) {
+  for(size_t i = 0; i < MODULATE_MAX_SESSIONS; i++)
+    contexts[i] = new SessionContext((int)i, max_segment_size, max_frame_count, echo_capacity, echo_target_latency_ms, pipeline_capacity, skin_history_capacity, initial_settings);
+  default_context = new SessionContext(MODULATE_MAX_SESSIONS, max_segment_size, max_frame_count, echo_capacity, echo_target_latency_ms, pipeline_capacity, skin_history_capacity, initial_settings);
+}
+
+SessionRegistry::~SessionRegistry() {
+  for(size_t i = 0; i < MODULATE_MAX_SESSIONS; i++)
+    delete contexts[i];
+  delete default_context;
+}
+
+uint64_t SessionRegistry::hash_handle(const char* session_group_handle) {
+  // FNV-1a - handles are short, so this is cheap enough to do on every callback
+  uint64_t hash = 14695981039346656037ull;
+  for(const char* c = session_group_handle; c && *c; c++) {
+    hash ^= (unsigned char)*c;
+    hash *= 1099511628211ull;
+  }
+  return hash ? hash : 1; // 0 means unbound
+}
+
+bool SessionRegistry::uri_matches_channel(const char* initial_target_uri, const char* channel_name) {
+  // Channel URIs look like sip:confctl-g-issuer.channel_name@domain
+  if(!initial_target_uri || !channel_name[0])
+    return false;
+  const size_t name_length = strlen(channel_name);
+  for(const char* match = strstr(initial_target_uri, channel_name); match; match = strstr(match + 1, channel_name)) {
+    const char before = match == initial_target_uri ? '\0' : match[-1];
+    const char after = match[name_length];
+    if((before == '\0' || before == '.' || before == ':') && (after == '\0' || after == '@'))
+      return true;
+  }
+  return false;
+}
+
+SessionContext* SessionRegistry::reserve(const char* channel_name) {
+  for(size_t i = 0; i < MODULATE_MAX_SESSIONS; i++) {
+    SessionContext* context = contexts[i];
+    if(context->state.load() != SessionContext::free_state)
+      continue;
+    strncpy(context->channel_name, channel_name, MODULATE_MAX_CHANNEL_NAME_LENGTH - 1);
+    context->channel_name[MODULATE_MAX_CHANNEL_NAME_LENGTH - 1] = '\0';
+    context->session_key.store(0);
+    context->state.store(SessionContext::reserved_state);
+    return context;
+  }
+  return nullptr;
+}
+
+size_t SessionRegistry::count_sessions(bool bound_only) const {
+  size_t count = 0;
+  for(size_t i = 0; i < MODULATE_MAX_SESSIONS; i++) {
+    const int state = contexts[i]->state.load(std::memory_order_relaxed);
+    if(bound_only ? state == SessionContext::bound_state : state != SessionContext::free_state)
+      count++;
+  }
+  return count;
+}
+
+void SessionRegistry::wait_for_callbacks() {
+  for(size_t i = 0; i < get_number_of_contexts(); i++) {
+    while(get_context(i).active_callbacks.load() != 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+SessionContext* SessionRegistry::drain(const char* channel_name) {
+  for(size_t i = 0; i < MODULATE_MAX_SESSIONS; i++) {
+    SessionContext* context = contexts[i];
+    int state = context->state.load();
+    // A context already being released belongs to whoever's releasing it
+    if(state == SessionContext::free_state || state == SessionContext::releasing_state ||
+       strncmp(context->channel_name, channel_name, MODULATE_MAX_CHANNEL_NAME_LENGTH))
+      continue;
+
+    // Wait for the audio thread to let go (and for any bind in progress to finish),
+    // after which no new callback can pick this context up
+    while(!context->state.compare_exchange_weak(state, SessionContext::releasing_state)) {
+      if(state == SessionContext::free_state || state == SessionContext::releasing_state)
+        break;
+      if(state == SessionContext::binding_state)
+        state = SessionContext::bound_state;
+      std::this_thread::yield();
+    }
+    if(state == SessionContext::free_state || state == SessionContext::releasing_state)
+      continue;
+    while(context->active_callbacks.load() != 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return context;
+  }
+  return nullptr;
+}
+
+void SessionRegistry::release(SessionContext& context) {
+  // Nothing else touches a drained context, so it's safe to reset it from here
+  modulate_voice_skin_helper_reset(context.voice_skin_helper, EXPECTED_SAMPLE_RATE);
+  context.skin_switch.get_converter().reset();
+  context.framing.reset();
+  context.echo_buffer.discard();
+  context.pipeline.reset();
+  context.silence_gate.reset();
+  context.callback_count = 0;
+  context.session_key.store(0);
+  context.channel_name[0] = '\0';
+  context.state.store(SessionContext::free_state);
+}
+
+bool SessionRegistry::try_bind(SessionContext* context, uint64_t key) {
+  int expected = SessionContext::reserved_state;
+  if(!context->state.compare_exchange_strong(expected, SessionContext::binding_state))
+    return false;
+  context->session_key.store(key);
+  context->state.store(SessionContext::bound_state);
+  return true;
+}
+
+SessionContext& SessionRegistry::acquire(const char* session_group_handle, const char* initial_target_uri) {
+  const uint64_t key = hash_handle(session_group_handle);
+
+  for(int attempt = 0; attempt < 2; attempt++) {
+    for(size_t i = 0; i < MODULATE_MAX_SESSIONS; i++) {
+      SessionContext* context = contexts[i];
+      if(context->session_key.load(std::memory_order_relaxed) != key)
+        continue;
+      context->active_callbacks.fetch_add(1);
+      // Re-check now that we're counted, in case the session is being released
+      if(context->state.load() == SessionContext::bound_state && context->session_key.load() == key)
+        return *context;
+      context->active_callbacks.fetch_sub(1);
+    }
+
+    // First audio for this session group - bind it to the reserved context for its channel,
+    // and only that, since guessing could give one session another's voice skin and settings
+    if(attempt > 0)
+      break;
+    bool bound = false;
+    for(size_t i = 0; i < MODULATE_MAX_SESSIONS && !bound; i++) {
+      SessionContext* context = contexts[i];
+      if(context->state.load() == SessionContext::reserved_state &&
+         uri_matches_channel(initial_target_uri, context->channel_name))
+        bound = try_bind(context, key);
+    }
+    if(!bound)
+      break;
+  }
+
+  unmatched_callbacks.fetch_add(1, std::memory_order_relaxed);
+  default_context->active_callbacks.fetch_add(1);
+  return *default_context;
+}
+
+void SessionRegistry::finish_callback(SessionContext& context) {
+  context.active_callbacks.fetch_sub(1);
+}
+
+SessionContext* SessionRegistry::acquire_index(size_t index) {
+  if(index >= MODULATE_MAX_SESSIONS) {
+    default_context->active_callbacks.fetch_add(1);
+    return default_context;
+  }
+  SessionContext* context = contexts[index];
+  if(context->state.load(std::memory_order_relaxed) != SessionContext::bound_state)
+    return nullptr;
+  context->active_callbacks.fetch_add(1);
+  if(context->state.load() == SessionContext::bound_state)
+    return context;
+  context->active_callbacks.fetch_sub(1);
+  return nullptr;
+}
@@ -0,0 +1,145 @@
+#ifndef MODULATE_SESSION_REGISTRY_HPP
+#define MODULATE_SESSION_REGISTRY_HPP
+
+#include <atomic>
+#include <cstdint>
+
+#include "modulate/modulate.h"
+#include "triple_buffer.hpp"
+#include "echo_buffer.hpp"
+#include "conversion_pipeline.hpp"
+#include "silence_gate.hpp"
+#include "skin_switch.hpp"
+#include "frame_rebuffer.hpp"
+
+#define MODULATE_MAX_SESSIONS 4
+#define MODULATE_MAX_CHANNEL_NAME_LENGTH 128
+
+// Everything the convert function needs to know about the user's current choices.
+// A copy of this is handed to the audio thread as a whole, so that it never sees
+// e.g. a half-updated set of filter strengths.
+struct ConversionSettings {
+  void* voice_skin;
+  modulate_parameters params;
+  SilenceGateSettings gate;
+  uint64_t generation;
+};
+
+// The state needed to convert one Vivox session's audio stream.  Each session gets
+// its own voice skin helper (and so its own resampler state), buffers, echo ring and
+// settings, so that e.g. a party channel and a proximity channel don't corrupt each
+// other's streams.
+//
+// A voice skin also carries internal state, so each session converts with its own copy of
+// it where the app can make one - see ModulateVivoxIntegration::set_voice_skin_copier.
+class SessionContext {
+public:
+  const int index; // position in the registry, with the default context last
+  void* voice_skin_helper;
+  float* float_buffer;
+  EchoBuffer echo_buffer;
+  SilenceGate silence_gate;
+  // Which voice skin the session is heard through - settings.voice_skin is where it's headed
+  SkinSwitch skin_switch;
+  // Cuts the audio into the blocks the voice skin converts
+  FrameRebuffer framing;
+  // Only used in pipelined mode
+  ConversionPipeline pipeline;
+
+  // Frames converted since the session started, counted by the converting thread
+  uint64_t callback_count;
+
+  // Written by the UI side (serialized by the owner), read once per frame by the audio thread
+  ConversionSettings pending_settings;
+  TripleBuffer<ConversionSettings> settings;
+  std::atomic<uint64_t> observed_settings_generation;
+
+  SessionContext(int index, unsigned int max_segment_size, size_t max_frame_count,
+                 size_t echo_capacity, float echo_target_latency_ms, size_t pipeline_capacity,
+                 size_t skin_history_capacity, const ConversionSettings& initial_settings);
+  ~SessionContext();
+  SessionContext(const SessionContext& other) = delete;
+  SessionContext& operator=(const SessionContext& other) = delete;
+
+  void publish_settings(const ConversionSettings& new_settings);
+  // Generation of the settings no callback on this context could still be using
+  uint64_t get_observed_settings_generation();
+  bool is_reserved() const {return state.load() != free_state;}
+  bool is_reserved_for(const char* name) const;
+
+private:
+  friend class SessionRegistry;
+  enum State {free_state, reserved_state, binding_state, bound_state, releasing_state};
+  std::atomic<int> state;
+  std::atomic<uint64_t> session_key;   // hash of the session_group_handle bound to this context
+  std::atomic<int> active_callbacks;   // audio callbacks currently using this context
+  char channel_name[MODULATE_MAX_CHANNEL_NAME_LENGTH];
+};
+
+// A fixed pool of SessionContexts, preallocated so that the audio thread never allocates.
+// Contexts are reserved by channel name when a session is added, and bound to the
+// session_group_handle the first time Vivox delivers audio for that channel.  Audio for
+// anything that can't be matched to a session goes through a default context.
+class SessionRegistry {
+private:
+  SessionContext* contexts[MODULATE_MAX_SESSIONS];
+  SessionContext* default_context;
+  std::atomic<uint64_t> unmatched_callbacks;
+
+  static uint64_t hash_handle(const char* session_group_handle);
+  static bool uri_matches_channel(const char* initial_target_uri, const char* channel_name);
+  bool try_bind(SessionContext* context, uint64_t key);
+
+public:
+  SessionRegistry(unsigned int max_segment_size, size_t max_frame_count,
+                  size_t echo_capacity, float echo_target_latency_ms, size_t pipeline_capacity,
+                  size_t skin_history_capacity, const ConversionSettings& initial_settings);
+  ~SessionRegistry();
+  SessionRegistry(const SessionRegistry& other) = delete;
+  SessionRegistry& operator=(const SessionRegistry& other) = delete;
+
+  // UI side - not safe to call concurrently with each other
+  // Returns nullptr if every context is already in use
+  SessionContext* reserve(const char* channel_name);
+  // Waits for any in-flight callbacks on a context reserved for the channel, after which no
+  // new callback can pick it up, and returns it for release - or nullptr once there are none.
+  // Safe to call alongside the others, so they needn't wait meanwhile, though not alongside
+  // another drain or release of the same channel.
+  SessionContext* drain(const char* channel_name);
+  // Resets a drained context and returns it to the pool
+  void release(SessionContext& context);
+  // Waits until every context has been seen with no callback in flight, so that any callback
+  // that started before this was called has finished.  Unlike drain, new ones may start.
+  void wait_for_callbacks();
+  // Every context that may be used by the audio thread, including the default one
+  size_t get_number_of_contexts() const {return MODULATE_MAX_SESSIONS + 1;}
+  SessionContext& get_context(size_t index) {return index < MODULATE_MAX_SESSIONS ? *contexts[index] : *default_context;}
+  // Sessions added and not yet removed, or with bound_only just those Vivox has delivered
+  // audio for.  Safe to call from any thread, though it may be a moment out of date.
+  size_t count_sessions(bool bound_only) const;
+  // Audio callbacks that went to the default context, not matching any session's channel
+  uint64_t get_unmatched_callbacks() const {return unmatched_callbacks.load(std::memory_order_relaxed);}
+
+  // Audio side - every acquire must be paired with a finish_callback
+  SessionContext& acquire(const char* session_group_handle, const char* initial_target_uri);
+  void finish_callback(SessionContext& context);
+  // Worker side - the context at index if it has a session to convert (or is the default),
+  // otherwise nullptr.  A non-null result must be paired with a finish_callback.
+  SessionContext* acquire_index(size_t index);
+};
+
+// Holds a context for the duration of an audio callback
+class SessionContextLease {
+private:
+  SessionRegistry& registry;
+public:
+  SessionContext& context;
+  SessionContextLease(SessionRegistry& _registry, const char* session_group_handle, const char* initial_target_uri) :
+    registry(_registry),
+    context(_registry.acquire(session_group_handle, initial_target_uri)) {}
+  ~SessionContextLease() {registry.finish_callback(context);}
+  SessionContextLease(const SessionContextLease& other) = delete;
+  SessionContextLease& operator=(const SessionContextLease& other) = delete;
+};
+
+#endif
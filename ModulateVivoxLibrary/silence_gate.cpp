@@ -0,0 +1,128 @@
+#include "silence_gate.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// How much of the audio before an onset goes through the voice skin to warm it up
+#define MODULATE_SILENCE_GATE_WARM_UP_MS 40.0f
+#define MODULATE_SILENCE_GATE_FADE_MS 10.0f
+
+SilenceGate::SilenceGate(size_t _history_capacity) :
+  history(new float[_history_capacity]),
+  history_capacity(_history_capacity),
+  history_position(0),
+  history_count(0),
+  warm_up_buffer(new float[_history_capacity]),
+  is_open(false),
+  silent_ms(0.0f),
+  fade_gain(0.0f),
+  frames(0),
+  skipped_frames(0),
+  skipped_seconds(0.0) {
+}
+
+SilenceGate::~SilenceGate() {
+  delete[] history;
+  delete[] warm_up_buffer;
+}
+
+SilenceGateSettings SilenceGate::default_settings() {
+  SilenceGateSettings settings;
+  settings.enabled = true;
+  settings.threshold_dbfs = -50.0f;
+  settings.hangover_ms = 300.0f;
+  return settings;
+}
+
+GateAction SilenceGate::update(const float* samples, size_t pcm_frame_count, int audio_frame_rate,
+                               bool speaking, const SilenceGateSettings& settings) {
+  frames.fetch_add(1, std::memory_order_relaxed);
+  if(audio_frame_rate <= 0)
+    return GateAction::convert;
+
+  bool speech = speaking || !settings.enabled;
+  if(!speech) {
+    double sum_of_squares = 0.0;
+    for(size_t i = 0; i < pcm_frame_count; i++)
+      sum_of_squares += samples[i] * samples[i];
+    const double level_dbfs = 10.0 * log10(sum_of_squares / std::max(pcm_frame_count, (size_t)1) + 1e-12);
+    speech = level_dbfs > settings.threshold_dbfs;
+  }
+
+  if(speech) {
+    silent_ms = 0.0f;
+    if(is_open)
+      return GateAction::convert;
+    is_open = true;
+    return GateAction::open;
+  }
+
+  if(!is_open) {
+    record_history(samples, pcm_frame_count);
+    fade_gain = 0.0f;
+    skipped_frames.fetch_add(1, std::memory_order_relaxed);
+    // Only this thread writes it, so a plain load and store is enough
+    skipped_seconds.store(skipped_seconds.load(std::memory_order_relaxed) + (double)pcm_frame_count / audio_frame_rate,
+                          std::memory_order_relaxed);
+    return GateAction::skip;
+  }
+
+  silent_ms += 1000.0f * pcm_frame_count / audio_frame_rate;
+  if(silent_ms < settings.hangover_ms)
+    return GateAction::convert;
+  is_open = false;
+  history_count = 0;
+  record_history(samples, pcm_frame_count);
+  return GateAction::close;
+}
+
+void SilenceGate::record_history(const float* samples, size_t pcm_frame_count) {
+  // Only the most recent history_capacity samples matter
+  if(pcm_frame_count > history_capacity) {
+    samples += pcm_frame_count - history_capacity;
+    pcm_frame_count = history_capacity;
+  }
+  const size_t first_segment = std::min(pcm_frame_count, history_capacity - history_position);
+  memcpy(history + history_position, samples, first_segment * sizeof(float));
+  memcpy(history, samples + first_segment, (pcm_frame_count - first_segment) * sizeof(float));
+  history_position = (history_position + pcm_frame_count) % history_capacity;
+  history_count = std::min(history_count + pcm_frame_count, history_capacity);
+}
+
+float* SilenceGate::get_warm_up_audio(size_t& count, int audio_frame_rate) {
+  count = std::min(history_count, (size_t)(MODULATE_SILENCE_GATE_WARM_UP_MS * audio_frame_rate / 1000));
+  const size_t start = (history_position + history_capacity - count) % history_capacity;
+  const size_t first_segment = std::min(count, history_capacity - start);
+  memcpy(warm_up_buffer, history + start, first_segment * sizeof(float));
+  memcpy(warm_up_buffer + first_segment, history, (count - first_segment) * sizeof(float));
+  history_count = 0;
+  return warm_up_buffer;
+}
+
+void SilenceGate::apply_fade(float* samples, size_t pcm_frame_count, int audio_frame_rate) {
+  const float target = is_open ? 1.0f : 0.0f;
+  if(fade_gain == target || audio_frame_rate <= 0)
+    return;
+  const float step = 1000.0f / (MODULATE_SILENCE_GATE_FADE_MS * audio_frame_rate);
+  for(size_t i = 0; i < pcm_frame_count; i++) {
+    fade_gain = target > fade_gain ? std::min(target, fade_gain + step) : std::max(target, fade_gain - step);
+    samples[i] *= fade_gain;
+  }
+}
+
+void SilenceGate::reset() {
+  is_open = false;
+  silent_ms = 0.0f;
+  fade_gain = 0.0f;
+  history_position = 0;
+  history_count = 0;
+}
+
+SilenceGateStats SilenceGate::get_stats() const {
+  SilenceGateStats stats;
+  stats.frames = frames.load(std::memory_order_relaxed);
+  stats.skipped_frames = skipped_frames.load(std::memory_order_relaxed);
+  stats.skipped_seconds = skipped_seconds.load(std::memory_order_relaxed);
+  return stats;
+}
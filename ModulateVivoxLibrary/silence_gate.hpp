@@ -0,0 +1,77 @@
+#ifndef MODULATE_SILENCE_GATE_HPP
+#define MODULATE_SILENCE_GATE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+struct SilenceGateSettings {
+  bool enabled;
+  float threshold_dbfs; // frames louder than this count as speech even if Vivox disagrees
+  float hangover_ms;    // how long the gate stays open after the last speech
+};
+
+struct SilenceGateStats {
+  uint64_t frames;
+  uint64_t skipped_frames;
+  double skipped_seconds; // audio that didn't go through the voice skin
+};
+
+// What convert should do with a frame
+enum class GateAction {
+  convert, // the gate is open
+  open,    // speech is starting: warm the voice skin up on the history, then convert and fade in
+  close,   // speech has stopped: convert one last frame and fade it out
+  skip     // the gate is closed: output silence without running the voice skin
+};
+
+// Decides which frames need the voice skin at all.  A frame is speech if Vivox says the
+// user is speaking or its energy is above the threshold, and the gate stays open for a
+// hangover period after the last speech so that quiet word endings aren't cut off.
+// While closed, the gate keeps a short history of the input, which is fed through the
+// voice skin (and thrown away) when it opens so that the model starts from a warm state,
+// and the converted audio is faded in so that onsets don't click.
+//
+// Used only by the thread that converts a session's audio.
+class SilenceGate {
+private:
+  float* history;
+  const size_t history_capacity;
+  size_t history_position;
+  size_t history_count;
+  float* warm_up_buffer;
+
+  bool is_open;
+  float silent_ms;
+  float fade_gain;
+
+  std::atomic<uint64_t> frames;
+  std::atomic<uint64_t> skipped_frames;
+  std::atomic<double> skipped_seconds;
+
+  void record_history(const float* samples, size_t pcm_frame_count);
+
+public:
+  // history_capacity is the most audio fed through the voice skin when the gate opens
+  explicit SilenceGate(size_t history_capacity);
+  ~SilenceGate();
+  SilenceGate(const SilenceGate& other) = delete;
+  SilenceGate& operator=(const SilenceGate& other) = delete;
+
+  static SilenceGateSettings default_settings();
+
+  GateAction update(const float* samples, size_t pcm_frame_count, int audio_frame_rate,
+                    bool speaking, const SilenceGateSettings& settings);
+
+  // After update returns open: the audio from just before this frame, oldest first.
+  // The buffer may be converted in place.
+  float* get_warm_up_audio(size_t& count, int audio_frame_rate);
+  // Applies the fade in or out to the converted frame
+  void apply_fade(float* samples, size_t pcm_frame_count, int audio_frame_rate);
+
+  // Back to closed, with no history, e.g. for a new session
+  void reset();
+  SilenceGateStats get_stats() const;
+};
+
+#endif
@@ -0,0 +1,335 @@
+#include "skin_switch.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include <utility>
+
+#define EXPECTED_SAMPLE_RATE 48000
+#define MODULATE_SKIN_SWITCH_PRIME_MS 300.0f
+#define MODULATE_SKIN_SWITCH_CROSSFADE_MS 30.0f
+// Priming rounds before the audio thread is left to feed in the rest, however much that is
+#define MODULATE_SKIN_SWITCH_MAX_PRIME_ROUNDS 4
+// How long to wait for the audio thread to hand over input before assuming none is flowing
+#define MODULATE_SKIN_SWITCH_SNAPSHOT_TIMEOUT_MS 50
+// A session with no input for this long isn't streaming
+#define MODULATE_SKIN_SWITCH_IDLE_MS 200
+#define MODULATE_SKIN_SWITCH_HALF_PI 1.57079632679489661923f
+
+static int64_t get_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+SkinSwitch::SkinSwitch(unsigned int max_segment_size, size_t _max_frame_count, size_t _history_capacity) :
+  max_frame_count(_max_frame_count),
+  history(new float[_history_capacity]),
+  history_capacity(_history_capacity),
+  history_start(0),
+  history_end(0),
+  history_rate(0),
+  last_input_ns(0),
+  snapshot(new float[_history_capacity]),
+  snapshot_from(0),
+  snapshot_max_ms(0.0f),
+  snapshot_count(0),
+  snapshot_end(0),
+  snapshot_rate(0),
+  snapshot_requested(false),
+  snapshot_ready(false),
+  requested_voice_skin(nullptr),
+  cut_over_requested(false),
+  state(idle_state),
+  standby_helper(nullptr),
+  standby_converter(new NativeRateConverter(max_segment_size, _max_frame_count)),
+  prepared_voice_skin(nullptr),
+  prepared_primed(false),
+  primed_until(UINT64_MAX),
+  primed_rate(0),
+  prepared_crossfade_ms(0.0f),
+  active_voice_skin(nullptr),
+  active_converter(new NativeRateConverter(max_segment_size, _max_frame_count)),
+  crossfade_position(0),
+  crossfade_length(0),
+  catch_up_pending(false),
+  incoming_buffer(new float[_max_frame_count]),
+  switches(0),
+  primed_switches(0),
+  longest_prepare_ms(0.0) {
+  modulate_voice_skin_helper_create(&standby_helper, max_segment_size);
+  modulate_voice_skin_helper_reset(standby_helper, EXPECTED_SAMPLE_RATE);
+}
+
+SkinSwitch::~SkinSwitch() {
+  modulate_voice_skin_helper_destroy(&standby_helper);
+  delete standby_converter;
+  delete active_converter;
+  delete[] history;
+  delete[] snapshot;
+  delete[] incoming_buffer;
+}
+
+SkinSwitchSettings SkinSwitch::default_settings() {
+  SkinSwitchSettings settings;
+  settings.prime_ms = MODULATE_SKIN_SWITCH_PRIME_MS;
+  settings.crossfade_ms = MODULATE_SKIN_SWITCH_CROSSFADE_MS;
+  return settings;
+}
+
+bool SkinSwitch::is_idle() const {
+  return get_now_ns() - last_input_ns.load(std::memory_order_relaxed) > (int64_t)MODULATE_SKIN_SWITCH_IDLE_MS * 1000000;
+}
+
+void SkinSwitch::record_input(const float* samples, size_t pcm_frame_count, int audio_frame_rate) {
+  last_input_ns.store(get_now_ns(), std::memory_order_relaxed);
+  if(audio_frame_rate != history_rate) {
+    // Input at the old rate is no use for priming at the new one
+    history_start = history_end;
+    history_rate = audio_frame_rate;
+  }
+  // Only the end of a frame longer than the whole history is kept
+  const size_t skipped = pcm_frame_count > history_capacity ? pcm_frame_count - history_capacity : 0;
+  for(size_t i = skipped; i < pcm_frame_count; ) {
+    const size_t position = (size_t)((history_end + i) % history_capacity);
+    const size_t count = std::min(pcm_frame_count - i, history_capacity - position);
+    memcpy(history + position, samples + i, sizeof(float)*count);
+    i += count;
+  }
+  history_end += pcm_frame_count;
+  if(history_end - history_start > history_capacity)
+    history_start = history_end - history_capacity;
+
+  serve_snapshot();
+}
+
+void SkinSwitch::serve_snapshot() {
+  if(!snapshot_requested.load(std::memory_order_relaxed) || !snapshot_requested.exchange(false, std::memory_order_acquire))
+    return;
+  uint64_t from = history_start;
+  if(snapshot_from) {
+    from = std::max(from, snapshot_from);
+  } else {
+    const uint64_t wanted = (uint64_t)(snapshot_max_ms * history_rate / 1000.0f);
+    if(wanted < history_end - history_start)
+      from = history_end - wanted;
+  }
+  from = std::min(from, history_end);
+  snapshot_count = (size_t)(history_end - from);
+  for(size_t i = 0; i < snapshot_count; ) {
+    const size_t position = (size_t)((from + i) % history_capacity);
+    const size_t count = std::min(snapshot_count - i, history_capacity - position);
+    memcpy(snapshot + i, history + position, sizeof(float)*count);
+    i += count;
+  }
+  snapshot_end = history_end;
+  snapshot_rate = history_rate;
+  snapshot_ready.store(true, std::memory_order_release);
+  snapshot_event.signal();
+}
+
+void* SkinSwitch::update(void* target_voice_skin, int audio_frame_rate, void*& voice_skin_helper) {
+  // Not a relaxed load: this pairs with the check for callbacks in flight after the request
+  const bool cut_over = cut_over_requested.load() && cut_over_requested.exchange(false);
+  void* voice_skin = active_voice_skin.load(std::memory_order_relaxed);
+  if(!is_crossfading() && target_voice_skin != voice_skin && state.load(std::memory_order_relaxed) == ready_state) {
+    // Taken before looking at what was prepared, so the background thread can't be rewriting it
+    int expected = ready_state;
+    if(state.compare_exchange_strong(expected, crossfading_state, std::memory_order_acquire)) {
+      if(prepared_voice_skin == target_voice_skin) {
+        crossfade_position = 0;
+        crossfade_length = (size_t)(prepared_crossfade_ms * std::max(audio_frame_rate, 0) / 1000.0f);
+        catch_up_pending = true;
+      } else {
+        // Prepared for a skin that's since been replaced - the background thread will redo it
+        state.store(ready_state, std::memory_order_release);
+      }
+    }
+  }
+  if(cut_over || !target_voice_skin) {
+    finish_crossfade(voice_skin_helper);
+    if(active_voice_skin.load(std::memory_order_relaxed) != target_voice_skin)
+      active_voice_skin.store(nullptr);
+  }
+  return active_voice_skin.load(std::memory_order_relaxed);
+}
+
+bool SkinSwitch::is_settled(void* target_voice_skin) const {
+  return state.load() != crossfading_state && active_voice_skin.load() == target_voice_skin;
+}
+
+int SkinSwitch::generate_standby(void* voice_skin, float* samples, size_t count, int audio_frame_rate,
+                                 const modulate_parameters* params, bool native_rate) {
+  if(native_rate && standby_converter->supports(audio_frame_rate, count))
+    return standby_converter->generate(voice_skin, samples, samples, count, audio_frame_rate, params);
+  return modulate_voice_skin_helper_generate(voice_skin, standby_helper, samples, samples, (unsigned int)count,
+                                             audio_frame_rate, params);
+}
+
+void SkinSwitch::catch_up(int audio_frame_rate, size_t pcm_frame_count, const modulate_parameters* params,
+                          bool native_rate) {
+  if(primed_until == UINT64_MAX || primed_rate != audio_frame_rate || history_rate != audio_frame_rate ||
+     history_end - history_start < pcm_frame_count)
+    return;
+  const uint64_t frame_start = history_end - pcm_frame_count;
+  // A frame's worth at most, to bound the extra work on this thread - the crossfade
+  // covers for anything older that was missed
+  uint64_t from = std::max(primed_until, history_start);
+  if(frame_start > max_frame_count)
+    from = std::max(from, frame_start - max_frame_count);
+  if(from >= frame_start)
+    return;
+  const size_t count = (size_t)(frame_start - from);
+  for(size_t i = 0; i < count; ) {
+    const size_t position = (size_t)((from + i) % history_capacity);
+    const size_t run = std::min(count - i, history_capacity - position);
+    memcpy(incoming_buffer + i, history + position, sizeof(float)*run);
+    i += run;
+  }
+  generate_standby(prepared_voice_skin, incoming_buffer, count, audio_frame_rate, params, native_rate);
+}
+
+int SkinSwitch::convert_incoming(const float* samples, size_t pcm_frame_count, int audio_frame_rate,
+                                 const modulate_parameters* params, bool native_rate) {
+  if(pcm_frame_count > max_frame_count)
+    return 1;
+  if(catch_up_pending) {
+    catch_up(audio_frame_rate, pcm_frame_count, params, native_rate);
+    catch_up_pending = false;
+  }
+  memcpy(incoming_buffer, samples, sizeof(float)*pcm_frame_count);
+  return generate_standby(prepared_voice_skin, incoming_buffer, pcm_frame_count, audio_frame_rate, params, native_rate);
+}
+
+void SkinSwitch::silence_incoming(size_t pcm_frame_count) {
+  memset(incoming_buffer, 0, sizeof(float)*std::min(pcm_frame_count, max_frame_count));
+}
+
+void SkinSwitch::mix(float* samples, size_t pcm_frame_count, void*& voice_skin_helper) {
+  for(size_t i = 0; i < pcm_frame_count; i++) {
+    const float t = crossfade_length ? std::min(1.0f, (float)(crossfade_position + i + 1) / crossfade_length) : 1.0f;
+    // Equal-power, so the level doesn't dip halfway through: the gains' squares sum to one
+    const float angle = t * MODULATE_SKIN_SWITCH_HALF_PI;
+    samples[i] = samples[i] * std::cos(angle) + incoming_buffer[i] * std::sin(angle);
+  }
+  crossfade_position += pcm_frame_count;
+  if(crossfade_position >= crossfade_length)
+    finish_crossfade(voice_skin_helper);
+}
+
+void SkinSwitch::finish_crossfade(void*& voice_skin_helper) {
+  if(!is_crossfading())
+    return;
+  active_voice_skin.store(prepared_voice_skin);
+  std::swap(voice_skin_helper, standby_helper);
+  std::swap(active_converter, standby_converter);
+  switches.fetch_add(1, std::memory_order_relaxed);
+  if(prepared_primed)
+    primed_switches.fetch_add(1, std::memory_order_relaxed);
+  state.store(idle_state, std::memory_order_release);
+}
+
+bool SkinSwitch::needs_preparing() const {
+  void* voice_skin = requested_voice_skin.load();
+  if(!voice_skin)
+    return false;
+  const int current_state = state.load(std::memory_order_acquire);
+  if((current_state == ready_state || current_state == crossfading_state) && prepared_voice_skin == voice_skin)
+    return false;
+  // Mid-crossfade, the active skin is the one on its way out
+  return current_state == crossfading_state || active_voice_skin.load() != voice_skin;
+}
+
+bool SkinSwitch::is_using(void* voice_skin) const {
+  // State first: the active skin only changes to the prepared one before the state goes idle
+  const int current_state = state.load(std::memory_order_acquire);
+  if(active_voice_skin.load() == voice_skin)
+    return true;
+  return (current_state == ready_state || current_state == crossfading_state) && prepared_voice_skin == voice_skin;
+}
+
+bool SkinSwitch::take_standby(const std::atomic<bool>& running) {
+  while(running.load()) {
+    int expected = idle_state;
+    if(state.compare_exchange_strong(expected, preparing_state, std::memory_order_acquire))
+      return true;
+    // A prepared switch the audio thread hasn't started can be taken back
+    expected = ready_state;
+    if(state.compare_exchange_strong(expected, preparing_state, std::memory_order_acquire))
+      return true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return false;
+}
+
+bool SkinSwitch::take_snapshot(uint64_t from, float max_ms, const std::atomic<bool>& running) {
+  snapshot_ready.store(false, std::memory_order_relaxed);
+  snapshot_from = from;
+  snapshot_max_ms = max_ms;
+  snapshot_requested.store(true, std::memory_order_release);
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(MODULATE_SKIN_SWITCH_SNAPSHOT_TIMEOUT_MS);
+  bool withdrawing = false;
+  while(!snapshot_ready.load(std::memory_order_acquire)) {
+    if(!withdrawing && (!running.load() || std::chrono::steady_clock::now() > deadline)) {
+      // Once the audio thread has taken the request it's a copy away from done, so wait for it
+      if(snapshot_requested.exchange(false))
+        return false;
+      withdrawing = true;
+    }
+    snapshot_event.wait_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+void SkinSwitch::prime(void* voice_skin, const SkinSwitchSettings& settings, const modulate_parameters& params,
+                       bool native_rate, const std::atomic<bool>& running) {
+  uint64_t from = 0;
+  for(int round = 0; round < MODULATE_SKIN_SWITCH_MAX_PRIME_ROUNDS; round++) {
+    if(!take_snapshot(from, settings.prime_ms, running))
+      return;
+    if(snapshot_rate != primed_rate) {
+      // The first round, or the rate changed under us and priming starts over
+      if(primed_rate)
+        modulate_voice_skin_reset(voice_skin);
+      modulate_voice_skin_helper_reset(standby_helper, snapshot_rate);
+      primed_rate = snapshot_rate;
+    }
+    for(size_t offset = 0; offset < snapshot_count; offset += max_frame_count) {
+      const size_t count = std::min(max_frame_count, snapshot_count - offset);
+      generate_standby(voice_skin, snapshot + offset, count, snapshot_rate, &params, native_rate);
+    }
+    primed_until = snapshot_end;
+    from = snapshot_end;
+    // Close enough that the audio thread can feed in the rest
+    if(snapshot_count <= max_frame_count)
+      return;
+  }
+}
+
+void SkinSwitch::prepare(void* voice_skin, bool prime_from_history, const SkinSwitchSettings& settings,
+                         const modulate_parameters& params, bool native_rate, const std::atomic<bool>& running) {
+  if(!take_standby(running))
+    return;
+  const auto start = std::chrono::steady_clock::now();
+  primed_until = UINT64_MAX;
+  primed_rate = 0;
+  if(prime_from_history)
+    modulate_voice_skin_reset(voice_skin);
+  modulate_voice_skin_helper_reset(standby_helper, EXPECTED_SAMPLE_RATE);
+  standby_converter->reset();
+  if(prime_from_history && settings.prime_ms > 0.0f)
+    prime(voice_skin, settings, params, native_rate, running);
+
+  prepared_voice_skin = voice_skin;
+  prepared_primed = primed_rate != 0;
+  prepared_crossfade_ms = std::max(settings.crossfade_ms, 0.0f);
+  const double prepare_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  if(prepare_ms > longest_prepare_ms.load(std::memory_order_relaxed))
+    longest_prepare_ms.store(prepare_ms, std::memory_order_relaxed);
+  state.store(ready_state, std::memory_order_release);
+}
+
+SkinSwitchStats SkinSwitch::get_stats() const {
+  return {switches.load(std::memory_order_relaxed), primed_switches.load(std::memory_order_relaxed),
+          longest_prepare_ms.load(std::memory_order_relaxed)};
+}
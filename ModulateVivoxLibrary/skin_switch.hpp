@@ -0,0 +1,166 @@
+#ifndef MODULATE_SKIN_SWITCH_HPP
+#define MODULATE_SKIN_SWITCH_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "modulate/modulate.h"
+#include "audio_safe_event.hpp"
+#include "native_rate_converter.hpp"
+
+struct SkinSwitchSettings {
+  float prime_ms;     // input the incoming skin converts before it's heard; 0 to only reset it
+  float crossfade_ms; // 0 to swap outright on a frame boundary
+};
+
+struct SkinSwitchStats {
+  uint64_t switches;
+  uint64_t primed_switches;  // switches to a skin primed with the session's own input
+  double longest_prepare_ms; // time from starting to prepare a skin until it was ready
+};
+
+// Switches a session from one voice skin to another without a pop or a dropout.
+//
+// A skin that's just been reset starts from a cold state, so swapping it straight in is
+// heard as a click and a moment of near silence.  Instead, a background thread resets the
+// incoming skin and a standby voice skin helper, and primes them by converting (and
+// throwing away) the last few hundred ms of the session's input, which the audio thread
+// keeps in a history ring.  It then asks for the input that arrived meanwhile, and so on
+// until it's within a frame of the live stream.  On the next frame boundary the audio
+// thread feeds in whatever input is still missing, and crossfades (equal-power) from the
+// outgoing skin to the incoming one, both converting the live input.  Once the crossfade
+// is over the standby helper becomes the session's helper, and the old one is the standby
+// for the next switch.  The same goes for the native rate fast path's filters, so each
+// skin's output is filtered by its own, with the same latency either side of a crossfade.
+//
+// A skin that's already in use elsewhere can't be reset or primed without disturbing it,
+// so it's only crossfaded to.  A session with no audio flowing doesn't wait for any of
+// this: once it's been told to cut over, its next frame no longer uses the outgoing skin.
+//
+// The audio side must only be called by the thread converting the session's audio, and
+// the background side by a single background thread.  request may be called from anywhere.
+class SkinSwitch {
+private:
+  enum State {idle_state, preparing_state, ready_state, crossfading_state};
+
+  const size_t max_frame_count;
+
+  // The session's recent input, as absolute sample positions.  Only the audio thread
+  // touches these.
+  float* history;
+  const size_t history_capacity;
+  uint64_t history_start;
+  uint64_t history_end;
+  int history_rate;
+  std::atomic<int64_t> last_input_ns;
+
+  // Input copied out of the history for the background thread, on request.  The request
+  // fields are written before snapshot_requested is set, the rest before snapshot_ready is.
+  float* snapshot;
+  uint64_t snapshot_from;  // 0 for the latest snapshot_max_ms of input
+  float snapshot_max_ms;
+  size_t snapshot_count;
+  uint64_t snapshot_end;
+  int snapshot_rate;
+  std::atomic<bool> snapshot_requested;
+  std::atomic<bool> snapshot_ready;
+  AudioSafeEvent snapshot_event;
+
+  std::atomic<void*> requested_voice_skin;
+  std::atomic<bool> cut_over_requested;
+  std::atomic<int> state;
+  // Belongs to the background thread, except while crossfading.  The rest of the prepared
+  // switch is written before state becomes ready.
+  void* standby_helper;
+  NativeRateConverter* standby_converter;
+  void* prepared_voice_skin;
+  bool prepared_primed;
+  uint64_t primed_until; // where in the history priming stopped, or UINT64_MAX if it didn't happen
+  int primed_rate;
+  float prepared_crossfade_ms;
+
+  // The skin the session is heard through, and the crossfade away from it
+  std::atomic<void*> active_voice_skin;
+  NativeRateConverter* active_converter;
+  size_t crossfade_position;
+  size_t crossfade_length;
+  bool catch_up_pending;
+  float* incoming_buffer;
+
+  std::atomic<uint64_t> switches;
+  std::atomic<uint64_t> primed_switches;
+  std::atomic<double> longest_prepare_ms;
+
+  void serve_snapshot();
+  bool take_snapshot(uint64_t from, float max_ms, const std::atomic<bool>& running);
+  bool take_standby(const std::atomic<bool>& running);
+  // Converts with the incoming skin's helper, or its fast path filters
+  int generate_standby(void* voice_skin, float* samples, size_t count, int audio_frame_rate,
+                       const modulate_parameters* params, bool native_rate);
+  void prime(void* voice_skin, const SkinSwitchSettings& settings, const modulate_parameters& params,
+             bool native_rate, const std::atomic<bool>& running);
+  void catch_up(int audio_frame_rate, size_t pcm_frame_count, const modulate_parameters* params, bool native_rate);
+  void finish_crossfade(void*& voice_skin_helper);
+
+public:
+  // history_capacity is the most input that can be primed with
+  SkinSwitch(unsigned int max_segment_size, size_t max_frame_count, size_t history_capacity);
+  ~SkinSwitch();
+  SkinSwitch(const SkinSwitch& other) = delete;
+  SkinSwitch& operator=(const SkinSwitch& other) = delete;
+
+  static SkinSwitchSettings default_settings();
+
+  // The skin the session should switch to.  Wake the background thread afterwards.
+  void request(void* voice_skin) {requested_voice_skin.store(voice_skin);}
+  // Whether the session has had no input for a while
+  bool is_idle() const;
+  // Makes the next frame finish any switch straight away, or fall silent if the incoming
+  // skin isn't ready yet, rather than go on using the outgoing skin
+  void request_cut_over() {cut_over_requested.store(true);}
+
+  // Audio side
+  // Keeps the frame's input, before it's converted
+  void record_input(const float* samples, size_t pcm_frame_count, int audio_frame_rate);
+  // The skin to convert this frame with, which is nullptr until the first skin is ready.
+  // Starts a crossfade to target_voice_skin if it's been prepared, and cuts over if asked
+  // to, swapping voice_skin_helper for the standby helper.
+  void* update(void* target_voice_skin, int audio_frame_rate, void*& voice_skin_helper);
+  bool is_crossfading() const {return state.load(std::memory_order_relaxed) == crossfading_state;}
+  void* get_incoming_voice_skin() const {return prepared_voice_skin;}
+  // Whether the session has finished switching to target_voice_skin.  Safe to call from
+  // any thread.
+  bool is_settled(void* target_voice_skin) const;
+  // The fast path's filters for the skin update returned - see NativeRateConverter
+  NativeRateConverter& get_converter() {return *active_converter;}
+  // While crossfading: converts the frame with the incoming skin, into a buffer of its own,
+  // on the native rate fast path if native_rate is set and the frame allows it
+  int convert_incoming(const float* samples, size_t pcm_frame_count, int audio_frame_rate,
+                       const modulate_parameters* params, bool native_rate);
+  // While crossfading: for an incoming skin that can't convert yet, e.g. as it isn't
+  // authenticated, so the crossfade is to silence
+  void silence_incoming(size_t pcm_frame_count);
+  // Mixes the incoming skin's output into samples, which hold the outgoing skin's.  When
+  // the crossfade ends, voice_skin_helper is swapped for the standby helper.
+  void mix(float* samples, size_t pcm_frame_count, void*& voice_skin_helper);
+  // While crossfading, for a frame no one hears: switches over straight away
+  void skip_crossfade(void*& voice_skin_helper) {finish_crossfade(voice_skin_helper);}
+
+  // Background side
+  void* get_requested_voice_skin() const {return requested_voice_skin.load();}
+  bool needs_preparing() const;
+  // Whether voice_skin is being heard, or about to be, on this session
+  bool is_using(void* voice_skin) const;
+  // When the session last had input, for telling which sessions are live
+  int64_t get_last_input_ns() const {return last_input_ns.load(std::memory_order_relaxed);}
+  // Readies voice_skin to take over, resetting and priming it first if prime_from_history
+  // is set - see above - on the native rate fast path if native_rate is set.  Waits for
+  // any crossfade that's still under way.  Gives up if running is cleared.
+  void prepare(void* voice_skin, bool prime_from_history, const SkinSwitchSettings& settings,
+               const modulate_parameters& params, bool native_rate, const std::atomic<bool>& running);
+
+  SkinSwitchStats get_stats() const;
+};
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef MODULATE_SPSC_RING_HPP
+#define MODULATE_SPSC_RING_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+// Lock-free single-producer/single-consumer ring buffer of trivially copyable samples.
+// head and tail are 64-bit monotonic counters (they never need to be reduced - at 48kHz
+// they would take millions of years to wrap), and the capacity is a power of two so that
+// indexing is a mask instead of a modulo.  Reads and writes are done as at most two
+// memcpy segments.
+//
+// Only one thread may call the producer functions, and only one thread may call
+// the consumer functions.
+template <typename T>
+class SpscRing {
+private:
+  T* buffer;
+  const size_t capacity;
+  const size_t mask;
+
+  // Keep the two indices on separate cache lines so the threads don't fight over them
+  alignas(64) std::atomic<uint64_t> head; // written by the producer
+  alignas(64) std::atomic<uint64_t> tail; // written by the consumer
+
+  static size_t round_up_to_power_of_two(size_t value) {
+    size_t result = 1;
+    while(result < value)
+      result <<= 1;
+    return result;
+  }
+
+public:
+  explicit SpscRing(size_t min_capacity) :
+    capacity(round_up_to_power_of_two(min_capacity)),
+    mask(round_up_to_power_of_two(min_capacity) - 1),
+    head(0),
+    tail(0) {
+    buffer = new T[capacity];
+  }
+  ~SpscRing() {
+    delete[] buffer;
+  }
+  SpscRing(const SpscRing& other) = delete;
+  SpscRing& operator=(const SpscRing& other) = delete;
+
+  size_t get_capacity() const {return capacity;}
+  bool is_lock_free() const {return head.is_lock_free() && tail.is_lock_free();}
+
+  // Producer side
+
+  // Number of samples that can currently be written
+  size_t write_available() const {
+    return capacity - (size_t)(head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire));
+  }
+
+  // Writes as many of the count samples as fit, and returns the number written
+  size_t write(const T* data, size_t count) {
+    const uint64_t head_value = head.load(std::memory_order_relaxed);
+    const uint64_t tail_value = tail.load(std::memory_order_acquire);
+    count = std::min(count, capacity - (size_t)(head_value - tail_value));
+
+    const size_t start = (size_t)head_value & mask;
+    const size_t first_segment = std::min(count, capacity - start);
+    memcpy(buffer + start, data, first_segment * sizeof(T));
+    memcpy(buffer, data + first_segment, (count - first_segment) * sizeof(T));
+
+    head.store(head_value + count, std::memory_order_release);
+    return count;
+  }
+
+  // Consumer side
+
+  // Number of samples that can currently be read
+  size_t read_available() const {
+    return (size_t)(head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed));
+  }
+
+  // Reads up to count samples into data, and returns the number read
+  size_t read(T* data, size_t count) {
+    const uint64_t tail_value = tail.load(std::memory_order_relaxed);
+    const uint64_t head_value = head.load(std::memory_order_acquire);
+    count = std::min(count, (size_t)(head_value - tail_value));
+
+    const size_t start = (size_t)tail_value & mask;
+    const size_t first_segment = std::min(count, capacity - start);
+    memcpy(data, buffer + start, first_segment * sizeof(T));
+    memcpy(data + first_segment, buffer, (count - first_segment) * sizeof(T));
+
+    tail.store(tail_value + count, std::memory_order_release);
+    return count;
+  }
+
+  // The oldest readable samples that are contiguous in memory, without consuming them,
+  // so that they can be used in place.  Follow with skip() once they've been used.
+  const T* peek_contiguous(size_t& count) const {
+    const uint64_t tail_value = tail.load(std::memory_order_relaxed);
+    const uint64_t head_value = head.load(std::memory_order_acquire);
+    const size_t start = (size_t)tail_value & mask;
+    count = std::min((size_t)(head_value - tail_value), capacity - start);
+    return buffer + start;
+  }
+
+  // Discards up to count samples without reading them, and returns the number discarded
+  size_t skip(size_t count) {
+    const uint64_t tail_value = tail.load(std::memory_order_relaxed);
+    const uint64_t head_value = head.load(std::memory_order_acquire);
+    count = std::min(count, (size_t)(head_value - tail_value));
+    tail.store(tail_value + count, std::memory_order_release);
+    return count;
+  }
+};
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef MODULATE_TRIPLE_BUFFER_HPP
+#define MODULATE_TRIPLE_BUFFER_HPP
+
+#include <atomic>
+
+// Wait-free hand-off of a small struct from one writer thread to one reader thread.
+// The writer fills the back slot and publishes it with a single atomic exchange; the
+// reader picks up the newest published slot with a single atomic load (plus an exchange
+// only when something new was published).  Neither side ever waits on the other, and
+// the reader never sees a partially written value.
+//
+// publish() must only be called from one thread at a time, and acquire() must only be
+// called from one thread (the audio thread).  The slot returned by acquire() stays
+// valid and unchanged until the next call to acquire().
+template <typename T>
+class TripleBuffer {
+private:
+  static const unsigned int index_mask = 0x3;
+  static const unsigned int fresh_bit = 0x4;
+
+  T slots[3];
+  // Index of the slot in the middle, with fresh_bit set if the reader hasn't taken it yet
+  std::atomic<unsigned int> middle;
+  unsigned int back = 0;  // owned by the writer
+  unsigned int front = 1; // owned by the reader
+
+public:
+  explicit TripleBuffer(const T& initial_value) :
+    slots{initial_value, initial_value, initial_value},
+    middle(2) {}
+  TripleBuffer(const TripleBuffer& other) = delete;
+  TripleBuffer& operator=(const TripleBuffer& other) = delete;
+
+  // Writer side
+  T& back_buffer() {
+    return slots[back];
+  }
+
+  void publish() {
+    back = middle.exchange(back | fresh_bit, std::memory_order_acq_rel) & index_mask;
+  }
+
+  // Reader side
+  const T& acquire() {
+    if(middle.load(std::memory_order_relaxed) & fresh_bit)
+      front = middle.exchange(front, std::memory_order_acq_rel) & index_mask;
+    return slots[front];
+  }
+};
+
+#endif
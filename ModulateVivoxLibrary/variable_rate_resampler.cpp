@@ -0,0 +1,106 @@
+#include "variable_rate_resampler.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#define MODULATE_VARIABLE_RATE_PI 3.14159265358979323846
+// Kaiser window shape - short filters can't do much better than ~60dB anyway
+#define MODULATE_VARIABLE_RATE_KAISER_BETA 6.0
+
+// Modified Bessel function of the first kind, order 0, for the Kaiser window
+static double bessel_i0(double x) {
+  double sum = 1.0;
+  double term = 1.0;
+  for(int k = 1; k < 32; k++) {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+  }
+  return sum;
+}
+
+VariableRateResampler::VariableRateResampler(size_t max_output_count) :
+  kernels(get_audio_kernels()),
+  cutoff(0.0),
+  buffer_size(MODULATE_VARIABLE_RATE_TAPS + max_output_count * MODULATE_VARIABLE_RATE_MAX_RATIO + 1) {
+  buffer = new float[buffer_size];
+  set_cutoff(1.0);
+  reset();
+}
+
+VariableRateResampler::~VariableRateResampler() {
+  delete[] buffer;
+}
+
+void VariableRateResampler::set_cutoff(double new_cutoff) {
+  new_cutoff = std::min(1.0, std::max(0.01, new_cutoff));
+  if(new_cutoff == cutoff)
+    return;
+  cutoff = new_cutoff;
+  const double half_width = MODULATE_VARIABLE_RATE_TAPS / 2;
+  for(int p = 0; p <= MODULATE_VARIABLE_RATE_PHASES; p++) {
+    // Phase p puts the output p / PHASES of a sample after tap TAPS / 2 - 1
+    const double offset = half_width - 1 + (double)p / MODULATE_VARIABLE_RATE_PHASES;
+    double sum = 0.0;
+    for(int k = 0; k < MODULATE_VARIABLE_RATE_TAPS; k++) {
+      const double t = k - offset;
+      const double x = MODULATE_VARIABLE_RATE_PI * cutoff * t;
+      const double sinc = x == 0.0 ? 1.0 : sin(x) / x;
+      const double r = t / half_width;
+      const double window = bessel_i0(MODULATE_VARIABLE_RATE_KAISER_BETA * sqrt(std::max(0.0, 1.0 - r * r))) /
+                            bessel_i0(MODULATE_VARIABLE_RATE_KAISER_BETA);
+      taps[p][k] = (float)(sinc * window);
+      sum += taps[p][k];
+    }
+    // Unity gain at DC for every phase, so the gain doesn't ripple as the position moves
+    for(int k = 0; k < MODULATE_VARIABLE_RATE_TAPS; k++)
+      taps[p][k] = (float)(taps[p][k] / sum);
+  }
+}
+
+void VariableRateResampler::reset() {
+  // Silence before the first sample, so the first output lands on it
+  buffered = MODULATE_VARIABLE_RATE_TAPS / 2 - 1;
+  memset(buffer, 0, sizeof(float)*buffered);
+  position = 0.0;
+}
+
+size_t VariableRateResampler::get_input_needed(size_t output_count, double ratio) const {
+  if(output_count == 0)
+    return 0;
+  // read works out each position the same way, so this is exactly what it will use
+  const size_t needed = (size_t)(position + (output_count - 1) * ratio) + MODULATE_VARIABLE_RATE_TAPS;
+  return needed > buffered ? needed - buffered : 0;
+}
+
+size_t VariableRateResampler::write(const float* input, size_t count) {
+  count = std::min(count, buffer_size - buffered);
+  memcpy(buffer + buffered, input, sizeof(float)*count);
+  buffered += count;
+  return count;
+}
+
+size_t VariableRateResampler::read(float* output, size_t count, double ratio, float gain) {
+  const double start_position = position;
+  size_t produced = 0;
+  for(; produced < count; produced++) {
+    const double sample_position = start_position + produced * ratio;
+    const size_t start = (size_t)sample_position;
+    if(start + MODULATE_VARIABLE_RATE_TAPS > buffered)
+      break;
+    const double phase = (sample_position - start) * MODULATE_VARIABLE_RATE_PHASES;
+    const int p = (int)phase;
+    const float weight = (float)(phase - p);
+    const float a = kernels.dot_product(taps[p], buffer + start, MODULATE_VARIABLE_RATE_TAPS);
+    const float b = kernels.dot_product(taps[p + 1], buffer + start, MODULATE_VARIABLE_RATE_TAPS);
+    output[produced] = gain * (a + weight * (b - a));
+  }
+
+  // Drop the input no later output needs
+  position = start_position + produced * ratio;
+  const size_t used = std::min((size_t)position, buffered);
+  memmove(buffer, buffer + used, sizeof(float)*(buffered - used));
+  buffered -= used;
+  position -= used;
+  return produced;
+}
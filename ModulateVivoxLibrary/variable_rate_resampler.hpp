@@ -0,0 +1,63 @@
+#ifndef MODULATE_VARIABLE_RATE_RESAMPLER_HPP
+#define MODULATE_VARIABLE_RATE_RESAMPLER_HPP
+
+#include <cstddef>
+
+#include "audio_kernels.hpp"
+
+// Fractional positions the filter is designed for; those in between are interpolated
+#define MODULATE_VARIABLE_RATE_PHASES 64
+// Filter length - the resampler delays its input by half of this
+#define MODULATE_VARIABLE_RATE_TAPS 16
+// Most input samples read per output sample, e.g. 48kHz down to 8kHz is 6
+#define MODULATE_VARIABLE_RATE_MAX_RATIO 8
+
+// Resamples by a ratio that can change from one call to the next, for following a clock
+// that drifts against another.  Each output sample is a windowed-sinc FIR centred at a
+// fractional input position, with the taps for that position interpolated between the
+// two nearest of MODULATE_VARIABLE_RATE_PHASES precomputed ones.
+//
+// Input is written in, and read out ratio input samples per output sample;
+// get_input_needed says how much input a read will take, so that the caller can pull
+// exactly that from wherever the input is buffered.  Not thread safe.
+class VariableRateResampler {
+private:
+  const AudioKernels& kernels;
+  // One branch per phase, plus the next sample's phase 0 to interpolate towards
+  float taps[MODULATE_VARIABLE_RATE_PHASES + 1][MODULATE_VARIABLE_RATE_TAPS];
+  double cutoff;
+
+  // Input not yet used up, with the filter's history at the start
+  float* buffer;
+  const size_t buffer_size;
+  size_t buffered;
+  // Input position of the next output sample, from the start of the buffer
+  double position;
+
+public:
+  // max_output_count is the most a single read will be asked for
+  explicit VariableRateResampler(size_t max_output_count);
+  ~VariableRateResampler();
+  VariableRateResampler(const VariableRateResampler& other) = delete;
+  VariableRateResampler& operator=(const VariableRateResampler& other) = delete;
+
+  // The lowpass cutoff, as a fraction of the input's Nyquist frequency - lower it in
+  // proportion when downsampling.  Redesigning the filter takes ~1000 sin() calls, so
+  // this only does it when the cutoff changes.
+  void set_cutoff(double new_cutoff);
+  // Clears the filter's history, as at the start of a new stream
+  void reset();
+
+  // How many more input samples a read of output_count at ratio will use
+  size_t get_input_needed(size_t output_count, double ratio) const;
+  // Takes as much of the input as fits, and returns how much that was
+  size_t write(const float* input, size_t count);
+  // Produces up to count output samples, scaled by gain, at ratio input samples per
+  // output sample, and returns how many there was enough input for
+  size_t read(float* output, size_t count, double ratio, float gain);
+
+  // The delay the filter adds, in input samples
+  static size_t get_latency_samples() {return MODULATE_VARIABLE_RATE_TAPS / 2;}
+};
+
+#endif
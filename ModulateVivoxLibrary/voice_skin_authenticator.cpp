@@ -0,0 +1,284 @@
+#include "voice_skin_authenticator.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#include "modulate/modulate.h"
+
+// An entry rejected with its batch - only set_authenticated or a later batch changes that
+#define MODULATE_REJECTED_BATCH UINT64_MAX
+
+VoiceSkinAuthenticator::VoiceSkinAuthenticator()
+  : applied_batch(0), next_batch(1), pending_batch(0) {
+  for(Entry& entry : entries) {
+    entry.voice_skin.store(nullptr, std::memory_order_relaxed);
+    entry.batch.store(0, std::memory_order_relaxed);
+    entry.authenticated.store(false, std::memory_order_relaxed);
+  }
+}
+
+VoiceSkinAuthenticator::Entry* VoiceSkinAuthenticator::find(void* voice_skin, bool add) {
+  // Open addressing - entries are never removed, so a probe can stop at the first empty one
+  const size_t start = (size_t)(((uintptr_t)voice_skin >> 4) * 0x9E3779B97F4A7C15ull);
+  for(size_t i = 0; i < MODULATE_MAX_AUTHENTICATED_VOICE_SKINS; i++) {
+    Entry& entry = entries[(start + i) % MODULATE_MAX_AUTHENTICATED_VOICE_SKINS];
+    void* existing = entry.voice_skin.load(std::memory_order_acquire);
+    if(existing == voice_skin)
+      return &entry;
+    if(!existing) {
+      if(!add)
+        return nullptr;
+      // Another thread may be adding to the same slot, possibly the same skin
+      if(entry.voice_skin.compare_exchange_strong(existing, voice_skin, std::memory_order_acq_rel) ||
+         existing == voice_skin)
+        return &entry;
+    }
+  }
+  return nullptr;
+}
+
+int VoiceSkinAuthenticator::create_batch_request(const std::vector<void*>& voice_skins, const std::string& api_key,
+                                                 unsigned int max_threads, std::string& request, size_t& failed_index) {
+  std::lock_guard<std::mutex> lock(mutex);
+  failed_index = SIZE_MAX;
+  // A batch that never got its response can't be applied now, so its skins mustn't be
+  // taken as authenticated when a later batch is
+  for(void* voice_skin : pending_voice_skins)
+    if(Entry* entry = find(voice_skin, false))
+      if(entry->batch.load(std::memory_order_relaxed) == pending_batch)
+        entry->batch.store(MODULATE_REJECTED_BATCH, std::memory_order_release);
+  pending_voice_skins.clear();
+  pending_batch = 0;
+
+  // Each message takes a while to create, so they're created concurrently, as
+  // VoiceSkinCatalog loads skins
+  std::vector<std::string> messages(voice_skins.size());
+  std::vector<int> error_codes(voice_skins.size(), 0);
+  std::atomic<size_t> next_skin(0);
+  auto create_messages = [&] {
+    char message[MODULATE_AUTHENTICATION_MESSAGE_LENGTH];
+    for(size_t i = next_skin.fetch_add(1); i < voice_skins.size(); i = next_skin.fetch_add(1)) {
+      error_codes[i] = voice_skins[i] ? modulate_voice_skin_create_authentication_message(voice_skins[i], api_key.c_str(),
+                                                                                           message, sizeof(message))
+                                      : 1;
+      if(!error_codes[i])
+        messages[i] = std::string(message, strnlen(message, sizeof(message)));
+    }
+  };
+  size_t thread_count = max_threads ? max_threads : std::max(1u, std::thread::hardware_concurrency());
+  thread_count = std::min(thread_count, std::max((size_t)1, voice_skins.size()));
+  // This thread is one of the pool
+  std::vector<std::thread> threads;
+  for(size_t i = 1; i < thread_count; i++)
+    threads.emplace_back(create_messages);
+  create_messages();
+  for(std::thread& thread : threads)
+    thread.join();
+
+  for(size_t i = 0; i < voice_skins.size(); i++) {
+    if(error_codes[i]) {
+      failed_index = i;
+      return error_codes[i];
+    }
+  }
+  const uint64_t batch = next_batch++;
+  for(size_t i = 0; i < voice_skins.size(); i++) {
+    Entry* entry = find(voice_skins[i], true);
+    if(!entry) {
+      failed_index = i;
+      return 1;
+    }
+    entry->batch.store(batch, std::memory_order_release);
+  }
+  pending_batch = batch;
+  pending_voice_skins = voice_skins;
+  request = format_batch_request(messages);
+  return 0;
+}
+
+int VoiceSkinAuthenticator::apply_batch_response(const std::string& response, size_t& failed_index) {
+  std::lock_guard<std::mutex> lock(mutex);
+  failed_index = SIZE_MAX;
+  if(!pending_batch)
+    return MODULATE_AUTHENTICATION_NO_BATCH;
+  bool success = false;
+  std::vector<std::string> signed_responses;
+  if(!parse_batch_response(response, success, signed_responses))
+    return MODULATE_AUTHENTICATION_BAD_RESPONSE;
+  int error_code = 0;
+  if(!success)
+    error_code = MODULATE_AUTHENTICATION_REJECTED;
+  else if(signed_responses.size() != pending_voice_skins.size())
+    error_code = MODULATE_AUTHENTICATION_BAD_RESPONSE;
+
+  // The SDK authenticates each skin as its response checks out, but none of them count
+  // here until they all have
+  for(size_t i = 0; !error_code && i < pending_voice_skins.size(); i++) {
+    error_code = modulate_voice_skin_check_authentication_message(pending_voice_skins[i], signed_responses[i].c_str());
+    if(error_code)
+      failed_index = i;
+  }
+  if(error_code) {
+    for(void* voice_skin : pending_voice_skins)
+      if(Entry* entry = find(voice_skin, false))
+        entry->batch.store(MODULATE_REJECTED_BATCH, std::memory_order_release);
+  } else {
+    // The one store that authenticates the whole batch
+    applied_batch.store(pending_batch, std::memory_order_release);
+    // Sticky, so being in a later batch doesn't unauthenticate a skin
+    for(void* voice_skin : pending_voice_skins)
+      if(Entry* entry = find(voice_skin, false))
+        entry->authenticated.store(true, std::memory_order_release);
+  }
+  pending_voice_skins.clear();
+  pending_batch = 0;
+  return error_code;
+}
+
+void VoiceSkinAuthenticator::set_authenticated(void* voice_skin) {
+  if(Entry* entry = find(voice_skin, true))
+    entry->authenticated.store(true, std::memory_order_release);
+}
+
+bool VoiceSkinAuthenticator::is_authenticated(void* voice_skin) {
+  if(!voice_skin)
+    return false;
+  Entry* entry = find(voice_skin, false);
+  if(entry) {
+    if(entry->authenticated.load(std::memory_order_acquire))
+      return true;
+    const uint64_t batch = entry->batch.load(std::memory_order_acquire);
+    if(batch)
+      return batch <= applied_batch.load(std::memory_order_acquire);
+  }
+
+  // Never in a batch, so ask the SDK, and remember the answer once it's yes
+  int is_authenticated = 0;
+  if(modulate_voice_skin_check_authenticated(voice_skin, &is_authenticated) || !is_authenticated)
+    return false;
+  if(!entry)
+    entry = find(voice_skin, true);
+  if(!entry)
+    return true;
+  // It may have joined a batch meanwhile, which then decides
+  const uint64_t batch = entry->batch.load(std::memory_order_acquire);
+  if(batch && batch > applied_batch.load(std::memory_order_acquire))
+    return false;
+  entry->authenticated.store(true, std::memory_order_release);
+  return true;
+}
+
+size_t VoiceSkinAuthenticator::get_authenticated_count() const {
+  const uint64_t applied = applied_batch.load(std::memory_order_acquire);
+  size_t count = 0;
+  for(const Entry& entry : entries) {
+    if(!entry.voice_skin.load(std::memory_order_acquire))
+      continue;
+    const uint64_t batch = entry.batch.load(std::memory_order_acquire);
+    if(entry.authenticated.load(std::memory_order_acquire) || (batch && batch <= applied))
+      count++;
+  }
+  return count;
+}
+
+std::string VoiceSkinAuthenticator::format_batch_request(const std::vector<std::string>& messages) {
+  std::string request = "{\"request_strings\": [";
+  for(size_t i = 0; i < messages.size(); i++) {
+    if(i)
+      request += ", ";
+    request += '"';
+    for(char c : messages[i]) {
+      if(c == '"' || c == '\\')
+        request += '\\';
+      request += c;
+    }
+    request += '"';
+  }
+  request += "]}";
+  return request;
+}
+
+namespace {
+  void skip_whitespace(const std::string& s, size_t& position) {
+    while(position < s.size() && (s[position] == ' ' || s[position] == '\t' || s[position] == '\r' || s[position] == '\n'))
+      position++;
+  }
+
+  // Just enough JSON for the server's response: a string without \u escapes
+  bool parse_string(const std::string& s, size_t& position, std::string& value) {
+    if(position >= s.size() || s[position] != '"')
+      return false;
+    value.clear();
+    for(position++; position < s.size(); position++) {
+      char c = s[position];
+      if(c == '"') {
+        position++;
+        return true;
+      }
+      if(c == '\\') {
+        if(++position >= s.size())
+          return false;
+        c = s[position];
+        switch(c) {
+          case 'n': c = '\n'; break;
+          case 't': c = '\t'; break;
+          case 'r': c = '\r'; break;
+          case '"': case '\\': case '/': break;
+          default: return false;
+        }
+      }
+      value += c;
+    }
+    return false;
+  }
+
+  // Where the value of "key" starts, or std::string::npos
+  size_t find_value(const std::string& s, const std::string& key) {
+    size_t position = s.find("\"" + key + "\"");
+    if(position == std::string::npos)
+      return position;
+    position += key.size() + 2;
+    skip_whitespace(s, position);
+    if(position >= s.size() || s[position] != ':')
+      return std::string::npos;
+    position++;
+    skip_whitespace(s, position);
+    return position;
+  }
+}
+
+bool VoiceSkinAuthenticator::parse_batch_response(const std::string& response, bool& success,
+                                                  std::vector<std::string>& signed_responses) {
+  success = false;
+  signed_responses.clear();
+  size_t position = find_value(response, "success");
+  if(position == std::string::npos)
+    return false;
+  success = response.compare(position, 4, "true") == 0;
+  if(!success)
+    return true;
+
+  position = find_value(response, "signed_responses");
+  if(position == std::string::npos || response[position] != '[')
+    return false;
+  position++;
+  skip_whitespace(response, position);
+  if(position < response.size() && response[position] == ']')
+    return true;
+  while(true) {
+    std::string value;
+    if(!parse_string(response, position, value))
+      return false;
+    signed_responses.push_back(value);
+    skip_whitespace(response, position);
+    if(position >= response.size())
+      return false;
+    if(response[position] == ']')
+      return true;
+    if(response[position] != ',')
+      return false;
+    position++;
+    skip_whitespace(response, position);
+  }
+}
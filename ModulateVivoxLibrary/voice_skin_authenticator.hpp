@@ -0,0 +1,86 @@
+#ifndef MODULATE_VOICE_SKIN_AUTHENTICATOR_HPP
+#define MODULATE_VOICE_SKIN_AUTHENTICATOR_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Voice skins whose authentication can be remembered, across all batches
+#define MODULATE_MAX_AUTHENTICATED_VOICE_SKINS 1024
+
+// Errors of our own, alongside the SDK's (which are positive)
+#define MODULATE_AUTHENTICATION_NO_BATCH (-1)        // there's no batch request awaiting a response
+#define MODULATE_AUTHENTICATION_BAD_RESPONSE (-2)    // the response couldn't be parsed, or is for another batch
+#define MODULATE_AUTHENTICATION_REJECTED (-3)        // the server turned the batch down
+
+// Authenticates voice skins a batch at a time, and remembers which are authenticated so
+// that the audio thread doesn't have to ask the SDK on every frame.
+//
+// A batch's authentication messages are created concurrently (each is a big modular
+// exponentiation), and go to the authentication server as one request:
+//   {"request_strings": ["<message>", ...]}
+// whose response has a signed response for each, in the same order:
+//   {"success": true, "signed_responses": ["<signed response>", ...]}
+// The response is applied as a whole: the skins in the batch become authenticated all at
+// once, as far as is_authenticated is concerned, or - if any signed response is rejected -
+// none of them do.
+//
+// Skins that were never part of a batch are looked up in the SDK, and remembered once
+// they're authenticated.  The UI side is serialized internally; is_authenticated is
+// lock-free and doesn't allocate.
+class VoiceSkinAuthenticator {
+private:
+  // Never removed, so a voice skin's entry stays put once it's been added
+  struct Entry {
+    std::atomic<void*> voice_skin;
+    // The last batch the skin was in - it's authenticated once that batch is applied, and
+    // never if the batch was rejected
+    std::atomic<uint64_t> batch;
+    // Authenticated by an earlier batch, on its own, or as seen by the SDK
+    std::atomic<bool> authenticated;
+  };
+  Entry entries[MODULATE_MAX_AUTHENTICATED_VOICE_SKINS];
+  std::atomic<uint64_t> applied_batch;
+
+  std::mutex mutex;
+  uint64_t next_batch;
+  uint64_t pending_batch;
+  std::vector<void*> pending_voice_skins;
+
+  // nullptr if voice_skin isn't there, and with add, if the table is full
+  Entry* find(void* voice_skin, bool add);
+
+public:
+  VoiceSkinAuthenticator();
+  VoiceSkinAuthenticator(const VoiceSkinAuthenticator& other) = delete;
+  VoiceSkinAuthenticator& operator=(const VoiceSkinAuthenticator& other) = delete;
+
+  // UI side
+  // Creates an authentication message for every skin, on up to max_threads threads at once
+  // (one per core if 0), and puts them in request for the authentication server.  Any batch
+  // still awaiting its response is abandoned.  Returns 0, or the SDK's error for the first
+  // skin to fail, whose index goes in failed_index.
+  int create_batch_request(const std::vector<void*>& voice_skins, const std::string& api_key,
+                           unsigned int max_threads, std::string& request, size_t& failed_index);
+  // Applies the server's response to the last batch request.  Returns 0 once every skin in
+  // the batch is authenticated, otherwise an error, with the index of the skin whose signed
+  // response was rejected in failed_index (or SIZE_MAX if no skin is to blame).
+  int apply_batch_response(const std::string& response, size_t& failed_index);
+  // For a skin authenticated on its own, with the SDK
+  void set_authenticated(void* voice_skin);
+
+  // Audio side
+  bool is_authenticated(void* voice_skin);
+  // Skins known to be authenticated, from any thread.  A skin authenticated on the SDK's
+  // side only counts once is_authenticated has seen it.
+  size_t get_authenticated_count() const;
+
+  // The JSON either side of the authentication server, exposed for testing
+  static std::string format_batch_request(const std::vector<std::string>& messages);
+  static bool parse_batch_response(const std::string& response, bool& success, std::vector<std::string>& signed_responses);
+};
+
+#endif
@@ -0,0 +1,272 @@
+#include "voice_skin_catalog.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+#include "modulate/modulate.h"
+
+// What the name cache knows a skin file by: its path, size and modification time, so that
+// a changed file is loaded again to pick up its new name
+static std::string get_name_cache_key(const std::string& filename) {
+  std::error_code error;
+  const uintmax_t size = std::filesystem::file_size(filename, error);
+  if(error)
+    return "";
+  const auto modified = std::filesystem::last_write_time(filename, error);
+  if(error)
+    return "";
+  return filename + "\t" + std::to_string(size) + "\t" + std::to_string(modified.time_since_epoch().count());
+}
+
+VoiceSkinCatalog::VoiceSkinCatalog(unsigned int _max_frame_size, const std::string& _name_cache_filename) :
+  max_frame_size(_max_frame_size),
+  name_cache_filename(_name_cache_filename),
+  batch_total(0),
+  batch_done(0),
+  batch_failed(0),
+  idle_copy_loaders(0),
+  stopping(false) {
+}
+
+VoiceSkinCatalog::~VoiceSkinCatalog() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  copy_queue_changed.notify_all();
+  for(std::thread& loader : copy_loaders)
+    loader.join();
+  for(Entry& entry : entries) {
+    if(entry.voice_skin)
+      modulate_voice_skin_destroy(&entry.voice_skin);
+    for(void*& copy : entry.copies)
+      if(copy)
+        modulate_voice_skin_destroy(&copy);
+  }
+}
+
+bool VoiceSkinCatalog::publish(const std::string& name, const std::string& filename, void* voice_skin) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(entry_indices.find(name) == entry_indices.end()) {
+      entry_indices[name] = entries.size();
+      entries.push_back({name, filename, voice_skin});
+      return true;
+    }
+  }
+  if(voice_skin)
+    modulate_voice_skin_destroy(&voice_skin);
+  return false;
+}
+
+// One line per skin: its cache key, a tab, then its name
+std::map<std::string, std::string> VoiceSkinCatalog::read_name_cache() const {
+  std::map<std::string, std::string> names;
+  if(name_cache_filename.empty())
+    return names;
+  std::ifstream f(name_cache_filename);
+  std::string line;
+  while(std::getline(f, line)) {
+    const size_t tab = line.find_last_of('\t');
+    if(tab != std::string::npos && tab + 1 < line.size())
+      names[line.substr(0, tab)] = line.substr(tab + 1);
+  }
+  return names;
+}
+
+void VoiceSkinCatalog::write_name_cache() const {
+  if(name_cache_filename.empty())
+    return;
+  std::vector<std::pair<std::string, std::string>> lines;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for(const Entry& entry : entries)
+      lines.push_back({entry.filename, entry.name});
+  }
+  // Written alongside and renamed over the old cache, so a crash can't leave half a cache
+  const std::string temporary_filename = name_cache_filename + ".tmp";
+  {
+    std::ofstream f(temporary_filename);
+    for(const auto& line : lines) {
+      const std::string key = get_name_cache_key(line.first);
+      if(!key.empty())
+        f << key << "\t" << line.second << "\n";
+    }
+    if(!f)
+      return;
+  }
+  std::error_code error;
+  std::filesystem::rename(temporary_filename, name_cache_filename, error);
+}
+
+int VoiceSkinCatalog::add(const std::vector<std::string>& filenames, bool lazy, unsigned int max_threads,
+                          std::string& error_filename) {
+  batch_total.store(filenames.size());
+  batch_done.store(0);
+  batch_failed.store(0);
+  const std::map<std::string, std::string> cached_names = lazy ? read_name_cache() : std::map<std::string, std::string>();
+
+  // Kept per file, so that the first failure in file order is the one reported
+  std::vector<int> error_codes(filenames.size(), 0);
+  std::atomic<size_t> next_file(0);
+  std::atomic<bool> loaded_any(false);
+  auto load_files = [&] {
+    for(size_t i = next_file++; i < filenames.size(); i = next_file++) {
+      const std::string& filename = filenames[i];
+      const auto cached = cached_names.find(get_name_cache_key(filename));
+      if(cached != cached_names.end()) {
+        publish(cached->second, filename, nullptr);
+        batch_done++;
+        continue;
+      }
+
+      void* voice_skin = nullptr;
+      const int error_code = modulate_voice_skin_create(max_frame_size, filename.c_str(), &voice_skin);
+      if(error_code) {
+        error_codes[i] = error_code;
+        batch_failed++;
+      } else {
+        char name[MODULATE_SKIN_NAME_MAX_LENGTH];
+        modulate_voice_skin_get_skin_name(voice_skin, name);
+        publish(name, filename, voice_skin);
+        loaded_any.store(true);
+      }
+      batch_done++;
+    }
+  };
+
+  size_t thread_count = max_threads ? max_threads : std::max(1u, std::thread::hardware_concurrency());
+  thread_count = std::min(thread_count, std::max((size_t)1, filenames.size()));
+  // This thread is one of the pool
+  std::vector<std::thread> threads;
+  for(size_t i = 1; i < thread_count; i++)
+    threads.emplace_back(load_files);
+  load_files();
+  for(std::thread& thread : threads)
+    thread.join();
+
+  if(loaded_any.load())
+    write_name_cache();
+
+  for(size_t i = 0; i < filenames.size(); i++) {
+    if(error_codes[i]) {
+      error_filename = filenames[i];
+      return error_codes[i];
+    }
+  }
+  return 0;
+}
+
+VoiceSkinLoadProgress VoiceSkinCatalog::get_progress() const {
+  return {batch_total.load(), batch_done.load(), batch_failed.load()};
+}
+
+size_t VoiceSkinCatalog::size() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return entries.size();
+}
+
+const std::string& VoiceSkinCatalog::get_name(size_t index) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return entries.at(index).name;
+}
+
+bool VoiceSkinCatalog::contains(const std::string& name) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return entry_indices.find(name) != entry_indices.end();
+}
+
+void* VoiceSkinCatalog::get_voice_skin(const std::string& name, int* error_code) {
+  size_t index;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto it = entry_indices.find(name);
+    if(it == entry_indices.end())
+      return nullptr;
+    index = it->second;
+    if(entries[index].voice_skin)
+      return entries[index].voice_skin;
+  }
+
+  std::lock_guard<std::mutex> load_lock(lazy_load_mutex);
+  std::string filename;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    // Someone else may have loaded it while we waited
+    if(entries[index].voice_skin)
+      return entries[index].voice_skin;
+    filename = entries[index].filename;
+  }
+  void* voice_skin = nullptr;
+  const int create_error_code = modulate_voice_skin_create(max_frame_size, filename.c_str(), &voice_skin);
+  if(create_error_code) {
+    if(error_code)
+      *error_code = create_error_code;
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  entries[index].voice_skin = voice_skin;
+  return voice_skin;
+}
+
+void* VoiceSkinCatalog::get_voice_skin_copy(void* voice_skin, size_t copy) {
+  if(!voice_skin || copy == 0)
+    return nullptr;
+  std::lock_guard<std::mutex> lock(mutex);
+  for(size_t index = 0; index < entries.size(); index++) {
+    Entry& entry = entries[index];
+    if(entry.voice_skin != voice_skin)
+      continue;
+    if(entry.copies.size() < copy) {
+      entry.copies.resize(copy, nullptr);
+      entry.copies_requested.resize(copy, false);
+    }
+    if(!entry.copies_requested[copy - 1]) {
+      entry.copies_requested[copy - 1] = true;
+      copy_queue.push_back({index, copy});
+      const size_t max_loaders = std::max(1u, std::thread::hardware_concurrency());
+      if(!idle_copy_loaders && copy_loaders.size() < max_loaders)
+        copy_loaders.emplace_back(&VoiceSkinCatalog::run_copy_loader, this);
+      else
+        copy_queue_changed.notify_one();
+    }
+    return entry.copies[copy - 1];
+  }
+  return nullptr;
+}
+
+void VoiceSkinCatalog::run_copy_loader() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while(!stopping) {
+    if(copy_queue.empty()) {
+      idle_copy_loaders++;
+      copy_queue_changed.wait(lock);
+      idle_copy_loaders--;
+      continue;
+    }
+    const std::pair<size_t, size_t> request = copy_queue.front();
+    copy_queue.pop_front();
+    const std::string filename = entries[request.first].filename;
+    lock.unlock();
+    void* copy = nullptr;
+    // A copy that fails to load stays requested, so it isn't tried over and over
+    if(modulate_voice_skin_create(max_frame_size, filename.c_str(), &copy))
+      copy = nullptr;
+    lock.lock();
+    entries[request.first].copies[request.second - 1] = copy;
+  }
+}
+
+std::vector<void*> VoiceSkinCatalog::get_voice_skin_copies(const std::string& name) const {
+  std::vector<void*> copies;
+  std::lock_guard<std::mutex> lock(mutex);
+  const auto it = entry_indices.find(name);
+  if(it == entry_indices.end())
+    return copies;
+  for(void* copy : entries[it->second].copies)
+    if(copy)
+      copies.push_back(copy);
+  return copies;
+}
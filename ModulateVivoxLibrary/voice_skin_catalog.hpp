@@ -0,0 +1,102 @@
+#ifndef MODULATE_VOICE_SKIN_CATALOG_HPP
+#define MODULATE_VOICE_SKIN_CATALOG_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// How far the current batch of voice skins has got
+struct VoiceSkinLoadProgress {
+  size_t total;
+  size_t done;   // loaded, registered lazily, or failed
+  size_t failed;
+};
+
+// Every voice skin the app knows about, by name.  Skins are added a batch at a time, loaded
+// concurrently on a bounded pool of threads and published one by one as they finish, so
+// the catalog can be read (e.g. to show progress) while a batch is still loading.
+//
+// In lazy mode a skin is only registered by name, and its weights are loaded the first time
+// it's asked for.  The SDK can't read a skin's name without loading it, so names come from a
+// cache file, written whenever a skin's been loaded; skins the cache doesn't know yet (new or
+// changed files) are loaded up front to learn their names.
+//
+// A caller that mustn't share a skin's internal state with others (e.g. a second session)
+// can ask for its own copy, which loads in the background on a pool bounded like add's.
+//
+// Thread safe.  Names and indices stay valid until the catalog is destroyed.
+class VoiceSkinCatalog {
+private:
+  struct Entry {
+    std::string name;
+    std::string filename;
+    void* voice_skin; // nullptr until loaded, for lazily registered skins
+    std::vector<void*> copies; // by copy number less one, nullptr until loaded
+    std::vector<bool> copies_requested;
+  };
+
+  const unsigned int max_frame_size;
+  const std::string name_cache_filename;
+
+  mutable std::mutex mutex;
+  std::deque<Entry> entries; // in the order they were published
+  std::map<std::string, size_t> entry_indices;
+  // Held while loading a lazily registered skin, so that it's only loaded once
+  std::mutex lazy_load_mutex;
+
+  std::atomic<size_t> batch_total;
+  std::atomic<size_t> batch_done;
+  std::atomic<size_t> batch_failed;
+
+  // Copies waiting to load, by entry index and copy number, and the threads loading them
+  std::deque<std::pair<size_t, size_t>> copy_queue;
+  std::condition_variable copy_queue_changed;
+  std::vector<std::thread> copy_loaders;
+  size_t idle_copy_loaders;
+  bool stopping;
+  void run_copy_loader();
+
+  // Returns false (and destroys voice_skin) if there's already a skin by this name
+  bool publish(const std::string& name, const std::string& filename, void* voice_skin);
+  std::map<std::string, std::string> read_name_cache() const;
+  void write_name_cache() const;
+
+public:
+  // name_cache_filename may be empty, in which case lazy loading loads everything up front
+  VoiceSkinCatalog(unsigned int max_frame_size, const std::string& name_cache_filename);
+  // Destroys every skin that was loaded
+  ~VoiceSkinCatalog();
+  VoiceSkinCatalog(const VoiceSkinCatalog& other) = delete;
+  VoiceSkinCatalog& operator=(const VoiceSkinCatalog& other) = delete;
+
+  // Loads (or registers) every file, on up to max_threads threads at once, or one per core
+  // if max_threads is 0.  Returns once they're all done: 0 if they all succeeded, otherwise
+  // the error code of the first file to fail, which goes in error_filename.  A skin with the
+  // same name as one already in the catalog is dropped.
+  int add(const std::vector<std::string>& filenames, bool lazy, unsigned int max_threads,
+          std::string& error_filename);
+  VoiceSkinLoadProgress get_progress() const;
+
+  size_t size() const;
+  const std::string& get_name(size_t index) const;
+  bool contains(const std::string& name) const;
+  // The skin called name, loading it first if it was registered lazily.  Returns nullptr if
+  // there's no such skin or it failed to load, with the SDK's error in error_code if given.
+  void* get_voice_skin(const std::string& name, int* error_code = nullptr);
+  // Copy number copy (from 1) of a skin get_voice_skin returned, loaded from the same file.
+  // Doesn't wait: returns nullptr until the copy's loaded, having queued it the first time it's
+  // asked for, and for good if it fails to load or voice_skin isn't in the catalog.  A copy
+  // needs authenticating on its own.
+  void* get_voice_skin_copy(void* voice_skin, size_t copy);
+  // Every copy of the skin called name loaded so far
+  std::vector<void*> get_voice_skin_copies(const std::string& name) const;
+};
+
+#endif
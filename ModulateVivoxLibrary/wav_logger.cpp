@@ -1,18 +1,29 @@
 #include "wav_logger.hpp"
+#include "rt_audit.hpp"
 
-#include <filesystem>
+#include <algorithm>
 
 #include <ctime>
 
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 // Wav writing code based on a post by user Duthomhas on http://www.cplusplus.com/forum/beginner/166954/
 // Retrieved on October 23, 2019
 
 // Fixed the data chunk size value, based on WAVE format documenatation at http://soundfile.sapp.org/doc/WaveFormat/
 // plus prolific use of "hexdump -C logs/log0.wav" to examine the wav headers in the log files
 
-#ifndef MODULATE_MAX_LOG_FILE_LENGTH
-#define MODULATE_MAX_LOG_FILE_LENGTH (1<<24)
-#endif
+#define MODULATE_WAV_STAGING_SIZE 4096
+// The logging service also wakes this often on its own, to write out whatever's left
+#define MODULATE_WAV_LOGGING_IDLE_TIMEOUT_MS 500
 
 using namespace std;
 
@@ -28,66 +39,57 @@ namespace little_endian_io
 }
 using namespace little_endian_io;
 
-WavLogger::WavLogger(size_t _buffer_size, size_t _sample_rate, const string& _log_directory, const string& _basename) :
-  buffer_size(_buffer_size),
+WavLogger::WavLogger(size_t _buffer_size, size_t _sample_rate, const string& _log_directory, const string& _basename,
+                     WavSampleFormat _format, LogFileWorker* file_worker, size_t _max_file_length) :
+  file(file_worker, _max_file_length, _log_directory, _basename, _format == WavSampleFormat::flac ? ".flac" : ".wav"),
+  kernels(get_audio_kernels()),
+  staging(new short[MODULATE_WAV_STAGING_SIZE]),
+  flac_encoder(_format == WavSampleFormat::flac ? new FlacEncoder() : nullptr),
+  ring(_buffer_size),
+  dropped_samples(0),
+  wake_event(nullptr),
+  wake_threshold(ring.get_capacity() / 4),
+  buffer_size(ring.get_capacity()),
   sample_rate(_sample_rate),
   log_directory(_log_directory),
-  basename(_basename) {
-  buffer = new float[buffer_size];
-  if(!head.is_lock_free())
+  basename(_basename),
+  format(_format),
+  max_file_length(_max_file_length) {
+  if(!ring.is_lock_free())
     throw std::runtime_error("Atomic integers are not lock-free, cannot create wav logger");
-  head.store(0);
-  tail.store(0);
 
-  filesystem::create_directories(log_directory);
-  current_filename = get_next_filename();
-  open_file(current_filename);
+  write_header();
 }
 
 WavLogger::~WavLogger() {
   write_outstanding_samples_to_file();
-  close_file();
+  file.close(finish_file());
+  delete[] staging;
+  delete flac_encoder;
 }
 
 bool WavLogger::add_audio_nonblocking(const float* audio, size_t num_samples) {
-  int tail_lower_bound = tail.load();
-  int head_value = head.load();
-
-  // If the buffer can't fit the new samples, just continue and the log will skip
-  if((head_value + (int)num_samples) > (tail_lower_bound + (int)buffer_size))
+  MODULATE_RT_AUDIT_SCOPE("WavLogger::add_audio_nonblocking");
+  // If the ring can't fit the new samples, just continue and the log will skip
+  if(ring.write_available() < num_samples) {
+    dropped_samples.fetch_add(num_samples, std::memory_order_relaxed);
     return false;
-
-  for(int i = 0; i < (int)num_samples; i++) {
-    int index = (head_value + i) % buffer_size;
-    buffer[index] = audio[i];
   }
-
-  head.fetch_add((int)num_samples);
+  ring.write(audio, num_samples);
+  if(ring.get_capacity() - ring.write_available() >= wake_threshold)
+    wake_service();
   return true;
 }
 
-string WavLogger::get_next_filename() {
-  string filename;
-
-  char time_and_date[20];
-  time_t rawtime;
-  time(&rawtime);
-  struct tm * timeinfo = localtime(&rawtime);
-  strftime(time_and_date, 20, "%Y_%m_%d_%H_%M", timeinfo);
-
-  for(size_t i = 0; i < 1000; i++) {
-    filename = log_directory + "/" + string(time_and_date) + "_" + to_string(i) + "_" + basename + ".wav";
-    bool file_doesnt_exist = !filesystem::exists(filename);
-    if(file_doesnt_exist)
-      break;
+void WavLogger::write_header() {
+  ofstream& f = file.f;
+  if(flac_encoder) {
+    flac_encoder->begin(f, (uint32_t)sample_rate);
+    return;
   }
-  return filename;
-}
 
-void WavLogger::open_file(const string& filename) {
-  f = ofstream(filename, ios::binary);
-
-  int bits_per_sample = 16;
+  const bool is_float = format == WavSampleFormat::float32;
+  int bits_per_sample = is_float ? 32 : 16;
   int channels = 1;
   int data_block_size = channels * (bits_per_sample / 8);
   int bytes_per_sec = data_block_size * (int)sample_rate;
@@ -96,110 +98,217 @@ void WavLogger::open_file(const string& filename) {
   f << "RIFF----WAVE"; // ---- to be filled in with filesize-in-bytes - 8
   // Begin the fmt chunk
   f << "fmt "; // format chunk header
-  write_word( f,              16, 4 );  // no extension data
-  write_word( f,               1, 2 );  // PCM - integer samples
+  write_word( f, is_float ? 18 : 16, 4 );  // non-PCM formats carry a (zero) extension size
+  write_word( f,  is_float ? 3 : 1, 2 );  // PCM - integer samples, or IEEE float
   write_word( f,        channels, 2 );  // one channel (mono file)
   write_word( f,     sample_rate, 4 );  // samples per second (Hz)
   write_word( f,   bytes_per_sec, 4 );  // (Sample Rate * BitsPerSample * Channels) / 8
   write_word( f, data_block_size, 2 );  // data block size (size of two integer samples, one for each channel, in bytes)
   write_word( f, bits_per_sample, 2 );  // number of bits per sample (use a multiple of 8)
+  if(is_float) {
+    write_word( f,               0, 2 );  // no extension data
+    // Non-PCM files also need a fact chunk with the number of samples
+    f << "fact";
+    write_word( f,               4, 4 );
+    fact_chunk_pos = f.tellp();
+    f << "----";  // (sample count to be filled in later)
+  }
 
   // Begin the data chunk
   data_chunk_pos = f.tellp();
   f << "data----";  // (chunk size to be filled in later)
 }
 
+void WavLogger::wake_service() {
+  if(AudioSafeEvent* event = wake_event.load(std::memory_order_acquire))
+    event->signal();
+}
+
 void WavLogger::write_outstanding_samples_to_file() {
   std::lock_guard<std::mutex> lock(writer_mutex);
-  int tail_value = tail.load();
-  int head_lower_bound = head.load();
-
-  int volume = (1<<15)-1;
-  for(; tail_value < head_lower_bound; tail_value++) {
-    int index = tail_value % buffer_size;
-    write_word(f, (int)(buffer[index] * volume), 2);
+  ofstream& f = file.f;
+
+  // WAV data is little-endian, as is every platform we build for, so samples go out as they are.
+  // Each contiguous stretch of the ring is written (after converting it, for int16) in one go.
+  // FLAC logs are converted the same way, and compressed here on the logging thread.
+  // Only what's there now is written, so that a busy audio thread can't keep us here.
+  for(size_t remaining = ring.read_available(); remaining; ) {
+    size_t count;
+    const float* samples = ring.peek_contiguous(count);
+    count = std::min(count, remaining);
+    if(format == WavSampleFormat::float32) {
+      f.write(reinterpret_cast<const char*>(samples), count * sizeof(float));
+    } else {
+      count = std::min(count, (size_t)MODULATE_WAV_STAGING_SIZE);
+      kernels.float_to_int16(samples, staging, count);
+      if(flac_encoder)
+        flac_encoder->add_samples(staging, count);
+      else
+        f.write(reinterpret_cast<const char*>(staging), count * sizeof(short));
+    }
+    ring.skip(count);
+    remaining -= count;
   }
-  tail.store(tail_value);
 
-  // Start new log file if needed
+  // Start new log file if needed.  If the next one isn't open yet, this one carries on
+  // until it is, rather than holding up the samples behind us.
   size_t file_length = f.tellp();
-  if(file_length > MODULATE_MAX_LOG_FILE_LENGTH)
+  if(file_length > max_file_length && file.is_next_file_ready())
     close_file_and_open_next();
-
-  // Avoid overflow on 32bit ints - TODO: only relevant if we record for over 6 hours...
-  if(tail_value > (1<<30)) {
-    int reduction_amount = ((1<<30) / (int)buffer_size) * (int)buffer_size;
-    tail.fetch_sub(reduction_amount);
-    head.fetch_sub(reduction_amount);
-  }
 }
 
 void WavLogger::close_file_and_open_next() {
-  close_file();
-  current_filename = get_next_filename();
-  open_file(current_filename);
+  file.rotate(finish_file());
+  write_header();
 }
 
-void WavLogger::close_file() {
+static LogFilePatch get_word_patch(size_t position, uint32_t value) {
+  LogFilePatch patch = {position, std::vector<uint8_t>(4)};
+  for(size_t i = 0; i < 4; i++, value >>= 8)
+    patch.bytes[i] = (uint8_t)(value & 0xFF);
+  return patch;
+}
+
+// The header fields that could only be filled in once the file was finished
+std::vector<LogFilePatch> WavLogger::finish_file() {
+  if(flac_encoder) {
+    uint8_t stream_info[MODULATE_FLAC_STREAM_INFO_BYTES];
+    flac_encoder->finish_without_header(stream_info);
+    return {{(size_t)flac_encoder->get_stream_info_position(),
+             std::vector<uint8_t>(stream_info, stream_info + sizeof(stream_info))}};
+  }
+
   // (We'll need the final file size to fix the chunk sizes above)
-  size_t file_length = f.tellp();
+  size_t file_length = file.f.tellp();
 
+  std::vector<LogFilePatch> patches;
   // Fix the data chunk header to contain the data size
-  f.seekp( data_chunk_pos + 4 );
-  write_word( f, file_length - (data_chunk_pos + 8), 4);
+  const size_t data_length = file_length - (data_chunk_pos + 8);
+  patches.push_back(get_word_patch(data_chunk_pos + 4, (uint32_t)data_length));
+
+  if(format == WavSampleFormat::float32)
+    patches.push_back(get_word_patch(fact_chunk_pos, (uint32_t)(data_length / sizeof(float))));
 
   // Fix the file header to contain the proper RIFF chunk size, which is (file size - 8) bytes
-  f.seekp( 0 + 4 );
-  write_word( f, file_length - 8, 4 );
-  f.close();
+  patches.push_back(get_word_patch(0 + 4, (uint32_t)(file_length - 8)));
+  return patches;
 }
 
 
 
+ThreadedWavLogger::ThreadedWavLogger(WavLoggingService& _service, size_t buffer_size, size_t sample_rate,
+                                     const string& log_directory, const string& basename, WavSampleFormat format) :
+  wav_logger_ptr(new WavLogger(buffer_size, sample_rate, log_directory, basename, format, &_service.get_file_worker())),
+  service(&_service) {
+  latest_sample_rate.store((int)sample_rate);
+}
+
 ThreadedWavLogger& ThreadedWavLogger::operator=(ThreadedWavLogger&& other) {
-  bool other_thread_running = other.thread_running;
-  if(other_thread_running)
+  bool other_registered = other.registered;
+  if(other_registered)
     other.stop_logging_thread();
   wav_logger_ptr = other.wav_logger_ptr;
+  service = other.service;
   latest_sample_rate.store(other.latest_sample_rate);
   other.wav_logger_ptr = nullptr;
-  if(other_thread_running)
+  if(other_registered)
     start_logging_thread();
   return *this;
 }
 
 ThreadedWavLogger::~ThreadedWavLogger() {
-  if(thread_running)
-    stop_logging_thread();
+  stop_logging_thread();
   delete wav_logger_ptr;
 }
 
-void ThreadedWavLogger::log_task() {
-  const float buffer_fraction = 0.25;
-  while(!should_finish_logging) {
-    const int latest_sample_rate_value = latest_sample_rate.load();
-    if(latest_sample_rate_value != wav_logger_ptr->sample_rate) {
-      wav_logger_ptr->sample_rate = latest_sample_rate_value;
-      wav_logger_ptr->close_file_and_open_next();
-    }
-
-    const float delay_seconds = ((float)wav_logger_ptr->buffer_size / (float)wav_logger_ptr->sample_rate) * buffer_fraction;
+void ThreadedWavLogger::drain() {
+  const size_t latest_sample_rate_value = (size_t)latest_sample_rate.load();
+  if(latest_sample_rate_value != wav_logger_ptr->sample_rate) {
+    // Finish off the old file at the old rate first
     wav_logger_ptr->write_outstanding_samples_to_file();
-    std::this_thread::sleep_for(std::chrono::milliseconds((int)(delay_seconds * 1000)));
+    wav_logger_ptr->sample_rate = latest_sample_rate_value;
+    wav_logger_ptr->close_file_and_open_next();
   }
   wav_logger_ptr->write_outstanding_samples_to_file();
 }
 
 void ThreadedWavLogger::start_logging_thread() {
-  should_finish_logging = false;
-  thread_running = true;
-  logging_thread = std::thread([this]{log_task();});
+  if(registered)
+    return;
+  service->add_logger(this);
+  registered = true;
 }
 
 void ThreadedWavLogger::stop_logging_thread() {
-  if(thread_running) {
-    should_finish_logging = true;
-    logging_thread.join();
-    thread_running = false;
+  if(!registered)
+    return;
+  service->remove_logger(this);
+  registered = false;
+  wav_logger_ptr->write_outstanding_samples_to_file();
+}
+
+
+WavLoggingService::WavLoggingService() :
+  running(true) {
+  thread = std::thread([this]{run();});
+}
+
+WavLoggingService::~WavLoggingService() {
+  running.store(false);
+  wake_event.signal();
+  thread.join();
+}
+
+void WavLoggingService::add_logger(ServicedLogger* logger) {
+  std::lock_guard<std::mutex> lock(loggers_mutex);
+  loggers.push_back(logger);
+  logger->set_wake_event(&wake_event);
+}
+
+void WavLoggingService::remove_logger(ServicedLogger* logger) {
+  std::lock_guard<std::mutex> lock(loggers_mutex);
+  logger->set_wake_event(nullptr);
+  loggers.erase(std::remove(loggers.begin(), loggers.end(), logger), loggers.end());
+}
+
+static void set_background_priority(bool background) {
+#ifdef _WIN32
+  // Background mode also lowers the thread's I/O priority, and can be left again
+  SetThreadPriority(GetCurrentThread(), background ? THREAD_MODE_BACKGROUND_BEGIN : THREAD_MODE_BACKGROUND_END);
+#elif defined(__linux__)
+  // SCHED_IDLE only while idle.  Leaving it takes CAP_SYS_NICE, or an RLIMIT_NICE that
+  // allows the thread's nice value, so without either the thread stays at normal priority
+  // rather than get stuck behind everything else with samples to write.
+  sched_param param = {};
+  if(!background) {
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+    return;
+  }
+  const int nice_value = getpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid));
+  rlimit nice_limit;
+  const bool can_leave = geteuid() == 0 ||
+    (getrlimit(RLIMIT_NICE, &nice_limit) == 0 && (rlim_t)(20 - nice_value) <= nice_limit.rlim_cur);
+  if(can_leave)
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#else
+  (void)background;
+#endif
+}
+
+void WavLoggingService::run() {
+  bool background = false;
+  while(running.load()) {
+    wake_event.wait_for(std::chrono::milliseconds(MODULATE_WAV_LOGGING_IDLE_TIMEOUT_MS));
+
+    std::lock_guard<std::mutex> lock(loggers_mutex);
+    bool idle = true;
+    for(ServicedLogger* logger : loggers)
+      idle = idle && !logger->has_outstanding_samples();
+    if(idle != background) {
+      set_background_priority(idle);
+      background = idle;
+    }
+    for(ServicedLogger* logger : loggers)
+      logger->drain();
   }
 }
@@ -7,61 +7,108 @@
 
 #include <mutex>
 #include <thread>
-
+#include <vector>
+
+#include "audio_kernels.hpp"
+#include "spsc_ring.hpp"
+#include "audio_safe_event.hpp"
+#include "flac_encoder.hpp"
+#include "log_file_rotation.hpp"
+
+enum class WavSampleFormat {
+  int16,   // 16-bit PCM
+  float32, // 32-bit IEEE float, written straight from the ring with no conversion
+  flac     // 16-bit PCM, losslessly compressed into .flac files instead of .wav
+};
 
 class WavLogger {
 private:
-  std::ofstream f;
+  RotatingLogFile file;
   size_t data_chunk_pos;
-  std::string current_filename;
+  size_t fact_chunk_pos;
+
+  // Samples are converted into staging a ring segment at a time, and written with one write()
+  const AudioKernels& kernels;
+  short* staging;
+  FlacEncoder* flac_encoder; // only for WavSampleFormat::flac
 
   std::mutex writer_mutex;
-  float* buffer;
-  std::atomic<int> head;
-  std::atomic<int> tail;
+  SpscRing<float> ring;
+  std::atomic<uint64_t> dropped_samples;
 
-  std::string get_next_filename();
-  void open_file(const std::string& filename);
-  void close_file();
+  // Set while a service is draining this logger
+  std::atomic<AudioSafeEvent*> wake_event;
+  const size_t wake_threshold;
+
+  void write_header();
+  std::vector<LogFilePatch> finish_file();
 
 public:
-  const size_t buffer_size;
+  const size_t buffer_size; // the requested size, rounded up to a power of two
   size_t sample_rate;
   const std::string log_directory;
   const std::string basename;
+  const WavSampleFormat format;
+  const size_t max_file_length;
 
+  // With a file_worker, log files are opened ahead of time and finished off on the worker,
+  // rather than on the thread writing out the samples
   WavLogger(size_t buffer_size, size_t sample_rate,
-            const std::string& log_directory, const std::string& basename);
+            const std::string& log_directory, const std::string& basename,
+            WavSampleFormat format = WavSampleFormat::int16, LogFileWorker* file_worker = nullptr,
+            size_t max_file_length = MODULATE_MAX_LOG_FILE_LENGTH);
   ~WavLogger();
 
   // add_audio_nonblocking is not safe to use on multiple threads
-  // use only on the audio thread
+  // use only on the audio thread.  If the ring can't fit all of the audio, none of it
+  // is logged, and it's counted in get_dropped_samples.
   bool add_audio_nonblocking(const float* audio, size_t num_samples);
+  uint64_t get_dropped_samples() const {return dropped_samples.load(std::memory_order_relaxed);}
 
+  // Signals event whenever a quarter of the ring is waiting to be written, leaving
+  // plenty of room for the audio thread while the service writes
+  void set_wake_event(AudioSafeEvent* event) {wake_event.store(event);}
+  void wake_service();
+
+  bool has_outstanding_samples() const {return ring.read_available() > 0;}
+  // Moves on to a new file once this one's over max_file_length and the next is ready
   void write_outstanding_samples_to_file();
+  // Moves on to a new file now, e.g. for a new sample rate
   void close_file_and_open_next();
 };
 
 
-class ThreadedWavLogger {
+// Anything a WavLoggingService can drain
+class ServicedLogger {
+public:
+  virtual ~ServicedLogger() {}
+  // Called by the service, which holds its lock across all three
+  virtual bool has_outstanding_samples() const = 0;
+  virtual void set_wake_event(AudioSafeEvent* event) = 0;
+  virtual void drain() = 0;
+};
+
+class WavLoggingService;
+
+// A WavLogger drained by a shared WavLoggingService
+class ThreadedWavLogger : public ServicedLogger {
 private:
   WavLogger* wav_logger_ptr;
-
-  std::thread logging_thread;
-  bool should_finish_logging = true;
-  bool thread_running = false;
+  WavLoggingService* service;
+  bool registered = false;
 
   std::atomic<int> latest_sample_rate;
 
-  void log_task();
+  // Called by the service: picks up sample rate changes and writes out what's buffered
+  void drain() override;
+  bool has_outstanding_samples() const override {return wav_logger_ptr->has_outstanding_samples();}
+  void set_wake_event(AudioSafeEvent* event) override {wav_logger_ptr->set_wake_event(event);}
 
 public:
-  ThreadedWavLogger(size_t buffer_size, size_t sample_rate,
-                    const std::string& log_directory, const std::string& basename) :
-    wav_logger_ptr(new WavLogger(buffer_size, sample_rate, log_directory, basename)) {
-    latest_sample_rate.store((int)sample_rate);
-  };
-  ThreadedWavLogger& operator=(const ThreadedWavLogger& other) = delete; // don't copy in order to avoid multiple logging threads
+  ThreadedWavLogger(WavLoggingService& service, size_t buffer_size, size_t sample_rate,
+                    const std::string& log_directory, const std::string& basename,
+                    WavSampleFormat format = WavSampleFormat::int16);
+  ThreadedWavLogger& operator=(const ThreadedWavLogger& other) = delete; // don't copy in order to avoid draining one logger twice
   ThreadedWavLogger(const ThreadedWavLogger& other) = delete;
   ThreadedWavLogger& operator=(ThreadedWavLogger&& other);
   ThreadedWavLogger(ThreadedWavLogger&& other) {*this = std::move(other);};
@@ -72,13 +119,47 @@ public:
   inline bool add_audio_nonblocking(const float* audio, size_t num_samples) {
     return wav_logger_ptr->add_audio_nonblocking(audio, num_samples);
   }
+  uint64_t get_dropped_samples() const {return wav_logger_ptr->get_dropped_samples();}
 
   inline void set_sample_rate_nonblocking(int sample_rate) {
-    latest_sample_rate.store(sample_rate);
+    if(latest_sample_rate.exchange(sample_rate) != sample_rate)
+      wav_logger_ptr->wake_service();
   }
 
+  // Starts and stops the service draining this logger
   void start_logging_thread();
   void stop_logging_thread();
 };
 
+// One thread that writes out every registered logger.  Rather than polling,
+// it sleeps until a logger's ring crosses a fill threshold (or its sample rate changes),
+// with a long timeout to pick up whatever's left in quieter loggers.  While idle the
+// thread drops to background priority, where the platform supports it.
+// Log files are opened and closed on a second thread, so rotating doesn't stall the first.
+class WavLoggingService {
+private:
+  LogFileWorker file_worker;
+  std::mutex loggers_mutex; // held while draining, so removed loggers are never touched again
+  std::vector<ServicedLogger*> loggers;
+
+  AudioSafeEvent wake_event;
+  std::atomic<bool> running;
+  std::thread thread;
+
+  void run();
+
+public:
+  WavLoggingService();
+  ~WavLoggingService();
+  WavLoggingService(const WavLoggingService& other) = delete;
+  WavLoggingService& operator=(const WavLoggingService& other) = delete;
+
+  void add_logger(ServicedLogger* logger);
+  // Once this returns, the service won't touch the logger again
+  void remove_logger(ServicedLogger* logger);
+
+  // For the service's loggers to open and close their files on
+  LogFileWorker& get_file_worker() {return file_worker;}
+};
+
 #endif
@@ -0,0 +1,373 @@
+// Benchmark of authenticating voice skins, against a stand-in authentication server.
+//
+// Serves the authentication endpoints over HTTP on 127.0.0.1, signing each message the way
+// the stub library checks (see MODULATE_STUB_REQUIRE_AUTHENTICATION), after a delay of
+// --server-ms per request to stand in for the round trip to the real server:
+//   POST /authenticate        {"request_string": "<message>"}
+//                             -> {"success": true, "signed_response": "<signed>"}
+//   POST /authenticate_batch  {"request_strings": ["<message>", ...]}
+//                             -> {"success": true, "signed_responses": ["<signed>", ...]}
+// Then authenticates N stub skins each way:
+//   one at a time (old)  - each message created in turn on the UI thread, then sent in a
+//                          request of its own (all in flight at once, as the app's async
+//                          requests were), and checked as its response arrives
+//   batch                - the messages created concurrently by VoiceSkinAuthenticator, sent
+//                          in one request, and the response applied as a whole
+// reporting the time until every skin could convert.  A batch whose response has one bad
+// signature is then checked to leave every skin in it unauthenticated, and the cost of the
+// audio thread's authentication check is compared: asking the SDK, as it did every frame,
+// against VoiceSkinAuthenticator's cache.
+//
+// Only works against the stub, as only the stand-in server and the stub agree on signing.
+//
+// Usage: auth_bench [--skins N] [--message-ms MS] [--server-ms MS] [--threads N]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "modulate/modulate.h"
+#include "voice_skin_authenticator.hpp"
+
+// As the app creates its skins
+#define BENCH_MAX_SEGMENT_SIZE 2400
+#define BENCH_CHECK_ITERATIONS 1000000
+
+namespace fs = std::filesystem;
+
+static double get_ms_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The stub's signing rule: "signed:" and the message's 64-bit FNV-1a hash in hex
+static std::string sign(const std::string& message) {
+  uint64_t hash = 14695981039346656037ull;
+  for(char c : message)
+    hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+  char signature[32];
+  snprintf(signature, sizeof(signature), "signed:%016llx", (unsigned long long)hash);
+  return signature;
+}
+
+// The quoted strings in body after key, up to the closing bracket if it's a list
+static std::vector<std::string> get_strings(const std::string& body, const std::string& key) {
+  std::vector<std::string> strings;
+  size_t position = body.find("\"" + key + "\"");
+  if(position == std::string::npos)
+    return strings;
+  position = body.find(':', position + key.size() + 2);
+  const bool list = position != std::string::npos && body.find_first_not_of(" \t\r\n", position + 1) != std::string::npos &&
+                    body[body.find_first_not_of(" \t\r\n", position + 1)] == '[';
+  const size_t end = list ? body.find(']', position) : std::string::npos;
+  while(position != std::string::npos) {
+    const size_t open = body.find('"', position + 1);
+    if(open == std::string::npos || open > end)
+      break;
+    const size_t close = body.find('"', open + 1);
+    if(close == std::string::npos)
+      break;
+    strings.push_back(body.substr(open + 1, close - open - 1));
+    if(!list)
+      break;
+    position = close;
+  }
+  return strings;
+}
+
+// The stand-in authentication server, a thread per connection
+class AuthServer {
+private:
+  int listen_socket;
+  int port;
+  double server_ms;
+  std::atomic<bool> running;
+  std::atomic<size_t> requests;
+  // The batch signature to spoil, or SIZE_MAX
+  std::atomic<size_t> corrupt_index;
+  std::thread accept_thread;
+  std::vector<std::thread> connection_threads;
+
+  void serve(int connection) {
+    std::string request;
+    char buffer[4096];
+    size_t header_end = std::string::npos;
+    size_t content_length = 0;
+    while(true) {
+      const ssize_t received = recv(connection, buffer, sizeof(buffer), 0);
+      if(received <= 0)
+        break;
+      request.append(buffer, received);
+      if(header_end == std::string::npos && (header_end = request.find("\r\n\r\n")) != std::string::npos) {
+        const size_t length_header = request.find("Content-Length:");
+        if(length_header != std::string::npos && length_header < header_end)
+          content_length = (size_t)atol(request.c_str() + length_header + 15);
+      }
+      if(header_end != std::string::npos && request.size() >= header_end + 4 + content_length)
+        break;
+    }
+    requests.fetch_add(1);
+    std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(server_ms));
+
+    std::string body;
+    const std::string request_body = header_end == std::string::npos ? "" : request.substr(header_end + 4);
+    if(request.compare(0, 24, "POST /authenticate_batch") == 0) {
+      body = "{\"success\": true, \"signed_responses\": [";
+      const std::vector<std::string> messages = get_strings(request_body, "request_strings");
+      for(size_t i = 0; i < messages.size(); i++)
+        body += std::string(i ? ", " : "") + "\"" + (i == corrupt_index.load() ? "signed:bad" : sign(messages[i])) + "\"";
+      body += "]}";
+    } else if(request.compare(0, 18, "POST /authenticate") == 0) {
+      const std::vector<std::string> messages = get_strings(request_body, "request_string");
+      body = messages.empty() ? "{\"success\": false}"
+                              : "{\"success\": true, \"signed_response\": \"" + sign(messages[0]) + "\"}";
+    } else {
+      body = "{\"success\": false}";
+    }
+    const std::string response = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " +
+                                 std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    send(connection, response.data(), response.size(), 0);
+    close(connection);
+  }
+
+public:
+  AuthServer(double server_ms) : port(0), server_ms(server_ms), running(true), requests(0), corrupt_index(SIZE_MAX) {
+    listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t address_length = sizeof(address);
+    if(listen_socket < 0 || bind(listen_socket, (sockaddr*)&address, sizeof(address)) ||
+       listen(listen_socket, 128) || getsockname(listen_socket, (sockaddr*)&address, &address_length)) {
+      std::cerr << "Couldn't start the stand-in authentication server" << std::endl;
+      exit(1);
+    }
+    port = ntohs(address.sin_port);
+    accept_thread = std::thread([this] {
+      while(running.load()) {
+        const int connection = accept(listen_socket, nullptr, nullptr);
+        if(connection < 0)
+          continue;
+        if(!running.load()) {
+          close(connection);
+          break;
+        }
+        connection_threads.emplace_back(&AuthServer::serve, this, connection);
+      }
+    });
+  }
+
+  ~AuthServer() {
+    running.store(false);
+    // Wakes accept up
+    post("/", "");
+    accept_thread.join();
+    for(std::thread& thread : connection_threads)
+      thread.join();
+    close(listen_socket);
+  }
+
+  size_t get_requests() const {return requests.load();}
+  void set_corrupt_index(size_t index) {corrupt_index.store(index);}
+
+  // The response body, or "" if the server couldn't be reached
+  std::string post(const std::string& path, const std::string& body) const {
+    const int client = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if(client < 0 || connect(client, (sockaddr*)&address, sizeof(address))) {
+      if(client >= 0)
+        close(client);
+      return "";
+    }
+    const std::string request = "POST " + path + " HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Type: application/json\r\n"
+                                "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    send(client, request.data(), request.size(), 0);
+    std::string response;
+    char buffer[4096];
+    ssize_t received;
+    while((received = recv(client, buffer, sizeof(buffer), 0)) > 0)
+      response.append(buffer, received);
+    close(client);
+    const size_t header_end = response.find("\r\n\r\n");
+    return header_end == std::string::npos ? "" : response.substr(header_end + 4);
+  }
+};
+
+static std::vector<void*> create_skins(const std::string& filename, size_t count) {
+  std::vector<void*> voice_skins(count, nullptr);
+  for(void*& voice_skin : voice_skins) {
+    if(modulate_voice_skin_create(BENCH_MAX_SEGMENT_SIZE, filename.c_str(), &voice_skin)) {
+      std::cerr << "Couldn't create a voice skin from " << filename << std::endl;
+      exit(1);
+    }
+  }
+  return voice_skins;
+}
+
+static void destroy_skins(std::vector<void*>& voice_skins) {
+  for(void*& voice_skin : voice_skins)
+    modulate_voice_skin_destroy(&voice_skin);
+}
+
+static bool can_convert(const std::vector<void*>& voice_skins) {
+  float audio[BENCH_MAX_SEGMENT_SIZE] = {};
+  for(void* voice_skin : voice_skins)
+    if(modulate_voice_skin_generate(voice_skin, audio, BENCH_MAX_SEGMENT_SIZE, audio, nullptr))
+      return false;
+  return true;
+}
+
+// The time per call of check, in ns
+template <typename Check>
+static double time_check(Check check) {
+  const auto start = std::chrono::steady_clock::now();
+  size_t authenticated = 0;
+  for(size_t i = 0; i < BENCH_CHECK_ITERATIONS; i++)
+    authenticated += check() ? 1 : 0;
+  const double ns = get_ms_since(start) * 1e6 / BENCH_CHECK_ITERATIONS;
+  if(authenticated != BENCH_CHECK_ITERATIONS) {
+    std::cerr << "A voice skin wasn't authenticated when checked" << std::endl;
+    exit(1);
+  }
+  return ns;
+}
+
+int main(int argc, char** argv) {
+  size_t skin_count = 16;
+  double message_ms = 20.0;
+  double server_ms = 50.0;
+  unsigned int threads = 0;
+  for(int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if(arg == "--skins" && i + 1 < argc)
+      skin_count = std::max(1, atoi(argv[++i]));
+    else if(arg == "--message-ms" && i + 1 < argc)
+      message_ms = std::max(0.0, atof(argv[++i]));
+    else if(arg == "--server-ms" && i + 1 < argc)
+      server_ms = std::max(0.0, atof(argv[++i]));
+    else if(arg == "--threads" && i + 1 < argc)
+      threads = std::max(0, atoi(argv[++i]));
+    else {
+      std::cerr << "Usage: auth_bench [--skins N] [--message-ms MS] [--server-ms MS] [--threads N]" << std::endl;
+      return 2;
+    }
+  }
+  setenv("MODULATE_STUB_REQUIRE_AUTHENTICATION", "1", 1);
+  setenv("MODULATE_STUB_AUTH_MESSAGE_MS", std::to_string(message_ms).c_str(), 1);
+  const fs::path scratch_directory = fs::temp_directory_path() / "modulate_auth_bench";
+  fs::create_directories(scratch_directory);
+  const std::string filename = (scratch_directory / "bench_skin.mod").string();
+  std::ofstream(filename) << "bench";
+  const std::string api_key = "bench-api-key";
+  AuthServer server(server_ms);
+
+  // One at a time, as the app used to
+  std::vector<void*> voice_skins = create_skins(filename, skin_count);
+  if(can_convert(voice_skins)) {
+    std::cerr << "Voice skins converted before being authenticated" << std::endl;
+    return 1;
+  }
+  size_t requests_before = server.get_requests();
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> requests;
+  std::atomic<size_t> failures(0);
+  for(void* voice_skin : voice_skins) {
+    char message[MODULATE_AUTHENTICATION_MESSAGE_LENGTH];
+    if(modulate_voice_skin_create_authentication_message(voice_skin, api_key.c_str(), message, sizeof(message))) {
+      std::cerr << "Couldn't create an authentication message" << std::endl;
+      return 1;
+    }
+    requests.emplace_back([&server, &failures, voice_skin, request = std::string(message)] {
+      const std::string response = server.post("/authenticate", "{\"request_string\": \"" + request + "\"}");
+      const std::vector<std::string> signed_response = get_strings(response, "signed_response");
+      if(signed_response.empty() || modulate_voice_skin_check_authentication_message(voice_skin, signed_response[0].c_str()))
+        failures.fetch_add(1);
+    });
+  }
+  for(std::thread& thread : requests)
+    thread.join();
+  const double single_ms = get_ms_since(start);
+  const size_t single_requests = server.get_requests() - requests_before;
+  if(failures.load() || !can_convert(voice_skins)) {
+    std::cerr << "Authenticating one at a time failed" << std::endl;
+    return 1;
+  }
+  destroy_skins(voice_skins);
+
+  // The whole batch at once
+  voice_skins = create_skins(filename, skin_count);
+  VoiceSkinAuthenticator authenticator;
+  requests_before = server.get_requests();
+  start = std::chrono::steady_clock::now();
+  std::string request;
+  size_t failed_index;
+  int error_code = authenticator.create_batch_request(voice_skins, api_key, threads, request, failed_index);
+  const double batch_messages_ms = get_ms_since(start);
+  if(!error_code)
+    error_code = authenticator.apply_batch_response(server.post("/authenticate_batch", request), failed_index);
+  const double batch_ms = get_ms_since(start);
+  const size_t batch_requests = server.get_requests() - requests_before;
+  bool all_authenticated = true;
+  for(void* voice_skin : voice_skins)
+    all_authenticated = all_authenticated && authenticator.is_authenticated(voice_skin);
+  if(error_code || !all_authenticated || !can_convert(voice_skins)) {
+    std::cerr << "Authenticating as a batch failed, error code " << error_code << std::endl;
+    return 1;
+  }
+
+  // The audio thread's check, before and after
+  void* checked_voice_skin = voice_skins[0];
+  const double sdk_check_ns = time_check([&] {
+    int is_authenticated = 0;
+    modulate_voice_skin_check_authenticated(checked_voice_skin, &is_authenticated);
+    return is_authenticated != 0;
+  });
+  const double cached_check_ns = time_check([&] {return authenticator.is_authenticated(checked_voice_skin);});
+  destroy_skins(voice_skins);
+
+  // A batch with one bad signature authenticates none of its skins
+  voice_skins = create_skins(filename, skin_count);
+  VoiceSkinAuthenticator rejecting_authenticator;
+  server.set_corrupt_index(skin_count / 2);
+  error_code = rejecting_authenticator.create_batch_request(voice_skins, api_key, threads, request, failed_index);
+  if(!error_code)
+    error_code = rejecting_authenticator.apply_batch_response(server.post("/authenticate_batch", request), failed_index);
+  size_t authenticated_after_rejection = 0;
+  for(void* voice_skin : voice_skins)
+    authenticated_after_rejection += rejecting_authenticator.is_authenticated(voice_skin) ? 1 : 0;
+  destroy_skins(voice_skins);
+  const bool rejection_ok = error_code != 0 && failed_index == skin_count / 2 && authenticated_after_rejection == 0;
+
+  std::cout << skin_count << " skins, " << message_ms << "ms to create each message, " << server_ms
+            << "ms per server request\n"
+            << "mode                  requests   messages ms   total ms\n";
+  char line[200];
+  snprintf(line, sizeof(line), "%-21s %8zu %13s %10.1f\n", "one at a time (old)", single_requests, "-", single_ms);
+  std::cout << line;
+  snprintf(line, sizeof(line), "%-21s %8zu %13.1f %10.1f\n", "batch", batch_requests, batch_messages_ms, batch_ms);
+  std::cout << line;
+  std::cout << "bad signature in a batch: error code " << error_code << " at skin " << failed_index << ", "
+            << authenticated_after_rejection << " of " << skin_count << " skins authenticated - "
+            << (rejection_ok ? "ok" : "FAILED") << "\n";
+  snprintf(line, sizeof(line), "authentication check per frame: SDK %.1fns, cached %.1fns\n", sdk_check_ns, cached_check_ns);
+  std::cout << line;
+
+  fs::remove_all(scratch_directory);
+  return rejection_ok ? 0 : 1;
+}
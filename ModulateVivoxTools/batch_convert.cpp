@@ -0,0 +1,321 @@
+// Offline batch conversion of WAV files through a voice skin.
+//
+// Audio goes through the same steps as ModulateVivoxIntegration::convert: the first
+// channel is converted to float, pushed through modulate_voice_skin_helper_generate
+// in callback-sized frames, and the result is written back to every channel.  Files
+// are converted in parallel, with one voice skin and helper per worker thread.
+//
+// Usage: batch_convert [options] <voice_skin.mod> <input_dir> <output_dir>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "modulate/modulate.h"
+#include "audio_kernels.hpp"
+#include "wav_file.hpp"
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+#define MODULATE_MAX_SEGMENT_SIZE 2400
+
+namespace fs = std::filesystem;
+
+struct BatchOptions {
+  std::string voice_skin_filename;
+  std::string input_directory;
+  std::string output_directory;
+  unsigned int threads = 0;
+  float frame_ms = 10.0f;
+  float tail_ms = 0.0f;
+  std::string api_key_filename;
+  std::string auth_command;
+  modulate_parameters params = modulate_build_default_parameters_struct();
+};
+
+struct FileResult {
+  std::string error;
+  double audio_seconds = 0.0;
+  double processing_seconds = 0.0;
+};
+
+static void print_usage() {
+  std::cerr << "Usage: batch_convert [options] <voice_skin.mod> <input_dir> <output_dir>\n"
+            << "Converts every .wav file in input_dir with the voice skin, writing results to output_dir.\n"
+            << "Options:\n"
+            << "  --threads N            worker threads (default: one per core)\n"
+            << "  --frame-ms MS          callback frame length, up to 100ms (default 10)\n"
+            << "  --tail-ms MS           silence appended to each file to flush the model latency (default 0)\n"
+            << "  --radio X, --presence X, --bass-booster X, --intimidator X, --helm X, --vivid X\n"
+            << "                         filter strengths in [0, 1] (default 0)\n"
+            << "  --api-key FILE         API key used to authenticate each worker's voice skin\n"
+            << "  --auth-command CMD     command run as 'CMD <auth message>' that prints the signed\n"
+            << "                         response from the authentication server\n";
+}
+
+static bool parse_options(int argc, char** argv, BatchOptions& options) {
+  std::vector<std::string> positional;
+  for(int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const bool has_value = i + 1 < argc;
+    if(arg == "--help" || arg == "-h") {
+      return false;
+    } else if(arg.rfind("--", 0) == 0 && !has_value) {
+      std::cerr << "Missing value for " << arg << std::endl;
+      return false;
+    } else if(arg == "--threads") {
+      options.threads = (unsigned int)atoi(argv[++i]);
+    } else if(arg == "--frame-ms") {
+      options.frame_ms = (float)atof(argv[++i]);
+    } else if(arg == "--tail-ms") {
+      options.tail_ms = (float)atof(argv[++i]);
+    } else if(arg == "--radio") {
+      options.params.radio_strength = (float)atof(argv[++i]);
+    } else if(arg == "--presence") {
+      options.params.presence_strength = (float)atof(argv[++i]);
+    } else if(arg == "--bass-booster") {
+      options.params.bass_booster_strength = (float)atof(argv[++i]);
+    } else if(arg == "--intimidator") {
+      options.params.intimidator_strength = (float)atof(argv[++i]);
+    } else if(arg == "--helm") {
+      options.params.helm_strength = (float)atof(argv[++i]);
+    } else if(arg == "--vivid") {
+      options.params.vivid_strength = (float)atof(argv[++i]);
+    } else if(arg == "--api-key") {
+      options.api_key_filename = argv[++i];
+    } else if(arg == "--auth-command") {
+      options.auth_command = argv[++i];
+    } else if(arg.rfind("--", 0) == 0) {
+      std::cerr << "Unknown option " << arg << std::endl;
+      return false;
+    } else {
+      positional.push_back(arg);
+    }
+  }
+  if(positional.size() != 3)
+    return false;
+  if(options.frame_ms <= 0.0f || options.frame_ms > 100.0f) {
+    std::cerr << "--frame-ms must be in (0, 100]" << std::endl;
+    return false;
+  }
+  options.voice_skin_filename = positional[0];
+  options.input_directory = positional[1];
+  options.output_directory = positional[2];
+  if(options.threads == 0)
+    options.threads = std::max(1u, std::thread::hardware_concurrency());
+  return true;
+}
+
+static std::string trim(const std::string& value) {
+  const size_t start = value.find_first_not_of(" \t\r\n");
+  if(start == std::string::npos)
+    return "";
+  const size_t end = value.find_last_not_of(" \t\r\n");
+  return value.substr(start, end - start + 1);
+}
+
+// Voice skins only generate audio once authenticated.  The Modulate authentication
+// server is reached through a user-supplied command, so that this tool doesn't need
+// an HTTP client of its own.
+static bool authenticate_voice_skin(void* voice_skin, const BatchOptions& options, std::string& error) {
+  int is_authenticated = 0;
+  modulate_voice_skin_check_authenticated(voice_skin, &is_authenticated);
+  if(is_authenticated)
+    return true;
+  if(options.api_key_filename.empty() || options.auth_command.empty()) {
+    error = "voice skin is not authenticated - pass --api-key and --auth-command";
+    return false;
+  }
+
+  std::ifstream api_key_file(options.api_key_filename);
+  std::string api_key;
+  std::getline(api_key_file, api_key);
+  api_key = trim(api_key);
+  if(api_key.empty()) {
+    error = "couldn't read an API key from " + options.api_key_filename;
+    return false;
+  }
+
+  char msg[MODULATE_AUTHENTICATION_MESSAGE_LENGTH];
+  if(modulate_voice_skin_create_authentication_message(voice_skin, api_key.c_str(), msg, sizeof(msg))) {
+    error = "couldn't create an authentication message";
+    return false;
+  }
+
+  const std::string command = options.auth_command + " " + msg;
+  FILE* pipe = popen(command.c_str(), "r");
+  if(!pipe) {
+    error = "couldn't run " + options.auth_command;
+    return false;
+  }
+  std::string response;
+  char buffer[256];
+  while(fgets(buffer, sizeof(buffer), pipe))
+    response += buffer;
+  pclose(pipe);
+
+  if(modulate_voice_skin_check_authentication_message(voice_skin, trim(response).c_str())) {
+    error = "authentication server response was rejected";
+    return false;
+  }
+  return true;
+}
+
+// Mirrors ModulateVivoxIntegration::convert, one callback-sized frame at a time
+static bool convert_wav(void* voice_skin, void* voice_skin_helper, float* float_buffer,
+                        WavFile& wav, const BatchOptions& options, std::string& error) {
+  const AudioKernels& kernels = get_audio_kernels();
+  const size_t frame_size = std::max((size_t)1, (size_t)(wav.sample_rate * options.frame_ms / 1000.0f));
+
+  // Each file is its own stream, so start from a clean model and resampler state
+  modulate_voice_skin_reset(voice_skin);
+  modulate_voice_skin_helper_reset(voice_skin_helper, wav.sample_rate);
+
+  for(size_t offset = 0; offset < wav.frame_count(); offset += frame_size) {
+    const size_t pcm_frame_count = std::min(frame_size, wav.frame_count() - offset);
+    short* pcm_frames = wav.samples.data() + offset * wav.channels;
+
+    kernels.int16_to_float_strided(pcm_frames, wav.channels, float_buffer, pcm_frame_count);
+    const int error_code = modulate_voice_skin_helper_generate(voice_skin,
+                                                               voice_skin_helper,
+                                                               float_buffer,
+                                                               float_buffer,
+                                                               (unsigned int)pcm_frame_count,
+                                                               wav.sample_rate,
+                                                               &options.params);
+    if(error_code) {
+      error = "modulate_voice_skin_helper_generate returned error code " + std::to_string(error_code);
+      return false;
+    }
+    kernels.float_to_int16_fan_out(float_buffer, pcm_frames, pcm_frame_count, wav.channels);
+  }
+  return true;
+}
+
+static void worker_task(const BatchOptions& options,
+                        const std::vector<fs::path>& inputs,
+                        std::vector<FileResult>& results,
+                        std::atomic<size_t>& next_input,
+                        std::mutex& print_mutex) {
+  void* voice_skin = nullptr;
+  void* voice_skin_helper = nullptr;
+  std::string setup_error;
+  if(modulate_voice_skin_create(MODULATE_MAX_SEGMENT_SIZE, options.voice_skin_filename.c_str(), &voice_skin))
+    setup_error = "couldn't load voice skin " + options.voice_skin_filename;
+  else if(modulate_voice_skin_helper_create(&voice_skin_helper, MODULATE_MAX_SEGMENT_SIZE))
+    setup_error = "couldn't create voice skin helper";
+  else
+    authenticate_voice_skin(voice_skin, options, setup_error);
+
+  // Enough room for the largest frame at the highest sample rate we'd expect
+  std::vector<float> float_buffer((size_t)(192000 * options.frame_ms / 1000.0f) + 1);
+
+  for(size_t index = next_input++; index < inputs.size(); index = next_input++) {
+    FileResult& result = results[index];
+    if(!setup_error.empty()) {
+      result.error = setup_error;
+      continue;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    WavFile wav;
+    const fs::path output = fs::path(options.output_directory) / inputs[index].filename();
+    if(read_wav_file(inputs[index].string(), wav, result.error)) {
+      const size_t tail_frames = (size_t)(wav.sample_rate * options.tail_ms / 1000.0f);
+      wav.samples.resize(wav.samples.size() + tail_frames * wav.channels, 0);
+      if((size_t)(wav.sample_rate * options.frame_ms / 1000.0f) > float_buffer.size())
+        result.error = "sample rate " + std::to_string(wav.sample_rate) + " is too high";
+      else if(convert_wav(voice_skin, voice_skin_helper, float_buffer.data(), wav, options, result.error))
+        write_wav_file(output.string(), wav, result.error);
+    }
+    result.audio_seconds = wav.duration_seconds();
+    result.processing_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::lock_guard<std::mutex> lock(print_mutex);
+    if(result.error.empty())
+      std::cout << inputs[index].filename().string() << ": " << result.audio_seconds << "s of audio in "
+                << result.processing_seconds << "s" << std::endl;
+    else
+      std::cerr << inputs[index].filename().string() << ": " << result.error << std::endl;
+  }
+
+  if(voice_skin_helper)
+    modulate_voice_skin_helper_destroy(&voice_skin_helper);
+  if(voice_skin)
+    modulate_voice_skin_destroy(&voice_skin);
+}
+
+int main(int argc, char** argv) {
+  BatchOptions options;
+  if(!parse_options(argc, argv, options)) {
+    print_usage();
+    return 2;
+  }
+
+  std::vector<fs::path> inputs;
+  std::error_code ec;
+  for(const fs::directory_entry& entry : fs::directory_iterator(options.input_directory, ec)) {
+    std::string extension = entry.path().extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if(entry.is_regular_file() && extension == ".wav")
+      inputs.push_back(entry.path());
+  }
+  if(ec) {
+    std::cerr << "Couldn't read " << options.input_directory << ": " << ec.message() << std::endl;
+    return 1;
+  }
+  std::sort(inputs.begin(), inputs.end());
+  fs::create_directories(options.output_directory, ec);
+  if(ec) {
+    std::cerr << "Couldn't create " << options.output_directory << ": " << ec.message() << std::endl;
+    return 1;
+  }
+
+  const unsigned int threads = std::min(options.threads, (unsigned int)std::max((size_t)1, inputs.size()));
+  std::cout << "Converting " << inputs.size() << " files on " << threads << " threads using "
+            << get_audio_kernels().name << " sample conversion" << std::endl;
+
+  std::vector<FileResult> results(inputs.size());
+  std::atomic<size_t> next_input(0);
+  std::mutex print_mutex;
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for(unsigned int i = 0; i < threads; i++)
+    workers.emplace_back(worker_task, std::cref(options), std::cref(inputs), std::ref(results),
+                         std::ref(next_input), std::ref(print_mutex));
+  for(std::thread& worker : workers)
+    worker.join();
+  const double wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  size_t failures = 0;
+  double audio_seconds = 0.0;
+  double processing_seconds = 0.0;
+  for(const FileResult& result : results) {
+    if(!result.error.empty()) {
+      failures++;
+      continue;
+    }
+    audio_seconds += result.audio_seconds;
+    processing_seconds += result.processing_seconds;
+  }
+
+  std::cout << "Converted " << (inputs.size() - failures) << "/" << inputs.size() << " files: "
+            << audio_seconds << "s of audio in " << wall_seconds << "s" << std::endl;
+  if(wall_seconds > 0.0 && processing_seconds > 0.0)
+    std::cout << "Throughput: " << audio_seconds / wall_seconds << "x realtime overall, "
+              << audio_seconds / processing_seconds << "x realtime per thread" << std::endl;
+  return failures ? 1 : 0;
+}
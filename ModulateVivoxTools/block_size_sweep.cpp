@@ -0,0 +1,234 @@
+// Measures the cost of the voice skin at a range of model block sizes (see FrameRebuffer),
+// to pick the block size for a machine: smaller blocks mean less delay, but each voice skin
+// call has a fixed cost, so they cost more per sample.
+//
+// Drives the capture callback through the stub VivoxBase with Vivox-sized frames of noise,
+// once per block size, and reports for each the voice skin's time per sample and realtime
+// factor, the time per block and per callback (a callback that completes a block pays for
+// all of it), and the delay the rebuffering adds - as reported, and as measured by lining
+// the output up with the input (which also counts any change in the voice skin path's own
+// delay, e.g. where blocks let odd-sized frames take the native rate fast path).  Finally it suggests the smallest block with a realtime
+// factor within the budget and no callback over its deadline at the 99th percentile.
+//
+// Link against the real library to measure a real voice skin.  With the stub, set
+// MODULATE_STUB_CALL_US and MODULATE_STUB_US_PER_MS to give it a cost to measure.
+//
+// Usage: block_size_sweep [--rate HZ] [--frame N] [--blocks MS,MS,...] [--seconds S]
+//                         [--budget F] [--csv]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "modulate/modulate.h"
+#include "ModulateVivoxIntegration.hpp"
+#include "VivoxBase.hpp"
+
+#define MODULATE_MAX_SEGMENT_SIZE 2400
+// Longest lag looked for when measuring the delay, and how much output it's measured over
+#define SWEEP_MAX_LAG 4096
+#define SWEEP_LAG_WINDOW 16384
+
+struct SweepResult {
+  float block_ms;
+  size_t block_size;
+  double ns_per_sample;    // callback time over the audio converted
+  double realtime_factor;
+  double block_p99_ms;
+  double callback_p99_us;
+  double callback_max_us;
+  double frame_us;         // a callback's deadline
+  double reported_latency_ms;
+  long lag_samples;        // -1 if the output didn't line up with the input
+  uint64_t underruns;
+};
+
+// Noise low-passed well below the model's Nyquist frequency, so that it comes through intact
+static std::vector<short> make_noise(size_t count, int sample_rate) {
+  std::vector<short> noise(count);
+  uint32_t state = 12345;
+  const double a = exp(-2 * M_PI * 4000.0 / sample_rate);
+  double y1 = 0.0, y2 = 0.0;
+  for(size_t i = 0; i < count; i++) {
+    state = state * 1664525u + 1013904223u;
+    const double x = ((state >> 8) / (double)(1 << 24)) * 2.0 - 1.0;
+    y1 = (1 - a) * x + a * y1;
+    y2 = (1 - a) * y1 + a * y2;
+    noise[i] = (short)std::max(-32768.0, std::min(32767.0, 60000.0 * y2));
+  }
+  return noise;
+}
+
+static long find_lag(const std::vector<short>& input, const std::vector<short>& output, size_t from) {
+  long best_lag = -1;
+  double best = 0.0;
+  for(long lag = 0; lag < SWEEP_MAX_LAG; lag++) {
+    double correlation = 0.0, output_energy = 0.0, input_energy = 0.0;
+    for(size_t i = from; i < std::min(output.size(), from + SWEEP_LAG_WINDOW); i++) {
+      correlation += (double)output[i] * input[i - lag];
+      output_energy += (double)output[i] * output[i];
+      input_energy += (double)input[i - lag] * input[i - lag];
+    }
+    const double normalized = output_energy > 0.0 && input_energy > 0.0 ? correlation / sqrt(output_energy * input_energy) : 0.0;
+    if(normalized > best) {
+      best = normalized;
+      best_lag = lag;
+    }
+  }
+  return best > 0.9 ? best_lag : -1;
+}
+
+static SweepResult run_block_size(float block_ms, int sample_rate, int frame_count, int frames, void* voice_skin,
+                                  const std::string& log_directory) {
+  ModulateVivoxIntegration integration(MODULATE_MAX_SEGMENT_SIZE, voice_skin, log_directory.c_str());
+  VivoxBase* vivox = VivoxBase::latest();
+  integration.set_wav_logging_enabled(false);
+  integration.set_silence_gate(false, -50.0f, 300.0f);
+  integration.set_model_block_ms(block_ms);
+
+  // The skin is prepared off the audio thread, and until then the output is silent
+  std::vector<short> frame(frame_count);
+  const std::vector<short> warm_up = make_noise(frame_count, sample_rate);
+  for(int attempt = 0; attempt < 2000; attempt++) {
+    frame = warm_up;
+    vivox->capture("sweep", frame.data(), frame_count, sample_rate, 1);
+    if(std::any_of(frame.begin(), frame.end(), [](short s) {return s != 0;}))
+      break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  const size_t total = (size_t)frames * frame_count;
+  const std::vector<short> input = make_noise(total, sample_rate);
+  std::vector<short> output(total);
+  std::vector<double> callback_us(frames);
+  for(int i = 0; i < frames; i++) {
+    std::copy(input.begin() + (size_t)i * frame_count, input.begin() + (size_t)(i + 1) * frame_count, frame.begin());
+    const auto start = std::chrono::steady_clock::now();
+    vivox->capture("sweep", frame.data(), frame_count, sample_rate, 1);
+    callback_us[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    std::copy(frame.begin(), frame.end(), output.begin() + (size_t)i * frame_count);
+  }
+
+  const ConversionPerformanceStats stats = integration.get_performance_stats();
+  const FramingStats framing = integration.get_framing_stats();
+  SweepResult result;
+  result.block_ms = block_ms;
+  result.block_size = framing.block_size;
+  double sum = 0.0;
+  for(double us : callback_us)
+    sum += us;
+  // The callbacks do little besides converting, so their time stands in for the voice skin's
+  result.ns_per_sample = 1000.0 * sum / total;
+  result.realtime_factor = stats.realtime_factor;
+  result.block_p99_ms = stats.p99_ms;
+  std::sort(callback_us.begin(), callback_us.end());
+  result.callback_p99_us = callback_us[std::min(callback_us.size() - 1, (size_t)(0.99 * callback_us.size()))];
+  result.callback_max_us = callback_us.back();
+  result.frame_us = 1e6 * frame_count / sample_rate;
+  result.reported_latency_ms = framing.latency_ms;
+  result.lag_samples = find_lag(input, output, SWEEP_MAX_LAG);
+  result.underruns = framing.underruns;
+  return result;
+}
+
+int main(int argc, char** argv) {
+  int sample_rate = 48000;
+  int frame_count = 480;
+  std::vector<float> blocks_ms = {0.0f, 2.5f, 5.0f, 10.0f, 20.0f, 40.0f};
+  double seconds = 5.0;
+  double budget = 0.5;
+  bool csv = false;
+  for(int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if(arg == "--rate" && i + 1 < argc)
+      sample_rate = std::max(8000, atoi(argv[++i]));
+    else if(arg == "--frame" && i + 1 < argc)
+      frame_count = std::max(1, atoi(argv[++i]));
+    else if(arg == "--blocks" && i + 1 < argc) {
+      blocks_ms.clear();
+      std::stringstream list(argv[++i]);
+      std::string item;
+      while(std::getline(list, item, ','))
+        blocks_ms.push_back((float)atof(item.c_str()));
+    } else if(arg == "--seconds" && i + 1 < argc)
+      seconds = std::max(0.5, atof(argv[++i]));
+    else if(arg == "--budget" && i + 1 < argc)
+      budget = atof(argv[++i]);
+    else if(arg == "--csv")
+      csv = true;
+    else {
+      std::cerr << "Usage: block_size_sweep [--rate HZ] [--frame N] [--blocks MS,MS,...] [--seconds S] [--budget F] [--csv]"
+                << std::endl;
+      return 2;
+    }
+  }
+  // Long enough to measure the delay over, whatever the frame size
+  const int frames = std::max((int)(seconds * sample_rate / frame_count), (SWEEP_MAX_LAG + SWEEP_LAG_WINDOW) / frame_count + 1);
+
+  const std::string log_directory = (std::filesystem::temp_directory_path() / "modulate_block_size_sweep").string();
+  void* voice_skin = nullptr;
+  if(modulate_voice_skin_create(MODULATE_MAX_SEGMENT_SIZE, "sweep_skin.mod", &voice_skin)) {
+    std::cerr << "Couldn't create a voice skin" << std::endl;
+    return 1;
+  }
+
+  std::vector<SweepResult> results;
+  for(float block_ms : blocks_ms)
+    results.push_back(run_block_size(block_ms, sample_rate, frame_count, frames, voice_skin, log_directory));
+  // The delay measured with Vivox's own framing is the voice skin's, not the rebuffering's
+  long baseline_lag = -1;
+  for(const SweepResult& result : results)
+    if(result.block_size == 0)
+      baseline_lag = result.lag_samples;
+
+  if(csv)
+    std::cout << "block_ms,block_size,ns_per_sample,realtime_factor,block_p99_ms,callback_p99_us,callback_max_us,"
+                 "reported_latency_ms,measured_latency_ms,underruns\n";
+  else
+    std::cout << "Modulate library " << modulate_get_version() << ", " << sample_rate << "Hz, " << frame_count
+              << "-sample frames (" << 1e3 * frame_count / sample_rate << " ms), " << frames << " frames each\n"
+              << "block ms  samples  ns/sample  realtime  block p99 ms  callback p99 us  callback max us"
+                 "  latency ms  measured ms\n";
+  const SweepResult* best = nullptr;
+  for(const SweepResult& result : results) {
+    double measured_ms = NAN;
+    if(result.lag_samples >= 0 && baseline_lag >= 0)
+      measured_ms = 1000.0 * (result.lag_samples - baseline_lag) / sample_rate;
+    char line[256];
+    if(csv)
+      snprintf(line, sizeof(line), "%g,%zu,%.2f,%.4f,%.4f,%.1f,%.1f,%.3f,%.3f,%llu\n", result.block_ms, result.block_size,
+               result.ns_per_sample, result.realtime_factor, result.block_p99_ms, result.callback_p99_us, result.callback_max_us,
+               result.reported_latency_ms, measured_ms, (unsigned long long)result.underruns);
+    else
+      snprintf(line, sizeof(line), "%8g %8zu %10.2f %9.4f %13.4f %16.1f %16.1f %11.3f %12.3f%s\n", result.block_ms,
+               result.block_size, result.ns_per_sample, result.realtime_factor, result.block_p99_ms, result.callback_p99_us,
+               result.callback_max_us, result.reported_latency_ms, measured_ms, result.underruns ? "  underruns!" : "");
+    std::cout << line;
+    const bool fits = result.realtime_factor <= budget && result.callback_p99_us <= result.frame_us;
+    // The least delay, and of blocks that add the same, the cheapest
+    if(fits && (!best || result.reported_latency_ms < best->reported_latency_ms ||
+                (result.reported_latency_ms == best->reported_latency_ms && result.realtime_factor < best->realtime_factor)))
+      best = &result;
+  }
+  if(!csv) {
+    if(best && best->block_size)
+      std::cout << "Suggested: set_model_block_ms(" << best->block_ms << "), adding " << best->reported_latency_ms
+                << " ms, within a realtime factor of " << budget << "\n";
+    else if(best)
+      std::cout << "Suggested: Vivox's own framing (set_model_block_ms(0)), within a realtime factor of " << budget << "\n";
+    else
+      std::cout << "No block size keeps within a realtime factor of " << budget << " on this machine\n";
+  }
+
+  modulate_voice_skin_destroy(&voice_skin);
+  std::filesystem::remove_all(log_directory);
+  return 0;
+}
@@ -0,0 +1,227 @@
+// Microbenchmark of the Vivox capture and render callbacks in ModulateVivoxIntegration.
+//
+// Drives modulate_convert_before_audio_sent and modulate_before_audio_rendered
+// directly with synthetic PCM, through the stub VivoxBase and a stub (or real)
+// voice skin, sweeping the sample rates, channel counts and frame sizes Vivox uses,
+// with echo and WAV logging switched on and off.  This measures the integration
+// layer on its own - with the stub library, the voice skin itself costs nothing.
+// With --pipelined, the voice skin runs on the pipeline worker thread instead, and
+// the capture numbers are just the cost of queueing.
+//
+// Usage: callback_bench [--iterations N] [--format table|csv|json] [--output FILE] [--log-dir DIR]
+//                       [--pipelined DELAY_FRAMES]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "modulate/modulate.h"
+#include "ModulateVivoxIntegration.hpp"
+#include "VivoxBase.hpp"
+
+#define MODULATE_MAX_SEGMENT_SIZE 2400
+#define MODULATE_MODEL_SAMPLE_RATE 24000
+
+// Count heap allocations made by the benchmarking thread, so that background
+// threads (e.g. the WAV loggers) don't show up in the per-callback numbers
+static thread_local size_t thread_allocation_count = 0;
+
+void* operator new(size_t size) {
+  thread_allocation_count++;
+  if(void* ptr = malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc();
+}
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+void operator delete[](void* ptr) noexcept {
+  free(ptr);
+}
+void operator delete(void* ptr, size_t size) noexcept {
+  free(ptr);
+}
+void operator delete[](void* ptr, size_t size) noexcept {
+  free(ptr);
+}
+
+struct BenchConfig {
+  int sample_rate;
+  int channels;
+  int frame_count;
+  bool echo;
+  bool logging;
+};
+
+struct BenchResult {
+  BenchConfig config;
+  double capture_ns_per_callback;
+  double render_ns_per_callback;
+  double ns_per_sample; // capture and render together, per sample frame
+  double allocations_per_callback;
+};
+
+static BenchResult run_config(ModulateVivoxIntegration& integration, VivoxBase& vivox, const BenchConfig& config, int iterations) {
+  std::vector<short> capture_frames((size_t)config.frame_count * config.channels);
+  std::vector<short> render_frames(capture_frames.size());
+  std::vector<short> source(capture_frames.size());
+  for(int i = 0; i < config.frame_count; i++)
+    for(int channel = 0; channel < config.channels; channel++)
+      source[(size_t)i * config.channels + channel] = (short)(8000 * sin(2 * M_PI * 220.0 * i / config.sample_rate));
+
+  if(config.echo)
+    integration.start_realtime_echo();
+  else
+    integration.end_realtime_echo();
+  integration.set_wav_logging_enabled(config.logging);
+
+  const int warmup_iterations = std::max(10, iterations / 10);
+  std::chrono::steady_clock::duration capture_time(0);
+  std::chrono::steady_clock::duration render_time(0);
+  size_t allocations = 0;
+  for(int iteration = -warmup_iterations; iteration < iterations; iteration++) {
+    std::copy(source.begin(), source.end(), capture_frames.begin());
+    std::fill(render_frames.begin(), render_frames.end(), (short)0);
+    const size_t allocations_before = thread_allocation_count;
+
+    const auto capture_start = std::chrono::steady_clock::now();
+    vivox.capture("bench", capture_frames.data(), config.frame_count, config.sample_rate, config.channels);
+    const auto render_start = std::chrono::steady_clock::now();
+    vivox.render("bench", render_frames.data(), config.frame_count, config.sample_rate, config.channels);
+    const auto render_end = std::chrono::steady_clock::now();
+
+    if(iteration >= 0) {
+      capture_time += render_start - capture_start;
+      render_time += render_end - render_start;
+      allocations += thread_allocation_count - allocations_before;
+    }
+  }
+
+  BenchResult result;
+  result.config = config;
+  result.capture_ns_per_callback = std::chrono::duration<double, std::nano>(capture_time).count() / iterations;
+  result.render_ns_per_callback = std::chrono::duration<double, std::nano>(render_time).count() / iterations;
+  result.ns_per_sample = (result.capture_ns_per_callback + result.render_ns_per_callback) / config.frame_count;
+  result.allocations_per_callback = (double)allocations / (2.0 * iterations);
+  return result;
+}
+
+static void print_result(std::ostream& out, const std::string& format, const BenchResult& result) {
+  const BenchConfig& c = result.config;
+  if(format == "csv") {
+    out << c.sample_rate << "," << c.channels << "," << c.frame_count << "," << c.echo << "," << c.logging << ","
+        << result.capture_ns_per_callback << "," << result.render_ns_per_callback << ","
+        << result.ns_per_sample << "," << result.allocations_per_callback << "\n";
+  } else if(format == "json") {
+    out << "{\"modulate_version\": " << modulate_get_version()
+        << ", \"kernels\": \"" << get_audio_kernels().name << "\""
+        << ", \"sample_rate\": " << c.sample_rate << ", \"channels\": " << c.channels
+        << ", \"frame_count\": " << c.frame_count
+        << ", \"echo\": " << (c.echo ? "true" : "false") << ", \"logging\": " << (c.logging ? "true" : "false")
+        << ", \"capture_ns_per_callback\": " << result.capture_ns_per_callback
+        << ", \"render_ns_per_callback\": " << result.render_ns_per_callback
+        << ", \"ns_per_sample\": " << result.ns_per_sample
+        << ", \"allocations_per_callback\": " << result.allocations_per_callback << "}\n";
+  } else {
+    char line[160];
+    snprintf(line, sizeof(line), "%6d %2d %5d %4s %4s %12.0f %12.0f %9.2f %8.2f\n",
+             c.sample_rate, c.channels, c.frame_count, c.echo ? "on" : "off", c.logging ? "on" : "off",
+             result.capture_ns_per_callback, result.render_ns_per_callback,
+             result.ns_per_sample, result.allocations_per_callback);
+    out << line;
+  }
+}
+
+int main(int argc, char** argv) {
+  int iterations = 2000;
+  std::string format = "table";
+  std::string output_filename;
+  std::string log_directory = (std::filesystem::temp_directory_path() / "modulate_callback_bench").string();
+  int pipeline_delay_frames = 0;
+  for(int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if(arg == "--iterations" && i + 1 < argc)
+      iterations = std::max(1, atoi(argv[++i]));
+    else if(arg == "--format" && i + 1 < argc)
+      format = argv[++i];
+    else if(arg == "--output" && i + 1 < argc)
+      output_filename = argv[++i];
+    else if(arg == "--log-dir" && i + 1 < argc)
+      log_directory = argv[++i];
+    else if(arg == "--pipelined" && i + 1 < argc)
+      pipeline_delay_frames = std::max(1, atoi(argv[++i]));
+    else {
+      std::cerr << "Usage: callback_bench [--iterations N] [--format table|csv|json] [--output FILE] [--log-dir DIR]"
+                << " [--pipelined DELAY_FRAMES]" << std::endl;
+      return 2;
+    }
+  }
+
+  std::ofstream output_file;
+  if(!output_filename.empty())
+    output_file.open(output_filename);
+  std::ostream& out = output_filename.empty() ? std::cout : output_file;
+
+  void* voice_skin = nullptr;
+  if(modulate_voice_skin_create(MODULATE_MAX_SEGMENT_SIZE, "bench_voice_skin.mod", &voice_skin)) {
+    std::cerr << "Couldn't create a voice skin" << std::endl;
+    return 1;
+  }
+  modulate_voice_skin_reset(voice_skin);
+
+  int failures = 0;
+  {
+    ModulateVivoxIntegration integration(MODULATE_MAX_SEGMENT_SIZE, voice_skin, log_directory.c_str());
+    VivoxBase* vivox = VivoxBase::latest();
+    if(pipeline_delay_frames)
+      integration.set_pipelined_conversion(true, pipeline_delay_frames, DeadlineMissPolicy::repeat_last_frame);
+
+    if(format == "csv")
+      out << "sample_rate,channels,frame_count,echo,logging,capture_ns_per_callback,render_ns_per_callback,ns_per_sample,allocations_per_callback\n";
+    else if(format == "table")
+      out << "Modulate library " << modulate_get_version() << ", " << get_audio_kernels().name << " kernels, "
+          << iterations << " iterations per row"
+          << (pipeline_delay_frames ? ", pipelined" : "") << "\n"
+          << "  rate ch  frame echo  log   capture ns    render ns ns/sample allocs/cb\n";
+
+    const int sample_rates[] = {8000, 16000, 24000, 32000, 44100, 48000};
+    const int channel_counts[] = {1, 2};
+    const int frame_counts[] = {80, 160, 240, 320, 441, 480, 512, 960, 1024, 2048};
+    for(int sample_rate : sample_rates)
+      for(int channels : channel_counts)
+        for(int frame_count : frame_counts) {
+          // Skip frames longer than the voice skin was created to handle
+          if((long long)frame_count * MODULATE_MODEL_SAMPLE_RATE > (long long)MODULATE_MAX_SEGMENT_SIZE * sample_rate)
+            continue;
+          for(int echo = 0; echo < 2; echo++)
+            for(int logging = 0; logging < 2; logging++) {
+              const BenchConfig config = {sample_rate, channels, frame_count, echo != 0, logging != 0};
+              const BenchResult result = run_config(integration, *vivox, config, iterations);
+              if(result.allocations_per_callback > 0.0)
+                failures++;
+              print_result(out, format, result);
+            }
+        }
+
+    if(pipeline_delay_frames) {
+      const ConversionPipelineStats stats = integration.get_pipeline_stats();
+      std::cerr << stats.frames << " frames through the pipeline, " << stats.deadline_misses << " deadline misses, "
+                << stats.input_overruns << " input overruns" << std::endl;
+    }
+  }
+
+  modulate_voice_skin_destroy(&voice_skin);
+  if(failures)
+    std::cerr << failures << " configurations allocated memory on the audio thread" << std::endl;
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,66 @@
+// Decodes compressed session logs (see WavSampleFormat::flac) back to WAV files.
+//
+// Checks every frame, and reports each log's length and its compression ratio against
+// the 16-bit WAV it replaces.  Without an output file it only checks the logs.
+//
+// Usage: decode_log <log.flac> [output.wav]
+//        decode_log <log.flac>...
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "flac_file.hpp"
+#include "wav_file.hpp"
+
+static bool is_flac_filename(const std::string& filename) {
+  return std::filesystem::path(filename).extension() == ".flac";
+}
+
+int main(int argc, char** argv) {
+  std::vector<std::string> inputs;
+  std::string output;
+  for(int i = 1; i < argc; i++)
+    inputs.push_back(argv[i]);
+  // A second name that isn't a log is where to write the audio
+  if(inputs.size() == 2 && !is_flac_filename(inputs[1])) {
+    output = inputs[1];
+    inputs.pop_back();
+  }
+  if(inputs.empty()) {
+    std::cerr << "Usage: decode_log <log.flac> [output.wav]\n"
+              << "       decode_log <log.flac>..." << std::endl;
+    return 2;
+  }
+
+  int failures = 0;
+  for(const std::string& input : inputs) {
+    WavFile wav;
+    std::string error;
+    const auto start = std::chrono::steady_clock::now();
+    if(!read_flac_file(input, wav, error)) {
+      std::cerr << error << std::endl;
+      failures++;
+      continue;
+    }
+    const double decode_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const double file_bytes = (double)std::filesystem::file_size(input);
+    const double wav_bytes = 44.0 + wav.samples.size() * sizeof(short);
+
+    char line[512];
+    snprintf(line, sizeof(line), "%s: %.1fs at %uHz, %u channel(s), %.0f bytes, %.2f:1 against 16-bit WAV, decoded at %.0fx realtime\n",
+             input.c_str(), wav.duration_seconds(), wav.sample_rate, wav.channels, file_bytes,
+             file_bytes > 0 ? wav_bytes / file_bytes : 0.0,
+             decode_seconds > 0 ? wav.duration_seconds() / decode_seconds : 0.0);
+    std::cout << line;
+
+    if(!output.empty() && !write_wav_file(output, wav, error)) {
+      std::cerr << error << std::endl;
+      failures++;
+    }
+  }
+  return failures ? 1 : 0;
+}
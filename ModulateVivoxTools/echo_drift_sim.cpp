@@ -0,0 +1,204 @@
+// Runs the realtime echo path of the capture and render callbacks - EchoBuffer's push and
+// mix_into, called as the callbacks call them - as two devices on different clocks would,
+// a headset mic and the speakers say, for hours of simulated time, to check that it
+// follows the drift between them.
+//
+// The capture device runs --drift-ppm faster than its nominal rate (negative for slower),
+// and each callback arrives up to --jitter-ms late.  The capture side sends a sine, and the
+// render side checks what comes back: frames of silence once echo has started are dropouts,
+// and jumps bigger than the sine can make are glitches (the ring skipping ahead, or
+// restarting after running dry).  Every --report-minutes it prints the fill of the echo
+// ring, the drift the render side is correcting for, and what went wrong.
+//
+// Time is simulated, so hours take seconds - which is why this drives the EchoBuffer
+// rather than the callbacks themselves, as they read the real clock.  Try
+// --no-compensation to see the fill walk off without the drift loop.
+//
+// Usage: echo_drift_sim [--hours H] [--capture-rate HZ] [--render-rate HZ] [--frame-ms MS]
+//                       [--drift-ppm PPM] [--jitter-ms MS] [--target-ms MS] [--gain G]
+//                       [--report-minutes M] [--no-compensation]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "echo_buffer.hpp"
+
+// As the integration sets each session's echo buffer up
+#define SIM_RING_CAPACITY 8192
+#define SIM_MAX_FRAME_COUNT 2048
+#define SIM_DEFAULT_TARGET_MS 10.0f
+#define SIM_TONE_HZ 440.0
+#define SIM_AMPLITUDE 0.25
+
+struct SimWindow {
+  double fill_min_ms = 1e9;
+  double fill_max_ms = 0.0;
+  double fill_sum_ms = 0.0;
+  uint64_t render_callbacks = 0;
+  uint64_t dropouts = 0;
+  uint64_t glitches = 0;
+};
+
+static void print_window(double hours, const SimWindow& window, const EchoBufferStats& stats,
+                         const EchoBufferStats& previous) {
+  printf("%3d:%02d  %7.2f  %7.2f  %7.2f  %9.1f  %9llu  %7llu  %9llu  %8llu  %8llu\n",
+         (int)hours, (int)(hours * 60) % 60,
+         window.render_callbacks ? window.fill_min_ms : 0.0,
+         window.render_callbacks ? window.fill_sum_ms / window.render_callbacks : 0.0, window.fill_max_ms,
+         stats.drift_ppm, (unsigned long long)(stats.underruns - previous.underruns),
+         (unsigned long long)(stats.resyncs - previous.resyncs),
+         (unsigned long long)(stats.overruns - previous.overruns),
+         (unsigned long long)window.dropouts, (unsigned long long)window.glitches);
+}
+
+int main(int argc, char** argv) {
+  double hours = 3.0;
+  int capture_rate = 48000;
+  int render_rate = 48000;
+  double frame_ms = 10.0;
+  double drift_ppm = 200.0;
+  double jitter_ms = 2.0;
+  float target_ms = SIM_DEFAULT_TARGET_MS;
+  float gain = 1.0f;
+  double report_minutes = 15.0;
+  bool compensation = true;
+  for(int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if(arg == "--hours" && i + 1 < argc)
+      hours = std::max(0.01, atof(argv[++i]));
+    else if(arg == "--capture-rate" && i + 1 < argc)
+      capture_rate = std::max(8000, atoi(argv[++i]));
+    else if(arg == "--render-rate" && i + 1 < argc)
+      render_rate = std::max(8000, atoi(argv[++i]));
+    else if(arg == "--frame-ms" && i + 1 < argc)
+      frame_ms = std::max(1.0, atof(argv[++i]));
+    else if(arg == "--drift-ppm" && i + 1 < argc)
+      drift_ppm = atof(argv[++i]);
+    else if(arg == "--jitter-ms" && i + 1 < argc)
+      jitter_ms = std::max(0.0, atof(argv[++i]));
+    else if(arg == "--target-ms" && i + 1 < argc)
+      target_ms = (float)atof(argv[++i]);
+    else if(arg == "--gain" && i + 1 < argc)
+      gain = (float)atof(argv[++i]);
+    else if(arg == "--report-minutes" && i + 1 < argc)
+      report_minutes = std::max(0.1, atof(argv[++i]));
+    else if(arg == "--no-compensation")
+      compensation = false;
+    else {
+      fprintf(stderr, "Usage: echo_drift_sim [--hours H] [--capture-rate HZ] [--render-rate HZ] [--frame-ms MS] "
+                      "[--drift-ppm PPM] [--jitter-ms MS] [--target-ms MS] [--gain G] [--report-minutes M] "
+                      "[--no-compensation]\n");
+      return 2;
+    }
+  }
+  // A callback can't arrive after the next one is due
+  jitter_ms = std::min(jitter_ms, frame_ms * 0.9);
+  const int capture_frame = (int)lround(capture_rate * frame_ms / 1000);
+  const int render_frame = (int)lround(render_rate * frame_ms / 1000);
+  if(capture_frame > SIM_MAX_FRAME_COUNT || render_frame > SIM_MAX_FRAME_COUNT) {
+    fprintf(stderr, "Frames can be at most %d samples\n", SIM_MAX_FRAME_COUNT);
+    return 2;
+  }
+
+  // Each device's callbacks come a frame apart by its own clock
+  const double capture_period_s = capture_frame / (capture_rate * (1.0 + drift_ppm * 1e-6));
+  const double render_period_s = (double)render_frame / render_rate;
+  // The most a sample of the sine can differ from the last, with some room for the
+  // resampler's ripple
+  const double max_step = 1.5 * 2 * M_PI * SIM_TONE_HZ / render_rate * SIM_AMPLITUDE * 32767 * std::max(1.0f, gain) + 64;
+
+  uint64_t total_dropouts = 0, total_glitches = 0;
+  EchoBufferStats stats = {0, 0, 0, 0, 0.0f};
+  {
+    EchoBuffer echo(SIM_RING_CAPACITY, SIM_MAX_FRAME_COUNT, target_ms);
+    echo.set_drift_compensation(compensation);
+    echo.set_monitor_gain(gain);
+    const auto simulated_time = [](double seconds) {
+      return std::chrono::steady_clock::time_point(std::chrono::nanoseconds((int64_t)(seconds * 1e9)));
+    };
+
+    printf("%dHz capture (%d-sample frames) %+.0fppm, %dHz render (%d-sample frames), %.1fms jitter, "
+           "drift compensation %s\n", capture_rate, capture_frame, drift_ppm, render_rate, render_frame, jitter_ms,
+           compensation ? "on" : "off");
+    printf("  h:mm  fill min    mean      max  drift ppm  underruns  resyncs  overruns  dropouts  glitches\n");
+
+    std::mt19937 random(1234);
+    std::uniform_real_distribution<double> jitter(0.0, jitter_ms / 1000);
+    std::vector<short> capture_frames(capture_frame), render_frames(render_frame);
+    uint64_t capture_count = 0, render_count = 0, tone_position = 0;
+    double next_capture_s = jitter(random), next_render_s = jitter(random);
+    bool echo_started = false;
+    double last_sample = 0.0;
+    const double end_s = hours * 3600;
+    const double report_s = report_minutes * 60;
+    double next_report_s = report_s;
+    SimWindow window;
+    EchoBufferStats reported = stats;
+
+    while(std::min(next_capture_s, next_render_s) < end_s) {
+      if(next_capture_s <= next_render_s) {
+        // The tone repeats every second, so keep sin's argument small
+        for(int i = 0; i < capture_frame; i++, tone_position = (tone_position + 1) % capture_rate)
+          capture_frames[i] = (short)(SIM_AMPLITUDE * 32767 * sin(2 * M_PI * SIM_TONE_HZ * tone_position / capture_rate));
+        echo.push(capture_frames.data(), capture_frame, 1, capture_rate, simulated_time(next_capture_s));
+        capture_count++;
+        next_capture_s = capture_count * capture_period_s + jitter(random);
+        continue;
+      }
+
+      std::fill(render_frames.begin(), render_frames.end(), (short)0);
+      echo.mix_into(render_frames.data(), render_frame, 1, render_rate, simulated_time(next_render_s));
+      render_count++;
+      const double now_s = next_render_s;
+      next_render_s = render_count * render_period_s + jitter(random);
+
+      bool silent = true, glitched = false;
+      for(int i = 0; i < render_frame; i++) {
+        if(render_frames[i] != 0)
+          silent = false;
+        if(echo_started && fabs(render_frames[i] - last_sample) > max_step)
+          glitched = true;
+        last_sample = render_frames[i];
+      }
+      if(!silent)
+        echo_started = true;
+      if(echo_started && silent)
+        window.dropouts++;
+      else if(glitched)
+        window.glitches++;
+
+      stats = echo.get_stats();
+      const double fill_ms = 1000.0 * stats.fill / capture_rate;
+      window.fill_min_ms = std::min(window.fill_min_ms, fill_ms);
+      window.fill_max_ms = std::max(window.fill_max_ms, fill_ms);
+      window.fill_sum_ms += fill_ms;
+      window.render_callbacks++;
+
+      if(now_s >= next_report_s) {
+        print_window(now_s / 3600, window, stats, reported);
+        total_dropouts += window.dropouts;
+        total_glitches += window.glitches;
+        reported = stats;
+        window = SimWindow();
+        next_report_s += report_s;
+      }
+    }
+    if(window.render_callbacks) {
+      print_window(end_s / 3600, window, stats, reported);
+      total_dropouts += window.dropouts;
+      total_glitches += window.glitches;
+    }
+  }
+
+  printf("In all: %llu underruns, %llu resyncs, %llu overruns, %llu dropouts, %llu glitches; "
+         "drift %+.1fppm against %+.1fppm actual\n",
+         (unsigned long long)stats.underruns, (unsigned long long)stats.resyncs, (unsigned long long)stats.overruns,
+         (unsigned long long)total_dropouts, (unsigned long long)total_glitches, stats.drift_ppm, drift_ppm);
+  return 0;
+}
@@ -0,0 +1,264 @@
+// Exports multitrack session logs (.mtlog, see multitrack_logger.hpp) as stereo WAV files,
+// with the input on the left and the output on the right, aligned sample for sample.
+//
+// Each session gets its own files, and a new file starts wherever the sample rate changes,
+// the session restarts, or there's a gap of over a second (e.g. while logging was off).
+// Shorter runs of callbacks missing from the log (dropped because the logger fell behind)
+// are filled with silence the length of the previous callback, so that the rest of the
+// file stays in time.  Rotated logs can be given in any order.
+//
+// Usage: export_log [--session N] <output_dir> <log.mtlog>...
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "audio_kernels.hpp"
+#include "flac_file.hpp"
+#include "multitrack_logger.hpp"
+#include "wav_file.hpp"
+
+namespace fs = std::filesystem;
+
+struct LogFrame {
+  uint64_t callback_index;
+  uint64_t timestamp_us;
+  unsigned sample_rate;
+  uint16_t session;
+  bool speaking;
+  bool has_output;
+  std::vector<short> input;
+  std::vector<short> output;
+};
+
+struct LogFile {
+  std::string filename;
+  uint64_t start_time_unix_us = 0;
+  std::vector<LogFrame> frames;
+};
+
+template <typename Value>
+static Value get_value(const unsigned char* position) {
+  Value value;
+  memcpy(&value, position, sizeof(Value));
+  return value;
+}
+
+static bool decode_track(const unsigned char* data, size_t size, size_t count, uint32_t format,
+                         std::vector<short>& samples, std::string& error) {
+  samples.resize(count);
+  if(format == (uint32_t)WavSampleFormat::int16) {
+    if(size != count * sizeof(short)) {
+      error = "bad 16-bit track size";
+      return false;
+    }
+    memcpy(samples.data(), data, size);
+  } else if(format == (uint32_t)WavSampleFormat::float32) {
+    if(size != count * sizeof(float)) {
+      error = "bad float track size";
+      return false;
+    }
+    std::vector<float> floats(count);
+    memcpy(floats.data(), data, size);
+    get_audio_kernels().float_to_int16(floats.data(), samples.data(), count);
+  } else if(format == (uint32_t)WavSampleFormat::flac) {
+    std::vector<int32_t> decoded(count);
+    if(!decode_flac_subframe(data, size, count, 16, decoded.data(), error))
+      return false;
+    std::copy(decoded.begin(), decoded.end(), samples.begin());
+  } else {
+    error = "unknown sample format " + std::to_string(format);
+    return false;
+  }
+  return true;
+}
+
+// A log that was never closed can end part way through a record, which is not an error
+static bool read_multitrack_log(const std::string& filename, LogFile& log, std::string& error) {
+  std::ifstream f(filename, std::ios::binary);
+  if(!f) {
+    error = "couldn't open " + filename;
+    return false;
+  }
+  const std::vector<unsigned char> contents((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+  if(contents.size() < 24 || memcmp(contents.data(), "MTLG", 4)) {
+    error = filename + " is not a multitrack log";
+    return false;
+  }
+  const uint32_t version = get_value<uint32_t>(&contents[4]);
+  const uint32_t format = get_value<uint32_t>(&contents[8]);
+  const uint32_t tracks = get_value<uint32_t>(&contents[12]);
+  if(version != MODULATE_MULTITRACK_LOG_VERSION || tracks != MODULATE_MULTITRACK_LOG_TRACKS) {
+    error = filename + ": unsupported log version " + std::to_string(version);
+    return false;
+  }
+  log.filename = filename;
+  log.start_time_unix_us = get_value<uint64_t>(&contents[16]);
+
+  unsigned stream_rate = 0;
+  for(size_t position = 24; position + 8 <= contents.size(); ) {
+    const unsigned char* record = &contents[position];
+    const uint8_t type = record[0];
+    const uint32_t payload_size = get_value<uint32_t>(record + 4);
+    const unsigned char* payload = record + 8;
+    if(position + 8 + payload_size > contents.size())
+      break;
+    position += 8 + payload_size;
+
+    if(type == MODULATE_MULTITRACK_RATE_RECORD && payload_size >= 4) {
+      stream_rate = get_value<uint32_t>(payload);
+    } else if(type == MODULATE_MULTITRACK_FRAME_RECORD && payload_size >= 28) {
+      LogFrame frame;
+      frame.callback_index = get_value<uint64_t>(payload);
+      frame.timestamp_us = get_value<uint64_t>(payload + 8);
+      frame.sample_rate = get_value<uint32_t>(payload + 16);
+      const uint32_t count = get_value<uint32_t>(payload + 20);
+      frame.session = get_value<uint16_t>(payload + 24);
+      frame.speaking = payload[26] != 0;
+      const uint8_t frame_tracks = payload[27];
+      frame.has_output = frame_tracks > 1;
+      if(frame.sample_rate != stream_rate) {
+        error = filename + ": frame at " + std::to_string(frame.timestamp_us) + "us doesn't match the stream's sample rate";
+        return false;
+      }
+
+      const unsigned char* track = payload + 28;
+      const unsigned char* const payload_end = payload + payload_size;
+      for(uint8_t i = 0; i < frame_tracks; i++) {
+        if(track + 4 > payload_end || track + 4 + get_value<uint32_t>(track) > payload_end) {
+          error = filename + ": bad track size";
+          return false;
+        }
+        const uint32_t track_size = get_value<uint32_t>(track);
+        if(!decode_track(track + 4, track_size, count, format, i ? frame.output : frame.input, error)) {
+          error = filename + ": " + error;
+          return false;
+        }
+        track += 4 + track_size;
+      }
+      log.frames.push_back(std::move(frame));
+    }
+    // Anything else is from a newer logger, and skipped
+  }
+  return true;
+}
+
+struct Segment {
+  uint16_t session;
+  unsigned sample_rate;
+  uint64_t start_time_unix_us;
+  WavFile wav;
+  size_t frames = 0;
+  size_t missing_frames = 0;
+  size_t frames_without_output = 0;
+};
+
+int main(int argc, char** argv) {
+  int only_session = -1;
+  std::vector<std::string> arguments;
+  for(int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if(arg == "--session" && i + 1 < argc)
+      only_session = atoi(argv[++i]);
+    else
+      arguments.push_back(arg);
+  }
+  if(arguments.size() < 2) {
+    std::cerr << "Usage: export_log [--session N] <output_dir> <log.mtlog>..." << std::endl;
+    return 2;
+  }
+  const std::string output_directory = arguments[0];
+
+  std::vector<LogFile> logs;
+  for(size_t i = 1; i < arguments.size(); i++) {
+    LogFile log;
+    std::string error;
+    if(!read_multitrack_log(arguments[i], log, error)) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+    logs.push_back(std::move(log));
+  }
+  // Files rotated from one logger share its start time, and continue each other's timestamps
+  std::sort(logs.begin(), logs.end(), [](const LogFile& a, const LogFile& b) {
+    const uint64_t a_first = a.frames.empty() ? 0 : a.frames.front().timestamp_us;
+    const uint64_t b_first = b.frames.empty() ? 0 : b.frames.front().timestamp_us;
+    return a.start_time_unix_us != b.start_time_unix_us ? a.start_time_unix_us < b.start_time_unix_us : a_first < b_first;
+  });
+
+  // The segment each session is currently adding to, and the last frame it saw
+  std::vector<Segment> segments;
+  std::map<uint16_t, size_t> open_segments;
+  std::map<uint16_t, const LogFrame*> previous_frames;
+  for(const LogFile& log : logs) {
+    for(const LogFrame& frame : log.frames) {
+      if(only_session >= 0 && frame.session != only_session)
+        continue;
+      const auto previous_it = previous_frames.find(frame.session);
+      const LogFrame* previous = previous_it == previous_frames.end() ? nullptr : previous_it->second;
+      const uint64_t missing = previous && frame.callback_index > previous->callback_index ?
+                               frame.callback_index - previous->callback_index - 1 : 0;
+      if(!previous || previous->sample_rate != frame.sample_rate || frame.callback_index <= previous->callback_index ||
+         missing * previous->input.size() > frame.sample_rate) {
+        Segment segment;
+        segment.session = frame.session;
+        segment.sample_rate = frame.sample_rate;
+        segment.start_time_unix_us = log.start_time_unix_us + frame.timestamp_us;
+        segment.wav.sample_rate = frame.sample_rate;
+        segment.wav.channels = 2;
+        open_segments[frame.session] = segments.size();
+        segments.push_back(std::move(segment));
+        previous = nullptr;
+      }
+      Segment& segment = segments[open_segments[frame.session]];
+
+      if(previous && missing) {
+        segment.missing_frames += missing;
+        segment.wav.samples.resize(segment.wav.samples.size() + 2 * missing * previous->input.size(), 0);
+      }
+      for(size_t i = 0; i < frame.input.size(); i++) {
+        segment.wav.samples.push_back(frame.input[i]);
+        segment.wav.samples.push_back(frame.has_output ? frame.output[i] : 0);
+      }
+      segment.frames++;
+      if(!frame.has_output)
+        segment.frames_without_output++;
+      previous_frames[frame.session] = &frame;
+    }
+  }
+
+  fs::create_directories(output_directory);
+  std::map<uint16_t, int> session_segment_numbers;
+  for(const Segment& segment : segments) {
+    const int number = session_segment_numbers[segment.session]++;
+    const std::string filename = (fs::path(output_directory) /
+      ("session" + std::to_string(segment.session) + "_" + std::to_string(number) + "_" +
+       std::to_string(segment.sample_rate) + "Hz.wav")).string();
+    std::string error;
+    if(!write_wav_file(filename, segment.wav, error)) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+
+    const time_t start_seconds = (time_t)(segment.start_time_unix_us / 1000000);
+    char start_time[32];
+    strftime(start_time, sizeof(start_time), "%Y-%m-%d %H:%M:%S", localtime(&start_seconds));
+    char line[512];
+    snprintf(line, sizeof(line), "%s: from %s, %.1fs, %zu callbacks, %zu missing, %zu without output\n",
+             filename.c_str(), start_time, segment.wav.duration_seconds(), segment.frames,
+             segment.missing_frames, segment.frames_without_output);
+    std::cout << line;
+  }
+  if(segments.empty())
+    std::cout << "No audio to export" << std::endl;
+  return 0;
+}
@@ -0,0 +1,373 @@
+#include "flac_file.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include "flac_encoder.hpp"
+
+// Format reference: https://xiph.org/flac/format.html
+
+#define FLAC_MAX_CHANNELS 8
+#define FLAC_MAX_BLOCK_SIZE 65535
+
+namespace {
+
+class BitReader {
+private:
+  const unsigned char* data;
+  size_t size_bits;
+  size_t position;
+
+public:
+  bool overrun = false;
+
+  BitReader(const unsigned char* _data, size_t size) : data(_data), size_bits(size * 8), position(0) {}
+
+  // count <= 32
+  uint32_t get(unsigned count) {
+    if(position + count > size_bits) {
+      overrun = true;
+      position = size_bits;
+      return 0;
+    }
+    uint32_t value = 0;
+    while(count) {
+      const unsigned available = 8 - (unsigned)(position & 7);
+      const unsigned take = std::min(available, count);
+      value = (value << take) | ((data[position >> 3] >> (available - take)) & ((1u << take) - 1));
+      position += take;
+      count -= take;
+    }
+    return value;
+  }
+
+  int32_t get_signed(unsigned count) {
+    if(!count)
+      return 0;
+    const uint32_t value = get(count) << (32 - count);
+    return (int32_t)value >> (32 - count);
+  }
+
+  // Number of zeros before the next one
+  uint32_t get_unary() {
+    uint32_t zeros = 0;
+    // Whole zero bytes at a time where we can
+    while(!(position & 7) && position + 8 <= size_bits && !data[position >> 3]) {
+      zeros += 8;
+      position += 8;
+    }
+    while(!get(1)) {
+      if(overrun)
+        return zeros;
+      zeros++;
+    }
+    return zeros;
+  }
+
+  void align() {position = std::min((position + 7) & ~(size_t)7, size_bits);}
+  size_t byte_position() const {return position >> 3;}
+  bool at_end() const {return position >= size_bits;}
+};
+
+struct StreamInfo {
+  unsigned sample_rate = 0;
+  unsigned channels = 0;
+  unsigned bits_per_sample = 0;
+  uint64_t total_samples = 0; // 0 if unknown
+};
+
+bool decode_residual(BitReader& bits, int32_t* samples, size_t block_size, unsigned order, std::string& error) {
+  const unsigned method = bits.get(2);
+  if(method > 1) {
+    error = "reserved residual coding method";
+    return false;
+  }
+  const unsigned parameter_bits = method ? 5 : 4;
+  const unsigned escape = method ? 31 : 15;
+  const unsigned partition_order = bits.get(4);
+  const size_t partition_length = block_size >> partition_order;
+  if((partition_length << partition_order) != block_size || partition_length < order) {
+    error = "bad residual partition order";
+    return false;
+  }
+
+  size_t i = order;
+  for(size_t partition = 0; partition < ((size_t)1 << partition_order); partition++) {
+    const size_t end = (partition + 1) * partition_length;
+    const unsigned k = bits.get(parameter_bits);
+    if(k == escape) {
+      const unsigned raw_bits = bits.get(5);
+      for(; i < end; i++)
+        samples[i] = bits.get_signed(raw_bits);
+    } else {
+      for(; i < end; i++) {
+        const uint32_t value = (bits.get_unary() << k) | bits.get(k);
+        samples[i] = (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+      }
+    }
+    if(bits.overrun)
+      return false;
+  }
+  return true;
+}
+
+bool decode_subframe(BitReader& bits, int32_t* samples, size_t block_size, unsigned bits_per_sample, std::string& error) {
+  if(bits.get(1)) {
+    error = "bad subframe header";
+    return false;
+  }
+  const unsigned type = bits.get(6);
+  unsigned wasted_bits = 0;
+  if(bits.get(1))
+    wasted_bits = bits.get_unary() + 1;
+  if(wasted_bits >= bits_per_sample) {
+    error = "bad wasted bits count";
+    return false;
+  }
+  bits_per_sample -= wasted_bits;
+
+  if(type == 0) {
+    std::fill(samples, samples + block_size, bits.get_signed(bits_per_sample));
+  } else if(type == 1) {
+    for(size_t i = 0; i < block_size; i++)
+      samples[i] = bits.get_signed(bits_per_sample);
+  } else if(type >= 8 && type <= 12) {
+    const unsigned order = type & 7;
+    if(order > block_size) {
+      error = "predictor order larger than the block";
+      return false;
+    }
+    for(unsigned i = 0; i < order; i++)
+      samples[i] = bits.get_signed(bits_per_sample);
+    if(!decode_residual(bits, samples, block_size, order, error))
+      return false;
+    for(size_t i = order; i < block_size; i++) {
+      switch(order) {
+      case 1: samples[i] += samples[i-1]; break;
+      case 2: samples[i] += 2 * samples[i-1] - samples[i-2]; break;
+      case 3: samples[i] += 3 * samples[i-1] - 3 * samples[i-2] + samples[i-3]; break;
+      case 4: samples[i] += 4 * samples[i-1] - 6 * samples[i-2] + 4 * samples[i-3] - samples[i-4]; break;
+      }
+    }
+  } else if(type >= 32) {
+    const unsigned order = (type & 31) + 1;
+    if(order > block_size) {
+      error = "predictor order larger than the block";
+      return false;
+    }
+    for(unsigned i = 0; i < order; i++)
+      samples[i] = bits.get_signed(bits_per_sample);
+    const unsigned precision = bits.get(4) + 1;
+    const int shift = bits.get_signed(5);
+    if(precision == 16 || shift < 0) {
+      error = "bad LPC precision or shift";
+      return false;
+    }
+    int32_t coefficients[32];
+    for(unsigned i = 0; i < order; i++)
+      coefficients[i] = bits.get_signed(precision);
+    if(!decode_residual(bits, samples, block_size, order, error))
+      return false;
+    for(size_t i = order; i < block_size; i++) {
+      int64_t prediction = 0;
+      for(unsigned j = 0; j < order; j++)
+        prediction += (int64_t)coefficients[j] * samples[i - j - 1];
+      samples[i] += (int32_t)(prediction >> shift);
+    }
+  } else {
+    error = "reserved subframe type";
+    return false;
+  }
+
+  if(wasted_bits)
+    for(size_t i = 0; i < block_size; i++)
+      samples[i] = (int32_t)((uint32_t)samples[i] << wasted_bits);
+  return !bits.overrun;
+}
+
+bool read_stream_info(BitReader& bits, StreamInfo& info, std::string& error) {
+  bool found = false;
+  for(bool last = false; !last; ) {
+    last = bits.get(1);
+    const unsigned type = bits.get(7);
+    const uint32_t length = bits.get(24);
+    if(bits.overrun) {
+      error = "truncated metadata";
+      return false;
+    }
+    if(type == 0 && length >= 34) {
+      bits.get(16); // min and max block size
+      bits.get(16);
+      bits.get(24); // min and max frame size
+      bits.get(24);
+      info.sample_rate = bits.get(20);
+      info.channels = bits.get(3) + 1;
+      info.bits_per_sample = bits.get(5) + 1;
+      info.total_samples = ((uint64_t)bits.get(4) << 32) | bits.get(32);
+      for(uint32_t i = 18; i < length; i++)
+        bits.get(8); // MD5 signature
+      found = true;
+    } else {
+      for(uint32_t i = 0; i < length && !bits.overrun; i++)
+        bits.get(8);
+    }
+  }
+  if(!found || bits.overrun || !info.sample_rate) {
+    error = "missing STREAMINFO";
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+bool decode_flac_subframe(const unsigned char* data, size_t size, size_t count, unsigned bits_per_sample,
+                          int32_t* samples, std::string& error) {
+  BitReader bits(data, size);
+  if(decode_subframe(bits, samples, count, bits_per_sample, error))
+    return true;
+  if(error.empty())
+    error = "truncated subframe";
+  return false;
+}
+
+bool read_flac_file(const std::string& filename, WavFile& wav, std::string& error) {
+  std::ifstream f(filename, std::ios::binary);
+  if(!f) {
+    error = "couldn't open " + filename;
+    return false;
+  }
+  std::vector<unsigned char> contents((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+  if(contents.size() < 4 || memcmp(contents.data(), "fLaC", 4)) {
+    error = filename + " is not a FLAC file";
+    return false;
+  }
+
+  BitReader bits(contents.data() + 4, contents.size() - 4);
+  StreamInfo info;
+  if(!read_stream_info(bits, info, error)) {
+    error = filename + ": " + error;
+    return false;
+  }
+  wav.sample_rate = info.sample_rate;
+  wav.channels = info.channels;
+  wav.samples.clear();
+  wav.samples.reserve((size_t)info.total_samples * info.channels);
+
+  std::vector<int32_t> channel_samples[FLAC_MAX_CHANNELS];
+  for(std::vector<int32_t>& samples : channel_samples)
+    samples.resize(FLAC_MAX_BLOCK_SIZE + 1);
+
+  const unsigned char* const frames = contents.data() + 4;
+  uint64_t decoded = 0;
+  while(!bits.at_end() && (!info.total_samples || decoded < info.total_samples)) {
+    const size_t frame_start = bits.byte_position();
+    if(bits.get(14) != 0x3FFE || bits.get(1)) {
+      error = "lost sync";
+      break;
+    }
+    bits.get(1); // fixed or variable block size: the frame or sample number doesn't matter here
+    const unsigned block_size_code = bits.get(4);
+    const unsigned sample_rate_code = bits.get(4);
+    const unsigned channel_assignment = bits.get(4);
+    const unsigned sample_size_code = bits.get(3);
+    bits.get(1);
+
+    // UTF-8 style coded frame or sample number
+    const uint32_t first_byte = bits.get(8);
+    for(uint32_t mask = 0x40; (first_byte & 0x80) && (first_byte & mask); mask >>= 1)
+      bits.get(8);
+
+    size_t block_size = 0;
+    if(block_size_code == 1)
+      block_size = 192;
+    else if(block_size_code >= 2 && block_size_code <= 5)
+      block_size = (size_t)576 << (block_size_code - 2);
+    else if(block_size_code == 6)
+      block_size = bits.get(8) + 1;
+    else if(block_size_code == 7)
+      block_size = bits.get(16) + 1;
+    else if(block_size_code >= 8)
+      block_size = (size_t)256 << (block_size_code - 8);
+    if(sample_rate_code == 12)
+      bits.get(8);
+    else if(sample_rate_code == 13 || sample_rate_code == 14)
+      bits.get(16);
+
+    const size_t header_size = bits.byte_position() - frame_start;
+    if(bits.get(8) != flac_crc8(frames + frame_start, header_size) && !bits.overrun) {
+      error = "frame header CRC mismatch";
+      break;
+    }
+
+    static const unsigned sample_sizes[8] = {0, 8, 12, 0, 16, 20, 24, 32};
+    const unsigned bits_per_sample = sample_size_code ? sample_sizes[sample_size_code] : info.bits_per_sample;
+    const unsigned channels = channel_assignment < 8 ? channel_assignment + 1 : 2;
+    if(!block_size || channel_assignment > 10 || channels != info.channels ||
+       !bits_per_sample || bits_per_sample > 24) {
+      error = "unsupported frame header";
+      break;
+    }
+
+    bool ok = true;
+    for(unsigned channel = 0; channel < channels && ok; channel++) {
+      // The side channel of a stereo pair needs an extra bit
+      const bool side = (channel_assignment == 8 && channel == 1) || (channel_assignment == 9 && channel == 0) ||
+                        (channel_assignment == 10 && channel == 1);
+      ok = decode_subframe(bits, channel_samples[channel].data(), block_size, bits_per_sample + (side ? 1 : 0), error);
+    }
+    bits.align();
+    const size_t frame_size = bits.byte_position() - frame_start;
+    const uint32_t crc = bits.get(16);
+    if(!ok || bits.overrun) {
+      // A log that was never closed can end part way through a frame
+      if(bits.overrun && !info.total_samples) {
+        error.clear();
+        break;
+      }
+      if(error.empty())
+        error = "truncated frame";
+      break;
+    }
+    if(crc != flac_crc16(frames + frame_start, frame_size)) {
+      error = "frame CRC mismatch";
+      break;
+    }
+
+    int32_t* left = channel_samples[0].data();
+    int32_t* right = channel_samples[1].data();
+    for(size_t i = 0; i < block_size && channel_assignment >= 8; i++) {
+      if(channel_assignment == 8) {
+        right[i] = left[i] - right[i];
+      } else if(channel_assignment == 9) {
+        left[i] += right[i];
+      } else {
+        const int32_t mid = (int32_t)((uint32_t)left[i] << 1) | (right[i] & 1);
+        const int32_t difference = right[i];
+        left[i] = (mid + difference) >> 1;
+        right[i] = (mid - difference) >> 1;
+      }
+    }
+
+    for(size_t i = 0; i < block_size; i++) {
+      for(unsigned channel = 0; channel < channels; channel++) {
+        const int32_t sample = channel_samples[channel][i];
+        wav.samples.push_back((short)(bits_per_sample > 16 ? sample >> (bits_per_sample - 16)
+                                                            : sample * (1 << (16 - bits_per_sample))));
+      }
+    }
+    decoded += block_size;
+  }
+
+  if(!error.empty()) {
+    error = filename + ": " + error + " at sample " + std::to_string(decoded);
+    return false;
+  }
+  if(info.total_samples && decoded > info.total_samples)
+    wav.samples.resize((size_t)info.total_samples * info.channels);
+  return true;
+}
@@ -0,0 +1,23 @@
+#ifndef MODULATE_FLAC_FILE_HPP
+#define MODULATE_FLAC_FILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "wav_file.hpp"
+
+// Whole-file FLAC decoding for the offline tools, mainly for the compressed session logs.
+// Handles everything the WavLogger writes plus what other encoders commonly produce
+// (LPC subframes, stereo decorrelation, 8 to 24 bit samples, which are scaled to 16 bits),
+// and checks every frame's CRCs.  A log that was never closed (so has no sample count)
+// decodes up to its last complete frame.
+//
+// Returns false and fills in error on failure
+bool read_flac_file(const std::string& filename, WavFile& wav, std::string& error);
+
+// Decodes a single subframe of count samples, as written by FlacEncoder::encode_subframe
+bool decode_flac_subframe(const unsigned char* data, size_t size, size_t count, unsigned bits_per_sample,
+                          int32_t* samples, std::string& error);
+
+#endif
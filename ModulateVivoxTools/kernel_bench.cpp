@@ -0,0 +1,213 @@
+// Microbenchmark of the sample conversion kernels in audio_kernels.cpp.
+//
+// Times the plain C++ kernels (get_scalar_audio_kernels) against the ones
+// get_audio_kernels dispatches to on this CPU (SSE2, AVX2 or NEON), and both against the
+// per-sample loops convert() used before there were any kernels, on callback-sized
+// blocks: deinterleaving the first channel of 1, 2 and N channel int16 audio, saturating
+// float to int16, and fanning saturated samples out to 1, 2 and N channels, by
+// conversion and by mixing.  Each kernel runs over the same block many times, and the
+// fastest of several rounds counts, so that other work on the machine doesn't.  On x86
+// the cost is in time stamp counter cycles per sample, elsewhere in nanoseconds.
+//
+// First it checks that the two give the same output, on audio that includes
+// out-of-range samples, infinities and NaN, and exits with 1 if they don't.
+//
+// Usage: kernel_bench [--samples N] [--channels N] [--iterations N]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "audio_kernels.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_UNIT "cycles"
+static uint64_t read_counter() {
+  return __rdtsc();
+}
+#else
+#define BENCH_UNIT "ns"
+static uint64_t read_counter() {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+#define BENCH_ROUNDS 15
+
+// The loops convert() had before AudioKernels, as the baseline.  They don't saturate, so
+// they aren't checked; the cast goes through int so that overs wrap, as they did on x86,
+// rather than being undefined.
+static void original_deinterleave(const short* pcm_frames, size_t channels_per_frame, float* float_buffer,
+                                  size_t pcm_frame_count) {
+  for(size_t i = 0; i < pcm_frame_count; i++)
+    float_buffer[i] = float(pcm_frames[i*channels_per_frame]) / (1<<15);
+}
+
+static void original_fan_out(const float* float_buffer, short* pcm_frames, size_t pcm_frame_count,
+                             size_t channels_per_frame) {
+  for(size_t i = 0; i < pcm_frame_count; i++) {
+    pcm_frames[i*channels_per_frame] = (short)(int)(float_buffer[i] * ((1<<15) - 1));
+    for(size_t channel = 1; channel < channels_per_frame; channel++)
+      pcm_frames[i*channels_per_frame + channel] = pcm_frames[i*channels_per_frame];
+  }
+}
+
+struct BenchOptions {
+  size_t samples = 480; // 10ms at 48kHz
+  size_t channels = 6;
+  size_t iterations = 2000;
+};
+
+// Counter ticks per sample for the fastest round
+static double time_kernel(const BenchOptions& options, const std::function<void()>& run) {
+  double best = std::numeric_limits<double>::infinity();
+  for(int round = 0; round < BENCH_ROUNDS; round++) {
+    const uint64_t start = read_counter();
+    for(size_t i = 0; i < options.iterations; i++)
+      run();
+    const uint64_t ticks = read_counter() - start;
+    best = std::min(best, (double)ticks / ((double)options.iterations * options.samples));
+  }
+  return best;
+}
+
+// Audio with something for every branch: quiet and loud, clipped, and not numbers at all
+static std::vector<float> make_check_audio(size_t count) {
+  std::vector<float> audio(count);
+  const float specials[] = {NAN, -NAN, INFINITY, -INFINITY, 1.0f, -1.0f, 1.5f, -1.5f, 0.0f, -0.0f,
+                            0.5f / 32767, 1.5f / 32767, -2.5f / 32767, 32766.5f / 32767};
+  const size_t special_count = sizeof(specials) / sizeof(specials[0]);
+  for(size_t i = 0; i < count; i++)
+    audio[i] = i % 5 == 0 ? specials[(i / 5) % special_count] : 1.2f * (float)sin(0.01 * i) + (float)(i % 7) / 32767;
+  return audio;
+}
+
+static bool check_kernels(const AudioKernels& scalar, const AudioKernels& vector, const BenchOptions& options) {
+  // Odd sizes, so the tails are covered as well as the blocks
+  const size_t count = options.samples + 13;
+  const std::vector<float> audio = make_check_audio(count);
+  std::vector<short> pcm(count * options.channels);
+  for(size_t i = 0; i < pcm.size(); i++)
+    pcm[i] = (short)(i * 7919);
+  bool ok = true;
+  const auto report = [&](const std::string& kernel, bool same) {
+    if(!same)
+      std::cout << vector.name << " " << kernel << " differs from scalar\n";
+    ok = ok && same;
+  };
+
+  std::vector<short> expected(count * options.channels), actual(count * options.channels);
+  scalar.float_to_int16(audio.data(), expected.data(), count);
+  vector.float_to_int16(audio.data(), actual.data(), count);
+  report("float_to_int16", std::equal(expected.begin(), expected.begin() + count, actual.begin()));
+
+  for(size_t channels : {(size_t)1, (size_t)2, options.channels}) {
+    const std::string suffix = " x" + std::to_string(channels);
+    std::vector<float> expected_float(count), actual_float(count);
+    scalar.int16_to_float_strided(pcm.data(), channels, expected_float.data(), count);
+    vector.int16_to_float_strided(pcm.data(), channels, actual_float.data(), count);
+    report("int16_to_float_strided" + suffix, expected_float == actual_float);
+
+    const size_t length = count * channels;
+    scalar.float_to_int16_fan_out(audio.data(), expected.data(), count, channels);
+    vector.float_to_int16_fan_out(audio.data(), actual.data(), count, channels);
+    report("float_to_int16_fan_out" + suffix, std::equal(expected.begin(), expected.begin() + length, actual.begin()));
+
+    std::copy(pcm.begin(), pcm.begin() + length, expected.begin());
+    std::copy(pcm.begin(), pcm.begin() + length, actual.begin());
+    scalar.mix_int16_fan_out(pcm.data(), expected.data(), count, channels);
+    vector.mix_int16_fan_out(pcm.data(), actual.data(), count, channels);
+    report("mix_int16_fan_out" + suffix, std::equal(expected.begin(), expected.begin() + length, actual.begin()));
+  }
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  BenchOptions options;
+  for(int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if(arg == "--samples" && i + 1 < argc)
+      options.samples = (size_t)std::max(1, atoi(argv[++i]));
+    else if(arg == "--channels" && i + 1 < argc)
+      options.channels = (size_t)std::max(3, atoi(argv[++i]));
+    else if(arg == "--iterations" && i + 1 < argc)
+      options.iterations = (size_t)std::max(1, atoi(argv[++i]));
+    else {
+      std::cerr << "Usage: kernel_bench [--samples N] [--channels N] [--iterations N]" << std::endl;
+      return 2;
+    }
+  }
+
+  const AudioKernels& scalar = get_scalar_audio_kernels();
+  const AudioKernels& vector = get_audio_kernels();
+  if(!check_kernels(scalar, vector, options))
+    return 1;
+
+  const size_t samples = options.samples;
+  const size_t channels = options.channels;
+  std::vector<float> audio(samples), floats(samples);
+  for(size_t i = 0; i < samples; i++)
+    audio[i] = 1.2f * (float)sin(2 * M_PI * 440.0 * i / 48000);
+  std::vector<short> pcm(samples * channels), out(samples * channels);
+  for(size_t i = 0; i < pcm.size(); i++)
+    pcm[i] = (short)(20000.0 * sin(0.01 * i));
+
+  struct Row {
+    std::string kernel;
+    std::function<void(const AudioKernels&)> run;
+    std::function<void()> original; // empty where convert() had no loop of its own
+  };
+  std::vector<Row> rows;
+  for(size_t stride : {(size_t)1, (size_t)2, channels})
+    rows.push_back({"deinterleave x" + std::to_string(stride), [&, stride](const AudioKernels& kernels) {
+      kernels.int16_to_float_strided(pcm.data(), stride, floats.data(), samples);
+    }, [&, stride] {
+      original_deinterleave(pcm.data(), stride, floats.data(), samples);
+    }});
+  rows.push_back({"saturate", [&](const AudioKernels& kernels) {
+    kernels.float_to_int16(audio.data(), out.data(), samples);
+  }, nullptr});
+  for(size_t fan_out : {(size_t)1, (size_t)2, channels})
+    rows.push_back({"fan out x" + std::to_string(fan_out), [&, fan_out](const AudioKernels& kernels) {
+      kernels.float_to_int16_fan_out(audio.data(), out.data(), samples, fan_out);
+    }, [&, fan_out] {
+      original_fan_out(audio.data(), out.data(), samples, fan_out);
+    }});
+  for(size_t fan_out : {(size_t)1, (size_t)2, channels})
+    rows.push_back({"mix fan out x" + std::to_string(fan_out), [&, fan_out](const AudioKernels& kernels) {
+      // Mixing into a block that's already full saturates, which is the case worth timing
+      kernels.mix_int16_fan_out(pcm.data(), out.data(), samples, fan_out);
+    }, nullptr});
+
+  std::cout << samples << " samples per call, the original loops and " << scalar.name << " against " << vector.name
+            << ", " << BENCH_UNIT << " per sample\n";
+  char header[200];
+  snprintf(header, sizeof(header), "%-18s %8s %8s %8s %9s %12s\n", "kernel", "original", scalar.name, vector.name,
+           "speedup", "vs original");
+  std::cout << header;
+  for(const Row& row : rows) {
+    const double scalar_cost = time_kernel(options, [&] {row.run(scalar);});
+    const double vector_cost = time_kernel(options, [&] {row.run(vector);});
+    char line[200];
+    if(row.original) {
+      const double original_cost = time_kernel(options, row.original);
+      snprintf(line, sizeof(line), "%-18s %8.3f %8.3f %8.3f %8.2fx %11.2fx\n", row.kernel.c_str(), original_cost,
+               scalar_cost, vector_cost, scalar_cost / vector_cost, original_cost / vector_cost);
+    } else {
+      snprintf(line, sizeof(line), "%-18s %8s %8.3f %8.3f %8.2fx %12s\n", row.kernel.c_str(), "-", scalar_cost,
+               vector_cost, scalar_cost / vector_cost, "-");
+    }
+    std::cout << line;
+  }
+  return 0;
+}
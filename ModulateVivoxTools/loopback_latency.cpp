@@ -0,0 +1,340 @@
+// Measures the echo latency end to end, with the integration's latency probe (see
+// LatencyProbe): a chirp injected into the capture callback's input is found again in
+// the audio sent and in the render callback's output, with echo on.
+//
+// Drives the capture and render callbacks through the stub VivoxBase, paced like real audio
+// devices, and reports each stage of the path as the mean, min and max of --measurements:
+//   model lookahead      - the voice skin's own delay, measured at the model's rate (24kHz)
+//                          through the low-level API, where nothing is resampled
+//   helper resampler     - what the voice skin helper adds at this rate, over the lookahead
+//   native rate filters  - the native rate fast path's decimator and interpolator, as reported
+//   rebuffering          - the model block size's delay, as reported
+//   pipeline             - in pipelined mode, --pipelined frames
+//   echo ring            - from the audio sent to the render callback's output
+//
+// With the stub, voice skins pass audio through with no delay unless given one: set
+// --lookahead-ms and --helper-delay-ms (see MODULATE_STUB_LOOKAHEAD_MS) to give them a
+// known delay to measure.  --check runs a set of configurations with known delays and
+// fails if what's measured doesn't match them, to test the measurement itself.
+//
+// Usage: loopback_latency [--rate HZ] [--render-rate HZ] [--frame-ms MS] [--block-ms MS]
+//                         [--echo-target-ms MS] [--pipelined FRAMES] [--no-native-rate]
+//                         [--lookahead-ms MS] [--helper-delay-ms MS] [--measurements N] [--check]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "modulate/modulate.h"
+#include "ModulateVivoxIntegration.hpp"
+#include "VivoxBase.hpp"
+
+#define MODULATE_MAX_SEGMENT_SIZE 2400
+// Long enough for the voice skin to be ready and the echo ring to settle
+#define LATENCY_WARM_UP_MS 500
+// A measurement takes a little over MODULATE_LATENCY_PROBE_WINDOW_MS
+#define LATENCY_MEASUREMENT_TIMEOUT_MS 5000
+#define LATENCY_POLL_MS 20
+// How close --check needs the conversion to be to the delays it set up - the stub's
+// delays are whole samples, so a little over what rounding them can account for
+#define LATENCY_CHECK_TOLERANCE_MS 0.05
+// The echo stage is timed by the callbacks, so it's only as exact as they are - this much
+// more than the latest one came - and the echo ring's resampler adds a fraction of a
+// millisecond
+#define LATENCY_CHECK_ECHO_TOLERANCE_MS 1.0
+#define LATENCY_CHECK_LOOKAHEAD_MS 12.0
+#define LATENCY_CHECK_HELPER_DELAY_MS 3.0
+
+struct PathConfig {
+  int rate;
+  int render_rate;
+  double frame_ms;
+  float block_ms;
+  float echo_target_ms;
+  int pipeline_frames; // 0 for the capture callback to convert
+  bool native_rate;
+};
+
+struct StageSummary {
+  double mean = 0.0;
+  double min = 0.0;
+  double max = 0.0;
+};
+
+static StageSummary summarize(const std::vector<double>& values) {
+  StageSummary summary;
+  if(values.empty())
+    return summary;
+  summary.min = *std::min_element(values.begin(), values.end());
+  summary.max = *std::max_element(values.begin(), values.end());
+  for(double value : values)
+    summary.mean += value / values.size();
+  return summary;
+}
+
+// Whether the voice skin helper converts at this rate, rather than the native rate fast path
+static bool uses_helper(const PathConfig& config) {
+  const int factor = config.rate / MODULATE_MODEL_SAMPLE_RATE;
+  return !config.native_rate || config.rate % MODULATE_MODEL_SAMPLE_RATE ||
+         factor > MODULATE_NATIVE_RATE_MAX_FACTOR;
+}
+
+// A stub delay of delay_ms, as the whole number of samples at rate it comes to
+static double stub_delay_ms(double delay_ms, int rate) {
+  return 1000.0 * lround(delay_ms * rate / 1000) / rate;
+}
+
+// Runs the callbacks in real time, with echo on, taking measurements one after another.
+// Returns fewer than asked for if one doesn't complete.  late_ms is set to the latest any
+// callback came, which moves the echo ring's fill as it would with a real device.
+static std::vector<LatencyProbeResult> measure(const PathConfig& config, void* voice_skin, int measurements,
+                                               const std::string& log_directory, double& late_ms) {
+  ModulateVivoxIntegration integration(MODULATE_MAX_SEGMENT_SIZE, voice_skin, log_directory.c_str());
+  VivoxBase* vivox = VivoxBase::latest();
+  integration.set_wav_logging_enabled(false);
+  integration.set_native_rate_fast_path(config.native_rate);
+  integration.set_model_block_ms(config.block_ms);
+  integration.set_echo_target_latency_ms(config.echo_target_ms);
+  if(config.pipeline_frames)
+    integration.set_pipelined_conversion(true, config.pipeline_frames, DeadlineMissPolicy::silence);
+  integration.start_realtime_echo();
+
+  // The callbacks run on their own thread, paced like audio devices, so that finding the
+  // probe doesn't hold them up - the render callbacks half a frame after the capture ones,
+  // as if on another device
+  std::atomic<bool> running(true);
+  std::atomic<double> latest(0.0);
+  std::thread device([&] {
+    const int capture_frame = (int)lround(config.rate * config.frame_ms / 1000);
+    const int render_frame = (int)lround(config.render_rate * config.frame_ms / 1000);
+    const auto capture_period = std::chrono::duration<double>((double)capture_frame / config.rate);
+    const auto render_period = std::chrono::duration<double>((double)render_frame / config.render_rate);
+    std::vector<short> capture_frames(capture_frame), render_frames(render_frame);
+    const auto start = std::chrono::steady_clock::now();
+    uint64_t captures = 0, renders = 0;
+    while(running.load()) {
+      const auto next_capture = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(captures * capture_period);
+      const auto next_render = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>((renders + 0.5) * render_period);
+      const auto next = std::min(next_capture, next_render);
+      std::this_thread::sleep_until(next);
+      latest.store(std::max(latest.load(), std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - next).count()));
+      if(next_capture <= next_render) {
+        std::fill(capture_frames.begin(), capture_frames.end(), (short)0);
+        vivox->capture("latency", capture_frames.data(), capture_frame, config.rate, 1);
+        captures++;
+      } else {
+        std::fill(render_frames.begin(), render_frames.end(), (short)0);
+        vivox->render("latency", render_frames.data(), render_frame, config.render_rate, 1);
+        renders++;
+      }
+    }
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(LATENCY_WARM_UP_MS));
+  std::vector<LatencyProbeResult> results;
+  for(int i = 0; i < measurements; i++) {
+    integration.start_latency_probe();
+    const auto timeout = std::chrono::steady_clock::now() + std::chrono::milliseconds(LATENCY_MEASUREMENT_TIMEOUT_MS);
+    LatencyProbeResult result = integration.get_latency_probe_result();
+    while(result.state != LatencyProbeState::complete && result.state != LatencyProbeState::failed &&
+          std::chrono::steady_clock::now() < timeout) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(LATENCY_POLL_MS));
+      result = integration.get_latency_probe_result();
+    }
+    if(result.state != LatencyProbeState::complete)
+      break;
+    results.push_back(result);
+  }
+  running.store(false);
+  device.join();
+  late_ms = latest.load();
+  if(config.pipeline_frames)
+    integration.set_pipelined_conversion(false, config.pipeline_frames, DeadlineMissPolicy::silence);
+  return results;
+}
+
+static bool all_found(const std::vector<LatencyProbeResult>& results, int measurements) {
+  if((int)results.size() < measurements)
+    return false;
+  for(const LatencyProbeResult& result : results) {
+    if(!result.conversion.found || !result.rendered.found)
+      return false;
+  }
+  return true;
+}
+
+static void print_failure(const std::vector<LatencyProbeResult>& results, int measurements) {
+  if((int)results.size() < measurements) {
+    std::cerr << "Only " << results.size() << " of " << measurements << " measurements completed" << std::endl;
+    return;
+  }
+  for(const LatencyProbeResult& result : results) {
+    if(!result.conversion.found || !result.rendered.found) {
+      fprintf(stderr, "The probe didn't come through (correlation %.2f in the audio sent, %.2f in the render output)\n",
+              result.conversion.correlation, result.rendered.correlation);
+      return;
+    }
+  }
+}
+
+// Runs configurations whose delays are known from the stub's, and checks each stage
+static int run_check(void* voice_skin, const std::string& log_directory) {
+  const PathConfig configs[] = {
+    {48000, 48000, 10.0, 0.0f, 10.0f, 0, true},
+    {48000, 48000, 10.0, 0.0f, 10.0f, 0, false},
+    {44100, 44100, 10.0, 20.0f, 10.0f, 0, true},
+    {16000, 16000, 10.0, 0.0f, 20.0f, 2, true},
+    {48000, 44100, 20.0, 0.0f, 30.0f, 0, true},
+  };
+  int failures = 0;
+  printf("  capture  render  frame  block  pipeline  native  conversion ms  expected  echo ms  expected  late ms  result\n");
+  for(const PathConfig& config : configs) {
+    double late_ms = 0.0;
+    const std::vector<LatencyProbeResult> results = measure(config, voice_skin, 1, log_directory, late_ms);
+    if(!all_found(results, 1)) {
+      print_failure(results, 1);
+      failures++;
+      continue;
+    }
+    const LatencyProbeResult& result = results[0];
+    const bool helper = uses_helper(config);
+    const double expected = stub_delay_ms(LATENCY_CHECK_LOOKAHEAD_MS, helper ? config.rate : MODULATE_MODEL_SAMPLE_RATE) +
+                            (helper ? stub_delay_ms(LATENCY_CHECK_HELPER_DELAY_MS, config.rate) : 0.0) +
+                            result.rebuffer_ms + result.native_rate_ms + config.pipeline_frames * config.frame_ms;
+    // The echo ring sits at its target after each render callback has taken its frame, which
+    // then plays over the frame's duration - give or take how late the callbacks came
+    const double expected_echo = config.echo_target_ms + 1000.0 * lround(config.render_rate * config.frame_ms / 1000) /
+                                                         config.render_rate;
+    const bool ok = fabs(result.conversion.latency_ms - expected) <= LATENCY_CHECK_TOLERANCE_MS &&
+                    fabs(result.echo_ms - expected_echo) <= LATENCY_CHECK_ECHO_TOLERANCE_MS + late_ms;
+    printf("%9d %7d %6.0f %6.0f %9d %7s %14.3f %9.3f %8.2f %9.2f %8.2f  %s\n", config.rate, config.render_rate,
+           config.frame_ms, config.block_ms, config.pipeline_frames, helper ? "no" : "yes",
+           result.conversion.latency_ms, expected, result.echo_ms, expected_echo, late_ms, ok ? "ok" : "FAILED");
+    if(!ok)
+      failures++;
+  }
+  if(failures)
+    printf("%d configurations measured differently from their delays\n", failures);
+  return failures ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+  PathConfig config = {48000, 0, 10.0, 0.0f, 10.0f, 0, true};
+  int measurements = 3;
+  double lookahead_ms = -1.0, helper_delay_ms = -1.0;
+  bool check = false;
+  for(int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if(arg == "--rate" && i + 1 < argc)
+      config.rate = std::max(8000, atoi(argv[++i]));
+    else if(arg == "--render-rate" && i + 1 < argc)
+      config.render_rate = std::max(8000, atoi(argv[++i]));
+    else if(arg == "--frame-ms" && i + 1 < argc)
+      config.frame_ms = std::max(1.0, atof(argv[++i]));
+    else if(arg == "--block-ms" && i + 1 < argc)
+      config.block_ms = (float)std::max(0.0, atof(argv[++i]));
+    else if(arg == "--echo-target-ms" && i + 1 < argc)
+      config.echo_target_ms = (float)std::max(0.0, atof(argv[++i]));
+    else if(arg == "--pipelined" && i + 1 < argc)
+      config.pipeline_frames = std::max(0, std::min(MODULATE_MAX_PIPELINE_DELAY_FRAMES, atoi(argv[++i])));
+    else if(arg == "--no-native-rate")
+      config.native_rate = false;
+    else if(arg == "--lookahead-ms" && i + 1 < argc)
+      lookahead_ms = std::max(0.0, atof(argv[++i]));
+    else if(arg == "--helper-delay-ms" && i + 1 < argc)
+      helper_delay_ms = std::max(0.0, atof(argv[++i]));
+    else if(arg == "--measurements" && i + 1 < argc)
+      measurements = std::max(1, atoi(argv[++i]));
+    else if(arg == "--check")
+      check = true;
+    else {
+      std::cerr << "Usage: loopback_latency [--rate HZ] [--render-rate HZ] [--frame-ms MS] [--block-ms MS] "
+                   "[--echo-target-ms MS] [--pipelined FRAMES] [--no-native-rate] [--lookahead-ms MS] "
+                   "[--helper-delay-ms MS] [--measurements N] [--check]" << std::endl;
+      return 2;
+    }
+  }
+  if(!config.render_rate)
+    config.render_rate = config.rate;
+  if(config.rate > MODULATE_LATENCY_PROBE_MAX_RATE || config.render_rate > MODULATE_LATENCY_PROBE_MAX_RATE) {
+    std::cerr << "Rates can be at most " << MODULATE_LATENCY_PROBE_MAX_RATE << "Hz" << std::endl;
+    return 2;
+  }
+  if(check) {
+    lookahead_ms = lookahead_ms < 0.0 ? LATENCY_CHECK_LOOKAHEAD_MS : lookahead_ms;
+    helper_delay_ms = helper_delay_ms < 0.0 ? LATENCY_CHECK_HELPER_DELAY_MS : helper_delay_ms;
+  }
+  // Read by the stub when the voice skin and the integration's helpers are created
+  if(lookahead_ms >= 0.0)
+    setenv("MODULATE_STUB_LOOKAHEAD_MS", std::to_string(lookahead_ms).c_str(), 1);
+  if(helper_delay_ms >= 0.0)
+    setenv("MODULATE_STUB_HELPER_DELAY_MS", std::to_string(helper_delay_ms).c_str(), 1);
+
+  const std::string log_directory = (std::filesystem::temp_directory_path() / "modulate_loopback_latency").string();
+  void* voice_skin = nullptr;
+  if(modulate_voice_skin_create(MODULATE_MAX_SEGMENT_SIZE, "latency_skin.mod", &voice_skin)) {
+    std::cerr << "Couldn't create a voice skin" << std::endl;
+    return 1;
+  }
+
+  int status = 0;
+  if(check) {
+    status = run_check(voice_skin, log_directory);
+  } else {
+    // The lookahead on its own, where neither the helper nor the native rate filters resample
+    const PathConfig model_rate = {MODULATE_MODEL_SAMPLE_RATE, MODULATE_MODEL_SAMPLE_RATE, config.frame_ms, 0.0f,
+                                   config.echo_target_ms, 0, true};
+    double baseline_late_ms = 0.0, late_ms = 0.0;
+    const std::vector<LatencyProbeResult> baseline = measure(model_rate, voice_skin, measurements, log_directory,
+                                                             baseline_late_ms);
+    const std::vector<LatencyProbeResult> results = measure(config, voice_skin, measurements, log_directory, late_ms);
+    if(!all_found(baseline, measurements) || !all_found(results, measurements)) {
+      print_failure(all_found(baseline, measurements) ? results : baseline, measurements);
+      status = 1;
+    } else {
+      std::vector<double> lookahead, helper, native_rate, rebuffer, pipeline, conversion, echo, total;
+      double lookahead_mean = 0.0, lowest_correlation = 1.0;
+      for(const LatencyProbeResult& result : baseline)
+        lookahead_mean += result.conversion.latency_ms / baseline.size();
+      for(const LatencyProbeResult& result : baseline)
+        lookahead.push_back(result.conversion.latency_ms);
+      for(const LatencyProbeResult& result : results) {
+        const double pipeline_ms = config.pipeline_frames * config.frame_ms;
+        helper.push_back(uses_helper(config) ? result.voice_skin_ms - pipeline_ms - lookahead_mean : 0.0);
+        native_rate.push_back(result.native_rate_ms);
+        rebuffer.push_back(result.rebuffer_ms);
+        pipeline.push_back(pipeline_ms);
+        conversion.push_back(result.conversion.latency_ms);
+        echo.push_back(result.echo_ms);
+        total.push_back(result.rendered.latency_ms);
+        lowest_correlation = std::min(lowest_correlation, std::min(result.conversion.correlation, result.rendered.correlation));
+      }
+
+      printf("Modulate library %u, %dHz capture, %dHz render, %.0fms frames, %.0fms echo target, %d measurements "
+             "(lowest correlation %.2f, callbacks up to %.2fms late)\n", modulate_get_version(), config.rate,
+             config.render_rate, config.frame_ms, config.echo_target_ms, measurements, lowest_correlation, late_ms);
+      printf("  stage                 mean ms    min ms    max ms\n");
+      const std::pair<const char*, const std::vector<double>*> stages[] = {
+        {"model lookahead", &lookahead}, {"helper resampler", &helper}, {"native rate filters", &native_rate},
+        {"rebuffering", &rebuffer}, {"pipeline", &pipeline}, {"conversion", &conversion}, {"echo ring", &echo},
+        {"capture to render", &total},
+      };
+      for(const auto& stage : stages) {
+        const StageSummary summary = summarize(*stage.second);
+        printf("  %-20s %8.2f  %8.2f  %8.2f\n", stage.first, summary.mean, summary.min, summary.max);
+      }
+    }
+  }
+
+  modulate_voice_skin_destroy(&voice_skin);
+  std::filesystem::remove_all(log_directory);
+  return status;
+}
@@ -0,0 +1,168 @@
+// Compares the native rate fast path (see NativeRateConverter) with the voice skin helper.
+//
+// Drives the capture callback through the stub VivoxBase with band-limited noise, at the
+// rates and frame sizes Vivox uses, once with the fast path and once through the helper,
+// and reports for each the time per frame (mean and p99) and the latency the conversion
+// adds, measured as the lag that best lines the output up with the input.  Frames the
+// fast path can't take (44.1kHz, or an odd number of 48kHz samples) show the fallback.
+//
+// With the stub library the helper passes audio straight through, so this shows the cost
+// and latency of the fast path's own filters.  Linked against the real library it shows
+// them against the helper's resampler instead.
+//
+// Usage: native_rate_bench [--iterations N]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "modulate/modulate.h"
+#include "ModulateVivoxIntegration.hpp"
+#include "VivoxBase.hpp"
+
+#define MODULATE_MAX_SEGMENT_SIZE 2400
+// Longest lag looked for when measuring latency, and how much output it's measured over
+#define BENCH_MAX_LAG 1024
+#define BENCH_LAG_WINDOW 16384
+
+struct RateConfig {
+  int sample_rate;
+  int frame_count;
+};
+
+struct PathResult {
+  double mean_us;
+  double p99_us;
+  long latency_samples; // -1 if the output didn't line up with the input
+  double latency_ms;
+};
+
+// Noise low-passed well below the model's Nyquist frequency, so that both paths pass it
+static std::vector<short> make_noise(size_t count, int sample_rate) {
+  std::vector<short> noise(count);
+  uint32_t state = 12345;
+  const double a = exp(-2 * M_PI * 4000.0 / sample_rate);
+  double y1 = 0.0, y2 = 0.0;
+  for(size_t i = 0; i < count; i++) {
+    state = state * 1664525u + 1013904223u;
+    const double x = ((state >> 8) / (double)(1 << 24)) * 2.0 - 1.0;
+    // Two one-pole lowpasses in a row
+    y1 = (1 - a) * x + a * y1;
+    y2 = (1 - a) * y1 + a * y2;
+    noise[i] = (short)std::max(-32768.0, std::min(32767.0, 60000.0 * y2));
+  }
+  return noise;
+}
+
+static long find_lag(const std::vector<short>& input, const std::vector<short>& output, size_t from) {
+  long best_lag = -1;
+  double best = 0.0;
+  for(long lag = 0; lag < BENCH_MAX_LAG; lag++) {
+    double correlation = 0.0, output_energy = 0.0, input_energy = 0.0;
+    for(size_t i = from; i < std::min(output.size(), from + BENCH_LAG_WINDOW); i++) {
+      correlation += (double)output[i] * input[i - lag];
+      output_energy += (double)output[i] * output[i];
+      input_energy += (double)input[i - lag] * input[i - lag];
+    }
+    const double normalized = output_energy > 0.0 && input_energy > 0.0 ? correlation / sqrt(output_energy * input_energy) : 0.0;
+    if(normalized > best) {
+      best = normalized;
+      best_lag = lag;
+    }
+  }
+  // Anything less isn't the same signal
+  return best > 0.9 ? best_lag : -1;
+}
+
+static PathResult run_path(const RateConfig& config, bool native_rate, void* voice_skin, int iterations,
+                           const std::string& log_directory) {
+  ModulateVivoxIntegration integration(MODULATE_MAX_SEGMENT_SIZE, voice_skin, log_directory.c_str());
+  VivoxBase* vivox = VivoxBase::latest();
+  integration.set_wav_logging_enabled(false);
+  integration.set_silence_gate(false, -50.0f, 300.0f);
+  integration.set_native_rate_fast_path(native_rate);
+
+  // The skin is prepared off the audio thread, and until then the output is silent
+  std::vector<short> frame(config.frame_count);
+  const std::vector<short> warm_up = make_noise(config.frame_count, config.sample_rate);
+  for(int attempt = 0; attempt < 2000; attempt++) {
+    frame = warm_up;
+    vivox->capture("bench", frame.data(), config.frame_count, config.sample_rate, 1);
+    if(std::any_of(frame.begin(), frame.end(), [](short s) {return s != 0;}))
+      break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  const size_t total = (size_t)iterations * config.frame_count;
+  const std::vector<short> input = make_noise(total, config.sample_rate);
+  std::vector<short> output(total);
+  std::vector<double> frame_us(iterations);
+  for(int i = 0; i < iterations; i++) {
+    std::copy(input.begin() + (size_t)i * config.frame_count, input.begin() + (size_t)(i + 1) * config.frame_count, frame.begin());
+    const auto start = std::chrono::steady_clock::now();
+    vivox->capture("bench", frame.data(), config.frame_count, config.sample_rate, 1);
+    frame_us[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    std::copy(frame.begin(), frame.end(), output.begin() + (size_t)i * config.frame_count);
+  }
+
+  PathResult result;
+  double sum = 0.0;
+  for(double us : frame_us)
+    sum += us;
+  result.mean_us = sum / iterations;
+  std::sort(frame_us.begin(), frame_us.end());
+  result.p99_us = frame_us[std::min(frame_us.size() - 1, (size_t)(0.99 * frame_us.size()))];
+  result.latency_samples = find_lag(input, output, BENCH_MAX_LAG);
+  result.latency_ms = result.latency_samples < 0 ? 0.0 : 1000.0 * result.latency_samples / config.sample_rate;
+  return result;
+}
+
+int main(int argc, char** argv) {
+  int iterations = 2000;
+  for(int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if(arg == "--iterations" && i + 1 < argc)
+      iterations = std::max(10, atoi(argv[++i]));
+    else {
+      std::cerr << "Usage: native_rate_bench [--iterations N]" << std::endl;
+      return 2;
+    }
+  }
+  const std::string log_directory = (std::filesystem::temp_directory_path() / "modulate_native_rate_bench").string();
+  void* voice_skin = nullptr;
+  if(modulate_voice_skin_create(MODULATE_MAX_SEGMENT_SIZE, "bench_skin.mod", &voice_skin)) {
+    std::cerr << "Couldn't create a voice skin" << std::endl;
+    return 1;
+  }
+
+  const RateConfig configs[] = {{48000, 480}, {48000, 960}, {24000, 240}, {96000, 960}, {48000, 441}, {44100, 441}};
+  std::cout << "Modulate library " << modulate_get_version() << ", " << get_audio_kernels().name << " kernels, "
+            << iterations << " frames each\n"
+            << "  rate frame  fast path   mean us    p99 us  helper mean us  helper p99 us  added latency ms\n";
+  for(const RateConfig& config : configs) {
+    const bool supported = config.sample_rate % MODULATE_MODEL_SAMPLE_RATE == 0 &&
+                           config.frame_count % (config.sample_rate / MODULATE_MODEL_SAMPLE_RATE) == 0;
+    const PathResult fast = run_path(config, true, voice_skin, iterations, log_directory);
+    const PathResult helper = run_path(config, false, voice_skin, iterations, log_directory);
+    char line[200];
+    if(fast.latency_samples < 0 || helper.latency_samples < 0)
+      snprintf(line, sizeof(line), "%6d %5d %10s %9.2f %9.2f %15.2f %14.2f %17s\n", config.sample_rate, config.frame_count,
+               supported ? "yes" : "fallback", fast.mean_us, fast.p99_us, helper.mean_us, helper.p99_us, "no match");
+    else
+      snprintf(line, sizeof(line), "%6d %5d %10s %9.2f %9.2f %15.2f %14.2f %17.2f\n", config.sample_rate, config.frame_count,
+               supported ? "yes" : "fallback", fast.mean_us, fast.p99_us, helper.mean_us, helper.p99_us,
+               fast.latency_ms - helper.latency_ms);
+    std::cout << line;
+  }
+
+  modulate_voice_skin_destroy(&voice_skin);
+  std::filesystem::remove_all(log_directory);
+  return 0;
+}
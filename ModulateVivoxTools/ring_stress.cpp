@@ -0,0 +1,277 @@
+// Stress test of SpscRing, the lock-free ring between the audio threads and the loggers
+// and echo path, for hours of simulated audio.  Built and run with `make stress`, and
+// under ThreadSanitizer with `make tsan`.
+//
+// A producer thread pushes callback-sized frames of a counting sequence into a small ring,
+// all of a frame or none of it as WavLogger does, counting what didn't fit as dropped.  A
+// consumer thread drains it, alternately with read and in place with peek_contiguous and
+// skip.  Rather than real time, the producer waits for room while the consumer keeps up,
+// and only drops frames while the consumer stalls for a while, as a logging thread on a
+// slow disk would.  Frames vary in size so that they wrap around the end of the ring at
+// every offset.  The consumer checks that the sequence
+// only ever skips whole dropped frames, and at the end that everything pushed was either
+// read or counted as dropped.  The simulated time is how long the audio pushed would take
+// at 48kHz - 25 hours is past where 32-bit counters would have wrapped.
+//
+// It then does the same through WavLogger itself for a simulated minute, checking its own
+// dropped-sample count against the frames add_audio_nonblocking turned away.
+//
+// Usage: ring_stress [--hours N] [--log-dir DIR]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "spsc_ring.hpp"
+#include "wav_logger.hpp"
+
+#define STRESS_SAMPLE_RATE 48000
+// Not a power of two, so the ring rounds it up, as WavLogger's is
+#define STRESS_RING_SIZE 60000
+#define STRESS_WAV_LOGGER_RING_SIZE 3000
+#define STRESS_MAX_FRAME 960
+#define STRESS_READ_SIZE 2000
+// The consumer stalls for up to this many frames, about once every this many passes that
+// found new frames
+#define STRESS_MAX_STALL_FRAMES 160
+#define STRESS_STALL_INTERVAL 8
+#define STRESS_WAV_LOGGER_SECONDS 60
+
+// Small, fast and the same on every platform, so failures can be reproduced
+struct StressRandom {
+  uint64_t state;
+  explicit StressRandom(uint64_t seed) : state(seed) {}
+  uint32_t next() {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    return (uint32_t)(state >> 33);
+  }
+};
+
+// Lets the producer push as fast as the consumer keeps up, and no faster except while the
+// consumer's stalled.  Waiting is a short sleep rather than a yield, so that on one CPU the
+// other thread runs straight away.  Relaxed, so that ThreadSanitizer only sees the ring's
+// own synchronization.
+struct StressPacing {
+  std::atomic<uint64_t> frames{0};
+  std::atomic<uint64_t> stalled_until{0}; // in frames
+  std::atomic<bool> producing{true};
+  uint64_t last_frames = 0; // consumer only
+
+  static void wait() {std::this_thread::sleep_for(std::chrono::microseconds(1));}
+
+  // Producer side: whether a frame that doesn't fit should be dropped rather than waited for
+  bool consumer_stalled() const {
+    return frames.load(std::memory_order_relaxed) < stalled_until.load(std::memory_order_relaxed);
+  }
+  void pushed_frame() {frames.fetch_add(1, std::memory_order_relaxed);}
+  // The consumer's last look at the ring has to come after this
+  void finish_producing() {producing.store(false);}
+
+  // Consumer side, each time round: sometimes, once there's been a new frame, stalls until the
+  // producer's pushed a few more.  Returns whether it did.
+  bool pass(StressRandom& random) {
+    const uint64_t frames_value = frames.load(std::memory_order_relaxed);
+    if(frames_value == last_frames)
+      return false;
+    last_frames = frames_value;
+    if(random.next() % STRESS_STALL_INTERVAL)
+      return false;
+    const uint64_t until = frames_value + 1 + random.next() % STRESS_MAX_STALL_FRAMES;
+    stalled_until.store(until, std::memory_order_relaxed);
+    while(producing.load(std::memory_order_relaxed) && frames.load(std::memory_order_relaxed) < until)
+      wait();
+    return true;
+  }
+};
+
+struct RingResult {
+  uint64_t pushed = 0;
+  uint64_t dropped = 0;
+  uint64_t read = 0;
+  uint64_t skipped = 0;      // sequence the consumer never saw
+  uint64_t errors = 0;       // samples out of sequence other than at a frame boundary
+  uint64_t stalls = 0;
+};
+
+static RingResult run_ring(uint64_t total_samples) {
+  SpscRing<uint32_t> ring(STRESS_RING_SIZE);
+  RingResult result;
+  StressPacing pacing;
+  // The producer also keeps every frame it dropped, for the consumer's gaps to be checked against
+  std::vector<uint64_t> dropped_frame_starts;
+  std::vector<uint64_t> dropped_frame_ends;
+
+  std::thread producer([&] {
+    StressRandom random(1);
+    std::vector<uint32_t> frame(STRESS_MAX_FRAME);
+    uint64_t sequence = 0;
+    while(sequence < total_samples) {
+      const size_t count = (size_t)std::min<uint64_t>(1 + random.next() % STRESS_MAX_FRAME, total_samples - sequence);
+      while(ring.write_available() < count && !pacing.consumer_stalled())
+        StressPacing::wait();
+      for(size_t i = 0; i < count; i++)
+        frame[i] = (uint32_t)(sequence + i);
+      if(ring.write_available() < count) {
+        result.dropped += count;
+        dropped_frame_starts.push_back(sequence);
+        dropped_frame_ends.push_back(sequence + count);
+      } else {
+        ring.write(frame.data(), count);
+      }
+      sequence += count;
+      pacing.pushed_frame();
+    }
+    result.pushed = sequence;
+    pacing.finish_producing();
+  });
+
+  // The consumer sees samples as uint32_t, so it widens them back against what it expects
+  uint64_t expected = 0;
+  std::vector<uint64_t> gap_starts;
+  std::vector<uint64_t> gap_ends;
+  const auto check = [&](const uint32_t* samples, size_t count) {
+    for(size_t i = 0; i < count; i++) {
+      const uint32_t sample = samples[i];
+      if(sample != (uint32_t)expected) {
+        const uint64_t gap = (uint32_t)(sample - (uint32_t)expected);
+        gap_starts.push_back(expected);
+        gap_ends.push_back(expected + gap);
+        result.skipped += gap;
+        expected += gap;
+      }
+      expected++;
+    }
+    result.read += count;
+  };
+  StressRandom random(2);
+  std::vector<uint32_t> buffer(STRESS_READ_SIZE);
+  for(bool draining = true; draining; ) {
+    // The producer's last writes are visible once it's said it's done
+    draining = pacing.producing.load() || ring.read_available();
+    if(!ring.read_available()) {
+      StressPacing::wait();
+    } else if(random.next() % 2) {
+      check(buffer.data(), ring.read(buffer.data(), 1 + random.next() % STRESS_READ_SIZE));
+    } else {
+      size_t count;
+      const uint32_t* samples = ring.peek_contiguous(count);
+      count = std::min(count, (size_t)(1 + random.next() % STRESS_READ_SIZE));
+      check(samples, count);
+      ring.skip(count);
+    }
+    if(pacing.pass(random))
+      result.stalls++;
+  }
+  producer.join();
+  // Whatever the consumer never saw after the last sample it did was dropped too
+  if(expected < result.pushed) {
+    gap_starts.push_back(expected);
+    gap_ends.push_back(result.pushed);
+    result.skipped += result.pushed - expected;
+  }
+
+  // Every gap has to be a run of whole dropped frames
+  size_t frame = 0;
+  for(size_t gap = 0; gap < gap_starts.size(); gap++) {
+    while(frame < dropped_frame_starts.size() && dropped_frame_ends[frame] <= gap_starts[gap])
+      frame++;
+    uint64_t position = gap_starts[gap];
+    while(frame < dropped_frame_starts.size() && dropped_frame_starts[frame] == position && position < gap_ends[gap])
+      position = dropped_frame_ends[frame++];
+    if(position != gap_ends[gap])
+      result.errors++;
+  }
+  return result;
+}
+
+struct WavLoggerResult {
+  uint64_t pushed = 0;
+  uint64_t turned_away = 0;
+  uint64_t counted = 0;
+};
+
+static WavLoggerResult run_wav_logger(const std::string& log_directory) {
+  WavLoggerResult result;
+  WavLogger logger(STRESS_WAV_LOGGER_RING_SIZE, STRESS_SAMPLE_RATE, log_directory, "ring_stress");
+  StressPacing pacing;
+  std::thread drain([&] {
+    StressRandom random(3);
+    while(pacing.producing.load()) {
+      logger.write_outstanding_samples_to_file();
+      pacing.pass(random);
+      StressPacing::wait();
+    }
+  });
+  StressRandom random(4);
+  std::vector<float> frame(STRESS_MAX_FRAME);
+  for(size_t i = 0; i < frame.size(); i++)
+    frame[i] = 0.25f * (float)((i % 64) - 32) / 32;
+  while(result.pushed < (uint64_t)STRESS_WAV_LOGGER_SECONDS * STRESS_SAMPLE_RATE) {
+    const size_t count = 1 + random.next() % STRESS_MAX_FRAME;
+    // A frame turned away while the logging thread's keeping up is tried again, and counted again
+    while(!logger.add_audio_nonblocking(frame.data(), count)) {
+      result.turned_away += count;
+      if(pacing.consumer_stalled())
+        break;
+      StressPacing::wait();
+    }
+    result.pushed += count;
+    pacing.pushed_frame();
+  }
+  pacing.finish_producing();
+  drain.join();
+  logger.write_outstanding_samples_to_file();
+  result.counted = logger.get_dropped_samples();
+  return result;
+}
+
+int main(int argc, char** argv) {
+  double hours = 6.0;
+  std::string log_directory = (std::filesystem::temp_directory_path() / "modulate_ring_stress").string();
+  bool own_log_directory = true;
+  for(int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if(arg == "--hours" && i + 1 < argc)
+      hours = std::max(0.001, atof(argv[++i]));
+    else if(arg == "--log-dir" && i + 1 < argc) {
+      log_directory = argv[++i];
+      own_log_directory = false;
+    } else {
+      std::cerr << "Usage: ring_stress [--hours N] [--log-dir DIR]" << std::endl;
+      return 2;
+    }
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  const RingResult ring = run_ring((uint64_t)(hours * 3600 * STRESS_SAMPLE_RATE));
+  const double ring_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  const bool ring_ok = !ring.errors && ring.read + ring.dropped == ring.pushed && ring.skipped == ring.dropped &&
+                       ring.dropped && ring.read;
+  char line[300];
+  snprintf(line, sizeof(line), "SpscRing: %.2fh of audio in %.1fs, %llu samples read, %llu dropped (%.3f%%), "
+           "%llu skipped by the consumer, %llu out of sequence, %llu stalls\n", hours, ring_seconds,
+           (unsigned long long)ring.read, (unsigned long long)ring.dropped, 100.0 * ring.dropped / ring.pushed,
+           (unsigned long long)ring.skipped, (unsigned long long)ring.errors, (unsigned long long)ring.stalls);
+  std::cout << line;
+
+  std::filesystem::create_directories(log_directory);
+  const WavLoggerResult wav_logger = run_wav_logger(log_directory);
+  if(own_log_directory)
+    std::filesystem::remove_all(log_directory);
+  const bool wav_logger_ok = wav_logger.counted == wav_logger.turned_away && wav_logger.turned_away;
+  snprintf(line, sizeof(line), "WavLogger: %ds of audio, %llu samples turned away, %llu counted as dropped\n",
+           STRESS_WAV_LOGGER_SECONDS, (unsigned long long)wav_logger.turned_away, (unsigned long long)wav_logger.counted);
+  std::cout << line;
+
+  const bool ok = ring_ok && wav_logger_ok;
+  std::cout << (ok ? "ok" : "FAILED") << std::endl;
+  return ok ? 0 : 1;
+}
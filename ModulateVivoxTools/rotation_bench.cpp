@@ -0,0 +1,201 @@
+// Checks that log file rotation doesn't cost any logged audio.
+//
+// Feeds 10ms callbacks of a sine wave into a logger from a paced "audio thread", faster
+// than realtime, while a logging thread drains it the way WavLoggingService does.  The
+// logs are limited to a small size, so they rotate every second or so of audio.  Each
+// WavLogger format runs twice: rotating in place on the logging thread (as every rotation
+// used to), and with a LogFileWorker opening the next file ahead of time and finishing the
+// old one off in the background.  A MultitrackLogger on a real WavLoggingService runs too.
+//
+// Every log file open and close is made to take --disk-latency-ms longer, as on a laptop
+// with a virus scanner looking at every new file (or point --log-dir at a real slow disk,
+// with --disk-latency-ms 0).  For each run it reports the samples dropped because the ring
+// was full, the number of files written, and the longest the logging thread spent in a
+// single drain - the window in which rotating can make the ring overflow.
+//
+// Usage: rotation_bench [--seconds N] [--speed X] [--file-kb N] [--disk-latency-ms N] [--log-dir DIR]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "audio_safe_event.hpp"
+#include "multitrack_logger.hpp"
+#include "wav_logger.hpp"
+
+#define BENCH_SAMPLE_RATE 48000
+#define BENCH_FRAME_SIZE 480
+// The ring the integration gives each logger, ~340ms at 48kHz
+#define BENCH_RING_SIZE 16384
+// As WavLoggingService waits when nothing wakes it
+#define BENCH_IDLE_TIMEOUT_MS 500
+
+struct BenchOptions {
+  double audio_seconds = 60.0;
+  double speed = 10.0;
+  size_t file_length = 256 * 1024;
+  double disk_latency_ms = 50.0;
+  std::string log_directory;
+};
+
+struct RotationResult {
+  std::string name;
+  uint64_t dropped_samples;
+  size_t files;
+  double longest_drain_ms;
+};
+
+static size_t count_logs(const std::string& directory, const std::string& basename) {
+  size_t count = 0;
+  for(const auto& entry : std::filesystem::directory_iterator(directory))
+    if(entry.path().filename().string().find("_" + basename + ".") != std::string::npos)
+      count++;
+  return count;
+}
+
+// Calls callback(frame, count) every 10ms of audio / speed, until there's no audio left.  If
+// this thread oversleeps, it carries on from there rather than catching up in a burst - no
+// audio device would deliver the callbacks like that, and the burst alone could fill the ring.
+template <typename Callback>
+static void run_audio_thread(const BenchOptions& options, const std::vector<float>& audio, Callback callback) {
+  const auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+    std::chrono::duration<double>(BENCH_FRAME_SIZE / (double)BENCH_SAMPLE_RATE / options.speed));
+  auto next_callback = std::chrono::steady_clock::now();
+  for(size_t offset = 0; offset + BENCH_FRAME_SIZE <= audio.size(); offset += BENCH_FRAME_SIZE) {
+    std::this_thread::sleep_until(next_callback);
+    next_callback = std::max(next_callback, std::chrono::steady_clock::now()) + interval;
+    callback(audio.data() + offset, (size_t)BENCH_FRAME_SIZE);
+  }
+}
+
+static RotationResult run_wav_logger(const BenchOptions& options, const std::vector<float>& audio,
+                                     WavSampleFormat format, bool use_worker) {
+  const char* names[] = {"int16", "float32", "flac"};
+  const std::string name = std::string(names[(int)format]) + (use_worker ? "_worker" : "_in_place");
+  const std::string basename = "rotation_" + name;
+
+  RotationResult result = {"WavLogger " + name, 0, 0, 0.0};
+  {
+    LogFileWorker worker;
+    WavLogger logger(BENCH_RING_SIZE, BENCH_SAMPLE_RATE, options.log_directory, basename, format,
+                     use_worker ? &worker : nullptr, options.file_length);
+
+    AudioSafeEvent wake_event;
+    std::atomic<bool> running(true);
+    std::chrono::steady_clock::duration longest_drain(0);
+    logger.set_wake_event(&wake_event);
+    std::thread logging_thread([&] {
+      while(running.load()) {
+        wake_event.wait_for(std::chrono::milliseconds(BENCH_IDLE_TIMEOUT_MS));
+        const auto start = std::chrono::steady_clock::now();
+        logger.write_outstanding_samples_to_file();
+        longest_drain = std::max(longest_drain, std::chrono::steady_clock::now() - start);
+      }
+    });
+
+    run_audio_thread(options, audio, [&](const float* frame, size_t count) {
+      logger.add_audio_nonblocking(frame, count);
+    });
+
+    running.store(false);
+    wake_event.signal();
+    logging_thread.join();
+    logger.set_wake_event(nullptr);
+    result.dropped_samples = logger.get_dropped_samples();
+    result.longest_drain_ms = std::chrono::duration<double, std::milli>(longest_drain).count();
+  }
+  result.files = count_logs(options.log_directory, basename);
+  return result;
+}
+
+// Through the real service, so the longest drain isn't visible from here
+static RotationResult run_multitrack_logger(const BenchOptions& options, const std::vector<float>& audio) {
+  const std::string basename = "rotation_multitrack";
+  RotationResult result = {"MultitrackLogger flac", 0, 0, NAN};
+  {
+    WavLoggingService service;
+    MultitrackLogger logger(service, 2 * BENCH_RING_SIZE, BENCH_FRAME_SIZE, options.log_directory, basename,
+                            WavSampleFormat::flac, options.file_length);
+    logger.start_logging_thread();
+    uint64_t callback_index = 0;
+    run_audio_thread(options, audio, [&](const float* frame, size_t count) {
+      if(logger.begin_frame(frame, count, BENCH_SAMPLE_RATE, 1, 0, callback_index++))
+        logger.end_frame(frame);
+    });
+    logger.stop_logging_thread();
+    result.dropped_samples = logger.get_dropped_samples();
+  }
+  result.files = count_logs(options.log_directory, basename);
+  return result;
+}
+
+int main(int argc, char** argv) {
+  BenchOptions options;
+  options.log_directory = (std::filesystem::temp_directory_path() / "modulate_rotation_bench").string();
+  bool own_log_directory = true;
+  for(int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if(arg == "--seconds" && i + 1 < argc)
+      options.audio_seconds = std::max(1.0, atof(argv[++i]));
+    else if(arg == "--speed" && i + 1 < argc)
+      options.speed = std::max(0.1, atof(argv[++i]));
+    else if(arg == "--file-kb" && i + 1 < argc)
+      options.file_length = std::max(1, atoi(argv[++i])) * (size_t)1024;
+    else if(arg == "--disk-latency-ms" && i + 1 < argc)
+      options.disk_latency_ms = std::max(0.0, atof(argv[++i]));
+    else if(arg == "--log-dir" && i + 1 < argc) {
+      options.log_directory = argv[++i];
+      own_log_directory = false;
+    } else {
+      std::cerr << "Usage: rotation_bench [--seconds N] [--speed X] [--file-kb N] [--disk-latency-ms N] [--log-dir DIR]" << std::endl;
+      return 2;
+    }
+  }
+  // Logs from earlier runs would throw off the file counts
+  if(own_log_directory)
+    std::filesystem::remove_all(options.log_directory);
+  std::filesystem::create_directories(options.log_directory);
+  set_simulated_log_file_latency(std::chrono::microseconds((int64_t)(1000 * options.disk_latency_ms)));
+
+  std::vector<float> audio((size_t)(options.audio_seconds * BENCH_SAMPLE_RATE));
+  for(size_t i = 0; i < audio.size(); i++)
+    audio[i] = 0.5f * (float)sin(2 * M_PI * 220.0 * i / BENCH_SAMPLE_RATE);
+
+  std::vector<RotationResult> results;
+  for(WavSampleFormat format : {WavSampleFormat::int16, WavSampleFormat::float32, WavSampleFormat::flac}) {
+    results.push_back(run_wav_logger(options, audio, format, false));
+    results.push_back(run_wav_logger(options, audio, format, true));
+  }
+  results.push_back(run_multitrack_logger(options, audio));
+
+  // How long the logging thread can stall before the ring overflows, at this speed
+  const double ring_ms = 1000.0 * BENCH_RING_SIZE / BENCH_SAMPLE_RATE / options.speed;
+  std::cout << options.audio_seconds << "s of audio at " << options.speed << "x realtime, "
+            << options.file_length / 1024 << "KB files, " << options.disk_latency_ms << "ms disk latency, ring holds "
+            << ring_ms << "ms\n"
+            << "logger                         files  dropped samples  longest drain ms\n";
+  bool dropped = false;
+  for(const RotationResult& result : results) {
+    char drain[32] = "-";
+    if(!std::isnan(result.longest_drain_ms))
+      snprintf(drain, sizeof(drain), "%.3f", result.longest_drain_ms);
+    char line[200];
+    snprintf(line, sizeof(line), "%-30s %5zu %16llu %17s\n", result.name.c_str(), result.files,
+             (unsigned long long)result.dropped_samples, drain);
+    std::cout << line;
+    dropped = dropped || (result.dropped_samples && result.name.find("in_place") == std::string::npos);
+  }
+
+  if(own_log_directory)
+    std::filesystem::remove_all(options.log_directory);
+  // Rotating in place is only there for comparison
+  return dropped ? 1 : 0;
+}
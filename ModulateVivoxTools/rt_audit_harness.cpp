@@ -0,0 +1,198 @@
+// Drives the Vivox audio callbacks of the audit build (see rt_audit.hpp) with synthetic
+// audio through the stub VivoxBase, covering the paths the audio threads can take - echo,
+// the latency probe, other rates and channel counts, the silence gate, rebuffering,
+// oversized frames, voice skin switches with settings changing on another thread,
+// pipelined mode and a failing voice skin, with and without pipelining - and fails if any callback allocated, locked a mutex or did file or stream
+// I/O, printing where each violation came from.
+//
+// Build and run with `make audit`.  Linked against the real library, this also audits
+// the voice skin's own calls.
+//
+// Usage: rt_audit_harness [--frames N]
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "modulate/modulate.h"
+#include "ModulateVivoxIntegration.hpp"
+#include "VivoxBase.hpp"
+#include "rt_audit.hpp"
+
+#define MODULATE_MAX_SEGMENT_SIZE 2400
+
+#ifndef MODULATE_RT_AUDIT
+#error The harness needs the audit build of the integration - build it with make audit
+#endif
+
+struct HarnessState {
+  ModulateVivoxIntegration& integration;
+  VivoxBase& vivox;
+};
+
+// A voiced-sounding sine, so that the silence gate sees speech
+static void fill_frame(std::vector<short>& pcm_frames, int pcm_frame_count, int channels, int audio_frame_rate,
+                       uint64_t& position, float amplitude) {
+  pcm_frames.resize((size_t)pcm_frame_count * channels);
+  for(int i = 0; i < pcm_frame_count; i++, position++) {
+    const short sample = (short)(amplitude * 32767.0 * sin(2 * M_PI * 220.0 * position / audio_frame_rate));
+    for(int c = 0; c < channels; c++)
+      pcm_frames[(size_t)i * channels + c] = sample;
+  }
+}
+
+// Sends frames through the capture callback (and the render callback, for echo), leaving
+// time for the background threads to do their part if realtime is set
+static void stream(HarnessState& state, int frames, int pcm_frame_count, int audio_frame_rate, int channels,
+                   bool render, bool realtime, std::function<void(int)> before_frame = nullptr) {
+  std::vector<short> capture_frames, render_frames;
+  uint64_t position = 0;
+  for(int i = 0; i < frames; i++) {
+    if(before_frame)
+      before_frame(i);
+    fill_frame(capture_frames, pcm_frame_count, channels, audio_frame_rate, position, 0.3f);
+    state.vivox.capture("harness", capture_frames.data(), pcm_frame_count, audio_frame_rate, channels, 1);
+    if(render) {
+      render_frames.assign((size_t)pcm_frame_count * channels, 0);
+      state.vivox.render("harness", render_frames.data(), pcm_frame_count, audio_frame_rate, channels, 0);
+    }
+    if(realtime)
+      std::this_thread::sleep_for(std::chrono::microseconds(500));
+  }
+}
+
+int main(int argc, char** argv) {
+  int frames = 500;
+  for(int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if(arg == "--frames" && i + 1 < argc)
+      frames = std::max(10, atoi(argv[++i]));
+    else {
+      fprintf(stderr, "Usage: rt_audit_harness [--frames N]\n");
+      return 2;
+    }
+  }
+
+  const std::string log_directory = (std::filesystem::temp_directory_path() / "modulate_rt_audit_harness").string();
+  void* voice_skins[2] = {nullptr, nullptr};
+  void* failing_voice_skin = nullptr;
+  // The last has too small a frame size for any callback, so that every conversion fails
+  if(modulate_voice_skin_create(MODULATE_MAX_SEGMENT_SIZE, "harness_a.mod", &voice_skins[0]) ||
+     modulate_voice_skin_create(MODULATE_MAX_SEGMENT_SIZE, "harness_b.mod", &voice_skins[1]) ||
+     modulate_voice_skin_create(100, "harness_failing.mod", &failing_voice_skin)) {
+    fprintf(stderr, "Couldn't create the voice skins\n");
+    return 1;
+  }
+
+  int failed_scenarios = 0;
+  {
+    ModulateVivoxIntegration integration(MODULATE_MAX_SEGMENT_SIZE, voice_skins[0], log_directory.c_str());
+    integration.add_session("stub");
+    HarnessState state = {integration, *VivoxBase::latest()};
+
+    const std::vector<std::pair<const char*, std::function<void()>>> scenarios = {
+      {"48kHz mono capture, logging", [&] {
+        stream(state, frames, 480, 48000, 1, false, false);
+      }},
+      {"48kHz stereo capture and render, echo", [&] {
+        integration.start_realtime_echo();
+        stream(state, frames, 480, 48000, 2, true, false);
+        integration.end_realtime_echo();
+        stream(state, 10, 480, 48000, 2, true, false);
+      }},
+      {"latency probe, echo", [&] {
+        integration.start_realtime_echo();
+        integration.start_latency_probe();
+        stream(state, frames, 480, 48000, 1, true, false);
+        integration.end_realtime_echo();
+      }},
+      {"44.1kHz and 16kHz through the voice skin helper", [&] {
+        stream(state, frames, 441, 44100, 1, false, false);
+        stream(state, frames, 160, 16000, 1, false, false);
+      }},
+      {"silence gate opening and closing", [&] {
+        integration.set_silence_gate(true, -50.0f, 30.0f);
+        std::vector<short> pcm_frames(480);
+        uint64_t position = 0;
+        for(int i = 0; i < frames; i++) {
+          const bool speaking = (i / 20) % 2 == 0;
+          fill_frame(pcm_frames, 480, 1, 48000, position, speaking ? 0.3f : 0.0f);
+          state.vivox.capture("harness", pcm_frames.data(), 480, 48000, 1, speaking);
+        }
+        integration.set_silence_gate(false, -50.0f, 300.0f);
+      }},
+      {"20ms blocks, odd and oversized frames", [&] {
+        integration.set_model_block_ms(20.0f);
+        stream(state, frames, 441, 48000, 1, false, false);
+        stream(state, frames / 10, 4096, 48000, 2, false, false);
+        integration.set_model_block_ms(0.0f);
+        stream(state, frames / 10, 4096, 48000, 1, false, false);
+      }},
+      {"voice skin switches, settings changing on another thread", [&] {
+        std::atomic<bool> running(true);
+        std::thread ui([&] {
+          for(float strength = 0.0f; running.load(); strength = strength > 1.0f ? 0.0f : strength + 0.1f) {
+            integration.set_radio_strength(strength);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          }
+        });
+        integration.set_voice_skin_switching(50.0f, 20.0f);
+        stream(state, frames, 480, 48000, 1, false, true, [&](int i) {
+          if(i % 100 == 50)
+            integration.set_voice_skin(voice_skins[(i / 100) % 2 ? 0 : 1]);
+        });
+        running.store(false);
+        ui.join();
+        integration.set_voice_skin(voice_skins[0]);
+      }},
+      {"pipelined conversion", [&] {
+        integration.set_pipelined_conversion(true, 2, DeadlineMissPolicy::dry);
+        stream(state, frames, 480, 48000, 1, false, true);
+        integration.set_pipelined_conversion(false, 2, DeadlineMissPolicy::dry);
+      }},
+      {"failing voice skin", [&] {
+        integration.set_voice_skin(failing_voice_skin);
+        stream(state, frames, 480, 48000, 1, false, true);
+        integration.set_voice_skin(voice_skins[0]);
+        stream(state, 50, 480, 48000, 1, false, true);
+      }},
+      {"failing voice skin, pipelined", [&] {
+        integration.set_pipelined_conversion(true, 2, DeadlineMissPolicy::repeat_last_frame);
+        integration.set_voice_skin(failing_voice_skin);
+        stream(state, frames, 480, 48000, 1, false, true);
+        integration.set_voice_skin(voice_skins[0]);
+        stream(state, 50, 480, 48000, 1, false, true);
+        integration.set_pipelined_conversion(false, 2, DeadlineMissPolicy::repeat_last_frame);
+      }},
+    };
+
+    // The first frames bind the session and start the voice skin off
+    stream(state, 20, 480, 48000, 1, false, true);
+    for(const auto& scenario : scenarios) {
+      rt_audit_reset();
+      scenario.second();
+      const uint64_t violations = rt_audit_get_violation_count();
+      printf("%-60s %s\n", scenario.first, violations ? "FAILED" : "ok");
+      if(violations) {
+        rt_audit_print_report(stdout);
+        failed_scenarios++;
+      }
+    }
+    integration.remove_session("stub");
+  }
+
+  modulate_voice_skin_destroy(&voice_skins[0]);
+  modulate_voice_skin_destroy(&voice_skins[1]);
+  modulate_voice_skin_destroy(&failing_voice_skin);
+  std::filesystem::remove_all(log_directory);
+  if(failed_scenarios)
+    printf("%d scenarios made calls that aren't real-time safe from the audio callbacks\n", failed_scenarios);
+  return failed_scenarios ? 1 : 0;
+}
@@ -0,0 +1,315 @@
+// Stress test of the settings path: setters on several threads against a converting
+// audio thread.
+//
+// A thread per voice parameter calls its setter over and over, each with a counter, so
+// that the value of a parameter says which of its setter's calls it came from, and the
+// generation that call returned says from when until when that value was current (up to
+// STRESS_MAX_WRITES calls, which takes a few seconds).  A
+// voice skin thread meanwhile swaps between stub voice skins with set_voice_skin, waits
+// for get_observed_settings_generation to catch up, and then retires the skin it swapped
+// out, as an app destroying it would.  The session gets its own copy of each voice skin
+// through set_voice_skin_copier, which isn't ready the first time it's asked for, so the
+// session waits for it as it would for a loading one.  The capture callback runs unpaced on two
+// more threads through the stub VivoxBase, one for the session and one for audio that
+// goes through the default context, and the stub reports every generate call (see
+// modulate_stub.hpp).  It checks that:
+//   - every set of parameters the session's capture thread converted with was current all
+//     at once, at some generation, rather than torn between two
+//   - no thread converted with a voice skin after it had been retired
+//   - the two capture threads never converted with the same copy of a voice skin
+//   - the session waited for its copies rather than sharing
+// and exits with 1 if any failed.  Retired skins aren't actually destroyed until the
+// end, so a late use is reported rather than crashing.
+//
+// Built and run with `make stress`.  Only works against the stub.
+//
+// Usage: settings_stress [--seconds N] [--setter-threads N]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "modulate/modulate.h"
+#include "modulate_stub.hpp"
+#include "ModulateVivoxIntegration.hpp"
+#include "VivoxBase.hpp"
+
+#define MODULATE_MAX_SEGMENT_SIZE 2400
+#define STRESS_SAMPLE_RATE 48000
+#define STRESS_FRAME_SIZE 480
+#define STRESS_PARAMETERS 6
+// Parameter values are counters over this, so every one is exact as a float and no more than 1
+#define STRESS_MAX_WRITES (1 << 20)
+#define STRESS_MAX_OBSERVATIONS (1 << 21)
+#define STRESS_VOICE_SKINS 256
+// Longest a swapped-out voice skin may stay in use
+#define STRESS_RECLAIM_TIMEOUT_S 5.0
+
+typedef uint64_t (ModulateVivoxIntegration::*ParameterSetter)(float);
+
+static const ParameterSetter parameter_setters[STRESS_PARAMETERS] = {
+  &ModulateVivoxIntegration::set_radio_strength,
+  &ModulateVivoxIntegration::set_presence_strength,
+  &ModulateVivoxIntegration::set_bass_booster_strength,
+  &ModulateVivoxIntegration::set_intimidator_strength,
+  &ModulateVivoxIntegration::set_helm_strength,
+  &ModulateVivoxIntegration::set_vivid_strength
+};
+
+static float get_parameter(const modulate_parameters& params, size_t parameter) {
+  const float values[STRESS_PARAMETERS] = {params.radio_strength, params.presence_strength, params.bass_booster_strength,
+                                           params.intimidator_strength, params.helm_strength, params.vivid_strength};
+  return values[parameter];
+}
+
+// Both capture threads, the session's first
+static std::thread::id capture_threads[2];
+
+struct Observation {
+  void* voice_skin;
+  modulate_parameters params;
+};
+
+// Shared with the stub's generate observer, which has no context of its own
+static struct {
+  std::vector<Observation> observations;
+  std::atomic<size_t> observation_count{0};
+  // Every copy of a voice skin, to its index and to which capture thread first used it
+  std::unordered_map<void*, size_t> skin_indices;
+  std::unordered_map<void*, size_t> copy_indices;
+  std::unique_ptr<std::atomic<int>[]> copy_users;
+  std::atomic<bool> retired[STRESS_VOICE_SKINS];
+  std::atomic<uint64_t> retired_uses{0};
+  std::atomic<uint64_t> shared_uses{0};
+} stress;
+
+static void observe_generate(void* voice_skin, const modulate_parameters* parameters) {
+  const auto skin = stress.skin_indices.find(voice_skin);
+  if(skin != stress.skin_indices.end() && stress.retired[skin->second].load(std::memory_order_acquire))
+    stress.retired_uses.fetch_add(1);
+  const std::thread::id thread = std::this_thread::get_id();
+  const int user = thread == capture_threads[0] ? 1 : thread == capture_threads[1] ? 2 : 0;
+  const auto copy = stress.copy_indices.find(voice_skin);
+  if(user && copy != stress.copy_indices.end()) {
+    int first_user = 0;
+    if(!stress.copy_users[copy->second].compare_exchange_strong(first_user, user) && first_user != user)
+      stress.shared_uses.fetch_add(1);
+  }
+  // Only the session's capture callback converts with the published settings - the skin
+  // switch worker primes with whatever was pending when it started
+  if(thread != capture_threads[0] || !parameters)
+    return;
+  const size_t index = stress.observation_count.load(std::memory_order_relaxed);
+  if(index < stress.observations.size()) {
+    stress.observations[index] = {voice_skin, *parameters};
+    stress.observation_count.store(index + 1, std::memory_order_relaxed);
+  }
+}
+
+// Whether the parameters were all current at one generation, given the generation each
+// value of each parameter was published at
+static bool is_consistent(const modulate_parameters& params, const std::vector<std::vector<uint64_t>>& generations) {
+  uint64_t first = 0;
+  uint64_t last = UINT64_MAX;
+  for(size_t parameter = 0; parameter < STRESS_PARAMETERS; parameter++) {
+    const std::vector<uint64_t>& published = generations[parameter];
+    const double count = (double)get_parameter(params, parameter) * STRESS_MAX_WRITES;
+    const size_t value = (size_t)count;
+    if((double)value != count || value >= published.size())
+      return false;
+    first = std::max(first, published[value]);
+    if(value + 1 < published.size())
+      last = std::min(last, published[value + 1] - 1);
+  }
+  return first <= last;
+}
+
+int main(int argc, char** argv) {
+  double seconds = 5.0;
+  size_t setter_threads = STRESS_PARAMETERS;
+  for(int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if(arg == "--seconds" && i + 1 < argc)
+      seconds = std::max(0.1, atof(argv[++i]));
+    else if(arg == "--setter-threads" && i + 1 < argc)
+      setter_threads = (size_t)std::min(STRESS_PARAMETERS, std::max(1, atoi(argv[++i])));
+    else {
+      std::cerr << "Usage: settings_stress [--seconds N] [--setter-threads N]" << std::endl;
+      return 2;
+    }
+  }
+
+  std::vector<void*> voice_skins(STRESS_VOICE_SKINS);
+  for(size_t i = 0; i < voice_skins.size(); i++) {
+    const std::string filename = "stress_" + std::to_string(i) + ".mod";
+    if(modulate_voice_skin_create(MODULATE_MAX_SEGMENT_SIZE, filename.c_str(), &voice_skins[i])) {
+      std::cerr << "Couldn't create voice skin " << filename << std::endl;
+      return 1;
+    }
+    stress.skin_indices[voice_skins[i]] = i;
+    stress.retired[i].store(false);
+  }
+  stress.observations.resize(STRESS_MAX_OBSERVATIONS);
+
+  const std::string log_directory = (std::filesystem::temp_directory_path() / "modulate_settings_stress").string();
+  std::filesystem::create_directories(log_directory);
+  bool failed = false;
+  // Each voice skin, then its copies for the session contexts
+  std::vector<std::vector<void*>> copies(voice_skins.size());
+  {
+    // No voice skin to start with, so that no context ever converts with another's
+    ModulateVivoxIntegration integration(MODULATE_MAX_SEGMENT_SIZE, nullptr, log_directory.c_str());
+    for(size_t i = 0; i < voice_skins.size() && !failed; i++) {
+      copies[i].push_back(voice_skins[i]);
+      for(size_t copy_number = 1; copy_number <= MODULATE_MAX_SESSIONS && !failed; copy_number++) {
+        void* copy = nullptr;
+        const std::string filename = "stress_" + std::to_string(i) + ".mod";
+        failed = modulate_voice_skin_create(MODULATE_MAX_SEGMENT_SIZE, filename.c_str(), &copy) != 0;
+        copies[i].push_back(copy);
+      }
+      for(void* copy : copies[i]) {
+        stress.skin_indices[copy] = i;
+        stress.copy_indices[copy] = stress.copy_indices.size();
+      }
+    }
+    stress.copy_users.reset(new std::atomic<int>[stress.copy_indices.size()]);
+    for(size_t i = 0; i < stress.copy_indices.size(); i++)
+      stress.copy_users[i].store(0);
+    // Called with the integration's lock held, so nothing else guards asked
+    std::vector<std::vector<bool>> asked(voice_skins.size(), std::vector<bool>(MODULATE_MAX_SESSIONS + 1, false));
+    integration.set_voice_skin_copier([&](void* voice_skin, size_t copy_number) -> void* {
+      const auto skin = stress.skin_indices.find(voice_skin);
+      if(skin == stress.skin_indices.end() || failed || copy_number > MODULATE_MAX_SESSIONS)
+        return nullptr;
+      const bool ready = asked[skin->second][copy_number];
+      asked[skin->second][copy_number] = true;
+      return ready ? copies[skin->second][copy_number] : nullptr;
+    });
+    integration.set_voice_skin(voice_skins[0]);
+    integration.add_session("stress");
+    VivoxBase* vivox = VivoxBase::latest();
+
+    // Every parameter starts from a known value, at a known generation
+    std::vector<std::vector<uint64_t>> generations(STRESS_PARAMETERS);
+    for(size_t parameter = 0; parameter < STRESS_PARAMETERS; parameter++) {
+      generations[parameter].reserve(STRESS_MAX_WRITES);
+      generations[parameter].push_back((integration.*parameter_setters[parameter])(0.0f));
+    }
+
+    // One capture binds the session by its channel, and the other's channel matches no session,
+    // so it goes to the default context.  Neither converts until the observer knows which
+    // thread is which.
+    std::atomic<bool> running(true);
+    std::atomic<bool> observing(false);
+    std::atomic<uint64_t> frames(0);
+    const auto capture_loop = [&](const char* session_group_handle, const char* initial_target_uri) {
+      std::vector<short> pcm_frames(STRESS_FRAME_SIZE);
+      while(!observing.load())
+        std::this_thread::yield();
+      while(running.load()) {
+        for(size_t i = 0; i < pcm_frames.size(); i++)
+          pcm_frames[i] = (short)((i * 97) % 8000);
+        vivox->capture(session_group_handle, pcm_frames.data(), STRESS_FRAME_SIZE, STRESS_SAMPLE_RATE, 1, 1, initial_target_uri);
+        frames.fetch_add(1, std::memory_order_relaxed);
+      }
+    };
+    std::thread capture(capture_loop, "stress", "sip:confctl-g-stress.stress@stub");
+    std::thread default_capture(capture_loop, "stress_default", "sip:confctl-g-stress.other@stub");
+    capture_threads[0] = capture.get_id();
+    capture_threads[1] = default_capture.get_id();
+    modulate_stub_set_generate_observer(observe_generate);
+    observing.store(true);
+
+    // Setter threads take the parameters between them
+    std::vector<std::thread> setters;
+    for(size_t thread = 0; thread < setter_threads; thread++) {
+      setters.emplace_back([&, thread] {
+        for(size_t parameter = thread; running.load(); parameter += setter_threads) {
+          if(parameter >= STRESS_PARAMETERS)
+            parameter = thread;
+          std::vector<uint64_t>& published = generations[parameter];
+          if(published.size() >= STRESS_MAX_WRITES)
+            break;
+          const float value = (float)published.size() / STRESS_MAX_WRITES;
+          published.push_back((integration.*parameter_setters[parameter])(value));
+        }
+      });
+    }
+
+    size_t swaps = 0;
+    double longest_reclaim_s = 0.0;
+    bool reclaim_timed_out = false;
+    std::thread swapper([&] {
+      for(size_t next = 1; next < voice_skins.size() && running.load() && !reclaim_timed_out; next++) {
+        const uint64_t generation = integration.set_voice_skin(voice_skins[next]);
+        const auto start = std::chrono::steady_clock::now();
+        while(integration.get_observed_settings_generation() < generation) {
+          if(std::chrono::steady_clock::now() - start > std::chrono::duration<double>(STRESS_RECLAIM_TIMEOUT_S)) {
+            reclaim_timed_out = true;
+            break;
+          }
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if(reclaim_timed_out)
+          break;
+        longest_reclaim_s = std::max(longest_reclaim_s,
+                                     std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        stress.retired[next - 1].store(true, std::memory_order_release);
+        swaps++;
+      }
+    });
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    running.store(false);
+    swapper.join();
+    for(std::thread& setter : setters)
+      setter.join();
+    capture.join();
+    default_capture.join();
+    modulate_stub_set_generate_observer(nullptr);
+
+    uint64_t published = 0;
+    for(const std::vector<uint64_t>& parameter_generations : generations)
+      published += parameter_generations.size() - 1;
+    const size_t checked = stress.observation_count.load();
+    size_t torn = 0;
+    for(size_t i = 0; i < checked; i++)
+      torn += is_consistent(stress.observations[i].params, generations) ? 0 : 1;
+    const uint64_t retired_uses = stress.retired_uses.load();
+    const uint64_t shared_uses = stress.shared_uses.load();
+    const uint64_t copy_waits = integration.get_voice_skin_copy_waits();
+
+    std::cout << seconds << "s, " << setter_threads << " setter threads: " << published << " parameters set, "
+              << swaps << " voice skins swapped out and retired, " << frames.load() << " frames converted\n";
+    char line[200];
+    snprintf(line, sizeof(line), "%zu parameter sets checked, %zu torn; %llu generate calls on retired voice skins; "
+             "longest wait to retire a voice skin %.1fms\n", checked, torn, (unsigned long long)retired_uses,
+             1000.0 * longest_reclaim_s);
+    std::cout << line;
+    std::cout << shared_uses << " generate calls on a copy of a voice skin the other capture thread had used; "
+              << copy_waits << " waits for a copy\n";
+    if(reclaim_timed_out)
+      std::cout << "A swapped-out voice skin was still in use after " << STRESS_RECLAIM_TIMEOUT_S << "s\n";
+    failed = failed || torn || retired_uses || shared_uses || !copy_waits || reclaim_timed_out || !checked || !swaps;
+  }
+
+  for(std::vector<void*>& skin_copies : copies)
+    for(size_t copy_number = 1; copy_number < skin_copies.size(); copy_number++)
+      modulate_voice_skin_destroy(&skin_copies[copy_number]);
+
+  for(void*& voice_skin : voice_skins)
+    modulate_voice_skin_destroy(&voice_skin);
+  std::filesystem::remove_all(log_directory);
+  std::cout << (failed ? "FAILED" : "ok") << std::endl;
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,158 @@
+// Startup time benchmark of voice skin loading.
+//
+// Writes N dummy skin files and loads them through VoiceSkinCatalog the way the app does at
+// startup: one at a time (as create_voice_skin always did), concurrently on the catalog's
+// thread pool, and lazily - first with no name cache, which loads everything to learn the
+// names, then with the cache that run wrote, which only registers names.  For each it
+// reports the time until the catalog is complete, until the first skin was published, and
+// how long selecting the first skin then takes (which is when a lazy skin is loaded).
+//
+// The stub library sleeps MODULATE_STUB_SKIN_LOAD_MS per skin to stand in for the real
+// load, so against the stub this measures how well the loads overlap, not their CPU cost.
+// Linked against the real library, --load-ms is ignored and the dummy files won't load,
+// so pass real skins with --skins-from instead.
+//
+// Usage: skin_load_bench [--skins N] [--load-ms MS] [--skin-kb N] [--threads N] [--skins-from DIR]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "voice_skin_catalog.hpp"
+
+// As the app creates its skins
+#define BENCH_MAX_SEGMENT_SIZE 2400
+
+namespace fs = std::filesystem;
+
+struct LoadResult {
+  std::string mode;
+  unsigned int threads;
+  double startup_ms;
+  double first_skin_ms;
+  double first_select_ms;
+  size_t skins;
+};
+
+static double get_ms_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static LoadResult run_load(const std::string& mode, const std::vector<std::string>& filenames, bool lazy,
+                           unsigned int threads, const std::string& name_cache_filename) {
+  LoadResult result = {mode, threads, 0.0, 0.0, 0.0, 0};
+  VoiceSkinCatalog catalog(BENCH_MAX_SEGMENT_SIZE, name_cache_filename);
+
+  // Watches for the first skin to be published, as a UI showing progress would
+  std::atomic<bool> loading(true);
+  const auto start = std::chrono::steady_clock::now();
+  std::thread watcher([&] {
+    while(loading.load() && catalog.size() == 0)
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    result.first_skin_ms = get_ms_since(start);
+  });
+
+  std::string error_filename;
+  const int error_code = catalog.add(filenames, lazy, threads, error_filename);
+  result.startup_ms = get_ms_since(start);
+  loading.store(false);
+  watcher.join();
+  if(error_code) {
+    std::cerr << "Couldn't load " << error_filename << ", error code " << error_code << std::endl;
+    exit(1);
+  }
+  result.skins = catalog.size();
+
+  const auto select_start = std::chrono::steady_clock::now();
+  if(!catalog.get_voice_skin(catalog.get_name(0))) {
+    std::cerr << "Couldn't load " << catalog.get_name(0) << " on selecting it" << std::endl;
+    exit(1);
+  }
+  result.first_select_ms = get_ms_since(select_start);
+  return result;
+}
+
+int main(int argc, char** argv) {
+  size_t skin_count = 32;
+  double load_ms = 200.0;
+  size_t skin_kb = 1024;
+  unsigned int threads = 0;
+  std::string skins_directory;
+  for(int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if(arg == "--skins" && i + 1 < argc)
+      skin_count = std::max(1, atoi(argv[++i]));
+    else if(arg == "--load-ms" && i + 1 < argc)
+      load_ms = std::max(0.0, atof(argv[++i]));
+    else if(arg == "--skin-kb" && i + 1 < argc)
+      skin_kb = std::max(0, atoi(argv[++i]));
+    else if(arg == "--threads" && i + 1 < argc)
+      threads = std::max(0, atoi(argv[++i]));
+    else if(arg == "--skins-from" && i + 1 < argc)
+      skins_directory = argv[++i];
+    else {
+      std::cerr << "Usage: skin_load_bench [--skins N] [--load-ms MS] [--skin-kb N] [--threads N] [--skins-from DIR]"
+                << std::endl;
+      return 2;
+    }
+  }
+  const fs::path scratch_directory = fs::temp_directory_path() / "modulate_skin_load_bench";
+  fs::remove_all(scratch_directory);
+  fs::create_directories(scratch_directory);
+
+  std::vector<std::string> filenames;
+  if(skins_directory.empty()) {
+    // Random contents, so the file system can't cheat by compressing them
+    std::vector<char> contents(skin_kb * 1024);
+    uint32_t state = 1;
+    for(char& c : contents) {
+      state = state * 1664525u + 1013904223u;
+      c = (char)(state >> 24);
+    }
+    for(size_t i = 0; i < skin_count; i++) {
+      const std::string filename = (scratch_directory / ("bench_skin_" + std::to_string(i) + ".mod")).string();
+      std::ofstream(filename, std::ios::binary).write(contents.data(), contents.size());
+      filenames.push_back(filename);
+    }
+    setenv("MODULATE_STUB_SKIN_LOAD_MS", std::to_string(load_ms).c_str(), 1);
+  } else {
+    for(const auto& entry : fs::directory_iterator(skins_directory))
+      if(entry.path().extension() == ".mod")
+        filenames.push_back(entry.path().string());
+    std::sort(filenames.begin(), filenames.end());
+    if(filenames.empty()) {
+      std::cerr << "No .mod files in " << skins_directory << std::endl;
+      return 1;
+    }
+  }
+  const unsigned int pool_threads = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+  const std::string name_cache_filename = (scratch_directory / "voice_skin_names.txt").string();
+
+  std::vector<LoadResult> results;
+  results.push_back(run_load("one at a time (old)", filenames, false, 1, ""));
+  results.push_back(run_load("concurrent", filenames, false, pool_threads, ""));
+  results.push_back(run_load("lazy, no name cache", filenames, true, pool_threads, name_cache_filename));
+  results.push_back(run_load("lazy, name cache", filenames, true, pool_threads, name_cache_filename));
+
+  std::cout << filenames.size() << " skins";
+  if(skins_directory.empty())
+    std::cout << " of " << skin_kb << "KB, " << load_ms << "ms simulated load each";
+  std::cout << "\nmode                  threads   startup ms  first skin ms  first select ms\n";
+  for(const LoadResult& result : results) {
+    char line[200];
+    snprintf(line, sizeof(line), "%-21s %7u %12.1f %14.1f %16.1f\n", result.mode.c_str(), result.threads,
+             result.startup_ms, result.first_skin_ms, result.first_select_ms);
+    std::cout << line;
+  }
+
+  fs::remove_all(scratch_directory);
+  return 0;
+}
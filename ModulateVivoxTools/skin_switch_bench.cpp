@@ -0,0 +1,193 @@
+// Checks that switching voice skins mid-stream can't be heard.
+//
+// Drives the capture callback through the stub VivoxBase with a sine wave, paced like a
+// real audio device, while a "UI" thread switches between two voice skins every
+// --interval-ms the way select_voice_skin does.  The stub skins are made stateful (see
+// MODULATE_STUB_SKIN_WARM_UP_MS): after a reset their output fades in over --warm-up-ms,
+// and each delays the audio by a different amount, as two voices would differ.  Each run
+// switches a different way:
+//   reset and swap      - the new skin is reset and swapped in cold, as select_voice_skin used to
+//   primed              - primed with the recent input first, then swapped on a frame boundary
+//   primed + crossfade  - primed, then crossfaded in (the default)
+// For each it reports the deepest dip in level in the frames after a switch (the dropout),
+// the biggest click (the largest jump between samples, relative to the sine's own), and
+// how long a switch took from being asked for until the old skin was out of use.
+//
+// Usage: skin_switch_bench [--seconds N] [--interval-ms N] [--warm-up-ms N] [--speed X]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "modulate/modulate.h"
+#include "ModulateVivoxIntegration.hpp"
+#include "VivoxBase.hpp"
+
+#define MODULATE_MAX_SEGMENT_SIZE 2400
+#define BENCH_SAMPLE_RATE 48000
+#define BENCH_FRAME_SIZE 480
+// A whole number of cycles per frame, so every frame of the sine has the same level
+#define BENCH_SINE_HZ 200.0
+#define BENCH_SINE_AMPLITUDE 0.5
+
+struct BenchOptions {
+  double audio_seconds = 5.0;
+  double interval_ms = 500.0;
+  double warm_up_ms = 200.0;
+  double speed = 1.0;
+};
+
+struct SwitchResult {
+  std::string name;
+  size_t switches;
+  uint64_t primed_switches;
+  double deepest_dip_db; // quietest frame after a switch, relative to the sine
+  double worst_click_db; // largest jump between samples, relative to the sine's largest
+  double mean_switch_ms;
+  double longest_switch_ms;
+};
+
+static SwitchResult run_switches(const BenchOptions& options, const std::string& name, float prime_ms,
+                                 float crossfade_ms, void* voice_skins[2], const std::string& log_directory) {
+  SwitchResult result = {name, 0, 0, 0.0, 0.0, 0.0, 0.0};
+  const size_t frame_count = (size_t)(options.audio_seconds * BENCH_SAMPLE_RATE / BENCH_FRAME_SIZE);
+  std::vector<float> output(frame_count * BENCH_FRAME_SIZE);
+  // The callback index of each switch, so the frames after it can be checked
+  std::vector<size_t> switch_frames;
+  std::atomic<size_t> frames_done(0);
+
+  ModulateVivoxIntegration integration(MODULATE_MAX_SEGMENT_SIZE, voice_skins[0], log_directory.c_str());
+  VivoxBase* vivox = VivoxBase::latest();
+  integration.set_wav_logging_enabled(false);
+  integration.set_voice_skin_switching(prime_ms, crossfade_ms);
+
+  std::atomic<bool> running(true);
+  double total_switch_ms = 0.0;
+  std::thread ui_thread([&] {
+    const auto interval = std::chrono::duration<double, std::milli>(options.interval_ms / options.speed);
+    size_t next_skin = 1;
+    while(running.load()) {
+      const auto start = std::chrono::steady_clock::now();
+      std::this_thread::sleep_until(start + interval);
+      if(!running.load())
+        break;
+      switch_frames.push_back(frames_done.load());
+      const auto switch_start = std::chrono::steady_clock::now();
+      const uint64_t generation = integration.set_voice_skin(voice_skins[next_skin]);
+      next_skin = 1 - next_skin;
+      while(running.load() && integration.get_observed_settings_generation() < generation)
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+      const double switch_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - switch_start).count();
+      total_switch_ms += switch_ms;
+      result.longest_switch_ms = std::max(result.longest_switch_ms, switch_ms);
+    }
+  });
+
+  // The audio thread, carrying on from where it is if it oversleeps rather than bursting
+  const auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+    std::chrono::duration<double>(BENCH_FRAME_SIZE / (double)BENCH_SAMPLE_RATE / options.speed));
+  std::vector<short> pcm_frames(BENCH_FRAME_SIZE);
+  auto next_callback = std::chrono::steady_clock::now();
+  for(size_t frame = 0; frame < frame_count; frame++) {
+    std::this_thread::sleep_until(next_callback);
+    next_callback = std::max(next_callback, std::chrono::steady_clock::now()) + interval;
+    for(size_t i = 0; i < BENCH_FRAME_SIZE; i++) {
+      const size_t n = frame * BENCH_FRAME_SIZE + i;
+      pcm_frames[i] = (short)(32767 * BENCH_SINE_AMPLITUDE * sin(2 * M_PI * BENCH_SINE_HZ * n / BENCH_SAMPLE_RATE));
+    }
+    vivox->capture("bench", pcm_frames.data(), BENCH_FRAME_SIZE, BENCH_SAMPLE_RATE, 1);
+    for(size_t i = 0; i < BENCH_FRAME_SIZE; i++)
+      output[frame * BENCH_FRAME_SIZE + i] = pcm_frames[i] / 32768.0f;
+    frames_done.store(frame + 1);
+  }
+  running.store(false);
+  ui_thread.join();
+
+  // Every switch whose aftermath was captured in full
+  const size_t check_frames = (size_t)(options.interval_ms / 1000.0 * BENCH_SAMPLE_RATE / BENCH_FRAME_SIZE);
+  const double sine_rms = BENCH_SINE_AMPLITUDE / sqrt(2.0);
+  const double sine_step = BENCH_SINE_AMPLITUDE * 2 * M_PI * BENCH_SINE_HZ / BENCH_SAMPLE_RATE;
+  double lowest_rms = sine_rms;
+  double largest_step = 0.0;
+  for(size_t switch_frame : switch_frames) {
+    if(switch_frame + check_frames > frame_count)
+      break;
+    result.switches++;
+    for(size_t frame = switch_frame; frame < switch_frame + check_frames; frame++) {
+      double sum_of_squares = 0.0;
+      for(size_t i = frame * BENCH_FRAME_SIZE; i < (frame + 1) * BENCH_FRAME_SIZE; i++) {
+        sum_of_squares += output[i] * output[i];
+        if(i)
+          largest_step = std::max(largest_step, (double)fabs(output[i] - output[i - 1]));
+      }
+      lowest_rms = std::min(lowest_rms, sqrt(sum_of_squares / BENCH_FRAME_SIZE));
+    }
+  }
+  result.primed_switches = integration.get_skin_switch_stats().primed_switches;
+  result.deepest_dip_db = 20 * log10(std::max(lowest_rms, 1e-6) / sine_rms);
+  result.worst_click_db = 20 * log10(std::max(largest_step, 1e-9) / sine_step);
+  result.mean_switch_ms = switch_frames.empty() ? 0.0 : total_switch_ms / switch_frames.size();
+  return result;
+}
+
+int main(int argc, char** argv) {
+  BenchOptions options;
+  for(int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if(arg == "--seconds" && i + 1 < argc)
+      options.audio_seconds = std::max(1.0, atof(argv[++i]));
+    else if(arg == "--interval-ms" && i + 1 < argc)
+      options.interval_ms = std::max(50.0, atof(argv[++i]));
+    else if(arg == "--warm-up-ms" && i + 1 < argc)
+      options.warm_up_ms = std::max(0.0, atof(argv[++i]));
+    else if(arg == "--speed" && i + 1 < argc)
+      options.speed = std::max(0.1, atof(argv[++i]));
+    else {
+      std::cerr << "Usage: skin_switch_bench [--seconds N] [--interval-ms N] [--warm-up-ms N] [--speed X]" << std::endl;
+      return 2;
+    }
+  }
+  const std::string log_directory = (std::filesystem::temp_directory_path() / "modulate_skin_switch_bench").string();
+  setenv("MODULATE_STUB_SKIN_WARM_UP_MS", std::to_string(options.warm_up_ms).c_str(), 1);
+
+  void* voice_skins[2] = {nullptr, nullptr};
+  const char* filenames[2] = {"bench_skin_a.mod", "bench_skin_b.mod"};
+  for(int i = 0; i < 2; i++) {
+    if(modulate_voice_skin_create(MODULATE_MAX_SEGMENT_SIZE, filenames[i], &voice_skins[i])) {
+      std::cerr << "Couldn't create " << filenames[i] << std::endl;
+      return 1;
+    }
+  }
+
+  const SkinSwitchSettings defaults = SkinSwitch::default_settings();
+  std::vector<SwitchResult> results;
+  results.push_back(run_switches(options, "reset and swap (old)", 0.0f, 0.0f, voice_skins, log_directory));
+  results.push_back(run_switches(options, "primed", defaults.prime_ms, 0.0f, voice_skins, log_directory));
+  results.push_back(run_switches(options, "primed + crossfade", defaults.prime_ms, defaults.crossfade_ms, voice_skins,
+                                 log_directory));
+
+  std::cout << options.audio_seconds << "s of a " << BENCH_SINE_HZ << "Hz sine at " << options.speed
+            << "x realtime, a switch every " << options.interval_ms << "ms, skins warm up over "
+            << options.warm_up_ms << "ms\n"
+            << "mode                  switches primed  deepest dip dB  worst click dB  mean switch ms  longest switch ms\n";
+  for(const SwitchResult& result : results) {
+    char line[200];
+    snprintf(line, sizeof(line), "%-21s %8zu %6llu %15.1f %15.1f %15.1f %18.1f\n", result.name.c_str(),
+             result.switches, (unsigned long long)result.primed_switches, result.deepest_dip_db,
+             result.worst_click_db, result.mean_switch_ms, result.longest_switch_ms);
+    std::cout << line;
+  }
+
+  for(void*& voice_skin : voice_skins)
+    modulate_voice_skin_destroy(&voice_skin);
+  std::filesystem::remove_all(log_directory);
+  return 0;
+}
@@ -0,0 +1,60 @@
+// Stand-in for the VivoxBase class described in ModulateVivoxIntegration.cpp.
+// Rather than talking to Vivox, it records the audio callbacks that were registered,
+// so that tools can drive them directly with synthetic audio.
+#ifndef MODULATE_STUB_VIVOXBASE_HPP
+#define MODULATE_STUB_VIVOXBASE_HPP
+
+#include <set>
+#include <string>
+
+#include "vivox/include/VxcTypes.h"
+
+class ModulateVivoxIntegration;
+
+class VivoxBase {
+public:
+  void* modulate_integration_ptr;
+  vx_sdk_config_t config = vx_sdk_config_t();
+  std::set<std::string> sessions;
+
+  // The most recently created instance, so that tools can find the callbacks
+  // registered by the ModulateVivoxIntegration they just created
+  static VivoxBase*& latest() {
+    static VivoxBase* instance = nullptr;
+    return instance;
+  }
+
+  explicit VivoxBase(ModulateVivoxIntegration* integration) : modulate_integration_ptr(integration) {
+    latest() = this;
+  }
+  ~VivoxBase() {
+    if(latest() == this)
+      latest() = nullptr;
+  }
+
+  vx_sdk_config_t config_begin_setup(const char* issuer, const char* secret_key) {return vx_sdk_config_t();}
+  void config_finish_setup(const vx_sdk_config_t& new_config) {config = new_config;}
+
+  // Drive the registered callbacks the way the Vivox audio threads would.  A session added
+  // for channel "stub" matches the default target URI.
+  void capture(const char* session_group_handle, short* pcm_frames, int pcm_frame_count, int audio_frame_rate, int channels_per_frame, int speaking = 1,
+               const char* initial_target_uri = "sip:stub") {
+    config.pf_on_audio_unit_before_capture_audio_sent(this, session_group_handle, initial_target_uri, pcm_frames, pcm_frame_count, audio_frame_rate, channels_per_frame, speaking);
+  }
+  void render(const char* session_group_handle, short* pcm_frames, int pcm_frame_count, int audio_frame_rate, int channels_per_frame, int is_silence = 0,
+              const char* initial_target_uri = "sip:stub") {
+    config.pf_on_audio_unit_before_recv_audio_rendered(this, session_group_handle, initial_target_uri, pcm_frames, pcm_frame_count, audio_frame_rate, channels_per_frame, is_silence);
+  }
+
+  void Lock() {}
+  void Unlock() {}
+  void Start() {}
+  void connect() {}
+  void login() {}
+  void add_session(const char* channel_name, bool is_echo) {sessions.insert(channel_name);}
+  void remove_session(const char* channel_name, bool is_echo) {sessions.erase(channel_name);}
+  bool check_connected() {return true;}
+  bool check_logged_in() {return true;}
+};
+
+#endif
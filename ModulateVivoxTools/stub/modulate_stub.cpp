@@ -0,0 +1,345 @@
+// Stand-in implementation of modulate/modulate.h for building and exercising the
+// tools without the Modulate library.  Voice skins pass audio through unchanged,
+// are authenticated from the start, and are named after their file.
+//
+// Creating a real voice skin reads and unpacks its weights, which takes a while.  The stub
+// reads the file if there is one, and with MODULATE_STUB_SKIN_LOAD_MS set in the environment
+// then takes that long too, e.g. for benchmarking startup.
+//
+// A real voice skin also has internal state, and sounds wrong until it's heard some audio
+// after a reset.  With MODULATE_STUB_SKIN_WARM_UP_MS set, a stub skin's output fades in over
+// that much audio after each reset, and each skin delays its output by a few samples (a
+// different number per skin, as if they had different voices), e.g. for hearing switches.
+//
+// With MODULATE_STUB_REQUIRE_AUTHENTICATION=1 set, a skin has to be authenticated before it
+// converts anything, as a real one does.  Its authentication message is 617 digits, taking
+// MODULATE_STUB_AUTH_MESSAGE_MS to create, and the signed response the stub accepts is
+// "signed:" followed by the 64-bit FNV-1a hash of the message in hex - see
+// stub_sign_authentication_message - which a stand-in authentication server can produce.
+//
+// Converting with a real voice skin takes time, some of it for each call whatever its size.
+// With MODULATE_STUB_CALL_US and MODULATE_STUB_US_PER_MS set, each generate call spins for
+// that many microseconds, plus that many per millisecond of audio, e.g. for comparing sizes.
+//
+// A real voice skin also delays its output, by the model's lookahead, and the helper's
+// resampler adds more at rates other than the model's.  MODULATE_STUB_LOOKAHEAD_MS delays
+// every skin's output by that long, and MODULATE_STUB_HELPER_DELAY_MS the helper's at
+// other rates, e.g. for checking latency measurements against known delays.
+//
+// Tools can also watch every generate call, with the hooks in modulate_stub.hpp.
+
+#include "modulate/modulate.h"
+#include "modulate_stub.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+  // Longest delay a stub skin applies
+  const size_t stub_max_delay = 64;
+  // Highest rate the synthetic delays are sized for
+  const unsigned int stub_max_sample_rate = 96000;
+
+  // A fixed delay of so many milliseconds, at whatever rate
+  struct StubDelayLine {
+    double delay_ms = 0.0;
+    std::vector<float> line;
+    size_t position = 0;
+
+    void configure(const char* environment_variable) {
+      if(const char* ms = getenv(environment_variable))
+        delay_ms = std::max(0.0, atof(ms));
+      line.assign((size_t)(delay_ms * stub_max_sample_rate / 1000) + 1, 0.0f);
+    }
+    void reset() {
+      std::fill(line.begin(), line.end(), 0.0f);
+      position = 0;
+    }
+    void process(float* audio, size_t count, unsigned int sample_rate) {
+      const size_t delay = std::min((size_t)lround(delay_ms * sample_rate / 1000), line.size() - 1);
+      if(delay == 0)
+        return;
+      for(size_t i = 0; i < count; i++) {
+        line[position] = audio[i];
+        audio[i] = line[(position + line.size() - delay) % line.size()];
+        position = (position + 1) % line.size();
+      }
+    }
+  };
+
+  struct StubVoiceSkin {
+    unsigned int max_frame_size;
+    std::string name;
+    double warm_up_ms;   // 0 to pass audio through unchanged
+    double call_us;
+    double us_per_ms;
+    size_t delay;
+    // State, since the last reset
+    double converted_ms;
+    float delay_line[stub_max_delay];
+    size_t delay_position;
+    StubDelayLine lookahead;
+    // Authentication, which the UI thread changes while the audio thread checks it
+    std::atomic<bool> authenticated;
+    std::string authentication_message;
+    uint64_t authentication_messages_created;
+  };
+
+  uint64_t stub_fnv1a(const std::string& s) {
+    uint64_t hash = 14695981039346656037ull;
+    for(char c : s)
+      hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+    return hash;
+  }
+
+  // What the stand-in authentication server sends back for a message
+  std::string stub_sign_authentication_message(const std::string& message) {
+    char signature[32];
+    snprintf(signature, sizeof(signature), "signed:%016llx", (unsigned long long)stub_fnv1a(message));
+    return signature;
+  }
+
+  void stub_reset(StubVoiceSkin* skin) {
+    skin->converted_ms = 0.0;
+    memset(skin->delay_line, 0, sizeof(skin->delay_line));
+    skin->delay_position = 0;
+    skin->lookahead.reset();
+  }
+
+  void stub_spend_time(const StubVoiceSkin* skin, size_t count, unsigned int sample_rate) {
+    const double us = skin->call_us + skin->us_per_ms * 1000.0 * count / sample_rate;
+    if(us <= 0.0)
+      return;
+    // Sleeping is too coarse for this, and a real skin keeps the core busy anyway
+    const auto end = std::chrono::steady_clock::now() + std::chrono::duration<double, std::micro>(us);
+    while(std::chrono::steady_clock::now() < end)
+      ;
+  }
+
+  void stub_generate(StubVoiceSkin* skin, const float* input_audio, float* output_audio, size_t count,
+                     unsigned int sample_rate) {
+    stub_spend_time(skin, count, sample_rate);
+    if(skin->warm_up_ms <= 0.0) {
+      if(input_audio != output_audio)
+        memmove(output_audio, input_audio, count * sizeof(float));
+      skin->lookahead.process(output_audio, count, sample_rate);
+      return;
+    }
+    // The delay is the same length of time at any rate, as a voice's would be
+    const size_t delay = std::min(skin->delay * sample_rate / 48000, stub_max_delay - 1);
+    for(size_t i = 0; i < count; i++) {
+      const float gain = (float)std::min(1.0, skin->converted_ms / skin->warm_up_ms);
+      skin->delay_line[skin->delay_position] = input_audio[i];
+      skin->delay_position = (skin->delay_position + 1) % stub_max_delay;
+      output_audio[i] = gain * skin->delay_line[(skin->delay_position + stub_max_delay - 1 - delay) % stub_max_delay];
+      skin->converted_ms += 1000.0 / sample_rate;
+    }
+    skin->lookahead.process(output_audio, count, sample_rate);
+  }
+
+  std::atomic<StubGenerateObserver> stub_generate_observer(nullptr);
+
+  void stub_observe(void* voice_skin, const modulate_parameters* parameters) {
+    if(StubGenerateObserver observer = stub_generate_observer.load(std::memory_order_acquire))
+      observer(voice_skin, parameters);
+  }
+
+  struct StubVoiceSkinHelper {
+    unsigned int max_frame_size;
+    StubDelayLine resampler;
+  };
+}
+
+int modulate_voice_skin_create(unsigned int max_frame_size,
+                               const char* filename,
+                               void** voice_skin_ptr) {
+  if(!filename || !voice_skin_ptr)
+    return 1;
+  std::ifstream f(filename, std::ios::binary);
+  std::vector<char> contents(1 << 16);
+  while(f.read(contents.data(), contents.size()))
+    ;
+  if(const char* load_ms = getenv("MODULATE_STUB_SKIN_LOAD_MS"))
+    std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(atof(load_ms)));
+
+  std::string name(filename);
+  const size_t slash = name.find_last_of("/\\");
+  if(slash != std::string::npos)
+    name = name.substr(slash + 1);
+  const size_t dot = name.find_last_of('.');
+  if(dot != std::string::npos)
+    name = name.substr(0, dot);
+  if(name.size() >= MODULATE_SKIN_NAME_MAX_LENGTH)
+    name.resize(MODULATE_SKIN_NAME_MAX_LENGTH - 1);
+  StubVoiceSkin* skin = new StubVoiceSkin();
+  skin->max_frame_size = max_frame_size;
+  skin->name = name;
+  if(const char* warm_up_ms = getenv("MODULATE_STUB_SKIN_WARM_UP_MS"))
+    skin->warm_up_ms = atof(warm_up_ms);
+  if(const char* call_us = getenv("MODULATE_STUB_CALL_US"))
+    skin->call_us = atof(call_us);
+  if(const char* us_per_ms = getenv("MODULATE_STUB_US_PER_MS"))
+    skin->us_per_ms = atof(us_per_ms);
+  skin->delay = std::hash<std::string>()(name) % stub_max_delay;
+  skin->lookahead.configure("MODULATE_STUB_LOOKAHEAD_MS");
+  const char* require_authentication = getenv("MODULATE_STUB_REQUIRE_AUTHENTICATION");
+  skin->authenticated.store(!require_authentication || atoi(require_authentication) == 0);
+  skin->authentication_messages_created = 0;
+  stub_reset(skin);
+  *voice_skin_ptr = skin;
+  return 0;
+}
+
+int modulate_voice_skin_destroy(void** voice_skin_ptr) {
+  if(!voice_skin_ptr)
+    return 1;
+  delete (StubVoiceSkin*)*voice_skin_ptr;
+  *voice_skin_ptr = 0;
+  return 0;
+}
+
+int modulate_voice_skin_generate(void* voice_skin,
+                                 const float* input_audio,
+                                 unsigned int frame_size,
+                                 float* output_audio,
+                                 const modulate_parameters* parameters) {
+  StubVoiceSkin* skin = (StubVoiceSkin*)voice_skin;
+  stub_observe(voice_skin, parameters);
+  if(!skin || frame_size > skin->max_frame_size || !skin->authenticated.load())
+    return 1;
+  // The low-level API runs at the model's rate
+  stub_generate(skin, input_audio, output_audio, frame_size, 24000);
+  return 0;
+}
+
+int modulate_voice_skin_reset(void* voice_skin) {
+  if(!voice_skin)
+    return 1;
+  stub_reset((StubVoiceSkin*)voice_skin);
+  return 0;
+}
+
+int modulate_voice_skin_get_max_frame_size(void* voice_skin,
+                                           unsigned int* max_frame_size) {
+  if(!voice_skin)
+    return 1;
+  *max_frame_size = ((StubVoiceSkin*)voice_skin)->max_frame_size;
+  return 0;
+}
+
+int modulate_voice_skin_create_authentication_message(void* voice_skin,
+                                                      const char* api_key,
+                                                      char* message,
+                                                      unsigned int message_length) {
+  if(!voice_skin || !api_key || message_length < MODULATE_AUTHENTICATION_MESSAGE_LENGTH)
+    return 1;
+  StubVoiceSkin* skin = (StubVoiceSkin*)voice_skin;
+  if(const char* message_ms = getenv("MODULATE_STUB_AUTH_MESSAGE_MS"))
+    std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(atof(message_ms)));
+  // Different every time, as a real message is, and erasing the last one
+  uint64_t state = stub_fnv1a(skin->name + "/" + api_key + "/" + std::to_string(skin->authentication_messages_created++));
+  std::string digits;
+  while(digits.size() < MODULATE_AUTHENTICATION_MESSAGE_LENGTH - 1) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    digits += (char)('0' + (state >> 33) % 10);
+  }
+  skin->authentication_message = digits;
+  memcpy(message, digits.c_str(), digits.size() + 1);
+  return 0;
+}
+
+int modulate_voice_skin_check_authentication_message(void* voice_skin,
+                                                     const char* message) {
+  if(!voice_skin || !message)
+    return 1;
+  StubVoiceSkin* skin = (StubVoiceSkin*)voice_skin;
+  if(skin->authenticated.load())
+    return 0;
+  if(skin->authentication_message.empty() || stub_sign_authentication_message(skin->authentication_message) != message)
+    return 2;
+  skin->authenticated.store(true);
+  return 0;
+}
+
+int modulate_voice_skin_check_authenticated(void* voice_skin,
+                                            int* is_authenticated) {
+  *is_authenticated = voice_skin && ((StubVoiceSkin*)voice_skin)->authenticated.load() ? 1 : 0;
+  return voice_skin ? 0 : 1;
+}
+
+int modulate_voice_skin_get_skin_name(void* voice_skin, char* name) {
+  if(!voice_skin)
+    return 1;
+  strcpy(name, ((StubVoiceSkin*)voice_skin)->name.c_str());
+  return 0;
+}
+
+unsigned int modulate_get_version(void) {
+  return MODULATE_VERSION;
+}
+
+unsigned int modulate_get_voice_skin_version(void) {
+  return MODULATE_VOICE_SKIN_VERSION;
+}
+
+int modulate_start_text_logging_in_directory(const char* log_dir) {
+  return 0;
+}
+
+int modulate_voice_skin_helper_create(void** voice_skin_helper,
+                                      unsigned int max_frame_size) {
+  if(!voice_skin_helper)
+    return 1;
+  StubVoiceSkinHelper* helper = new StubVoiceSkinHelper();
+  helper->max_frame_size = max_frame_size;
+  helper->resampler.configure("MODULATE_STUB_HELPER_DELAY_MS");
+  *voice_skin_helper = helper;
+  return 0;
+}
+
+int modulate_voice_skin_helper_destroy(void** voice_skin_helper) {
+  if(!voice_skin_helper)
+    return 1;
+  delete (StubVoiceSkinHelper*)*voice_skin_helper;
+  *voice_skin_helper = 0;
+  return 0;
+}
+
+int modulate_voice_skin_helper_generate(void* voice_skin,
+                                        void* voice_skin_helper,
+                                        const float* input_audio,
+                                        float* output_audio,
+                                        unsigned int num_samples,
+                                        unsigned int sample_rate,
+                                        const modulate_parameters* parameters) {
+  stub_observe(voice_skin, parameters);
+  if(!voice_skin || !voice_skin_helper || sample_rate == 0 || !((StubVoiceSkin*)voice_skin)->authenticated.load())
+    return 1;
+  stub_generate((StubVoiceSkin*)voice_skin, input_audio, output_audio, num_samples, sample_rate);
+  // The model's own rate needs no resampling
+  if(sample_rate != 24000)
+    ((StubVoiceSkinHelper*)voice_skin_helper)->resampler.process(output_audio, num_samples, sample_rate);
+  return 0;
+}
+
+int modulate_voice_skin_helper_reset(void* voice_skin_helper,
+                                     unsigned int expected_sample_rate) {
+  if(!voice_skin_helper)
+    return 1;
+  ((StubVoiceSkinHelper*)voice_skin_helper)->resampler.reset();
+  return 0;
+}
+
+void modulate_stub_set_generate_observer(StubGenerateObserver observer) {
+  stub_generate_observer.store(observer, std::memory_order_release);
+}
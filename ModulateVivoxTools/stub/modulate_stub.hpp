@@ -0,0 +1,14 @@
+// Hooks into the stub that aren't part of modulate/modulate.h, for tools that check what
+// the integration does with its voice skins.  Only the stub has these.
+#ifndef MODULATE_STUB_HPP
+#define MODULATE_STUB_HPP
+
+#include "modulate/modulate.h"
+
+// Called on every generate (low-level or through the helper), on whatever thread is
+// converting, before the audio is.  Set it before any audio flows, and clear it with
+// nullptr once none does.
+typedef void (*StubGenerateObserver)(void* voice_skin, const modulate_parameters* parameters);
+void modulate_stub_set_generate_observer(StubGenerateObserver observer);
+
+#endif
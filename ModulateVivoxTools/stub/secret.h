@@ -0,0 +1,3 @@
+// Stand-in for the Vivox issuer and secret key header, which is not distributed
+#define MODULATE_VIVOX_ISSUER "stub-issuer"
+#define MODULATE_VIVOX_SECRET_KEY "stub-secret-key"
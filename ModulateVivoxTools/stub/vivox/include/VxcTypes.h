@@ -0,0 +1,11 @@
+// Stand-in for the parts of the Vivox SDK's VxcTypes.h used by ModulateVivoxIntegration
+#ifndef MODULATE_STUB_VXCTYPES_H
+#define MODULATE_STUB_VXCTYPES_H
+
+typedef struct vx_sdk_config {
+  void (*pf_on_audio_unit_after_capture_audio_read)(void* callback_handle, const char* session_group_handle, const char* initial_target_uri, short* pcm_frames, int pcm_frame_count, int audio_frame_rate, int channels_per_frame);
+  void (*pf_on_audio_unit_before_capture_audio_sent)(void* callback_handle, const char* session_group_handle, const char* initial_target_uri, short* pcm_frames, int pcm_frame_count, int audio_frame_rate, int channels_per_frame, int speaking);
+  void (*pf_on_audio_unit_before_recv_audio_rendered)(void* callback_handle, const char* session_group_handle, const char* initial_target_uri, short* pcm_frames, int pcm_frame_count, int audio_frame_rate, int channels_per_frame, int is_silence);
+} vx_sdk_config_t;
+
+#endif
@@ -0,0 +1,117 @@
+#include "wav_file.hpp"
+
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+
+#include "audio_kernels.hpp"
+
+static uint32_t read_u32(const unsigned char* bytes) {
+  return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint16_t read_u16(const unsigned char* bytes) {
+  return (uint16_t)(bytes[0] | (bytes[1] << 8));
+}
+
+static void write_u32(std::ostream& out, uint32_t value) {
+  const char bytes[4] = {(char)(value & 0xFF), (char)((value >> 8) & 0xFF), (char)((value >> 16) & 0xFF), (char)((value >> 24) & 0xFF)};
+  out.write(bytes, 4);
+}
+
+static void write_u16(std::ostream& out, uint16_t value) {
+  const char bytes[2] = {(char)(value & 0xFF), (char)((value >> 8) & 0xFF)};
+  out.write(bytes, 2);
+}
+
+bool read_wav_file(const std::string& filename, WavFile& wav, std::string& error) {
+  std::ifstream f(filename, std::ios::binary);
+  if(!f) {
+    error = "couldn't open " + filename;
+    return false;
+  }
+  std::vector<unsigned char> contents((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+  if(contents.size() < 12 || memcmp(contents.data(), "RIFF", 4) || memcmp(contents.data() + 8, "WAVE", 4)) {
+    error = filename + " is not a RIFF/WAVE file";
+    return false;
+  }
+
+  unsigned int format = 0;
+  unsigned int bits_per_sample = 0;
+  const unsigned char* data = nullptr;
+  size_t data_size = 0;
+  for(size_t pos = 12; pos + 8 <= contents.size(); ) {
+    const unsigned char* chunk = contents.data() + pos;
+    size_t chunk_size = read_u32(chunk + 4);
+    const size_t remaining = contents.size() - (pos + 8);
+    if(chunk_size > remaining)
+      chunk_size = remaining; // e.g. a log file that was never closed properly
+    if(!memcmp(chunk, "fmt ", 4) && chunk_size >= 16) {
+      format = read_u16(chunk + 8);
+      wav.channels = read_u16(chunk + 10);
+      wav.sample_rate = read_u32(chunk + 12);
+      bits_per_sample = read_u16(chunk + 22);
+      if(format == 0xFFFE && chunk_size >= 26)
+        format = read_u16(chunk + 32); // sub-format GUID starts with the plain format tag
+    } else if(!memcmp(chunk, "data", 4)) {
+      data = chunk + 8;
+      data_size = chunk_size;
+    }
+    pos += 8 + chunk_size + (chunk_size & 1);
+  }
+
+  if(!data || wav.channels == 0 || wav.sample_rate == 0) {
+    error = filename + " is missing its fmt or data chunk";
+    return false;
+  }
+  if(format == 1 && bits_per_sample == 16) {
+    wav.samples.resize(data_size / 2);
+    for(size_t i = 0; i < wav.samples.size(); i++)
+      wav.samples[i] = (short)read_u16(data + i * 2);
+  } else if(format == 3 && bits_per_sample == 32) {
+    std::vector<float> float_samples(data_size / 4);
+    for(size_t i = 0; i < float_samples.size(); i++) {
+      const uint32_t bits = read_u32(data + i * 4);
+      memcpy(&float_samples[i], &bits, 4);
+    }
+    wav.samples.resize(float_samples.size());
+    get_audio_kernels().float_to_int16(float_samples.data(), wav.samples.data(), float_samples.size());
+  } else {
+    error = filename + " has an unsupported sample format (only 16 bit PCM and 32 bit float are supported)";
+    return false;
+  }
+  wav.samples.resize(wav.frame_count() * wav.channels);
+  return true;
+}
+
+bool write_wav_file(const std::string& filename, const WavFile& wav, std::string& error) {
+  std::ofstream f(filename, std::ios::binary);
+  if(!f) {
+    error = "couldn't create " + filename;
+    return false;
+  }
+  const uint32_t data_size = (uint32_t)(wav.samples.size() * 2);
+  f.write("RIFF", 4);
+  write_u32(f, 36 + data_size);
+  f.write("WAVEfmt ", 8);
+  write_u32(f, 16);
+  write_u16(f, 1);
+  write_u16(f, (uint16_t)wav.channels);
+  write_u32(f, wav.sample_rate);
+  write_u32(f, wav.sample_rate * wav.channels * 2);
+  write_u16(f, (uint16_t)(wav.channels * 2));
+  write_u16(f, 16);
+  f.write("data", 4);
+  write_u32(f, data_size);
+  std::vector<char> bytes(data_size);
+  for(size_t i = 0; i < wav.samples.size(); i++) {
+    bytes[i * 2] = (char)(wav.samples[i] & 0xFF);
+    bytes[i * 2 + 1] = (char)((wav.samples[i] >> 8) & 0xFF);
+  }
+  f.write(bytes.data(), bytes.size());
+  if(!f) {
+    error = "failed writing " + filename;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,24 @@
+#ifndef MODULATE_WAV_FILE_HPP
+#define MODULATE_WAV_FILE_HPP
+
+#include <string>
+#include <vector>
+
+// Whole-file WAV reading and writing for the offline tools.
+// Reads 16 bit PCM and 32 bit float files (plain or WAVE_FORMAT_EXTENSIBLE),
+// and always holds the audio as interleaved 16 bit samples, since that's what
+// Vivox hands to the realtime callbacks.
+struct WavFile {
+  unsigned int sample_rate = 0;
+  unsigned int channels = 0;
+  std::vector<short> samples; // interleaved
+
+  size_t frame_count() const {return channels ? samples.size() / channels : 0;}
+  double duration_seconds() const {return sample_rate ? (double)frame_count() / sample_rate : 0.0;}
+};
+
+// Both return false and fill in error on failure
+bool read_wav_file(const std::string& filename, WavFile& wav, std::string& error);
+bool write_wav_file(const std::string& filename, const WavFile& wav, std::string& error);
+
+#endif
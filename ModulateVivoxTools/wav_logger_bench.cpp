@@ -0,0 +1,152 @@
+// Throughput benchmark of the WavLogger write path.
+//
+// Pushes audio through WavLogger's ring in 10ms frames and times
+// write_outstanding_samples_to_file, for 16-bit, 32-bit float and FLAC logs.  For comparison
+// it also times the original write path, which converted and wrote one sample at a
+// time with two ostream::put calls per sample.  Only the writing is timed - filling
+// the ring is the audio thread's cost, not the logger thread's.  The audio is a sine
+// wave, which compresses unrealistically well, unless --input gives a recording to use
+// (its first channel, looped to the requested length).
+//
+// Usage: wav_logger_bench [--seconds N] [--input FILE.wav] [--log-dir DIR]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "wav_file.hpp"
+#include "wav_logger.hpp"
+
+#define BENCH_SAMPLE_RATE 48000
+#define BENCH_FRAME_SIZE 480
+
+struct BenchResult {
+  std::string path;
+  double seconds;
+  size_t bytes;
+};
+
+// The write path WavLogger used before staging: convert and put() each sample
+static BenchResult run_per_sample_put(const std::vector<float>& audio, const std::string& filename) {
+  std::ofstream f(filename, std::ios::binary);
+  const auto start = std::chrono::steady_clock::now();
+  const int volume = (1<<15)-1;
+  for(float sample : audio) {
+    int value = (int)(sample * volume);
+    for(unsigned size = 2; size; --size, value >>= 8)
+      f.put(static_cast<char>(value & 0xFF));
+  }
+  f.flush();
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return {"per-sample put (old)", seconds, audio.size() * sizeof(short)};
+}
+
+static BenchResult run_wav_logger(const std::vector<float>& audio, size_t sample_rate, const std::string& directory,
+                                  WavSampleFormat format) {
+  const char* names[] = {"int16", "float32", "flac"};
+  const std::string name = names[(int)format];
+  auto is_bench_log = [&](const std::filesystem::path& path) {
+    return path.filename().string().find("_bench_" + name + ".") != std::string::npos;
+  };
+  // Logs from earlier runs in the same directory shouldn't count
+  std::vector<std::filesystem::path> earlier_logs;
+  for(const auto& entry : std::filesystem::directory_iterator(directory))
+    if(is_bench_log(entry.path()))
+      earlier_logs.push_back(entry.path());
+
+  std::chrono::steady_clock::duration write_time(0);
+  {
+    WavLogger logger(BENCH_SAMPLE_RATE, sample_rate, directory, "bench_" + name, format);
+    for(size_t offset = 0; offset < audio.size(); ) {
+      const size_t count = std::min((size_t)BENCH_FRAME_SIZE, audio.size() - offset);
+      if(logger.add_audio_nonblocking(audio.data() + offset, count)) {
+        offset += count;
+        continue;
+      }
+      // Ring is full - drain it, the way the logging thread would
+      const auto start = std::chrono::steady_clock::now();
+      logger.write_outstanding_samples_to_file();
+      write_time += std::chrono::steady_clock::now() - start;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    logger.write_outstanding_samples_to_file();
+    write_time += std::chrono::steady_clock::now() - start;
+  }
+
+  // What actually went to disk, headers and all, across however many files
+  size_t bytes = 0;
+  for(const auto& entry : std::filesystem::directory_iterator(directory))
+    if(is_bench_log(entry.path()) && std::find(earlier_logs.begin(), earlier_logs.end(), entry.path()) == earlier_logs.end())
+      bytes += entry.file_size();
+  return {"WavLogger " + name, std::chrono::duration<double>(write_time).count(), bytes};
+}
+
+int main(int argc, char** argv) {
+  double audio_seconds = 600.0;
+  std::string log_directory = (std::filesystem::temp_directory_path() / "modulate_wav_logger_bench").string();
+  bool own_log_directory = true;
+  std::string input_filename;
+  for(int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if(arg == "--seconds" && i + 1 < argc)
+      audio_seconds = std::max(1.0, atof(argv[++i]));
+    else if(arg == "--input" && i + 1 < argc)
+      input_filename = argv[++i];
+    else if(arg == "--log-dir" && i + 1 < argc) {
+      log_directory = argv[++i];
+      own_log_directory = false;
+    } else {
+      std::cerr << "Usage: wav_logger_bench [--seconds N] [--input FILE.wav] [--log-dir DIR]" << std::endl;
+      return 2;
+    }
+  }
+  size_t sample_rate = BENCH_SAMPLE_RATE;
+  std::vector<float> audio;
+  if(input_filename.empty()) {
+    audio.resize((size_t)(audio_seconds * sample_rate));
+    for(size_t i = 0; i < audio.size(); i++)
+      audio[i] = 0.5f * (float)sin(2 * M_PI * 220.0 * i / sample_rate);
+  } else {
+    WavFile wav;
+    std::string error;
+    if(!read_wav_file(input_filename, wav, error) || !wav.frame_count()) {
+      std::cerr << (error.empty() ? input_filename + " is empty" : error) << std::endl;
+      return 1;
+    }
+    sample_rate = wav.sample_rate;
+    audio.resize((size_t)(audio_seconds * sample_rate));
+    for(size_t i = 0; i < audio.size(); i++)
+      audio[i] = wav.samples[(i % wav.frame_count()) * wav.channels] / 32768.0f;
+  }
+  std::filesystem::create_directories(log_directory);
+
+  std::vector<BenchResult> results;
+  results.push_back(run_per_sample_put(audio, (std::filesystem::path(log_directory) / "bench_put.raw").string()));
+  results.push_back(run_wav_logger(audio, sample_rate, log_directory, WavSampleFormat::int16));
+  results.push_back(run_wav_logger(audio, sample_rate, log_directory, WavSampleFormat::float32));
+  results.push_back(run_wav_logger(audio, sample_rate, log_directory, WavSampleFormat::flac));
+
+  // The cost per second of audio is what the logging thread spends keeping up with one logger
+  const double pcm_bytes = audio.size() * sizeof(short);
+  std::cout << audio_seconds << "s of " << sample_rate << "Hz " << (input_filename.empty() ? "sine" : input_filename)
+            << ", " << get_audio_kernels().name << " kernels\n"
+            << "path                      Msamples/s     MB/s  x realtime  ms per audio s  size vs int16\n";
+  for(const BenchResult& result : results) {
+    char line[200];
+    snprintf(line, sizeof(line), "%-24s %11.1f %8.1f %11.0f %15.3f %14.3f\n", result.path.c_str(),
+             audio.size() / result.seconds / 1e6, result.bytes / result.seconds / 1e6,
+             audio_seconds / result.seconds, 1000.0 * result.seconds / audio_seconds, result.bytes / pcm_bytes);
+    std::cout << line;
+  }
+
+  // Only clean up after ourselves if the logs went into our own scratch directory
+  if(own_log_directory)
+    std::filesystem::remove_all(log_directory);
+  return 0;
+}
@@ -16,6 +16,52 @@ namespace ModulateVivoxWrapper {
 	String^ create_windows_system_string(const std::string& sane_string);
 	void debug(const std::string& str);
 
+	public value struct PerformanceStats
+	{
+		UInt64 frames;
+		UInt64 deadline_misses;
+		double p50_ms;
+		double p99_ms;
+		double p999_ms;
+		double max_ms;
+		double realtime_factor;
+		double skipped_fraction;
+		double cpu_seconds_saved;
+		UInt64 log_dropped_samples;
+		UInt64 pipeline_deadline_misses;
+		UInt64 pipeline_input_overruns;
+		double framing_latency_ms;
+		UInt64 oversized_frames;
+	};
+
+	public enum class MetricType
+	{
+		counter,
+		gauge,
+		histogram
+	};
+
+	public value struct Metric
+	{
+		String^ name;
+		String^ help;
+		array<String^>^ label_names;
+		array<String^>^ label_values;
+		MetricType type;
+		double value;
+		array<double>^ bucket_bounds;
+		array<UInt64>^ bucket_counts;
+		double sum;
+		UInt64 count;
+	};
+
+	public value struct SkinLoadProgress
+	{
+		UInt32 total;
+		UInt32 done;
+		UInt32 failed;
+	};
+
 	public ref class ModulateVivoxManagedWrapper
 	{
 	public:
@@ -30,9 +76,28 @@ namespace ModulateVivoxWrapper {
 		void select_voice_skin(String^ skin_name) { return unmanaged_wrapper->select_voice_skin(undo_windows_system_string(skin_name)); }
 
 		int create_voice_skin(String^ filename) { return unmanaged_wrapper->create_voice_skin(undo_windows_system_string(filename)); }
+		int create_voice_skins(array<String^>^ filenames, bool lazy) {
+			std::vector<std::string> unmanaged_filenames;
+			for each (String^ filename in filenames)
+				unmanaged_filenames.push_back(undo_windows_system_string(filename));
+			return unmanaged_wrapper->create_voice_skins(unmanaged_filenames, lazy ? 1 : 0);
+		}
+		String^ get_voice_skin_load_error_filename() { return create_windows_system_string(unmanaged_wrapper->get_voice_skin_load_error_filename()); }
+		SkinLoadProgress get_voice_skin_load_progress() {
+			ModulateVivoxLibrary::SkinLoadProgress unmanaged_progress = unmanaged_wrapper->get_voice_skin_load_progress();
+			SkinLoadProgress progress;
+			progress.total = unmanaged_progress.total;
+			progress.done = unmanaged_progress.done;
+			progress.failed = unmanaged_progress.failed;
+			return progress;
+		}
 		int load_api_key_from_file(String^ filename) { return unmanaged_wrapper->load_api_key_from_file(undo_windows_system_string(filename)); }
 		String^ create_auth_message_for_voice_skin(String^ voice_skin_name) { return create_windows_system_string(unmanaged_wrapper->create_auth_message_for_voice_skin(undo_windows_system_string(voice_skin_name))); }
 		int check_auth_message_for_voice_skin(String^ voice_skin_name, String^ auth_message) { return unmanaged_wrapper->check_auth_message_for_voice_skin(undo_windows_system_string(voice_skin_name), undo_windows_system_string(auth_message)); }
+		String^ create_auth_batch_request() { return create_windows_system_string(unmanaged_wrapper->create_auth_batch_request()); }
+		int apply_auth_batch_response(String^ response) { return unmanaged_wrapper->apply_auth_batch_response(undo_windows_system_string(response)); }
+		String^ get_auth_batch_failed_voice_skin_name() { return create_windows_system_string(unmanaged_wrapper->get_auth_batch_failed_voice_skin_name()); }
+		unsigned int get_number_of_voice_skin_copies_awaiting_authentication() { return unmanaged_wrapper->get_number_of_voice_skin_copies_awaiting_authentication(); }
 
 		void vivox_start_connect() { return unmanaged_wrapper->vivox_start_connect(); }
 		int vivox_check_connected() { return unmanaged_wrapper->vivox_check_connected(); }
@@ -41,6 +106,11 @@ namespace ModulateVivoxWrapper {
 		int vivox_check_logged_in() { return unmanaged_wrapper->vivox_check_logged_in(); }
 		void vivox_start_realtime_echo() { return unmanaged_wrapper->vivox_start_realtime_echo(); }
 		void vivox_end_realtime_echo() { return unmanaged_wrapper->vivox_end_realtime_echo(); }
+		void vivox_set_echo_target_latency_ms(float latency_ms) { return unmanaged_wrapper->vivox_set_echo_target_latency_ms(latency_ms); }
+		void vivox_set_echo_monitor_gain(float gain) { return unmanaged_wrapper->vivox_set_echo_monitor_gain(gain); }
+		void vivox_set_pipelined_conversion(int enabled, int delay_frames, int miss_policy) { return unmanaged_wrapper->vivox_set_pipelined_conversion(enabled, delay_frames, miss_policy); }
+		void vivox_set_native_rate_fast_path(int enabled) { return unmanaged_wrapper->vivox_set_native_rate_fast_path(enabled); }
+		void vivox_set_model_block_ms(float block_ms) { return unmanaged_wrapper->vivox_set_model_block_ms(block_ms); }
 		void vivox_add_session(String^ channel_name) { return unmanaged_wrapper->vivox_add_session(undo_windows_system_string(channel_name)); }
 		void vivox_remove_session(String^ channel_name) { return unmanaged_wrapper->vivox_remove_session(undo_windows_system_string(channel_name)); }
 
@@ -50,6 +120,58 @@ namespace ModulateVivoxWrapper {
 		void set_intimidator_strength(float value) { return unmanaged_wrapper->set_intimidator_strength(value); }
 		void set_helm_strength(float value) { return unmanaged_wrapper->set_helm_strength(value); }
 		void set_vivid_strength(float value) { return unmanaged_wrapper->set_vivid_strength(value); }
+		void set_silence_gate(int enabled, float threshold_dbfs, float hangover_ms) { return unmanaged_wrapper->set_silence_gate(enabled, threshold_dbfs, hangover_ms); }
+
+		PerformanceStats get_performance_stats() {
+			ModulateVivoxLibrary::PerformanceStats unmanaged_stats = unmanaged_wrapper->get_performance_stats();
+			PerformanceStats stats;
+			stats.frames = unmanaged_stats.frames;
+			stats.deadline_misses = unmanaged_stats.deadline_misses;
+			stats.p50_ms = unmanaged_stats.p50_ms;
+			stats.p99_ms = unmanaged_stats.p99_ms;
+			stats.p999_ms = unmanaged_stats.p999_ms;
+			stats.max_ms = unmanaged_stats.max_ms;
+			stats.realtime_factor = unmanaged_stats.realtime_factor;
+			stats.skipped_fraction = unmanaged_stats.skipped_fraction;
+			stats.cpu_seconds_saved = unmanaged_stats.cpu_seconds_saved;
+			stats.log_dropped_samples = unmanaged_stats.log_dropped_samples;
+			stats.pipeline_deadline_misses = unmanaged_stats.pipeline_deadline_misses;
+			stats.pipeline_input_overruns = unmanaged_stats.pipeline_input_overruns;
+			stats.framing_latency_ms = unmanaged_stats.framing_latency_ms;
+			stats.oversized_frames = unmanaged_stats.oversized_frames;
+			return stats;
+		}
+
+		array<Metric>^ get_metrics() {
+			std::vector<ModulateVivoxLibrary::Metric> unmanaged_metrics = unmanaged_wrapper->get_metrics();
+			array<Metric>^ metrics = gcnew array<Metric>((int)unmanaged_metrics.size());
+			for (int i = 0; i < metrics->Length; i++) {
+				const ModulateVivoxLibrary::Metric& unmanaged_metric = unmanaged_metrics[i];
+				Metric metric;
+				metric.name = create_windows_system_string(unmanaged_metric.name);
+				metric.help = create_windows_system_string(unmanaged_metric.help);
+				metric.label_names = gcnew array<String^>((int)unmanaged_metric.labels.size());
+				metric.label_values = gcnew array<String^>((int)unmanaged_metric.labels.size());
+				for (int j = 0; j < metric.label_names->Length; j++) {
+					metric.label_names[j] = create_windows_system_string(unmanaged_metric.labels[j].first);
+					metric.label_values[j] = create_windows_system_string(unmanaged_metric.labels[j].second);
+				}
+				metric.type = (MetricType)unmanaged_metric.type;
+				metric.value = unmanaged_metric.value;
+				metric.bucket_bounds = gcnew array<double>((int)unmanaged_metric.bucket_bounds.size());
+				metric.bucket_counts = gcnew array<UInt64>((int)unmanaged_metric.bucket_counts.size());
+				for (int j = 0; j < metric.bucket_bounds->Length; j++) {
+					metric.bucket_bounds[j] = unmanaged_metric.bucket_bounds[j];
+					metric.bucket_counts[j] = unmanaged_metric.bucket_counts[j];
+				}
+				metric.sum = unmanaged_metric.sum;
+				metric.count = unmanaged_metric.count;
+				metrics[i] = metric;
+			}
+			return metrics;
+		}
+		String^ get_metrics_text(int format) { return create_windows_system_string(unmanaged_wrapper->get_metrics_text(format)); }
+		void set_metrics_export(int format, float interval_s) { return unmanaged_wrapper->set_metrics_export(format, interval_s); }
 
 		unsigned int version() { return unmanaged_wrapper->version(); }
 